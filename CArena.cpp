@@ -0,0 +1,164 @@
+#include <string.h>
+#include <cstdio>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "CArena.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Arena
+    {
+        // no numaif.h, the policy is all that is needed from it
+        #define ARENA_MPOL_PREFERRED    1
+
+        static bool             s_bHugeExplicit = false;
+        static bool             s_bHugeAdvise   = true;
+        static bool             s_bNumaLocal    = true;
+
+        static pthread_mutex_t  s_mutexArena    = PTHREAD_MUTEX_INITIALIZER;
+        static tagArenaStatistics s_statistics  = { 0, 0, 0, 0, 0 };
+
+        // the open chunk of each node, without NUMA binding everything comes from the first
+        struct tagArenaCursor
+        {
+            char*           pCursor;
+            char*           pLimit;
+        };
+        static tagArenaCursor   s_cursors[ ARENA_NODES ];
+
+        static int currentNode()
+        {
+            unsigned cpu    = 0;
+            unsigned node   = 0;
+            if ( 0 != syscall( SYS_getcpu, &cpu, &node, NULL ) ) return -1;
+
+            return (int)node;
+        }
+
+        static void bindNode( void* pChunk, size_t size, int node )
+        {
+            if ( node < 0 ) return;
+
+            // preferred, not bound, a full node falls back to the others
+            unsigned long mask = 1UL << node;
+            if ( 0 == syscall( SYS_mbind, pChunk, size, ARENA_MPOL_PREFERRED, &mask, sizeof( mask ) * 8, 0 ) )
+                s_statistics.nodeMask |= mask;
+        }
+
+        // s_mutexArena must be held, node is -1 to leave the placement to the kernel
+        static char* mapChunk( size_t size, int node )
+        {
+            if ( s_bHugeExplicit ) {
+                // reserved up front, MAP_NORESERVE would turn a short pool into SIGBUS on first touch
+                void* pMap = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+                if ( MAP_FAILED != pMap ) {
+                    bindNode( pMap, size, node );
+                    s_statistics.hugeSize += size;
+                    return (char*)pMap;
+                }
+                // no huge pages reserved, transparent ones are the next best thing
+            }
+
+            // over-map by one huge page and trim, so the chunk starts on a huge page boundary
+            void* pMap = mmap( NULL, size + ARENA_HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+            if ( MAP_FAILED == pMap ) return NULL;
+
+            uintptr_t begin     = (uintptr_t)pMap;
+            uintptr_t aligned   = ( begin + ARENA_HUGE_PAGE - 1 ) & ~( ARENA_HUGE_PAGE - 1 );
+            if ( aligned > begin ) munmap( pMap, aligned - begin );
+            if ( begin + ARENA_HUGE_PAGE > aligned ) munmap( (void*)( aligned + size ), begin + ARENA_HUGE_PAGE - aligned );
+
+            if ( s_bHugeAdvise ) madvise( (void*)aligned, size, MADV_HUGEPAGE );
+            bindNode( (void*)aligned, size, node );
+            return (char*)aligned;
+        }
+
+        void initialize()
+        {
+            const Config::tagConfig* pConfig = Config::get();
+
+            s_bHugeExplicit = Config::HP_EXPLICIT == pConfig->hugePages;
+            s_bHugeAdvise   = Config::HP_OFF != pConfig->hugePages;
+            s_bNumaLocal    = pConfig->bNumaLocal;
+        }
+
+        void forkPrepare()
+        {
+            pthread_mutex_lock( &s_mutexArena );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexArena );
+        }
+
+        void* allocate( size_t size )
+        {
+            size = ( size + ARENA_ALIGN - 1 ) & ~(size_t)( ARENA_ALIGN - 1 );
+
+            // the node is read before the lock, a thread migrated meanwhile only costs a remote line
+            int node = s_bNumaLocal ? currentNode() : -1;
+            if ( node >= ARENA_NODES ) node = -1;
+            tagArenaCursor* pCursor = &s_cursors[ ( node < 0 ) ? 0 : node ];
+
+            pthread_mutex_lock( &s_mutexArena );
+
+            if ( NULL == pCursor->pCursor || size > (size_t)( pCursor->pLimit - pCursor->pCursor ) ) {
+                size_t chunkSize = ( size > ARENA_CHUNK ) ? ( size + ARENA_HUGE_PAGE - 1 ) & ~( ARENA_HUGE_PAGE - 1 ) : ARENA_CHUNK;
+
+                char* pChunk = mapChunk( chunkSize, node );
+                if ( NULL == pChunk ) { pthread_mutex_unlock( &s_mutexArena ); return NULL; }
+
+                s_statistics.chunkCount++;
+                s_statistics.mappedSize += chunkSize;
+
+                // a chunk of its own leaves the current one open for the small requests
+                if ( chunkSize > ARENA_CHUNK ) {
+                    s_statistics.usedSize += size;
+                    pthread_mutex_unlock( &s_mutexArena );
+                    return pChunk;
+                }
+
+                pCursor->pCursor    = pChunk;
+                pCursor->pLimit     = pChunk + chunkSize;
+            }
+
+            void* pData = pCursor->pCursor;
+            pCursor->pCursor += size;
+            s_statistics.usedSize += size;
+
+            pthread_mutex_unlock( &s_mutexArena );
+            return pData;
+        }
+
+        void getStatistics( tagArenaStatistics* const pStat )
+        {
+            if ( NULL == pStat ) return;
+
+            pthread_mutex_lock( &s_mutexArena );
+            *pStat = s_statistics;
+            pthread_mutex_unlock( &s_mutexArena );
+        }
+
+        void report()
+        {
+            tagArenaStatistics stat;
+            getStatistics( &stat );
+            if ( 0 == stat.chunkCount ) return;
+
+            fprintf( Config::output(), "metadata \n \tchunks: %ld\n\tmapped: %ld\n\tused: %ld\n\thuge pages: %s\n\tnodes:", \
+                            stat.chunkCount, \
+                            stat.mappedSize, \
+                            stat.usedSize, \
+                            stat.hugeSize == stat.mappedSize ? "explicit" : ( s_bHugeAdvise ? "transparent" : "off" ) );
+            if ( 0 == stat.nodeMask ) fprintf( Config::output(), " unbound" );
+            for ( int node = 0; node < ARENA_NODES; ++node ) {
+                if ( 0 != ( stat.nodeMask & ( 1UL << node ) ) ) fprintf( Config::output(), " %d", node );
+            }
+            fprintf( Config::output(), "\n" );
+        }
+    } // namespace Arena
+} // namespace MemoryTrace
@@ -0,0 +1,39 @@
+#ifndef __CARENAH__
+#define __CARENAH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MemoryTrace
+{
+    #define ARENA_HUGE_PAGE         ( 2UL << 20 )
+    #define ARENA_CHUNK             ( 4UL << 20 )       // two huge pages, larger requests get a chunk of their own
+    #define ARENA_ALIGN             64
+    #define ARENA_NODES             64
+    namespace Arena
+    {
+        // metadata of the hook itself: registry slots, stack depot, per-thread histograms.
+        // bump allocated from huge page aligned chunks, one cursor per NUMA node so a thread gets memory
+        // preferred on the node it runs on. nothing is ever given back
+        struct tagArenaStatistics
+        {
+            size_t          chunkCount;
+            size_t          mappedSize;
+            size_t          usedSize;
+            size_t          hugeSize;           // explicit huge pages, the rest is advised for transparent ones
+            uint64_t        nodeMask;           // nodes with a cursor of their own, 0 without NUMA binding
+        };
+
+        // only maps on first use, so it may be called while the hook initializes
+        void                initialize();
+        void                forkPrepare();
+        void                forkRelease();
+
+        // zeroed, ARENA_ALIGN aligned, NULL once the address space is exhausted
+        void*               allocate( size_t size );
+
+        void                getStatistics( tagArenaStatistics* const );
+        void                report();
+    }; // namespace Arena
+}; // namespace MemoryTrace
+#endif
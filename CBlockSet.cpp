@@ -0,0 +1,185 @@
+#include <string.h>
+#include "CBlockSet.h"
+#include "CThreadSlot.h"
+#include "CConfig.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace BlockSet
+    {
+        // open addressing with linear probing, 0 is an empty entry. an erase shifts the run after it back
+        // instead of leaving a tombstone, so the tables only ever grow. a grown out table stays mapped,
+        // a lookup that still probes it sees the sequence change and tries again
+        struct __attribute__ (( aligned( 64 ) )) tagShard
+        {
+            ThreadSlot::tagSpinLock lock;
+            volatile uint32_t       sequence;       // odd while entries move
+            size_t                  count;
+            size_t                  mask;
+            uintptr_t* volatile     pTable;
+        };
+
+        static bool             s_bEnabled  = false;
+        static volatile size_t  s_count     = 0;
+        static tagShard         s_shards[ BLOCK_SET_SHARDS ];
+
+        static inline uint64_t hashOf( uintptr_t value )
+        {
+            return ( value >> 4 ) * 0x9E3779B97F4A7C15ULL;
+        }
+
+        static inline tagShard* shardOf( uint64_t hash )
+        {
+            return &s_shards[ hash >> 58 ];
+        }
+
+        static inline size_t homeOf( uint64_t hash, size_t mask )
+        {
+            return ( hash >> 16 ) & mask;
+        }
+
+        // lock held
+        static void place( uintptr_t* pTable, size_t mask, uintptr_t value )
+        {
+            size_t i = homeOf( hashOf( value ), mask );
+            while ( 0 != pTable[i] ) i = ( i + 1 ) & mask;
+            pTable[i] = value;
+        }
+
+        // lock held, false when the arena is exhausted
+        static bool grow( tagShard* pShard )
+        {
+            size_t capacity = ( NULL == pShard->pTable ) ? BLOCK_SET_INITIAL : ( pShard->mask + 1 ) * 2;
+            uintptr_t* pTable = (uintptr_t*)Arena::allocate( capacity * sizeof( uintptr_t ) );
+            if ( NULL == pTable ) return false;
+
+            if ( NULL != pShard->pTable ) {
+                for ( size_t i = 0; i <= pShard->mask; ++i ) {
+                    if ( 0 != pShard->pTable[i] ) place( pTable, capacity - 1, pShard->pTable[i] );
+                }
+            }
+
+            __sync_fetch_and_add( &pShard->sequence, 1 );
+            // a lookup reads the mask first, it never pairs the larger mask with the smaller table
+            pShard->pTable  = pTable;
+            __atomic_store_n( &pShard->mask, capacity - 1, __ATOMIC_RELEASE );
+            __sync_fetch_and_add( &pShard->sequence, 1 );
+            return true;
+        }
+
+        void initialize()
+        {
+            s_bEnabled = Config::get()->bSwitchable && Config::TM_OFF != Config::get()->mode;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void forkPrepare()
+        {
+            if ( !s_bEnabled ) return;
+            for ( size_t i = 0; i < BLOCK_SET_SHARDS; ++i ) ThreadSlot::lock( &s_shards[i].lock );
+        }
+
+        void forkRelease()
+        {
+            if ( !s_bEnabled ) return;
+            for ( size_t i = 0; i < BLOCK_SET_SHARDS; ++i ) ThreadSlot::unlock( &s_shards[i].lock );
+        }
+
+        bool insert( const void* pData )
+        {
+            tagShard* pShard = shardOf( hashOf( (uintptr_t)pData ) );
+
+            ThreadSlot::lock( &pShard->lock );
+            // at most three quarters full, a probe always ends on an empty entry
+            if ( ( NULL == pShard->pTable || ( pShard->count + 1 ) * 4 > ( pShard->mask + 1 ) * 3 ) && !grow( pShard ) ) {
+                ThreadSlot::unlock( &pShard->lock );
+                return false;
+            }
+
+            place( pShard->pTable, pShard->mask, (uintptr_t)pData );
+            pShard->count++;
+            ThreadSlot::unlock( &pShard->lock );
+
+            __sync_fetch_and_add( &s_count, 1 );
+            return true;
+        }
+
+        bool erase( const void* pData )
+        {
+            uint64_t hash = hashOf( (uintptr_t)pData );
+            tagShard* pShard = shardOf( hash );
+
+            ThreadSlot::lock( &pShard->lock );
+
+            uintptr_t* pTable   = pShard->pTable;
+            size_t mask         = pShard->mask;
+            size_t i            = ( NULL == pTable ) ? 0 : homeOf( hash, mask );
+            while ( NULL != pTable && 0 != pTable[i] && (uintptr_t)pData != pTable[i] ) i = ( i + 1 ) & mask;
+
+            if ( NULL == pTable || 0 == pTable[i] ) {
+                ThreadSlot::unlock( &pShard->lock );
+                return false;
+            }
+
+            __sync_fetch_and_add( &pShard->sequence, 1 );
+            for ( size_t j = i; ; ) {
+                j = ( j + 1 ) & mask;
+                if ( 0 == pTable[j] ) break;
+
+                // an entry whose home lies cyclically in ( i, j ] is still reachable
+                size_t home = homeOf( hashOf( pTable[j] ), mask );
+                if ( ( i <= j ) ? ( i < home && home <= j ) : ( i < home || home <= j ) ) continue;
+
+                pTable[i] = pTable[j];
+                i = j;
+            }
+            pTable[i] = 0;
+            __sync_fetch_and_add( &pShard->sequence, 1 );
+
+            pShard->count--;
+            ThreadSlot::unlock( &pShard->lock );
+
+            __sync_fetch_and_sub( &s_count, 1 );
+            return true;
+        }
+
+        bool contains( const void* pData )
+        {
+            // every block with a header is gone, the common case while switched off
+            if ( 0 == s_count ) return false;
+
+            uint64_t hash = hashOf( (uintptr_t)pData );
+            tagShard* pShard = shardOf( hash );
+
+            for ( ;; ) {
+                uint32_t sequence = __atomic_load_n( &pShard->sequence, __ATOMIC_ACQUIRE );
+                if ( sequence & 1 ) continue;
+
+                size_t mask = __atomic_load_n( &pShard->mask, __ATOMIC_ACQUIRE );
+                const volatile uintptr_t* pTable = pShard->pTable;
+                bool bFound = false;
+
+                // bounded, a growth in between may pair the new table with the old, smaller mask
+                if ( NULL != pTable ) {
+                    size_t i = homeOf( hash, mask );
+                    for ( size_t probe = 0; probe <= mask && 0 != pTable[i]; ++probe, i = ( i + 1 ) & mask ) {
+                        if ( (uintptr_t)pData == pTable[i] ) { bFound = true; break; }
+                    }
+                }
+
+                __atomic_thread_fence( __ATOMIC_ACQUIRE );
+                if ( sequence == pShard->sequence ) return bFound;
+            }
+        }
+
+        size_t count()
+        {
+            return s_count;
+        }
+    } // namespace BlockSet
+} // namespace MemoryTrace
@@ -0,0 +1,29 @@
+#ifndef __CBLOCKSETH__
+#define __CBLOCKSETH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MemoryTrace
+{
+    #define BLOCK_SET_SHARDS        64
+    #define BLOCK_SET_INITIAL       1024        // entries of a shard's first table
+    namespace BlockSet
+    {
+        // user pointers of the blocks that carry a header, kept while tracking can be switched at runtime.
+        // a free looks the pointer up instead of reading a header that a block allocated while switched off does not have.
+        // lookups take no lock, a shard's sequence tells them to retry around an erase or a growth
+        void                initialize();
+        bool                isEnabled();
+        void                forkPrepare();
+        void                forkRelease();
+
+        // false when the arena is exhausted, the block must not be handed out then
+        bool                insert( const void* pData );
+        // false when the pointer was not in the set
+        bool                erase( const void* pData );
+        bool                contains( const void* pData );
+        size_t              count();
+    }; // namespace BlockSet
+}; // namespace MemoryTrace
+#endif
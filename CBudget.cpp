@@ -0,0 +1,391 @@
+#include <string.h>
+#include <cstdio>
+#include <dlfcn.h>
+#include "CBudget.h"
+#include "CConfig.h"
+#include "CThreadSlot.h"
+#include "CArena.h"
+#include "CStackDepot.h"
+#include "CTag.h"
+#include "CPersist.h"
+
+namespace MemoryTrace
+{
+    #define BUDGET_RESOLVED     0x80000000U         // the budgets of a path or stack were looked up
+    namespace Budget
+    {
+        // live bytes per budget that the threads of the slot added and removed, never reset,
+        // the sum over the slots is the live size of the budget
+        struct __attribute__ (( aligned( 64 ) )) tagBudgetSlot
+        {
+            int64_t         live[ BUDGET_MAX ];
+            int64_t         folded[ BUDGET_MAX ];   // live[] as the last fold read it
+            int64_t         pending[ BUDGET_MAX ];  // hard limits, bytes not yet in the budget's total
+        };
+
+        static bool             s_bEnabled      = false;
+        static bool             s_bFail         = false;
+        static tagBudget        s_budgets[ BUDGET_MAX ];
+        static size_t           s_count         = 0;
+        static uint32_t         s_scopes        = 0;        // 1 << BudgetScope for every scope in use
+        static uint32_t         s_hardMask      = 0;        // budgets with a hard limit
+        static tagBudgetSlot*   s_slots         = NULL;     // metadata arena, only when enabled
+
+        // the budgets a tag path or a stack is in, BUDGET_RESOLVED once known
+        static uint32_t         s_pathMasks[ TAG_PATH_CAPACITY ];
+        static uint32_t         s_stackMasks[ STACK_DEPOT_CAPACITY ];
+
+        // the runtime libraries the program started with, their frames are passed over like the hook's
+        static Persist::tagPersistModule    s_runtime[ PERSIST_MODULES ];
+        static uint32_t         s_runtimeCount  = 0;
+
+        static BudgetCallback volatile  s_pCallback = NULL;
+        static void* volatile           s_pContext  = NULL;
+
+        static const char* const s_scopeNames[] = { "tag", "module", "stack" };
+
+        static bool matchName( const char* pValue, size_t length, const char* const name )
+        {
+            return length == strlen( name ) && 0 == strncmp( pValue, name, length );
+        }
+
+        // 64k, 16m, 2g
+        static int64_t parseSize( const char* pValue, size_t length )
+        {
+            int64_t size = 0;
+            size_t i = 0;
+            for ( ; i < length && pValue[i] >= '0' && pValue[i] <= '9'; ++i ) size = size * 10 + ( pValue[i] - '0' );
+
+            if ( i < length ) {
+                switch ( pValue[i] | 0x20 ) {
+                case 'k':   size <<= 10; break;
+                case 'm':   size <<= 20; break;
+                case 'g':   size <<= 30; break;
+                default:    break;
+                }
+            }
+            return size;
+        }
+
+        // scope.name=soft[/hard], the name runs to the last '=' so module names keep their dots
+        static void parseBudget( const char* pItem, size_t length )
+        {
+            const char* pDot    = (const char*)memchr( pItem, '.', length );
+            const char* pEqual  = (const char*)memrchr( pItem, '=', length );
+            if ( NULL == pDot || NULL == pEqual || pEqual < pDot + 2 ) {
+                fprintf( stderr, "memhook: budget '%.*s' is not scope.name=soft[/hard]\n", (int)length, pItem );
+                return;
+            }
+            if ( s_count >= BUDGET_MAX ) {
+                fprintf( stderr, "memhook: more than %d budgets, '%.*s' ignored\n", BUDGET_MAX, (int)length, pItem );
+                return;
+            }
+
+            tagBudget* pBudget = &s_budgets[ s_count ];
+            memset( pBudget, 0, sizeof( tagBudget ) );
+
+            size_t scope = 0;
+            while ( scope < sizeof( s_scopeNames ) / sizeof( s_scopeNames[0] ) && !matchName( pItem, pDot - pItem, s_scopeNames[ scope ] ) ) ++scope;
+            if ( scope == sizeof( s_scopeNames ) / sizeof( s_scopeNames[0] ) ) {
+                fprintf( stderr, "memhook: unknown budget scope '%.*s'\n", (int)( pDot - pItem ), pItem );
+                return;
+            }
+            pBudget->scope = (BudgetScope)scope;
+
+            size_t nameLength = pEqual - pDot - 1;
+            if ( nameLength >= BUDGET_NAME_SIZE ) nameLength = BUDGET_NAME_SIZE - 1;
+            memcpy( pBudget->name, pDot + 1, nameLength );
+
+            const char* pLimits = pEqual + 1;
+            size_t limitsLength = pItem + length - pLimits;
+            const char* pSlash  = (const char*)memchr( pLimits, '/', limitsLength );
+
+            pBudget->softLimit  = parseSize( pLimits, ( NULL == pSlash ) ? limitsLength : pSlash - pLimits );
+            pBudget->hardLimit  = ( NULL == pSlash ) ? 0 : parseSize( pSlash + 1, pItem + length - pSlash - 1 );
+            if ( 0 == pBudget->softLimit && 0 == pBudget->hardLimit ) {
+                fprintf( stderr, "memhook: budget '%.*s' has no limit\n", (int)length, pItem );
+                return;
+            }
+
+            s_scopes |= 1U << pBudget->scope;
+            if ( 0 != pBudget->hardLimit ) s_hardMask |= 1U << s_count;
+            ++s_count;
+        }
+
+        void initialize()
+        {
+            const Config::tagConfig* pConfig = Config::get();
+            if ( '\0' == pConfig->budget[0] || Config::TM_OFF == pConfig->mode ) return;
+
+            for ( const char* pItem = pConfig->budget; '\0' != *pItem; ) {
+                const char* pEnd = strchr( pItem, ',' );
+                size_t length = ( NULL == pEnd ) ? strlen( pItem ) : pEnd - pItem;
+
+                if ( length > 0 ) parseBudget( pItem, length );
+                if ( NULL == pEnd ) break;
+                pItem = pEnd + 1;
+            }
+            if ( 0 == s_count ) return;
+
+            if ( ( s_scopes & ~( 1U << BS_TAG ) ) && !Config::isTraced() )
+                fprintf( stderr, "memhook: module and stack budgets need mode=sample or mode=full\n" );
+
+            uint32_t count = Persist::collectModules( s_runtime, PERSIST_MODULES );
+            for ( uint32_t i = 0; i < count; ++i ) {
+                if ( MemoryManager::isRuntimeModule( s_runtime[i].path ) ) s_runtime[ s_runtimeCount++ ] = s_runtime[i];
+            }
+
+            s_slots     = (tagBudgetSlot*)Arena::allocate( MAX_THREAD_SLOT * sizeof( tagBudgetSlot ) );
+            s_bFail     = pConfig->bBudgetFail;
+            s_bEnabled  = NULL != s_slots;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        // the whole path a/b, or any one tag on it
+        static bool matchTag( const char* pPath, const char* pName )
+        {
+            if ( 0 == strcmp( pPath, pName ) ) return true;
+
+            for ( const char* pPos = pPath; ; ) {
+                const char* pEnd = strchr( pPos, '/' );
+                if ( matchName( pPos, ( NULL == pEnd ) ? strlen( pPos ) : pEnd - pPos, pName ) ) return true;
+                if ( NULL == pEnd ) return false;
+                pPos = pEnd + 1;
+            }
+        }
+
+        // threads racing on a path or stack store the same mask
+        static uint32_t pathMask( uint32_t path )
+        {
+            uint32_t mask = s_pathMasks[ path - 1 ];
+            if ( 0 != mask ) return mask;
+
+            char name[ 512 ];
+            name[0] = '\0';
+            Tag::describe( path, name, sizeof( name ) );
+
+            mask = BUDGET_RESOLVED;
+            for ( size_t i = 0; i < s_count; ++i ) {
+                if ( BS_TAG == s_budgets[i].scope && matchTag( name, s_budgets[i].name ) ) mask |= 1U << i;
+            }
+            s_pathMasks[ path - 1 ] = mask;
+            return mask;
+        }
+
+        static bool isRuntime( uintptr_t pc )
+        {
+            for ( uint32_t i = 0; i < s_runtimeCount; ++i ) {
+                if ( pc >= s_runtime[i].begin && pc < s_runtime[i].end ) return true;
+            }
+            return false;
+        }
+
+        static uint32_t stackMask( size_t id )
+        {
+            uint32_t mask = s_stackMasks[ id - 1 ];
+            if ( 0 != mask ) return mask;
+
+            const StackDepot::tagStackEntry* pEntry = StackDepot::get( id );
+            if ( NULL == pEntry ) return 0;
+
+            // once per stack, dladdr() takes the loader lock. the offset into the module is the same in every run
+            const char* pModule = NULL;
+            const char* pSymbol = NULL;
+            char site[ BUDGET_NAME_SIZE ];
+            site[0] = '\0';
+
+            // operator new and the like are in every stack, the caller of the runtime is the site
+            size_t first = MemoryManager::skipHookFrames( pEntry->backtrace, pEntry->traceSize );
+            size_t frame = first;
+            while ( frame < pEntry->traceSize && isRuntime( (uintptr_t)pEntry->backtrace[ frame ] ) ) ++frame;
+            if ( frame == pEntry->traceSize ) frame = first;
+
+            Dl_info info;
+            if ( frame < pEntry->traceSize && 0 != dladdr( pEntry->backtrace[ frame ], &info ) && NULL != info.dli_fname ) {
+                pModule = strrchr( info.dli_fname, '/' );
+                pModule = ( NULL == pModule ) ? info.dli_fname : pModule + 1;
+                pSymbol = info.dli_sname;
+                snprintf( site, sizeof( site ), "%s+0x%lx", pModule, (char*)pEntry->backtrace[ frame ] - (char*)info.dli_fbase );
+            }
+
+            mask = BUDGET_RESOLVED;
+            for ( size_t i = 0; i < s_count; ++i ) {
+                const tagBudget* pBudget = &s_budgets[i];
+                if ( BS_MODULE == pBudget->scope && NULL != pModule && 0 == strcmp( pBudget->name, pModule ) ) mask |= 1U << i;
+                if ( BS_STACK == pBudget->scope && ( 0 == strcmp( pBudget->name, site ) || ( NULL != pSymbol && 0 == strcmp( pBudget->name, pSymbol ) ) ) )
+                    mask |= 1U << i;
+            }
+            s_stackMasks[ id - 1 ] = mask;
+            return mask;
+        }
+
+        static uint32_t maskOf( const MemoryManager::tagUnitNode* const pNode )
+        {
+            uint32_t mask = 0;
+            if ( ( s_scopes & ( 1U << BS_TAG ) ) && 0 != pNode->tagId && pNode->tagId <= TAG_PATH_CAPACITY )
+                mask |= pathMask( pNode->tagId );
+            if ( ( s_scopes & ~( 1U << BS_TAG ) ) && 0 != pNode->stackId && pNode->stackId <= STACK_DEPOT_CAPACITY )
+                mask |= stackMask( pNode->stackId );
+
+            return mask & ~BUDGET_RESOLVED;
+        }
+
+        // a hard limit's total takes the slot's bytes once they reach BUDGET_BATCH either way
+        static void share( tagBudgetSlot* const pSlot, size_t index, int64_t size )
+        {
+            int64_t pending = __sync_add_and_fetch( &pSlot->pending[ index ], size );
+            if ( pending < BUDGET_BATCH && pending > -BUDGET_BATCH ) return;
+
+            pending = __sync_lock_test_and_set( &pSlot->pending[ index ], 0 );
+            __sync_fetch_and_add( &s_budgets[ index ].total, pending );
+        }
+
+        void recordAlloc( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || pNode->bMock ) return;
+
+            uint32_t mask = maskOf( pNode );
+            if ( 0 == mask ) return;
+
+            tagBudgetSlot* pSlot = &s_slots[ ThreadSlot::current() ];
+            for ( uint32_t hard = mask & s_hardMask; 0 != hard; hard &= hard - 1 ) share( pSlot, __builtin_ctz( hard ), pNode->size );
+            for ( ; 0 != mask; mask &= mask - 1 ) __sync_fetch_and_add( &pSlot->live[ __builtin_ctz( mask ) ], pNode->size );
+        }
+
+        // the freeing thread's slot, the sum over the slots stays right
+        void recordFree( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || pNode->bMock ) return;
+
+            uint32_t mask = maskOf( pNode );
+            if ( 0 == mask ) return;
+
+            tagBudgetSlot* pSlot = &s_slots[ ThreadSlot::current() ];
+            for ( uint32_t hard = mask & s_hardMask; 0 != hard; hard &= hard - 1 ) share( pSlot, __builtin_ctz( hard ), -(int64_t)pNode->size );
+            for ( ; 0 != mask; mask &= mask - 1 ) __sync_fetch_and_sub( &pSlot->live[ __builtin_ctz( mask ) ], pNode->size );
+        }
+
+        // racing adds show up in the next sum
+        static int64_t sum( size_t index )
+        {
+            int64_t live = 0;
+            for ( size_t slot = 0; slot < MAX_THREAD_SLOT; ++slot ) live += s_slots[ slot ].live[ index ];
+
+            return live;
+        }
+
+        bool admit( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bFail || !s_bEnabled || NULL == pNode || pNode->bMock ) return true;
+
+            uint32_t mask = maskOf( pNode ) & s_hardMask;
+            if ( 0 == mask ) return true;
+
+            const tagBudgetSlot* pSlot = &s_slots[ ThreadSlot::current() ];
+            for ( ; 0 != mask; mask &= mask - 1 ) {
+                size_t index = __builtin_ctz( mask );
+                tagBudget* pBudget = &s_budgets[ index ];
+
+                // the thread's own bytes count at once, the other threads' once they reached the total
+                int64_t live = pBudget->total + pSlot->pending[ index ];
+                if ( live <= pBudget->hardLimit ) continue;
+
+                __sync_fetch_and_add( &pBudget->refused, 1 );
+                return false;
+            }
+            return true;
+        }
+
+        static void announce( const tagBudget* const pBudget, BudgetLevel level )
+        {
+            char scope[ BUDGET_NAME_SIZE + 8 ];
+            snprintf( scope, sizeof( scope ), "%s.%s", s_scopeNames[ pBudget->scope ], pBudget->name );
+            int64_t limit = ( BL_HARD == level ) ? pBudget->hardLimit : pBudget->softLimit;
+
+            BudgetCallback pCallback = s_pCallback;
+            if ( NULL != pCallback ) {
+                pCallback( scope, pBudget->live, limit, BL_HARD == level, s_pContext );
+                return;
+            }
+
+            // keep a single fprintf, the line must not interleave with other output
+            fprintf( Config::output(), "budget: %s over %s limit, live size: %ld, limit: %ld\n", \
+                            scope, \
+                            ( BL_HARD == level ) ? "hard" : "soft", \
+                            pBudget->live, \
+                            limit );
+        }
+
+        void tick()
+        {
+            if ( !s_bEnabled ) return;
+
+            for ( size_t i = 0; i < s_count; ++i ) {
+                tagBudget* pBudget = &s_budgets[i];
+
+                int64_t live = 0;
+                for ( size_t slot = 0; slot < MAX_THREAD_SLOT; ++slot ) {
+                    int64_t value = s_slots[ slot ].live[i];
+                    s_slots[ slot ].folded[i] = value;
+                    live += value;
+                }
+                pBudget->live = live;
+                if ( live > pBudget->peak ) pBudget->peak = live;
+
+                // announced once per crossing, again after it went back below the limit
+                BudgetLevel level = BL_NONE;
+                if ( 0 != pBudget->hardLimit && live > pBudget->hardLimit ) level = BL_HARD;
+                else if ( 0 != pBudget->softLimit && live > pBudget->softLimit ) level = BL_SOFT;
+
+                BudgetLevel previous = pBudget->level;
+                pBudget->level = level;
+                if ( level > previous ) announce( pBudget, level );
+            }
+        }
+
+        void setCallback( BudgetCallback pCallback, void* pContext )
+        {
+            s_pContext = pContext;
+            __sync_synchronize();
+            s_pCallback = pCallback;
+        }
+
+        void report()
+        {
+            if ( !s_bEnabled ) return;
+
+            fprintf( Config::output(), "budgets: %ld%s\n", s_count, s_bFail ? ", allocations past a hard limit fail" : "" );
+            for ( size_t i = 0; i < s_count; ++i ) {
+                const tagBudget* pBudget = &s_budgets[i];
+                int64_t live = sum( i );
+
+                fprintf( Config::output(), "\t%s.%s: live size: %ld, peak: %ld, soft limit: %ld, hard limit: %ld, refused: %lu\n", \
+                                s_scopeNames[ pBudget->scope ], \
+                                pBudget->name, \
+                                live, \
+                                ( live > pBudget->peak ) ? live : pBudget->peak, \
+                                pBudget->softLimit, \
+                                pBudget->hardLimit, \
+                                pBudget->refused );
+            }
+        }
+
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            memset( s_slots, 0, MAX_THREAD_SLOT * sizeof( tagBudgetSlot ) );
+            for ( size_t i = 0; i < s_count; ++i ) {
+                s_budgets[i].live       = 0;
+                s_budgets[i].total      = 0;
+                s_budgets[i].peak       = 0;
+                s_budgets[i].refused    = 0;
+                s_budgets[i].level      = BL_NONE;
+            }
+        }
+    } // namespace Budget
+} // namespace MemoryTrace
@@ -0,0 +1,66 @@
+#ifndef __CBUDGETH__
+#define __CBUDGETH__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define BUDGET_MAX              16
+    #define BUDGET_NAME_SIZE        64
+    #define BUDGET_PERIOD           ( 100 * 1000000ULL )    // ns between two folds of the thread deltas
+    #define BUDGET_BATCH            ( 64 * 1024 )           // bytes a thread keeps before a hard limit's total sees them
+    namespace Budget
+    {
+        enum BudgetScope
+        {
+            BS_TAG = 0,         // a tag name anywhere on the tag path, or the whole path a/b
+            BS_MODULE,          // file name of the module of the first frame outside the hook
+            BS_STACK,           // the function of that frame, or module+0xoffset for the call site itself
+        };
+
+        enum BudgetLevel
+        {
+            BL_NONE = 0,
+            BL_SOFT,
+            BL_HARD,
+        };
+
+        // budget=tag.render=64m/128m,module.libfoo.so=1g,stack.libfoo.so+0x1a2b=256k
+        struct tagBudget
+        {
+            BudgetScope     scope;
+            char            name[ BUDGET_NAME_SIZE ];
+
+            int64_t         softLimit;
+            int64_t         hardLimit;          // 0 for none
+
+            int64_t         live;               // as of the last fold
+            volatile int64_t    total;          // hard limits only, short by at most BUDGET_BATCH per thread slot
+            int64_t         peak;
+            uint64_t        refused;
+            BudgetLevel     level;              // last one announced
+        };
+
+        // soft and hard crossings, from the service thread
+        typedef void        (*BudgetCallback)( const char* scope, size_t live, size_t limit, int hard, void* context );
+
+        void                initialize();
+        bool                isEnabled();
+
+        // module and stack budgets see traced blocks only, tag budgets every block
+        void                recordAlloc( const MemoryManager::tagUnitNode* const );
+        void                recordFree( const MemoryManager::tagUnitNode* const );
+        // false when budgetfail=1 and the block takes a scope past its hard limit, recordAlloc() came first
+        bool                admit( const MemoryManager::tagUnitNode* const );
+
+        // folds the thread deltas and announces crossings, called by the reporter service thread
+        void                tick();
+        void                setCallback( BudgetCallback pCallback, void* pContext );
+        void                report();
+        // the child is held to the budgets with its own blocks only
+        void                forkChild();
+    }; // namespace Budget
+}; // namespace MemoryTrace
+#endif
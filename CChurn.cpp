@@ -0,0 +1,134 @@
+#include <string.h>
+#include <cstdio>
+#include <pthread.h>
+#include "CChurn.h"
+#include "CConfig.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace Churn
+    {
+        static bool             s_bEnabled      = false;
+        static uint64_t         s_window        = 0;
+        static uint64_t         s_startTime     = 0;
+        static tagChurnSite*    s_sites         = NULL;     // metadata arena, one per stack id
+
+        static pthread_mutex_t  s_mutexReport   = PTHREAD_MUTEX_INITIALIZER;
+
+        void initialize()
+        {
+            // needs the stack id, only traced modes have one
+            if ( 0 == Config::get()->churnWindow || !Config::isTraced() ) return;
+
+            s_sites     = (tagChurnSite*)Arena::allocate( STACK_DEPOT_CAPACITY * sizeof( tagChurnSite ) );
+            s_window    = Config::get()->churnWindow * 1000;
+            s_startTime = MemoryManager::timestamp();
+            s_bEnabled  = NULL != s_sites;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        static size_t bucketOf( uint64_t lifetime )
+        {
+            if ( 0 == lifetime ) return 0;
+
+            size_t bucket = 63 - __builtin_clzll( lifetime );
+            return ( bucket < CHURN_HISTOGRAM_SIZE ) ? bucket : CHURN_HISTOGRAM_SIZE - 1;
+        }
+
+        void record( const MemoryManager::tagUnitNode* const pNode, uint64_t now )
+        {
+            if ( !s_bEnabled || NULL == pNode || 0 == pNode->stackId ) return;
+
+            tagChurnSite* pSite = &s_sites[ pNode->stackId - 1 ];
+            uint64_t lifetime   = ( now > pNode->timestamp ) ? now - pNode->timestamp : 0;
+
+            __sync_fetch_and_add( &pSite->freeCount, 1 );
+            __sync_fetch_and_add( &pSite->freeSize, pNode->size );
+            __sync_fetch_and_add( &pSite->lifetime[ bucketOf( lifetime ) ], 1 );
+
+            if ( lifetime < s_window ) {
+                __sync_fetch_and_add( &pSite->churnCount, 1 );
+                __sync_fetch_and_add( &pSite->churnSize, pNode->size );
+            }
+        }
+
+        static void showSite( size_t id, double elapsed )
+        {
+            const tagChurnSite* pSite = &s_sites[ id - 1 ];
+
+            fprintf( Config::output(), "++++++++++++++ churn count: %ld, churn size: %ld, churn rate: %.0f bytes/s, freed: %ld ++++++++++++++\n", \
+                            pSite->churnCount, \
+                            pSite->churnSize, \
+                            pSite->churnSize / elapsed, \
+                            pSite->freeCount );
+
+            fprintf( Config::output(), "lifetime:\n" );
+            for ( size_t i = 0; i < CHURN_HISTOGRAM_SIZE; ++i ) {
+                if ( 0 == pSite->lifetime[i] ) continue;
+                fprintf( Config::output(), "\t[ %lu ns, %lu ns ): %u\n", 1UL << i, 1UL << ( i + 1 ), pSite->lifetime[i] );
+            }
+
+            const StackDepot::tagStackEntry* pStack = StackDepot::get( id );
+            if ( NULL != pStack ) {
+                fprintf( Config::output(), "backtrace:\n" );
+                MemoryManager::showBacktrace( pStack->backtrace, pStack->traceSize );
+            }
+        }
+
+        static void reportBy( const char* const name, bool bySize, size_t topK, double elapsed )
+        {
+            size_t top[ CHURN_TOPK ];
+            size_t used = 0;
+
+            if ( topK > CHURN_TOPK ) topK = CHURN_TOPK;
+
+            for ( size_t id = 1; id <= STACK_DEPOT_CAPACITY; ++id ) {
+                size_t value = bySize ? s_sites[ id - 1 ].churnSize : s_sites[ id - 1 ].churnCount;
+                if ( 0 == value ) continue;
+
+                size_t pos = ( used < topK ) ? used++ : topK;
+                while ( pos > 0 ) {
+                    const tagChurnSite* pPrev = &s_sites[ top[ pos - 1 ] - 1 ];
+                    if ( ( bySize ? pPrev->churnSize : pPrev->churnCount ) >= value ) break;
+                    if ( pos < topK ) top[ pos ] = top[ pos - 1 ];
+                    --pos;
+                }
+                if ( pos < topK ) top[ pos ] = id;
+            }
+
+            fprintf( Config::output(), "churn sites by %s, window: %lu us, top %ld\n", name, s_window / 1000, used );
+            for ( size_t i = 0; i < used; ++i ) {
+                fprintf( Config::output(), "#%ld ", i );
+                showSite( top[i], elapsed );
+            }
+        }
+
+        void report( size_t topK )
+        {
+            if ( !s_bEnabled ) return;
+
+            double elapsed = ( MemoryManager::timestamp() - s_startTime ) / 1e9;
+            if ( elapsed <= 0 ) elapsed = 1e-9;
+
+            pthread_mutex_lock( &s_mutexReport );
+            reportBy( "count", false, topK, elapsed );
+            reportBy( "bytes", true, topK, elapsed );
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            for ( size_t i = 0; i < STACK_DEPOT_CAPACITY; ++i ) {
+                if ( 0 != s_sites[i].freeCount ) memset( &s_sites[i], 0, sizeof( tagChurnSite ) );
+            }
+            s_startTime = MemoryManager::timestamp();
+        }
+    } // namespace Churn
+} // namespace MemoryTrace
@@ -0,0 +1,33 @@
+#ifndef __CCHURNH__
+#define __CCHURNH__
+
+#include <stdint.h>
+#include "CMemoryManager.h"
+#include "CStackDepot.h"
+
+namespace MemoryTrace
+{
+    #define CHURN_HISTOGRAM_SIZE        32
+    #define CHURN_TOPK                  16
+    namespace Churn
+    {
+        // lifetime histogram of one call site, bucket i counts lifetimes in [ 2^i, 2^(i+1) ) ns
+        struct tagChurnSite
+        {
+            size_t          freeCount;
+            size_t          freeSize;
+            size_t          churnCount;
+            size_t          churnSize;
+            uint32_t        lifetime[ CHURN_HISTOGRAM_SIZE ];
+        };
+
+        void                initialize();
+        bool                isEnabled();
+
+        void                record( const MemoryManager::tagUnitNode* const, uint64_t now );
+        void                report( size_t topK = CHURN_TOPK );
+        // the histograms start empty in a forked child, and so does the time they cover
+        void                forkChild();
+    }; // namespace Churn
+}; // namespace MemoryTrace
+#endif
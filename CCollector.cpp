@@ -0,0 +1,248 @@
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "CCollector.h"
+#include "CStackDepot.h"
+#include "CConfig.h"
+#include "CMapping.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace Collector
+    {
+        // largest encoding of one site, a varint takes at most 10 bytes
+        #define COLLECT_RECORD_MAX  ( 5 * 10 + COLLECT_LOCATION )
+        #define COLLECT_STAGED_MAX  ( COLLECT_MESSAGE_SIZE / 4 )   // a site record takes 4 bytes at least
+
+        // what the collector was last told about a site
+        struct tagSentSite
+        {
+            int64_t         liveCount;
+            int64_t         liveSize;
+            uint64_t        allocCount;
+            bool            bAnnounced;
+        };
+
+        struct tagStagedSite
+        {
+            uint32_t        id;
+            int64_t         liveCount;
+            int64_t         liveSize;
+            uint64_t        allocCount;
+        };
+
+        static bool             s_bEnabled      = false;
+        static int              s_fd            = -1;
+        static bool             s_bReset        = true;
+        static uint64_t         s_sequence      = 0;
+        static uint64_t         s_dropped       = 0;
+        static char             s_command[ 32 ];
+        static pthread_mutex_t  s_mutexPush     = PTHREAD_MUTEX_INITIALIZER;
+
+        static tagSentSite*     s_sent          = NULL;     // metadata arena, one per stack id
+        static tagStagedSite*   s_staged        = NULL;     // the sites of the message in flight
+        static uint8_t          s_message[ COLLECT_MESSAGE_SIZE ];
+
+        static uint64_t realtime()
+        {
+            struct timespec now;
+            clock_gettime( CLOCK_REALTIME, &now );
+
+            return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        }
+
+        // a new connection may be a new collector, it is told everything again
+        static bool connectCollector()
+        {
+            int fd = socket( AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 );
+            if ( -1 == fd ) return false;
+
+            struct sockaddr_un address;
+            memset( &address, 0, sizeof( address ) );
+            address.sun_family = AF_UNIX;
+            memcpy( address.sun_path, Config::get()->collect, strnlen( Config::get()->collect, sizeof( address.sun_path ) - 1 ) );
+
+            if ( 0 != connect( fd, (struct sockaddr*)&address, sizeof( address ) ) ) { close( fd ); return false; }
+
+            memset( s_sent, 0, STACK_DEPOT_CAPACITY * sizeof( tagSentSite ) );
+            s_fd        = fd;
+            s_bReset    = true;
+            return true;
+        }
+
+        static size_t encodeSites( size_t pos, uint32_t* const pStaged )
+        {
+            uint32_t staged = 0;
+
+            for ( size_t id = 1; id <= STACK_DEPOT_CAPACITY; ++id ) {
+                const StackDepot::tagStackEntry* pEntry = StackDepot::get( id );
+                if ( NULL == pEntry ) continue;
+
+                tagSentSite* pSent  = &s_sent[ id - 1 ];
+                int64_t liveCount   = pEntry->liveCount;
+                int64_t liveSize    = pEntry->liveSize;
+                uint64_t allocCount = pEntry->allocCount;
+                // sites a forked child inherited with the depot are announced once it allocates from them
+                if ( !pSent->bAnnounced && 0 == allocCount && 0 == liveCount && 0 == liveSize ) continue;
+                if ( pSent->bAnnounced && liveCount == pSent->liveCount && liveSize == pSent->liveSize && allocCount == pSent->allocCount ) continue;
+
+                // the sites that do not fit go with the next message
+                if ( pos + COLLECT_RECORD_MAX > COLLECT_MESSAGE_SIZE || staged == COLLECT_STAGED_MAX ) break;
+
+                pos += encode( s_message + pos, ( id << 1 ) | ( pSent->bAnnounced ? 0 : 1 ) );
+                if ( !pSent->bAnnounced ) {
+                    char location[ COLLECT_LOCATION ];
+                    StackDepot::describe( pEntry, location, sizeof( location ) );
+
+                    size_t length = strlen( location );
+                    pos += encode( s_message + pos, length );
+                    memcpy( s_message + pos, location, length );
+                    pos += length;
+                }
+                pos += encode( s_message + pos, zigzag( liveCount - pSent->liveCount ) );
+                pos += encode( s_message + pos, zigzag( liveSize - pSent->liveSize ) );
+                pos += encode( s_message + pos, allocCount - pSent->allocCount );
+
+                tagStagedSite* pStaged = &s_staged[ staged++ ];
+                pStaged->id         = id;
+                pStaged->liveCount  = liveCount;
+                pStaged->liveSize   = liveSize;
+                pStaged->allocCount = allocCount;
+            }
+
+            *pStaged = staged;
+            return pos;
+        }
+
+        static void commitSites( uint32_t staged )
+        {
+            for ( uint32_t i = 0; i < staged; ++i ) {
+                tagSentSite* pSent  = &s_sent[ s_staged[i].id - 1 ];
+                pSent->liveCount    = s_staged[i].liveCount;
+                pSent->liveSize     = s_staged[i].liveSize;
+                pSent->allocCount   = s_staged[i].allocCount;
+                pSent->bAnnounced   = true;
+            }
+        }
+
+        static void pushMessage( uint32_t flags )
+        {
+            if ( -1 == s_fd && !connectCollector() ) return;
+
+            MemoryManager::tagUnitManager stat;
+            MemoryManager::getStatistics( &stat );
+            Mapping::tagMappingStatistics mapping;
+            Mapping::getStatistics( &mapping );
+
+            tagCollectHeader* pHeader = (tagCollectHeader*)s_message;
+            pHeader->magic          = COLLECT_MAGIC;
+            pHeader->version        = COLLECT_VERSION;
+            pHeader->pid            = getpid();
+            pHeader->flags          = flags | ( s_bReset ? CF_RESET : 0 );
+            pHeader->sequence       = s_sequence;
+            pHeader->time           = realtime();
+            memcpy( pHeader->command, s_command, sizeof( pHeader->command ) );
+            pHeader->allocCount     = stat.allocCount;
+            pHeader->allocSize      = stat.allocSize;
+            pHeader->freeCount      = stat.freeCount;
+            pHeader->freeSize       = stat.freeSize;
+            pHeader->peakSize       = stat.peakSize;
+            pHeader->mappedCount    = mapping.liveCount;
+            pHeader->mappedSize     = mapping.liveSize;
+            pHeader->dropped        = s_dropped;
+
+            uint32_t staged = 0;
+            size_t length = encodeSites( sizeof( tagCollectHeader ), &staged );
+            pHeader->siteCount      = staged;
+
+            if ( length == (size_t)send( s_fd, s_message, length, MSG_DONTWAIT | MSG_NOSIGNAL ) ) {
+                commitSites( staged );
+                s_bReset = false;
+                ++s_sequence;
+                return;
+            }
+
+            if ( EAGAIN == errno || EWOULDBLOCK == errno || ENOBUFS == errno ) {
+                // back-pressure, the counters still go out and the deltas add up until a message goes through
+                pHeader->dropped    = ++s_dropped;
+                pHeader->flags      = flags | CF_COUNTERS;
+                pHeader->siteCount  = 0;
+                if ( sizeof( tagCollectHeader ) == (size_t)send( s_fd, s_message, sizeof( tagCollectHeader ), MSG_DONTWAIT | MSG_NOSIGNAL ) )
+                    ++s_sequence;
+                return;
+            }
+
+            // the collector is gone, connect again with the next period
+            close( s_fd );
+            s_fd = -1;
+        }
+
+        void initialize()
+        {
+            // the socket is connected by the reporter service thread, nothing here may allocate
+            if ( '\0' == Config::get()->collect[0] || Config::TM_OFF == Config::get()->mode ) return;
+
+            int fd = open( "/proc/self/comm", O_RDONLY | O_CLOEXEC );
+            if ( -1 != fd ) {
+                ssize_t size = read( fd, s_command, sizeof( s_command ) - 1 );
+                if ( size > 0 && '\n' == s_command[ size - 1 ] ) s_command[ size - 1 ] = '\0';
+                close( fd );
+            }
+
+            s_sent      = (tagSentSite*)Arena::allocate( STACK_DEPOT_CAPACITY * sizeof( tagSentSite ) );
+            s_staged    = (tagStagedSite*)Arena::allocate( COLLECT_STAGED_MAX * sizeof( tagStagedSite ) );
+            s_bEnabled  = NULL != s_sent && NULL != s_staged;
+        }
+
+        void uninitialize()
+        {
+            if ( !s_bEnabled ) return;
+
+            pthread_mutex_lock( &s_mutexPush );
+            s_bEnabled = false;
+            pushMessage( CF_EXIT );
+            if ( -1 != s_fd ) { close( s_fd ); s_fd = -1; }
+            pthread_mutex_unlock( &s_mutexPush );
+        }
+
+        void forkPrepare()
+        {
+            pthread_mutex_lock( &s_mutexPush );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexPush );
+        }
+
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            // the parent announced its sites under its own pid, the child starts from nothing
+            if ( -1 != s_fd ) { close( s_fd ); s_fd = -1; }
+            memset( s_sent, 0, STACK_DEPOT_CAPACITY * sizeof( tagSentSite ) );
+            s_bReset    = true;
+            s_sequence  = 0;
+            s_dropped   = 0;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void push()
+        {
+            pthread_mutex_lock( &s_mutexPush );
+            if ( s_bEnabled ) pushMessage( 0 );
+            pthread_mutex_unlock( &s_mutexPush );
+        }
+    } // namespace Collector
+} // namespace MemoryTrace
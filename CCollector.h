@@ -0,0 +1,100 @@
+#ifndef __CCOLLECTORH__
+#define __CCOLLECTORH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MemoryTrace
+{
+    #define COLLECT_MAGIC           0x3154434C4F43484DULL   // "MHCOLCT1"
+    #define COLLECT_VERSION         2
+    #define COLLECT_PATH            "/tmp/memhook-collect.sock"
+    #define COLLECT_QUERY_SUFFIX    ".query"
+    #define COLLECT_PERIOD          1000                    // ms
+    #define COLLECT_MESSAGE_SIZE    65536
+    #define COLLECT_LOCATION        112
+    namespace Collector
+    {
+        enum CollectFlags
+        {
+            CF_RESET            = 0x1,      // first message on a connection, the sites carry absolute values
+            CF_COUNTERS         = 0x2,      // the collector was busy, sites are held back for a later message
+            CF_EXIT             = 0x4,      // last message of the process
+        };
+
+        // one datagram per period, shared with memhook-collect, bump COLLECT_VERSION on any change.
+        // siteCount records follow the header, each one
+        //     varint  id << 1 | has location
+        //     varint  location length, location bytes        only the first time the site is sent
+        //     varint  zigzag live count delta
+        //     varint  zigzag live size delta
+        //     varint  allocation count delta
+        // deltas are against the last message that went through, the collector adds them up
+        struct tagCollectHeader
+        {
+            uint64_t        magic;
+            uint32_t        version;
+            uint32_t        pid;
+            uint32_t        flags;
+            uint32_t        siteCount;
+            uint64_t        sequence;
+            uint64_t        time;               // realtime ns
+            char            command[ 32 ];
+
+            uint64_t        allocCount;
+            uint64_t        allocSize;
+            uint64_t        freeCount;
+            uint64_t        freeSize;
+            uint64_t        peakSize;
+            uint64_t        mappedCount;        // mmap=1
+            uint64_t        mappedSize;
+            uint64_t        dropped;            // messages that fell back to counters so far
+        };
+
+        // the varint of the site records, 7 bits a byte from the lowest, the length
+        inline size_t encode( uint8_t* const pBuffer, uint64_t value )
+        {
+            size_t length = 0;
+            while ( value >= 0x80 ) {
+                pBuffer[ length++ ] = (uint8_t)( value | 0x80 );
+                value >>= 7;
+            }
+            pBuffer[ length++ ] = (uint8_t)value;
+            return length;
+        }
+
+        // false when the varint runs past pEnd or 64 bits
+        inline bool decode( const uint8_t** ppData, const uint8_t* const pEnd, uint64_t* const pValue )
+        {
+            uint64_t value = 0;
+            for ( unsigned shift = 0; *ppData < pEnd && shift < 64; shift += 7 ) {
+                uint8_t byte = *(*ppData)++;
+                value |= (uint64_t)( byte & 0x7F ) << shift;
+                if ( 0 == ( byte & 0x80 ) ) { *pValue = value; return true; }
+            }
+            return false;
+        }
+
+        inline uint64_t zigzag( int64_t value )
+        {
+            return ( (uint64_t)value << 1 ) ^ (uint64_t)( value >> 63 );
+        }
+
+        inline int64_t unzigzag( uint64_t value )
+        {
+            return (int64_t)( value >> 1 ) ^ -(int64_t)( value & 1 );
+        }
+
+        void                initialize();
+        void                uninitialize();
+        void                forkPrepare();
+        void                forkRelease();
+        // the child connects again under its own pid
+        void                forkChild();
+        bool                isEnabled();
+
+        // sends what changed since the last message, called by the reporter service thread
+        void                push();
+    }; // namespace Collector
+}; // namespace MemoryTrace
+#endif
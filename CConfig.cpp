@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "CConfig.h"
+#include "CMemoryManager.h"
+#include "CLeakSuspect.h"
+#include "CCollector.h"
+#include "CWriter.h"
+
+namespace MemoryTrace
+{
+    namespace Config
+    {
+        static tagConfig    s_config = {
+            .mode           = TM_FULL,
+            .depth          = BACKTRACE_DEPTH,
+            .sampleRate     = 100,
+            .output         = { '\0' },
+            .format         = OF_TEXT,
+            .reportTriggers = RT_EXIT,
+            .reportPeriod   = 0,
+            .reportSignal   = SIGUSR2,
+            .bHeavyHitter   = false,
+            .churnWindow    = 0,
+            .bSizeClass     = false,
+            .statsPeriod    = 0,
+            .symbolizeThreads = 4,
+            .record         = { '\0' },
+            .leakWindow     = 0,
+            .leakWindows    = LEAK_SUSPECT_WINDOWS,
+            .persist        = { '\0' },
+            .freeBatch      = 256,
+            .bFollowExec    = true,
+            .collect        = { '\0' },
+            .collectPeriod  = COLLECT_PERIOD,
+            .bMapping       = false,
+            .hugePages      = HP_TRANSPARENT,
+            .bNumaLocal     = true,
+            .bSwitchable    = false,
+            .bTracing       = true,
+            .switchSignal   = 0,
+            .backend        = BE_LIBC,
+            .bProfile       = false,
+            .freedHistory   = 0,
+            .snapshot       = { '\0' },
+            .bCompress      = false,
+            .budget         = { '\0' },
+            .bBudgetFail    = false,
+            .bUnloadReport  = false,
+            .bGrowth        = false,
+        };
+
+        static int          s_outputFd  = STDERR_FILENO;
+        static volatile int s_outputPending = 0;    // 1 in a forked child until the first report, 2 while opening
+
+        // paths as given, a forked child expands them again for its own pid
+        static char         s_outputPattern[ CONFIG_PATH_SIZE ];
+        static char         s_recordPattern[ CONFIG_PATH_SIZE ];
+        static char         s_persistPattern[ CONFIG_PATH_SIZE ];
+        static char         s_snapshotPattern[ CONFIG_PATH_SIZE ];
+
+        static bool matchValue( const char* pValue, size_t length, const char* const name )
+        {
+            return length == strlen( name ) && 0 == strncmp( pValue, name, length );
+        }
+
+        static size_t parseNumber( const char* pValue, size_t length )
+        {
+            size_t number = 0;
+            for ( size_t i = 0; i < length && pValue[i] >= '0' && pValue[i] <= '9'; ++i )
+                number = number * 10 + ( pValue[i] - '0' );
+
+            return number;
+        }
+
+        static void parseMode( const char* pValue, size_t length )
+        {
+            static const char* const s_modes[] = { "off", "counters", "sample", "full", "trace" };
+
+            for ( size_t i = 0; i < sizeof( s_modes ) / sizeof( s_modes[0] ); ++i ) {
+                if ( matchValue( pValue, length, s_modes[i] ) ) { s_config.mode = (TraceMode)i; return; }
+            }
+            fprintf( stderr, "memhook: unknown mode '%.*s'\n", (int)length, pValue );
+        }
+
+        static void parseHugePages( const char* pValue, size_t length )
+        {
+            static const char* const s_hugePages[] = { "off", "thp", "explicit" };
+
+            for ( size_t i = 0; i < sizeof( s_hugePages ) / sizeof( s_hugePages[0] ); ++i ) {
+                if ( matchValue( pValue, length, s_hugePages[i] ) ) { s_config.hugePages = (HugePages)i; return; }
+            }
+            fprintf( stderr, "memhook: unknown hugepages '%.*s'\n", (int)length, pValue );
+        }
+
+        static void parseFormat( const char* pValue, size_t length )
+        {
+            static const char* const s_formats[] = { "text", "json", "csv" };
+
+            for ( size_t i = 0; i < sizeof( s_formats ) / sizeof( s_formats[0] ); ++i ) {
+                if ( matchValue( pValue, length, s_formats[i] ) ) { s_config.format = (OutputFormat)i; return; }
+            }
+            fprintf( stderr, "memhook: unsupported format '%.*s', using text\n", (int)length, pValue );
+        }
+
+        static void parseBackend( const char* pValue, size_t length )
+        {
+            static const char* const s_backends[] = { "libc", "slab" };
+
+            for ( size_t i = 0; i < sizeof( s_backends ) / sizeof( s_backends[0] ); ++i ) {
+                if ( matchValue( pValue, length, s_backends[i] ) ) { s_config.backend = (Backend)i; return; }
+            }
+            fprintf( stderr, "memhook: unknown backend '%.*s'\n", (int)length, pValue );
+        }
+
+        // report=exit+signal+period
+        static void parseTriggers( const char* pValue, size_t length )
+        {
+            s_config.reportTriggers = 0;
+
+            while ( length > 0 ) {
+                const char* pEnd = (const char*)memchr( pValue, '+', length );
+                size_t itemLength = ( NULL == pEnd ) ? length : pEnd - pValue;
+
+                if ( matchValue( pValue, itemLength, "exit" ) )         s_config.reportTriggers |= RT_EXIT;
+                else if ( matchValue( pValue, itemLength, "signal" ) )  s_config.reportTriggers |= RT_SIGNAL;
+                else if ( matchValue( pValue, itemLength, "period" ) )  s_config.reportTriggers |= RT_PERIOD;
+                else if ( !matchValue( pValue, itemLength, "none" ) )
+                    fprintf( stderr, "memhook: unknown report trigger '%.*s'\n", (int)itemLength, pValue );
+
+                if ( NULL == pEnd ) break;
+                length  -= itemLength + 1;
+                pValue  = pEnd + 1;
+            }
+        }
+
+        // copies the path and expands %p to the pid, returns whether there was one
+        static bool expandPath( const char* pValue, size_t length, char* const pPath )
+        {
+            size_t pos = 0;
+            bool bPid = false;
+
+            for ( size_t i = 0; i < length && pos + 1 < CONFIG_PATH_SIZE; ++i ) {
+                if ( '%' == pValue[i] && i + 1 < length && 'p' == pValue[ i + 1 ] ) {
+                    pos += snprintf( pPath + pos, CONFIG_PATH_SIZE - pos, "%d", getpid() );
+                    bPid = true;
+                    ++i;
+                } else {
+                    pPath[ pos++ ] = pValue[i];
+                }
+            }
+            pPath[ pos < CONFIG_PATH_SIZE ? pos : CONFIG_PATH_SIZE - 1 ] = '\0';
+            return bPid;
+        }
+
+        static void parsePath( const char* pValue, size_t length, char* const pPath, char* const pPattern )
+        {
+            size_t patternLength = ( length < CONFIG_PATH_SIZE ) ? length : CONFIG_PATH_SIZE - 1;
+            memcpy( pPattern, pValue, patternLength );
+            pPattern[ patternLength ] = '\0';
+
+            expandPath( pValue, length, pPath );
+        }
+
+        // a path without %p gets the pid appended, the child must not write into the files of its parent
+        static void forkPath( const char* const pPattern, char* const pPath )
+        {
+            if ( '\0' == pPattern[0] ) return;
+
+            if ( !expandPath( pPattern, strlen( pPattern ), pPath ) ) {
+                size_t length = strlen( pPath );
+                snprintf( pPath + length, CONFIG_PATH_SIZE - length, ".%d", getpid() );
+            }
+        }
+
+        static void openOutput()
+        {
+            s_outputFd = STDERR_FILENO;
+            if ( '\0' == s_config.output[0] ) return;
+
+            // the report writer buffers, the descriptor is all the output needs
+            int fd = open( s_config.output, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+            if ( -1 == fd ) {
+                fprintf( stderr, "memhook: can not open %s, using stderr\n", s_config.output );
+                return;
+            }
+            s_outputFd = fd;
+        }
+
+        static void parseOption( const char* pKey, size_t keyLength, const char* pValue, size_t length )
+        {
+            if ( matchValue( pKey, keyLength, "mode" ) ) {
+                parseMode( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "depth" ) ) {
+                s_config.depth = parseNumber( pValue, length );
+                if ( 0 == s_config.depth || s_config.depth > BACKTRACE_DEPTH ) s_config.depth = BACKTRACE_DEPTH;
+            } else if ( matchValue( pKey, keyLength, "sample" ) ) {
+                s_config.sampleRate = parseNumber( pValue, length );
+                if ( 0 == s_config.sampleRate ) s_config.sampleRate = 1;
+            } else if ( matchValue( pKey, keyLength, "output" ) ) {
+                parsePath( pValue, length, s_config.output, s_outputPattern );
+            } else if ( matchValue( pKey, keyLength, "format" ) ) {
+                parseFormat( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "report" ) ) {
+                parseTriggers( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "period" ) ) {
+                s_config.reportPeriod = parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "signal" ) ) {
+                s_config.reportSignal = parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "hitters" ) ) {
+                s_config.bHeavyHitter = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "churn" ) ) {
+                s_config.churnWindow = parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "sizes" ) ) {
+                s_config.bSizeClass = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "stats" ) ) {
+                s_config.statsPeriod = parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "symbolize" ) ) {
+                s_config.symbolizeThreads = parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "record" ) ) {
+                parsePath( pValue, length, s_config.record, s_recordPattern );
+            } else if ( matchValue( pKey, keyLength, "leak" ) ) {
+                s_config.leakWindow = parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "leakwindows" ) ) {
+                s_config.leakWindows = parseNumber( pValue, length );
+                if ( 0 == s_config.leakWindows ) s_config.leakWindows = 1;
+            } else if ( matchValue( pKey, keyLength, "persist" ) ) {
+                parsePath( pValue, length, s_config.persist, s_persistPattern );
+            } else if ( matchValue( pKey, keyLength, "batch" ) ) {
+                s_config.freeBatch = parseNumber( pValue, length );
+                if ( s_config.freeBatch > FREE_BATCH_MAX ) s_config.freeBatch = FREE_BATCH_MAX;
+            } else if ( matchValue( pKey, keyLength, "exec" ) ) {
+                s_config.bFollowExec = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "collect" ) ) {
+                // one socket for the host, a forked child sends to the same collector
+                expandPath( pValue, length, s_config.collect );
+            } else if ( matchValue( pKey, keyLength, "collectperiod" ) ) {
+                s_config.collectPeriod = parseNumber( pValue, length );
+                if ( 0 == s_config.collectPeriod ) s_config.collectPeriod = COLLECT_PERIOD;
+            } else if ( matchValue( pKey, keyLength, "mmap" ) ) {
+                s_config.bMapping = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "hugepages" ) ) {
+                parseHugePages( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "numa" ) ) {
+                s_config.bNumaLocal = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "switch" ) ) {
+                s_config.bSwitchable = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "tracing" ) ) {
+                // starting switched off only makes sense if it can be switched on
+                s_config.bTracing = 0 != parseNumber( pValue, length );
+                if ( !s_config.bTracing ) s_config.bSwitchable = true;
+            } else if ( matchValue( pKey, keyLength, "switchsignal" ) ) {
+                s_config.switchSignal = parseNumber( pValue, length );
+                if ( 0 != s_config.switchSignal ) s_config.bSwitchable = true;
+            } else if ( matchValue( pKey, keyLength, "backend" ) ) {
+                parseBackend( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "profile" ) ) {
+                s_config.bProfile = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "freed" ) ) {
+                s_config.freedHistory = parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "snapshot" ) ) {
+                parsePath( pValue, length, s_config.snapshot, s_snapshotPattern );
+            } else if ( matchValue( pKey, keyLength, "compress" ) ) {
+                s_config.bCompress = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "budget" ) ) {
+                if ( length >= CONFIG_BUDGET_SIZE ) fprintf( stderr, "memhook: budget list longer than %d, cut\n", CONFIG_BUDGET_SIZE - 1 );
+                snprintf( s_config.budget, CONFIG_BUDGET_SIZE, "%.*s", (int)length, pValue );
+            } else if ( matchValue( pKey, keyLength, "budgetfail" ) ) {
+                s_config.bBudgetFail = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "unload" ) ) {
+                s_config.bUnloadReport = 0 != parseNumber( pValue, length );
+            } else if ( matchValue( pKey, keyLength, "growth" ) ) {
+                s_config.bGrowth = 0 != parseNumber( pValue, length );
+            } else {
+                fprintf( stderr, "memhook: unknown option '%.*s'\n", (int)keyLength, pKey );
+            }
+        }
+
+        void initialize()
+        {
+            // MEMHOOK_OPTIONS=key=value:key=value
+            const char* pOptions = getenv( CONFIG_ENV_OPTIONS );
+
+            while ( NULL != pOptions && '\0' != *pOptions ) {
+                const char* pEnd = strchr( pOptions, ':' );
+                size_t length = ( NULL == pEnd ) ? strlen( pOptions ) : pEnd - pOptions;
+
+                const char* pEqual = (const char*)memchr( pOptions, '=', length );
+                if ( NULL != pEqual ) {
+                    parseOption( pOptions, pEqual - pOptions, pEqual + 1, length - ( pEqual - pOptions ) - 1 );
+                } else if ( length > 0 ) {
+                    fprintf( stderr, "memhook: option '%.*s' has no value\n", (int)length, pOptions );
+                }
+
+                pOptions = ( NULL == pEnd ) ? NULL : pEnd + 1;
+            }
+
+            if ( s_config.reportPeriod > 0 ) s_config.reportTriggers |= RT_PERIOD;
+
+            // started by exec from a traced process, the files of the process tree are told apart by pid
+            const char* pRoot = getenv( CONFIG_ENV_ROOT );
+            if ( NULL != pRoot && atoi( pRoot ) != getpid() ) {
+                forkPath( s_outputPattern, s_config.output );
+                forkPath( s_recordPattern, s_config.record );
+                forkPath( s_persistPattern, s_config.persist );
+                forkPath( s_snapshotPattern, s_config.snapshot );
+            }
+
+            openOutput();
+        }
+
+        void forkChild()
+        {
+            forkPath( s_recordPattern, s_config.record );
+            forkPath( s_persistPattern, s_config.persist );
+            forkPath( s_snapshotPattern, s_config.snapshot );
+
+            if ( '\0' == s_outputPattern[0] ) return;
+
+            forkPath( s_outputPattern, s_config.output );
+            if ( STDERR_FILENO == s_outputFd ) { openOutput(); return; }
+
+            // the descriptor is kept and replaced with the first report,
+            // children that only exec or _exit leave no empty file behind
+            s_outputPending = 1;
+        }
+
+        static void openPending()
+        {
+            if ( __sync_bool_compare_and_swap( &s_outputPending, 1, 2 ) ) {
+                int fd = open( s_config.output, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644 );
+                if ( -1 == fd ) {
+                    fprintf( stderr, "memhook: can not open %s, using stderr\n", s_config.output );
+                    dup3( STDERR_FILENO, s_outputFd, O_CLOEXEC );
+                } else {
+                    dup3( fd, s_outputFd, O_CLOEXEC );
+                    close( fd );
+                }
+                __sync_synchronize();
+                s_outputPending = 0;
+            }
+            while ( 0 != s_outputPending ) ;
+        }
+
+        const tagConfig* get()
+        {
+            return &s_config;
+        }
+
+        bool isTraced()
+        {
+            return s_config.mode >= TM_SAMPLE;
+        }
+
+        FILE* output()
+        {
+            if ( 0 != s_outputPending ) openPending();
+            return Writer::stream();
+        }
+
+        int outputFd()
+        {
+            if ( 0 != s_outputPending ) openPending();
+            return s_outputFd;
+        }
+
+        int signalFd()
+        {
+            return s_outputFd;
+        }
+    } // namespace Config
+} // namespace MemoryTrace
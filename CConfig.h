@@ -0,0 +1,124 @@
+#ifndef __CCONFIGH__
+#define __CCONFIGH__
+
+#include <stddef.h>
+#include <cstdio>
+
+namespace MemoryTrace
+{
+    #define CONFIG_ENV_OPTIONS      "MEMHOOK_OPTIONS"
+    #define CONFIG_ENV_ROOT         "MEMHOOK_ROOT"      // pid of the first traced process of the tree
+    #define CONFIG_PATH_SIZE        256
+    #define CONFIG_BUDGET_SIZE      1024
+    namespace Config
+    {
+        enum TraceMode
+        {
+            TM_OFF = 0,         // straight to the real allocator
+            TM_COUNTERS,        // header and counters, no backtrace
+            TM_SAMPLE,          // every sampleRate-th allocation is fully tracked
+            TM_FULL,            // every allocation is fully tracked
+            TM_TRACE,           // full, plus one output line per operation
+        };
+
+        enum OutputFormat
+        {
+            OF_TEXT = 0,
+            OF_JSON,            // one object per line, text sections wrapped as {"type":"text"}
+            OF_CSV,             // one row per block, text sections in rows of type text
+        };
+
+        enum HugePages
+        {
+            HP_OFF = 0,         // regular pages
+            HP_TRANSPARENT,     // madvise( MADV_HUGEPAGE )
+            HP_EXPLICIT,        // MAP_HUGETLB, transparent when none are reserved
+        };
+
+        enum Backend
+        {
+            BE_LIBC = 0,        // headed blocks from the real allocator
+            BE_SLAB,            // headed blocks from the hook's thread-caching size classes
+        };
+
+        enum ReportTrigger
+        {
+            RT_EXIT             = 0x1,
+            RT_SIGNAL           = 0x2,
+            RT_PERIOD           = 0x4,
+        };
+
+        struct tagConfig
+        {
+            TraceMode       mode;
+            size_t          depth;
+            size_t          sampleRate;
+
+            char            output[ CONFIG_PATH_SIZE ];
+            OutputFormat    format;
+
+            unsigned        reportTriggers;
+            size_t          reportPeriod;       // seconds
+            int             reportSignal;
+
+            bool            bHeavyHitter;
+            size_t          churnWindow;        // us, 0 to disable
+            bool            bSizeClass;
+            size_t          statsPeriod;        // ms, 0 to disable
+            size_t          symbolizeThreads;   // 0 for backtrace_symbols_fd
+
+            char            record[ CONFIG_PATH_SIZE ];     // operation trace for memhook-replay
+
+            size_t          leakWindow;         // seconds, 0 to disable
+            size_t          leakWindows;        // growing windows before a site is reported
+
+            char            persist[ CONFIG_PATH_SIZE ];    // counters and stack depot for memhook-postmortem
+
+            size_t          freeBatch;          // frees unlinked per lock, 1 to unlink every free at once
+
+            bool            bFollowExec;        // programs started by exec are traced with the same options
+
+            char            collect[ CONFIG_PATH_SIZE ];    // socket of memhook-collect
+            size_t          collectPeriod;      // ms
+
+            bool            bMapping;           // mmap, munmap, mremap and sbrk are tracked next to the heap
+
+            HugePages       hugePages;          // backing of the hook's own metadata
+            bool            bNumaLocal;         // metadata prefers the node of the thread that maps it
+
+            bool            bSwitchable;        // tracking can be switched off and on while running
+            bool            bTracing;           // whether it starts switched on
+            int             switchSignal;       // toggles tracking, 0 for none
+
+            Backend         backend;            // where blocks with a header come from
+
+            bool            bProfile;           // the hook's own cost per operation and phase
+
+            size_t          freedHistory;       // freed blocks the crash handler can attribute a fault to, 0 to disable
+
+            char            snapshot[ CONFIG_PATH_SIZE ];   // columnar heap snapshot per report for memhook-query
+
+            bool            bCompress;          // the output in packed blocks, memhook cat unpacks them
+
+            char            budget[ CONFIG_BUDGET_SIZE ];   // scope.name=soft/hard,... parsed by Budget
+            bool            bBudgetFail;        // allocations past a hard limit return NULL
+
+            bool            bUnloadReport;      // dlclose reports the live blocks allocated by the module
+            bool            bGrowth;            // realloc chains per call site
+        };
+
+        // parses MEMHOOK_OPTIONS, called once while the hook initializes so nothing may allocate
+        void                initialize();
+        // the paths of a forked child, %p expanded again or the pid appended, and its own output
+        void                forkChild();
+        const tagConfig*    get();
+
+        bool                isTraced();
+        FILE*               output();
+        int                 outputFd();
+        // async-signal-safe, the descriptor as resolved so far. never opens, a forked child that has not
+        // reported yet writes to the inherited one, its own file is later put under the same number
+        int                 signalFd();
+    }; // namespace Config
+}; // namespace MemoryTrace
+#endif
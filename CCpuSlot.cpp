@@ -0,0 +1,156 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "CCpuSlot.h"
+#include "CThreadSlot.h"
+#include "CArena.h"
+
+#if defined( __x86_64__ ) && defined( __linux__ ) && __has_include( <sys/rseq.h> )
+#include <sys/rseq.h>
+// glibc before 2.35 has no rseq registration, every add goes to the thread slots there
+#pragma weak __rseq_offset
+#pragma weak __rseq_size
+#define CPU_SLOT_RSEQ
+#endif
+
+namespace MemoryTrace
+{
+    namespace CpuSlot
+    {
+        static tagCpuCounters*  s_pCpuCounters  = NULL;
+        static size_t           s_cpuCount      = MAX_CPU_SLOT;
+        static tagCpuCounters   s_threadCounters[ MAX_THREAD_SLOT ];
+
+#ifdef CPU_SLOT_RSEQ
+        static struct rseq* rseqArea()
+        {
+            if ( NULL == &__rseq_size || 0 == __rseq_size ) return NULL;
+
+            struct rseq* pRseq = (struct rseq*)( (char*)__builtin_thread_pointer() + __rseq_offset );
+            // registration failed or was turned off with glibc.pthread.rseq=0
+            return ( (int32_t)pRseq->cpu_id < 0 ) ? NULL : pRseq;
+        }
+
+        // false when the kernel aborted the sequence or the CPU has no slot
+        static bool rseqAdd( struct rseq* pRseq, int64_t* pValue, int64_t value )
+        {
+            // pValue is the counter in the table of CPU 0, the current CPU's line is cpu_id * 64 further.
+            // the add is the commit, a preemption or signal before it restarts at the abort handler
+            __asm__ __volatile__ goto (
+                ".pushsection __rseq_cs, \"aw\"\n\t"
+                ".balign 32\n\t"
+                "3:\n\t"
+                ".long 0x0, 0x0\n\t"
+                ".quad 1f, (2f - 1f), 4f\n\t"
+                ".popsection\n\t"
+                "leaq 3b(%%rip), %%rax\n\t"
+                "movq %%rax, %c[csOffset](%[rseq])\n\t"
+                "1:\n\t"
+                "movl %c[cpuOffset](%[rseq]), %%eax\n\t"
+                "cmpl %[cpuCount], %%eax\n\t"
+                "jae 4f\n\t"
+                "shlq $6, %%rax\n\t"
+                "addq %[value], (%[base], %%rax)\n\t"
+                "2:\n\t"
+                ".pushsection __rseq_failure, \"ax\"\n\t"
+                ".byte 0x0f, 0xb9, 0x3d\n\t"
+                ".long 0x53053053\n\t"
+                "4:\n\t"
+                "jmp %l[abort]\n\t"
+                ".popsection\n\t"
+                :
+                : [rseq] "r" ( pRseq ),
+                  [base] "r" ( pValue ),
+                  [value] "r" ( value ),
+                  [cpuCount] "r" ( (uint32_t)s_cpuCount ),
+                  [csOffset] "i" ( offsetof( struct rseq, rseq_cs ) ),
+                  [cpuOffset] "i" ( offsetof( struct rseq, cpu_id ) )
+                : "memory", "cc", "rax"
+                : abort );
+            return true;
+        abort:
+            return false;
+        }
+#endif
+
+        // highest possible CPU + 1 from "0-N" or "0,2-5", sysconf() would allocate while the hook initializes
+        static size_t possibleCpus()
+        {
+            int fd = open( "/sys/devices/system/cpu/possible", O_RDONLY | O_CLOEXEC );
+            if ( -1 == fd ) return MAX_CPU_SLOT;
+
+            char buffer[ 256 ];
+            ssize_t size = read( fd, buffer, sizeof( buffer ) - 1 );
+            close( fd );
+            if ( size <= 0 ) return MAX_CPU_SLOT;
+            buffer[ size ] = '\0';
+
+            size_t last = 0;
+            size_t number = 0;
+            for ( ssize_t i = 0; i <= size; ++i ) {
+                if ( buffer[i] >= '0' && buffer[i] <= '9' ) { number = number * 10 + ( buffer[i] - '0' ); continue; }
+                if ( number > last ) last = number;
+                number = 0;
+            }
+
+            return ( last + 1 < MAX_CPU_SLOT ) ? last + 1 : MAX_CPU_SLOT;
+        }
+
+        void initialize()
+        {
+            if ( NULL != s_pCpuCounters ) return;
+
+            size_t cpuCount = possibleCpus();
+            tagCpuCounters* pCounters = (tagCpuCounters*)Arena::allocate( cpuCount * sizeof( tagCpuCounters ) );
+            if ( NULL == pCounters ) return;
+
+            s_cpuCount = cpuCount;
+            __sync_synchronize();
+            s_pCpuCounters = pCounters;
+        }
+
+        bool isRseq()
+        {
+#ifdef CPU_SLOT_RSEQ
+            return NULL != s_pCpuCounters && NULL != rseqArea();
+#else
+            return false;
+#endif
+        }
+
+        void add( CpuCounter counter, int64_t value )
+        {
+#ifdef CPU_SLOT_RSEQ
+            tagCpuCounters* pCounters = s_pCpuCounters;
+            if ( NULL != pCounters ) {
+                struct rseq* pRseq = rseqArea();
+                if ( NULL != pRseq && rseqAdd( pRseq, &pCounters->values[ counter ], value ) ) return;
+            }
+#endif
+            // slots are shared once there are more threads than slots
+            __atomic_fetch_add( &s_threadCounters[ ThreadSlot::current() ].values[ counter ], value, __ATOMIC_RELAXED );
+        }
+
+        void sum( int64_t* const values )
+        {
+            for ( size_t c = 0; c < CC_COUNT; ++c ) values[c] = 0;
+
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) {
+                for ( size_t c = 0; c < CC_COUNT; ++c ) values[c] += __atomic_load_n( &s_threadCounters[i].values[c], __ATOMIC_RELAXED );
+            }
+
+            tagCpuCounters* pCounters = s_pCpuCounters;
+            if ( NULL == pCounters ) return;
+
+            for ( size_t i = 0; i < s_cpuCount; ++i ) {
+                for ( size_t c = 0; c < CC_COUNT; ++c ) values[c] += __atomic_load_n( &pCounters[i].values[c], __ATOMIC_RELAXED );
+            }
+        }
+
+        void reset()
+        {
+            memset( s_threadCounters, 0, sizeof( s_threadCounters ) );
+            if ( NULL != s_pCpuCounters ) memset( s_pCpuCounters, 0, s_cpuCount * sizeof( tagCpuCounters ) );
+        }
+    } // namespace CpuSlot
+} // namespace MemoryTrace
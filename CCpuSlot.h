@@ -0,0 +1,41 @@
+#ifndef __CCPUSLOTH__
+#define __CCPUSLOTH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MemoryTrace
+{
+    #define MAX_CPU_SLOT        1024
+    namespace CpuSlot
+    {
+        // one cache line of counters per CPU, added to with a restartable sequence so the hot path
+        // takes neither a lock nor a locked instruction. threads without rseq, CPUs past MAX_CPU_SLOT
+        // and sequences the kernel aborted add to the per-thread slot instead, readers sum both
+        enum CpuCounter
+        {
+            CC_ALLOC_COUNT = 0,
+            CC_ALLOC_SIZE,
+            CC_FREE_COUNT,
+            CC_FREE_SIZE,
+            CC_COUNT,
+        };
+
+        struct __attribute__ (( aligned( 64 ) )) tagCpuCounters
+        {
+            int64_t         values[ 8 ];
+        };
+
+        // maps the per-CPU table from the metadata arena, counts go to the thread slots until then
+        void                initialize();
+        // whether the calling thread adds through rseq
+        bool                isRseq();
+
+        void                add( CpuCounter counter, int64_t value );
+        // async-signal-safe, racing adds show up in the next sum
+        void                sum( int64_t* const values );
+        // only while initializing or in a forked child
+        void                reset();
+    }; // namespace CpuSlot
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,199 @@
+#include <stdlib.h>
+#include <string.h>
+#include <cstdio>
+#include <errno.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "CExec.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Exec
+    {
+        typedef int         (*FUNC_EXECVE)( const char*, char* const[], char* const[] );
+        typedef int         (*FUNC_POSIX_SPAWN)( pid_t*, const char*, const posix_spawn_file_actions_t*, \
+                                                 const posix_spawnattr_t*, char* const[], char* const[] );
+
+        static bool         s_bEnabled      = false;
+        static char         s_library[ EXEC_ENV_SIZE ];
+        static char         s_options[ EXEC_ENV_SIZE ];
+        static char         s_root[ 64 ];
+
+        // the first traced process of the tree, in environ so even plain execv() passes it on,
+        // setenv would allocate while the hook initializes
+        static void exportRoot()
+        {
+            size_t count = 0;
+            while ( NULL != environ && NULL != environ[ count ] ) ++count;
+
+            void* pMap = mmap( NULL, ( count + 2 ) * sizeof( char* ), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( MAP_FAILED == pMap ) return;
+
+            char** ppEnv = (char**)pMap;
+            if ( count > 0 ) memcpy( ppEnv, environ, count * sizeof( char* ) );
+            ppEnv[ count ]      = s_root;
+            ppEnv[ count + 1 ]  = NULL;
+            environ = ppEnv;
+        }
+
+        void initialize()
+        {
+            if ( !Config::get()->bFollowExec ) return;
+
+            Dl_info info;
+            if ( 0 == dladdr( (void*)initialize, &info ) || NULL == info.dli_fname ) return;
+            snprintf( s_library, sizeof( s_library ), "%s", info.dli_fname );
+
+            // copied now, the program may change its environment later
+            const char* pOptions = getenv( CONFIG_ENV_OPTIONS );
+            if ( NULL != pOptions ) snprintf( s_options, sizeof( s_options ), "%s=%s", CONFIG_ENV_OPTIONS, pOptions );
+
+            const char* pRoot = getenv( CONFIG_ENV_ROOT );
+            if ( NULL != pRoot ) {
+                snprintf( s_root, sizeof( s_root ), "%s=%.32s", CONFIG_ENV_ROOT, pRoot );
+            } else {
+                snprintf( s_root, sizeof( s_root ), "%s=%d", CONFIG_ENV_ROOT, getpid() );
+                exportRoot();
+            }
+
+            s_bEnabled = true;
+        }
+
+        static const char* findValue( char* const envp[], const char* const name, size_t* pCount )
+        {
+            size_t length = strlen( name );
+            const char* pValue = NULL;
+
+            size_t count = 0;
+            for ( ; NULL != envp && NULL != envp[ count ]; ++count ) {
+                if ( 0 == strncmp( envp[ count ], name, length ) && '=' == envp[ count ][ length ] ) pValue = envp[ count ] + length + 1;
+            }
+
+            *pCount = count;
+            return pValue;
+        }
+
+        static bool hasLibrary( const char* pPreload )
+        {
+            // LD_PRELOAD is separated by spaces or colons
+            size_t length = strlen( s_library );
+            for ( const char* pFound = strstr( pPreload, s_library ); NULL != pFound; pFound = strstr( pFound + 1, s_library ) ) {
+                bool bBegin = pFound == pPreload || ' ' == pFound[-1] || ':' == pFound[-1];
+                bool bEnd   = '\0' == pFound[ length ] || ' ' == pFound[ length ] || ':' == pFound[ length ];
+                if ( bBegin && bEnd ) return true;
+            }
+            return false;
+        }
+
+        // no stdio on the way to exec, the buffer holds EXEC_ENV_SIZE * 2 bytes and stays terminated
+        static void append( char* const pBuffer, size_t* pLength, const char* pText )
+        {
+            while ( '\0' != *pText && *pLength < EXEC_ENV_SIZE * 2 - 1 ) pBuffer[ (*pLength)++ ] = *pText++;
+            pBuffer[ *pLength ] = '\0';
+        }
+
+        // NULL when envp already carries everything, otherwise a copy to release() after a failed exec.
+        // mapped rather than allocated, exec must stay async-signal-safe and after vfork() a block would
+        // land in the parent's heap
+        static char** environment( char* const envp[], size_t* pMapSize )
+        {
+            if ( !s_bEnabled ) return NULL;
+
+            size_t count = 0;
+            const char* pPreload    = findValue( envp, EXEC_ENV_PRELOAD, &count );
+            bool bPreload           = NULL != pPreload && hasLibrary( pPreload );
+            bool bOptions           = '\0' == s_options[0] || NULL != findValue( envp, CONFIG_ENV_OPTIONS, &count );
+            bool bRoot              = NULL != findValue( envp, CONFIG_ENV_ROOT, &count );
+            if ( bPreload && bOptions && bRoot ) return NULL;
+
+            *pMapSize = ( count + 4 ) * sizeof( char* ) + EXEC_ENV_SIZE * 2;
+            void* pMap = mmap( NULL, *pMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( MAP_FAILED == pMap ) return NULL;
+
+            char** ppEnv = (char**)pMap;
+            char* pBuffer = (char*)( ppEnv + count + 4 );
+
+            size_t used = 0;
+            for ( size_t i = 0; i < count; ++i ) {
+                if ( !bPreload && 0 == strncmp( envp[i], EXEC_ENV_PRELOAD "=", sizeof( EXEC_ENV_PRELOAD ) ) ) continue;
+                ppEnv[ used++ ] = envp[i];
+            }
+
+            // ours first, the others the program asked for stay behind it
+            if ( !bPreload ) {
+                size_t length = 0;
+                append( pBuffer, &length, EXEC_ENV_PRELOAD "=" );
+                append( pBuffer, &length, s_library );
+                if ( NULL != pPreload && '\0' != pPreload[0] ) {
+                    append( pBuffer, &length, " " );
+                    append( pBuffer, &length, pPreload );
+                }
+                ppEnv[ used++ ] = pBuffer;
+            }
+            if ( !bOptions ) ppEnv[ used++ ] = s_options;
+            if ( !bRoot ) ppEnv[ used++ ] = s_root;
+            ppEnv[ used ] = NULL;
+
+            return ppEnv;
+        }
+
+        static void release( char** ppEnv, size_t mapSize )
+        {
+            if ( NULL != ppEnv ) munmap( ppEnv, mapSize );
+        }
+
+        static void* realFunction( const char* const name )
+        {
+            void* pFunction = dlsym( RTLD_NEXT, name );
+            if ( NULL == pFunction ) errno = ENOSYS;
+            return pFunction;
+        }
+
+        int execve( const char* path, char* const argv[], char* const envp[] )
+        {
+            static FUNC_EXECVE s_pReal = NULL;
+            if ( NULL == s_pReal && NULL == ( s_pReal = (FUNC_EXECVE)realFunction( "execve" ) ) ) return -1;
+
+            size_t mapSize = 0;
+            char** ppEnv = environment( envp, &mapSize );
+            int result = s_pReal( path, argv, ( NULL != ppEnv ) ? ppEnv : envp );
+
+            int error = errno;
+            release( ppEnv, mapSize );
+            errno = error;
+            return result;
+        }
+
+        int execvpe( const char* file, char* const argv[], char* const envp[] )
+        {
+            static FUNC_EXECVE s_pReal = NULL;
+            if ( NULL == s_pReal && NULL == ( s_pReal = (FUNC_EXECVE)realFunction( "execvpe" ) ) ) return -1;
+
+            size_t mapSize = 0;
+            char** ppEnv = environment( envp, &mapSize );
+            int result = s_pReal( file, argv, ( NULL != ppEnv ) ? ppEnv : envp );
+
+            int error = errno;
+            release( ppEnv, mapSize );
+            errno = error;
+            return result;
+        }
+
+        int posixSpawn( pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions, \
+                        const posix_spawnattr_t* attr, char* const argv[], char* const envp[], bool bSearch )
+        {
+            static FUNC_POSIX_SPAWN s_pReal[2] = { NULL, NULL };
+            FUNC_POSIX_SPAWN* ppReal = &s_pReal[ bSearch ? 1 : 0 ];
+            if ( NULL == *ppReal && NULL == ( *ppReal = (FUNC_POSIX_SPAWN)realFunction( bSearch ? "posix_spawnp" : "posix_spawn" ) ) ) return ENOSYS;
+
+            size_t mapSize = 0;
+            char** ppEnv = environment( envp, &mapSize );
+            int result = (*ppReal)( pid, path, actions, attr, argv, ( NULL != ppEnv ) ? ppEnv : envp );
+
+            release( ppEnv, mapSize );
+            return result;
+        }
+    } // namespace Exec
+} // namespace MemoryTrace
@@ -0,0 +1,24 @@
+#ifndef __CEXECH__
+#define __CEXECH__
+
+#include <spawn.h>
+#include <sys/types.h>
+
+namespace MemoryTrace
+{
+    #define EXEC_ENV_PRELOAD        "LD_PRELOAD"
+    #define EXEC_ENV_SIZE           4096
+    namespace Exec
+    {
+        // remembers the preload library and the options, exports CONFIG_ENV_ROOT for the process tree
+        void                initialize();
+
+        // a program that passes its own environment keeps LD_PRELOAD, MEMHOOK_OPTIONS and MEMHOOK_ROOT,
+        // only calls with an explicit envp are interposed, the others use environ which already has them
+        int                 execve( const char* path, char* const argv[], char* const envp[] );
+        int                 execvpe( const char* file, char* const argv[], char* const envp[] );
+        int                 posixSpawn( pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions, \
+                                        const posix_spawnattr_t* attr, char* const argv[], char* const envp[], bool bSearch );
+    }; // namespace Exec
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,249 @@
+#include <string.h>
+#include <unistd.h>
+#include <execinfo.h>
+#include "CFault.h"
+#include "CStackDepot.h"
+#include "CConfig.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace Fault
+    {
+        static bool             s_bEnabled  = false;
+        static tagFreedBlock*   s_pFreed    = NULL;     // metadata arena, only with freed=N
+        static size_t           s_mask      = 0;
+        static volatile size_t  s_next      = 0;
+        static uint32_t* volatile*  s_pRegions  = NULL;     // region to the ring position + 1 of its newest free
+        static volatile uint32_t    s_largeHead = 0;
+
+        // no stdio in the handler, lines are put together in a buffer on the stack and written at once
+        struct tagLine
+        {
+            char            text[ 256 ];
+            size_t          length;
+        };
+
+        static void put( tagLine* pLine, const char* pText )
+        {
+            while ( '\0' != *pText && pLine->length < sizeof( pLine->text ) ) pLine->text[ pLine->length++ ] = *pText++;
+        }
+
+        static void putNumber( tagLine* pLine, size_t value )
+        {
+            char digits[ 24 ];
+            size_t count = 0;
+            do { digits[ count++ ] = '0' + value % 10; value /= 10; } while ( 0 != value );
+
+            while ( count > 0 && pLine->length < sizeof( pLine->text ) ) pLine->text[ pLine->length++ ] = digits[ --count ];
+        }
+
+        static void putAddress( tagLine* pLine, uintptr_t value )
+        {
+            char digits[ 16 ];
+            size_t count = 0;
+            do { digits[ count++ ] = "0123456789abcdef"[ value & 0xF ]; value >>= 4; } while ( 0 != value );
+
+            put( pLine, "0x" );
+            while ( count > 0 && pLine->length < sizeof( pLine->text ) ) pLine->text[ pLine->length++ ] = digits[ --count ];
+        }
+
+        static void flush( tagLine* pLine )
+        {
+            put( pLine, "\n" );
+            ssize_t written = write( Config::signalFd(), pLine->text, pLine->length );
+            (void)written;
+            pLine->length = 0;
+        }
+
+        // bytes between the address and [ begin, begin + size ), 0 inside
+        static uintptr_t distanceOf( uintptr_t addr, uintptr_t begin, size_t size )
+        {
+            if ( addr < begin ) return begin - addr;
+            if ( addr >= begin + size ) return addr - ( begin + size ) + 1;
+
+            return 0;
+        }
+
+        // where the fault lies relative to the block
+        static void putPosition( tagLine* pLine, uintptr_t addr, uintptr_t begin, size_t size )
+        {
+            if ( addr < begin ) {
+                putNumber( pLine, begin - addr );
+                put( pLine, " bytes before it" );
+            } else if ( addr >= begin + size ) {
+                putNumber( pLine, addr - ( begin + size ) );
+                put( pLine, " bytes past its end" );
+            } else {
+                put( pLine, "at offset " );
+                putNumber( pLine, addr - begin );
+            }
+        }
+
+        static void putStack( const char* const pName, size_t stackId )
+        {
+            const StackDepot::tagStackEntry* pEntry = StackDepot::get( stackId );
+
+            tagLine line = { { 0 }, 0 };
+            put( &line, pName );
+            if ( NULL == pEntry ) put( &line, " not recorded" );
+            flush( &line );
+
+            if ( NULL != pEntry ) backtrace_symbols_fd( pEntry->backtrace, pEntry->traceSize, Config::signalFd() );
+        }
+
+        // the chain head of a region, the leaves come from the arena on the first free there. NULL past 48 bits
+        static volatile uint32_t* regionHead( uintptr_t region, bool bCreate )
+        {
+            if ( ( region >> REGION_LEAF_BITS ) >= REGION_ROOT_SIZE ) return NULL;
+
+            uint32_t* volatile* ppLeaf = &s_pRegions[ region >> REGION_LEAF_BITS ];
+            if ( NULL == *ppLeaf ) {
+                if ( !bCreate ) return NULL;
+
+                uint32_t* pLeaf = (uint32_t*)Arena::allocate( ( 1UL << REGION_LEAF_BITS ) * sizeof( uint32_t ) );
+                if ( NULL == pLeaf ) return NULL;
+                // a racing free may have put its own there, that one stays unused in the arena
+                __sync_bool_compare_and_swap( ppLeaf, (uint32_t*)NULL, pLeaf );
+            }
+
+            return &( *ppLeaf )[ region & ( ( 1UL << REGION_LEAF_BITS ) - 1 ) ];
+        }
+
+        // newest first, ends where an entry was overwritten since or is being written
+        static void searchChain( uint32_t position, uintptr_t region, uintptr_t addr, const tagFreedBlock** ppBest, uintptr_t* pBestDistance )
+        {
+            size_t sequence = SIZE_MAX;
+
+            while ( 0 != position && position <= s_mask + 1 ) {
+                const tagFreedBlock* pFreed = &s_pFreed[ position - 1 ];
+                uintptr_t data = (uintptr_t)pFreed->pData;
+                if ( 0 == data || pFreed->sequence >= sequence ) break;
+
+                bool bLarge = pFreed->size >= ( 1UL << REGION_SHIFT );
+                if ( UINTPTR_MAX == region ? !bLarge : ( bLarge || ( data >> REGION_SHIFT ) != region ) ) break;
+                sequence = pFreed->sequence;
+
+                uintptr_t distance = distanceOf( addr, data, pFreed->size );
+                if ( distance < *pBestDistance || ( NULL != *ppBest && distance == *pBestDistance && sequence > ( *ppBest )->sequence ) ) {
+                    *ppBest         = pFreed;
+                    *pBestDistance  = distance;
+                }
+                position = pFreed->regionNext;
+            }
+        }
+
+        void initialize()
+        {
+            size_t count = Config::get()->freedHistory;
+            if ( 0 == count || Config::TM_OFF == Config::get()->mode ) return;
+
+            size_t capacity = 1;
+            while ( capacity < count && capacity < FAULT_FREED_MAX ) capacity <<= 1;
+
+            s_pFreed    = (tagFreedBlock*)Arena::allocate( capacity * sizeof( tagFreedBlock ) );
+            s_pRegions  = (uint32_t* volatile*)Arena::allocate( REGION_ROOT_SIZE * sizeof( uint32_t* ) );
+            s_mask      = capacity - 1;
+            s_bEnabled  = NULL != s_pFreed && NULL != s_pRegions;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void recordFree( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || pNode->bMock ) return;
+
+            void*  backtrace[ BACKTRACE_DEPTH ];
+            size_t hash;
+            size_t traceSize = MemoryManager::captureBacktrace( backtrace, &hash );
+
+            size_t sequence = __sync_fetch_and_add( &s_next, 1 );
+            tagFreedBlock* pFreed = &s_pFreed[ sequence & s_mask ];
+
+            // the handler ends a chain at an entry without a data pointer
+            pFreed->pData           = NULL;
+            __sync_synchronize();
+            pFreed->size            = pNode->size;
+            pFreed->serial          = pNode->serial;
+            pFreed->allocStackId    = pNode->stackId;
+            pFreed->freeStackId     = StackDepot::intern( hash, backtrace, traceSize );
+            pFreed->sequence        = sequence;
+            pFreed->regionNext      = 0;
+
+            volatile uint32_t* pHead = ( pNode->size >= ( 1UL << REGION_SHIFT ) ) ? &s_largeHead : regionHead( (uintptr_t)pNode->pData >> REGION_SHIFT, true );
+            if ( NULL != pHead ) pFreed->regionNext = __sync_lock_test_and_set( pHead, (uint32_t)( ( sequence & s_mask ) + 1 ) );
+            __sync_synchronize();
+            pFreed->pData           = pNode->pData;
+        }
+
+        void announce( int signal )
+        {
+            tagLine line = { { 0 }, 0 };
+
+            put( &line, "signal: " );
+            putNumber( &line, signal );
+            flush( &line );
+        }
+
+        void report( int signal, const void* pAddr )
+        {
+            uintptr_t addr = (uintptr_t)pAddr;
+            tagLine line = { { 0 }, 0 };
+
+            put( &line, "memhook: signal " );
+            putNumber( &line, signal );
+            put( &line, " at " );
+            putAddress( &line, addr );
+            flush( &line );
+
+            MemoryManager::tagUnitRecord record;
+            if ( MemoryManager::findUnit( pAddr, &record ) && distanceOf( addr, (uintptr_t)record.pData, record.size ) <= FAULT_NEAR_MAX ) {
+                put( &line, "memhook: live block " );
+                putAddress( &line, (uintptr_t)record.pData );
+                put( &line, ", size " );
+                putNumber( &line, record.size );
+                put( &line, ", serial " );
+                putNumber( &line, record.serial );
+                put( &line, ", fault " );
+                putPosition( &line, addr, (uintptr_t)record.pData, record.size );
+                flush( &line );
+
+                put( &line, "memhook: allocated by" );
+                if ( 0 == record.traceSize ) put( &line, " not recorded" );
+                flush( &line );
+                backtrace_symbols_fd( record.backtrace, record.traceSize, Config::signalFd() );
+            }
+
+            if ( !s_bEnabled ) return;
+
+            // the regions a block nearer than FAULT_NEAR_MAX may start in, like findUnit. on equal distance
+            // the most recent block freed there is the likely culprit
+            const tagFreedBlock* pBest = NULL;
+            uintptr_t bestDistance = UINTPTR_MAX;
+            uintptr_t region = addr >> REGION_SHIFT;
+
+            for ( uintptr_t r = ( region > 2 ) ? region - 2 : 0; r <= region + 1; ++r ) {
+                volatile uint32_t* pHead = regionHead( r, false );
+                if ( NULL != pHead ) searchChain( *pHead, r, addr, &pBest, &bestDistance );
+            }
+            searchChain( s_largeHead, UINTPTR_MAX, addr, &pBest, &bestDistance );
+            if ( NULL == pBest || bestDistance > FAULT_NEAR_MAX ) return;
+
+            put( &line, "memhook: freed block " );
+            putAddress( &line, (uintptr_t)pBest->pData );
+            put( &line, ", size " );
+            putNumber( &line, pBest->size );
+            put( &line, ", serial " );
+            putNumber( &line, pBest->serial );
+            put( &line, ", fault " );
+            putPosition( &line, addr, (uintptr_t)pBest->pData, pBest->size );
+            flush( &line );
+
+            putStack( "memhook: allocated by", pBest->allocStackId );
+            putStack( "memhook: freed by", pBest->freeStackId );
+        }
+    } // namespace Fault
+} // namespace MemoryTrace
@@ -0,0 +1,41 @@
+#ifndef __CFAULTH__
+#define __CFAULTH__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define FAULT_FREED_MAX         ( 1UL << 20 )       // entries of the free history at most
+    #define FAULT_NEAR_MAX          ( 64UL << 10 )      // a block further off than this is not blamed
+    namespace Fault
+    {
+        // what the crash handler knows of a freed block, freed=N keeps the last N of them with the stack
+        // that freed them. the entries are overwritten in place, a reader may see one half written.
+        // the entries of a region are chained newest first like the live blocks, a block of a region
+        // or more goes to a chain of its own
+        struct tagFreedBlock
+        {
+            void*           pData;
+            size_t          size;
+            size_t          serial;
+            size_t          allocStackId;
+            size_t          freeStackId;
+            size_t          sequence;       // of the free, an entry overwritten since has a larger one
+            uint32_t        regionNext;     // ring position + 1 of the previous free in the chain, 0 ends it
+        };
+
+        void                initialize();
+        bool                isEnabled();
+
+        // the free history, a no-op unless freed=N
+        void                recordFree( const MemoryManager::tagUnitNode* const );
+
+        // async-signal-safe, the line every caught signal starts with
+        void                announce( int signal );
+        // async-signal-safe, writes the live and the freed block containing or nearest to pAddr to the output
+        void                report( int signal, const void* pAddr );
+    }; // namespace Fault
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,165 @@
+#include <string.h>
+#include <cstdio>
+#include <malloc.h>
+#include <pthread.h>
+#include "CGrowth.h"
+#include "CConfig.h"
+#include "CArena.h"
+#include "CSlab.h"
+
+namespace MemoryTrace
+{
+    namespace Growth
+    {
+        static bool             s_bEnabled      = false;
+        static tagGrowthSite*   s_sites         = NULL;     // metadata arena, one per stack id
+
+        static pthread_mutex_t  s_mutexReport   = PTHREAD_MUTEX_INITIALIZER;
+
+        static const char* const s_factorNames[ GF_COUNT ] = { "shrink", "<=x1.25", "<=x1.5", "<=x2", "<=x4", ">x4" };
+
+        void initialize()
+        {
+            if ( !Config::get()->bGrowth || !Config::isTraced() ) return;
+
+            s_sites     = (tagGrowthSite*)Arena::allocate( STACK_DEPOT_CAPACITY * sizeof( tagGrowthSite ) );
+            s_bEnabled  = NULL != s_sites;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        static GrowthFactor factorOf( size_t oldSize, size_t newSize )
+        {
+            if ( newSize < oldSize )            return GF_SHRINK;
+            if ( 0 == oldSize )                 return GF_MORE;
+            if ( newSize * 4 <= oldSize * 5 )   return GF_125;
+            if ( newSize * 2 <= oldSize * 3 )   return GF_150;
+            if ( newSize <= oldSize * 2 )       return GF_200;
+            if ( newSize <= oldSize * 4 )       return GF_400;
+            return GF_MORE;
+        }
+
+        // what the allocator handed out for the old block, a slab block is as large as its class
+        static size_t usableOf( const MemoryManager::tagUnitNode* const pNode )
+        {
+            size_t usable = ( 0 != pNode->sizeClass ) ? Slab::classSize( pNode->sizeClass - 1 ) : malloc_usable_size( (void*)pNode );
+            return ( usable > sizeof( MemoryManager::tagUnitNode ) ) ? usable - sizeof( MemoryManager::tagUnitNode ) : 0;
+        }
+
+        void recordRealloc( MemoryManager::tagUnitNode* const pOld, MemoryManager::tagUnitNode* const pNew, size_t copied )
+        {
+            if ( !s_bEnabled || NULL == pOld || NULL == pNew || pOld->bMock ) return;
+
+            // the chain goes on in the new block, freeing the old one does not end it
+            pNew->chainLength = ( UINT16_MAX == pOld->chainLength ) ? UINT16_MAX : pOld->chainLength + 1;
+            pOld->chainLength = 0;
+
+            if ( 0 == pNew->stackId || pNew->stackId > STACK_DEPOT_CAPACITY ) return;
+
+            tagGrowthSite* pSite = &s_sites[ pNew->stackId - 1 ];
+            __sync_fetch_and_add( &pSite->reallocCount, 1 );
+            __sync_fetch_and_add( &pSite->copiedSize, copied );
+            __sync_fetch_and_add( &pSite->factors[ factorOf( pOld->size, pNew->size ) ], 1 );
+            if ( pNew->size <= usableOf( pOld ) ) __sync_fetch_and_add( &pSite->inPlaceCount, 1 );
+        }
+
+        void recordFree( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || 0 == pNode->chainLength || 0 == pNode->stackId || pNode->stackId > STACK_DEPOT_CAPACITY ) return;
+
+            tagGrowthSite* pSite = &s_sites[ pNode->stackId - 1 ];
+            __sync_fetch_and_add( &pSite->chainCount, 1 );
+            __sync_fetch_and_add( &pSite->chainLength, pNode->chainLength );
+            __sync_fetch_and_add( &pSite->finalSize, pNode->size );
+
+            uint64_t max = pSite->finalMax;
+            while ( pNode->size > max && !__sync_bool_compare_and_swap( &pSite->finalMax, max, pNode->size ) ) max = pSite->finalMax;
+        }
+
+        static void showSite( size_t index, size_t id )
+        {
+            const tagGrowthSite* pSite = &s_sites[ id - 1 ];
+
+            fprintf( Config::output(), "++++++++++++++ #%ld copied: %lu, reallocs: %lu, fit in place: %lu ++++++++++++++\n", \
+                            index, \
+                            pSite->copiedSize, \
+                            pSite->reallocCount, \
+                            pSite->inPlaceCount );
+
+            fprintf( Config::output(), "growth:" );
+            for ( size_t i = 0; i < GF_COUNT; ++i ) {
+                if ( 0 != pSite->factors[i] ) fprintf( Config::output(), " %s: %lu", s_factorNames[i], pSite->factors[i] );
+            }
+            fprintf( Config::output(), "\n" );
+
+            // chains still live have copied already but no final size yet
+            if ( 0 != pSite->chainCount ) {
+                uint64_t average = pSite->finalSize / pSite->chainCount;
+                fprintf( Config::output(), "chains: %lu, reallocs per chain: %.1f, final size: average %lu, max %lu\n", \
+                                pSite->chainCount, \
+                                (double)pSite->chainLength / pSite->chainCount, \
+                                average, \
+                                pSite->finalMax );
+                fprintf( Config::output(), "reserve %lu up front: saves %lu copied bytes, %lu reallocs\n", \
+                                average, \
+                                pSite->copiedSize, \
+                                pSite->reallocCount );
+            }
+
+            const StackDepot::tagStackEntry* pStack = StackDepot::get( id );
+            if ( NULL != pStack ) {
+                fprintf( Config::output(), "backtrace:\n" );
+                MemoryManager::showBacktrace( pStack->backtrace, pStack->traceSize );
+            }
+        }
+
+        void report( size_t topK )
+        {
+            if ( !s_bEnabled ) return;
+
+            size_t top[ GROWTH_TOPK ];
+            size_t used = 0;
+            uint64_t reallocs = 0, copied = 0;
+
+            if ( topK > GROWTH_TOPK ) topK = GROWTH_TOPK;
+
+            pthread_mutex_lock( &s_mutexReport );
+
+            // the memcpy bandwidth first, the allocator calls break ties
+            for ( size_t id = 1; id <= STACK_DEPOT_CAPACITY; ++id ) {
+                const tagGrowthSite* pSite = &s_sites[ id - 1 ];
+                if ( 0 == pSite->reallocCount ) continue;
+
+                reallocs    += pSite->reallocCount;
+                copied      += pSite->copiedSize;
+
+                size_t pos = ( used < topK ) ? used++ : topK;
+                while ( pos > 0 ) {
+                    const tagGrowthSite* pPrev = &s_sites[ top[ pos - 1 ] - 1 ];
+                    if ( pPrev->copiedSize > pSite->copiedSize ||
+                         ( pPrev->copiedSize == pSite->copiedSize && pPrev->reallocCount >= pSite->reallocCount ) ) break;
+                    if ( pos < topK ) top[ pos ] = top[ pos - 1 ];
+                    --pos;
+                }
+                if ( pos < topK ) top[ pos ] = id;
+            }
+
+            fprintf( Config::output(), "realloc growth by bytes copied, reallocs: %lu, copied: %lu, top %ld\n", reallocs, copied, used );
+            for ( size_t i = 0; i < used; ++i ) showSite( i, top[i] );
+
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            for ( size_t i = 0; i < STACK_DEPOT_CAPACITY; ++i ) {
+                if ( 0 != s_sites[i].reallocCount || 0 != s_sites[i].chainCount ) memset( &s_sites[i], 0, sizeof( tagGrowthSite ) );
+            }
+        }
+    } // namespace Growth
+} // namespace MemoryTrace
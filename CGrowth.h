@@ -0,0 +1,54 @@
+#ifndef __CGROWTHH__
+#define __CGROWTHH__
+
+#include <stdint.h>
+#include "CMemoryManager.h"
+#include "CStackDepot.h"
+
+namespace MemoryTrace
+{
+    #define GROWTH_TOPK             16
+    namespace Growth
+    {
+        // new size over old size of one realloc
+        enum GrowthFactor
+        {
+            GF_SHRINK = 0,
+            GF_125,             // [ 1, 1.25 ]
+            GF_150,             // ( 1.25, 1.5 ]
+            GF_200,             // ( 1.5, 2 ]
+            GF_400,             // ( 2, 4 ]
+            GF_MORE,            // more than 4, or from 0
+            GF_COUNT,
+        };
+
+        // the reallocs made at one call site, and the chains that ended in a block of that site.
+        // a chain is a block and the blocks it was realloc'ed into, each knows how many reallocs led to it
+        struct tagGrowthSite
+        {
+            uint64_t        reallocCount;
+            uint64_t        copiedSize;         // bytes moved from the old block to the new one
+            uint64_t        inPlaceCount;       // the new size fit the old block, the allocator could have grown it
+            uint64_t        factors[ GF_COUNT ];
+
+            uint64_t        chainCount;         // chains freed
+            uint64_t        chainLength;        // reallocs of those chains
+            uint64_t        finalSize;          // sum of the sizes they were freed at
+            uint64_t        finalMax;
+        };
+
+        // growth=1, needs the stack id of traced modes
+        void                initialize();
+        bool                isEnabled();
+
+        // called by realloc between the copy and the free of the old block, the new one continues its chain
+        void                recordRealloc( MemoryManager::tagUnitNode* const pOld, MemoryManager::tagUnitNode* const pNew, size_t copied );
+        // a freed block that came from a realloc ends its chain
+        void                recordFree( const MemoryManager::tagUnitNode* const );
+        // sites by bytes copied, where reserving the final size up front saves the most
+        void                report( size_t topK = GROWTH_TOPK );
+        // the sites start empty in a forked child
+        void                forkChild();
+    }; // namespace Growth
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,262 @@
+#include <string.h>
+#include <cstdio>
+#include <pthread.h>
+#include "CHeavyHitter.h"
+#include "CThreadSlot.h"
+#include "CConfig.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace HeavyHitter
+    {
+        struct tagHitterSlot
+        {
+            ThreadSlot::tagSpinLock lock;
+            tagHitterSketch         byCount;
+            tagHitterSketch         byBytes;
+        };
+
+        static bool                 s_bEnabled = false;
+        static tagHitterSlot*       s_slots = NULL;     // metadata arena, only when enabled
+
+        static pthread_mutex_t      s_mutexReport = PTHREAD_MUTEX_INITIALIZER;
+        static tagHitterEntry       s_merged[ HEAVY_HITTER_CAPACITY * 2 ];
+
+        void initialize()
+        {
+            // needs the backtrace, only traced modes have one
+            if ( !Config::get()->bHeavyHitter || !Config::isTraced() ) return;
+
+            s_slots     = (tagHitterSlot*)Arena::allocate( MAX_THREAD_SLOT * sizeof( tagHitterSlot ) );
+            s_bEnabled  = NULL != s_slots;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        #define INDEX_MASK          ( ( 1UL << HEAVY_HITTER_INDEX_BITS ) - 1 )
+
+        static inline size_t bucketOf( size_t hash )
+        {
+            return ( hash * 0x9E3779B97F4A7C15ULL ) >> ( 64 - HEAVY_HITTER_INDEX_BITS );
+        }
+
+        // the bucket holding the hash, or the free one that ends its probe sequence
+        static size_t findBucket( const tagHitterSketch* const pSketch, size_t hash )
+        {
+            size_t bucket = bucketOf( hash );
+            while ( 0 != pSketch->index[ bucket ] && pSketch->entries[ pSketch->index[ bucket ] - 1 ].hash != hash )
+                bucket = ( bucket + 1 ) & INDEX_MASK;
+
+            return bucket;
+        }
+
+        // backward shift, the entries after it stay reachable without tombstones
+        static void unindex( tagHitterSketch* const pSketch, size_t bucket )
+        {
+            pSketch->index[ bucket ] = 0;
+
+            for ( size_t next = ( bucket + 1 ) & INDEX_MASK; 0 != pSketch->index[ next ]; next = ( next + 1 ) & INDEX_MASK ) {
+                size_t home = bucketOf( pSketch->entries[ pSketch->index[ next ] - 1 ].hash );
+                if ( ( ( next - home ) & INDEX_MASK ) < ( ( next - bucket ) & INDEX_MASK ) ) continue;
+
+                pSketch->index[ bucket ]    = pSketch->index[ next ];
+                pSketch->index[ next ]      = 0;
+                bucket = next;
+            }
+        }
+
+        static inline void place( tagHitterSketch* const pSketch, size_t pos, uint8_t entry )
+        {
+            pSketch->heap[ pos ]        = entry;
+            pSketch->position[ entry ]  = (uint8_t)pos;
+        }
+
+        static void siftUp( tagHitterSketch* const pSketch, size_t pos )
+        {
+            uint8_t entry = pSketch->heap[ pos ];
+            size_t weight = pSketch->entries[ entry ].weight;
+
+            while ( pos > 0 && pSketch->entries[ pSketch->heap[ ( pos - 1 ) / 2 ] ].weight > weight ) {
+                place( pSketch, pos, pSketch->heap[ ( pos - 1 ) / 2 ] );
+                pos = ( pos - 1 ) / 2;
+            }
+            place( pSketch, pos, entry );
+        }
+
+        static void siftDown( tagHitterSketch* const pSketch, size_t pos )
+        {
+            uint8_t entry = pSketch->heap[ pos ];
+            size_t weight = pSketch->entries[ entry ].weight;
+
+            for ( ;; ) {
+                size_t child = 2 * pos + 1;
+                if ( child >= pSketch->used ) break;
+                if ( child + 1 < pSketch->used && pSketch->entries[ pSketch->heap[ child + 1 ] ].weight < pSketch->entries[ pSketch->heap[ child ] ].weight ) ++child;
+                if ( pSketch->entries[ pSketch->heap[ child ] ].weight >= weight ) break;
+
+                place( pSketch, pos, pSketch->heap[ child ] );
+                pos = child;
+            }
+            place( pSketch, pos, entry );
+        }
+
+        static void update( tagHitterSketch* const pSketch, const MemoryManager::tagUnitNode* const pNode, size_t weight )
+        {
+            pSketch->total += weight;
+
+            size_t bucket = findBucket( pSketch, pNode->traceHash );
+            if ( 0 != pSketch->index[ bucket ] ) {
+                uint8_t entry = pSketch->index[ bucket ] - 1;
+                pSketch->entries[ entry ].weight += weight;
+                siftDown( pSketch, pSketch->position[ entry ] );
+                return;
+            }
+
+            // not monitored yet, take a free entry or evict the smallest one
+            uint8_t entry;
+            tagHitterEntry* pEntry;
+            if ( pSketch->used < HEAVY_HITTER_CAPACITY ) {
+                entry           = (uint8_t)pSketch->used++;
+                pEntry          = &pSketch->entries[ entry ];
+                pEntry->weight  = weight;
+                pEntry->error   = 0;
+                place( pSketch, entry, entry );
+                siftUp( pSketch, entry );
+            } else {
+                entry           = pSketch->heap[0];
+                pEntry          = &pSketch->entries[ entry ];
+                unindex( pSketch, findBucket( pSketch, pEntry->hash ) );
+                pEntry->error   = pEntry->weight;
+                pEntry->weight  = pEntry->weight + weight;
+                siftDown( pSketch, 0 );
+                bucket = findBucket( pSketch, pNode->traceHash );
+            }
+
+            pEntry->hash        = pNode->traceHash;
+            pEntry->traceSize   = pNode->traceSize;
+            memcpy( pEntry->backtrace, pNode->backtrace, sizeof( pEntry->backtrace ) );
+            pSketch->index[ bucket ] = entry + 1;
+        }
+
+        void record( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode ) return;
+
+            tagHitterSlot* pSlot = &s_slots[ ThreadSlot::current() ];
+
+            ThreadSlot::lock( &pSlot->lock );
+            update( &pSlot->byCount, pNode, 1 );
+            update( &pSlot->byBytes, pNode, pNode->size );
+            ThreadSlot::unlock( &pSlot->lock );
+        }
+
+        // insertion sort, qsort of glibc may call malloc for the temporary buffer
+        static void sortEntries( tagHitterEntry* const pEntries, size_t count )
+        {
+            for ( size_t i = 1; i < count; ++i ) {
+                tagHitterEntry entry = pEntries[i];
+                size_t j = i;
+                while ( j > 0 && pEntries[ j - 1 ].weight < entry.weight ) {
+                    pEntries[j] = pEntries[ j - 1 ];
+                    --j;
+                }
+                pEntries[j] = entry;
+            }
+        }
+
+        static size_t mergeSketch( size_t used, const tagHitterSketch* const pSketch )
+        {
+            for ( size_t i = 0; i < pSketch->used; ++i ) {
+                const tagHitterEntry* pEntry = &pSketch->entries[i];
+
+                size_t j = 0;
+                for ( ; j < used; ++j ) {
+                    if ( s_merged[j].hash == pEntry->hash ) break;
+                }
+
+                if ( j < used ) {
+                    s_merged[j].weight  += pEntry->weight;
+                    s_merged[j].error   += pEntry->error;
+                    continue;
+                }
+
+                if ( used == sizeof( s_merged ) / sizeof( s_merged[0] ) ) {
+                    sortEntries( s_merged, used );
+                    used = HEAVY_HITTER_CAPACITY;
+                }
+                s_merged[ used++ ] = *pEntry;
+            }
+
+            return used;
+        }
+
+        static void reportSketch( const char* const name, bool bySize, size_t topK )
+        {
+            size_t used     = 0;
+            size_t total    = 0;
+
+            for ( size_t i = 0; i < ThreadSlot::count(); ++i ) {
+                tagHitterSlot* pSlot = &s_slots[i];
+
+                ThreadSlot::lock( &pSlot->lock );
+                const tagHitterSketch* pSketch = bySize ? &pSlot->byBytes : &pSlot->byCount;
+                total   += pSketch->total;
+                used    = mergeSketch( used, pSketch );
+                ThreadSlot::unlock( &pSlot->lock );
+            }
+
+            sortEntries( s_merged, used );
+            if ( topK > used ) topK = used;
+
+            fprintf( Config::output(), "heavy hitters by %s, top %ld, total: %ld\n", name, topK, total );
+            for ( size_t i = 0; i < topK; ++i ) {
+                fprintf( Config::output(), "++++++++++++++ #%ld %s: %ld, error: %ld, hash: %016lx ++++++++++++++\n", \
+                                i, \
+                                name, \
+                                s_merged[i].weight, \
+                                s_merged[i].error, \
+                                s_merged[i].hash );
+                MemoryManager::showBacktrace( s_merged[i].backtrace, s_merged[i].traceSize );
+            }
+        }
+
+        void report( size_t topK )
+        {
+            if ( !s_bEnabled ) return;
+
+            pthread_mutex_lock( &s_mutexReport );
+            reportSketch( "count", false, topK );
+            reportSketch( "bytes", true, topK );
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+
+        void forkPrepare()
+        {
+            if ( NULL == s_slots ) return;
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::lock( &s_slots[i].lock );
+        }
+
+        void forkRelease()
+        {
+            if ( NULL == s_slots ) return;
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::unlock( &s_slots[i].lock );
+        }
+
+        void forkChild()
+        {
+            if ( NULL == s_slots ) return;
+            for ( size_t i = 0; i < ThreadSlot::count(); ++i ) {
+                s_slots[i].byCount.total    = 0;
+                s_slots[i].byCount.used     = 0;
+                s_slots[i].byBytes.total    = 0;
+                s_slots[i].byBytes.used     = 0;
+                memset( s_slots[i].byCount.index, 0, sizeof( s_slots[i].byCount.index ) );
+                memset( s_slots[i].byBytes.index, 0, sizeof( s_slots[i].byBytes.index ) );
+            }
+        }
+    } // namespace HeavyHitter
+} // namespace MemoryTrace
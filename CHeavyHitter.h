@@ -0,0 +1,49 @@
+#ifndef __CHEAVYHITTERH__
+#define __CHEAVYHITTERH__
+
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define HEAVY_HITTER_CAPACITY   64
+    #define HEAVY_HITTER_TOPK       16
+    #define HEAVY_HITTER_INDEX_BITS 7           // hash buckets, twice the entries
+    namespace HeavyHitter
+    {
+        // Space-Saving summary over backtrace hashes, weight is 1 for count and size for bytes
+        struct tagHitterEntry
+        {
+            size_t          hash;
+            size_t          weight;
+            size_t          error;
+
+            size_t          traceSize;
+            void*           backtrace[ BACKTRACE_DEPTH ];
+        };
+
+        // the entries are found by hash through index and evicted from the top of a min-heap on their weight
+        struct tagHitterSketch
+        {
+            size_t          total;
+            size_t          used;
+            tagHitterEntry  entries[ HEAVY_HITTER_CAPACITY ];
+
+            uint8_t         heap[ HEAVY_HITTER_CAPACITY ];      // entry indices, the smallest weight first
+            uint8_t         position[ HEAVY_HITTER_CAPACITY ];  // of each entry in the heap
+            uint8_t         index[ 1 << HEAVY_HITTER_INDEX_BITS ];  // open addressing, entry index + 1, 0 is free
+        };
+
+        void                initialize();
+        bool                isEnabled();
+
+        void                record( const MemoryManager::tagUnitNode* const );
+        void                report( size_t topK = HEAVY_HITTER_TOPK );
+
+        // slot locks held across fork()
+        void                forkPrepare();
+        void                forkRelease();
+        // the sketches start empty in a forked child
+        void                forkChild();
+    }; // namespace HeavyHitter
+}; // namespace MemoryTrace
+#endif
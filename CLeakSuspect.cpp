@@ -0,0 +1,152 @@
+#include <string.h>
+#include <cstdio>
+#include "CLeakSuspect.h"
+#include "CSymbolizer.h"
+#include "CConfig.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace LeakSuspect
+    {
+        static bool             s_bEnabled      = false;
+        static uint64_t         s_window        = 0;
+        static tagSiteWindow*   s_sites         = NULL;     // metadata arena, one per stack id
+
+        void initialize()
+        {
+            // needs the per site live bytes of the stack depot, only traced modes have them
+            if ( 0 == Config::get()->leakWindow || !Config::isTraced() ) return;
+
+            s_sites     = (tagSiteWindow*)Arena::allocate( STACK_DEPOT_CAPACITY * sizeof( tagSiteWindow ) );
+            s_window    = Config::get()->leakWindow * 1000000000ULL;
+            s_bEnabled  = NULL != s_sites;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        uint64_t window()
+        {
+            return s_window;
+        }
+
+        // frames as function@file:line joined by ';', the record has to stay on one line
+        static size_t describeStack( const StackDepot::tagStackEntry* const pStack, char* const buffer, size_t length )
+        {
+            size_t pos = 0;
+            size_t frame = MemoryManager::skipHookFrames( pStack->backtrace, pStack->traceSize );
+
+            for ( ; frame < pStack->traceSize && pos < length; ++frame ) {
+                void* pc = pStack->backtrace[ frame ];
+                const char* pSeparator = ( 0 == pos ) ? "" : ";";
+
+                if ( 0 == Config::get()->symbolizeThreads ) {
+                    pos += snprintf( buffer + pos, length - pos, "%s%p", pSeparator, pc );
+                    continue;
+                }
+
+                Symbolizer::tagSymbol fallback;
+                const Symbolizer::tagSymbol* pSymbol = Symbolizer::lookup( pc, &fallback );
+                if ( NULL != pSymbol->function && NULL != pSymbol->file ) {
+                    pos += snprintf( buffer + pos, length - pos, "%s%s@%s:%d", pSeparator, pSymbol->function, pSymbol->file, pSymbol->line );
+                } else if ( NULL != pSymbol->function ) {
+                    pos += snprintf( buffer + pos, length - pos, "%s%s", pSeparator, pSymbol->function );
+                } else if ( NULL != pSymbol->module ) {
+                    pos += snprintf( buffer + pos, length - pos, "%s%s+0x%lx", pSeparator, pSymbol->module, pSymbol->offset );
+                } else {
+                    pos += snprintf( buffer + pos, length - pos, "%s%p", pSeparator, pc );
+                }
+            }
+
+            return ( pos < length ) ? pos : length - 1;
+        }
+
+        static void emit( const StackDepot::tagStackEntry* const pStack, const tagSiteWindow* const pSite )
+        {
+            double seconds = s_window / 1e9;
+            char stack[ LEAK_SUSPECT_LINE ];
+            stack[0] = '\0';
+            describeStack( pStack, stack, sizeof( stack ) );
+
+            // keep a single fprintf, the line must not interleave with other output
+            fprintf( Config::output(), "leak-suspect: site=%016lx windows=%u window_s=%.0f live_bytes=%ld live_count=%ld growth_bytes=%ld growth_rate=%.0f alloc_rate=%.1f stack=%s\n", \
+                            pStack->hash, \
+                            pSite->streak, \
+                            seconds, \
+                            pSite->lastLive, \
+                            pStack->liveCount, \
+                            pSite->lastLive - pSite->streakBase, \
+                            ( pSite->lastLive - pSite->streakBase ) / ( pSite->streak * seconds ), \
+                            ( pSite->minAllocs + pSite->maxAllocs ) / ( 2 * seconds ), \
+                            stack );
+        }
+
+        void tick()
+        {
+            if ( !s_bEnabled ) return;
+
+            size_t windows = Config::get()->leakWindows;
+
+            for ( size_t id = 1; id <= STACK_DEPOT_CAPACITY; ++id ) {
+                const StackDepot::tagStackEntry* pStack = StackDepot::get( id );
+                if ( NULL == pStack ) continue;
+
+                tagSiteWindow* pSite = &s_sites[ id - 1 ];
+                int64_t  live       = pStack->liveSize;
+                uint64_t allocCount = pStack->allocCount;
+                uint64_t allocs     = allocCount - pSite->lastAllocCount;
+
+                pSite->lastAllocCount = allocCount;
+
+                // a site first seen in this window has no history yet
+                if ( !pSite->bSeen ) {
+                    pSite->bSeen        = true;
+                    pSite->lastLive     = live;
+                    pSite->streakBase   = live;
+                    continue;
+                }
+
+                if ( live <= pSite->lastLive || 0 == allocs ) {
+                    pSite->lastLive     = live;
+                    pSite->streakBase   = live;
+                    pSite->streak       = 0;
+                    continue;
+                }
+
+                if ( 0 == pSite->streak ) {
+                    pSite->minAllocs    = allocs;
+                    pSite->maxAllocs    = allocs;
+                } else {
+                    if ( allocs < pSite->minAllocs ) pSite->minAllocs = allocs;
+                    if ( allocs > pSite->maxAllocs ) pSite->maxAllocs = allocs;
+                }
+                pSite->lastLive = live;
+                pSite->streak++;
+
+                // a steady rate keeps within a factor of two, bursts and warm up are not leaks
+                bool bSteady = pSite->maxAllocs <= 2 * pSite->minAllocs;
+                if ( !bSteady ) {
+                    pSite->streakBase   = live;
+                    pSite->streak       = 0;
+                    continue;
+                }
+
+                // report when the streak reaches K windows and again every K windows it keeps growing
+                if ( 0 == pSite->streak % windows ) emit( pStack, pSite );
+            }
+        }
+
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            // a fork during tick() may leave a site with its allocation count taken but not yet seen
+            for ( size_t i = 0; i < STACK_DEPOT_CAPACITY; ++i ) {
+                if ( s_sites[i].bSeen || 0 != s_sites[i].lastAllocCount ) memset( &s_sites[i], 0, sizeof( tagSiteWindow ) );
+            }
+        }
+    } // namespace LeakSuspect
+} // namespace MemoryTrace
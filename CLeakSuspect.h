@@ -0,0 +1,35 @@
+#ifndef __CLEAKSUSPECTH__
+#define __CLEAKSUSPECTH__
+
+#include <stdint.h>
+#include "CStackDepot.h"
+
+namespace MemoryTrace
+{
+    #define LEAK_SUSPECT_WINDOWS    6
+    #define LEAK_SUSPECT_LINE       4096
+    namespace LeakSuspect
+    {
+        // state of one call site across the windows closed so far
+        struct tagSiteWindow
+        {
+            int64_t         lastLive;
+            int64_t         streakBase;         // live bytes when the current growth streak began
+            uint64_t        lastAllocCount;
+            uint64_t        minAllocs;          // allocations per window during the streak
+            uint64_t        maxAllocs;
+            uint32_t        streak;             // consecutive windows with growing live bytes
+            bool            bSeen;
+        };
+
+        void                initialize();
+        bool                isEnabled();
+
+        // closes a window, called by the reporter service thread every window
+        void                tick();
+        uint64_t            window();
+        // a forked child starts without history, the parent's sites are not its own
+        void                forkChild();
+    }; // namespace LeakSuspect
+}; // namespace MemoryTrace
+#endif
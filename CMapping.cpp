@@ -0,0 +1,617 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <cstdio>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "CMapping.h"
+#include "CStackDepot.h"
+#include "CSymbolizer.h"
+#include "CConfig.h"
+#include "CArena.h"
+
+extern "C" void* __sbrk( intptr_t increment );
+
+namespace MemoryTrace
+{
+    namespace Mapping
+    {
+        typedef void*           (*FUNC_MMAP)( void*, size_t, int, int, int, off_t );
+        typedef int             (*FUNC_MUNMAP)( void*, size_t );
+        typedef void*           (*FUNC_MREMAP)( void*, size_t, size_t, int, ... );
+        typedef void*           (*FUNC_SBRK)( intptr_t );
+
+        // AVL tree, the intervals do not overlap so ordered by begin they are ordered by end as well
+        struct tagMappingNode
+        {
+            tagMapping      mapping;
+            tagMappingNode* pLeft;          // next in the free list while unused
+            tagMappingNode* pRight;
+            int             height;
+        };
+
+        static bool                 s_bEnabled      = false;
+        static FUNC_MMAP            s_pRealMmap     = NULL;
+        static FUNC_MUNMAP          s_pRealMunmap   = NULL;
+        static FUNC_MREMAP          s_pRealMremap   = NULL;
+        static FUNC_SBRK            s_pRealSbrk     = NULL;
+        static uintptr_t            s_pageMask      = 4095;
+
+        static pthread_mutex_t      s_mutexMapping  = PTHREAD_MUTEX_INITIALIZER;
+        static tagMappingNode*      s_pRoot         = NULL;
+        static tagMappingNode*      s_pFreeNodes    = NULL;
+        static size_t               s_serial        = 0;
+        static tagMappingStatistics s_statistics;
+
+        static unsigned char        s_residency[ MAPPING_RESIDENT_CHUNK ];
+
+        // set while the hook itself works, the unwinder and the depot must not be tracked
+        static __thread bool t_bInside __attribute__ (( tls_model( "initial-exec" ) )) = false;
+
+        // called before initialize() resolved them, straight to the kernel
+        static void* realMmap( void* pAddr, size_t length, int prot, int flags, int fd, off_t offset )
+        {
+            if ( NULL != s_pRealMmap ) return s_pRealMmap( pAddr, length, prot, flags, fd, offset );
+            return (void*)syscall( SYS_mmap, pAddr, length, prot, flags, fd, offset );
+        }
+
+        static int realMunmap( void* pAddr, size_t length )
+        {
+            if ( NULL != s_pRealMunmap ) return s_pRealMunmap( pAddr, length );
+            return syscall( SYS_munmap, pAddr, length );
+        }
+
+        static void* realMremap( void* pOld, size_t oldLength, size_t newLength, int flags, void* pNew )
+        {
+            if ( NULL != s_pRealMremap ) return s_pRealMremap( pOld, oldLength, newLength, flags, pNew );
+            return (void*)syscall( SYS_mremap, pOld, oldLength, newLength, flags, pNew );
+        }
+
+        static bool isTracked( const void* pCaller )
+        {
+            return s_bEnabled && !t_bInside && !MemoryManager::isHookAddress( pCaller );
+        }
+
+        static uintptr_t pageEnd( uintptr_t begin, size_t length )
+        {
+            return ( begin + length + s_pageMask ) & ~s_pageMask;
+        }
+
+        static inline int heightOf( const tagMappingNode* const pNode )
+        {
+            return ( NULL == pNode ) ? 0 : pNode->height;
+        }
+
+        static inline void updateHeight( tagMappingNode* const pNode )
+        {
+            int left = heightOf( pNode->pLeft ), right = heightOf( pNode->pRight );
+            pNode->height = 1 + ( ( left > right ) ? left : right );
+        }
+
+        static tagMappingNode* rotateRight( tagMappingNode* const pNode )
+        {
+            tagMappingNode* pTop = pNode->pLeft;
+            pNode->pLeft    = pTop->pRight;
+            pTop->pRight    = pNode;
+            updateHeight( pNode );
+            updateHeight( pTop );
+            return pTop;
+        }
+
+        static tagMappingNode* rotateLeft( tagMappingNode* const pNode )
+        {
+            tagMappingNode* pTop = pNode->pRight;
+            pNode->pRight   = pTop->pLeft;
+            pTop->pLeft     = pNode;
+            updateHeight( pNode );
+            updateHeight( pTop );
+            return pTop;
+        }
+
+        static tagMappingNode* balance( tagMappingNode* const pNode )
+        {
+            updateHeight( pNode );
+            int factor = heightOf( pNode->pLeft ) - heightOf( pNode->pRight );
+
+            if ( factor > 1 ) {
+                if ( heightOf( pNode->pLeft->pLeft ) < heightOf( pNode->pLeft->pRight ) ) pNode->pLeft = rotateLeft( pNode->pLeft );
+                return rotateRight( pNode );
+            }
+            if ( factor < -1 ) {
+                if ( heightOf( pNode->pRight->pRight ) < heightOf( pNode->pRight->pLeft ) ) pNode->pRight = rotateRight( pNode->pRight );
+                return rotateLeft( pNode );
+            }
+            return pNode;
+        }
+
+        // s_mutexMapping must be held, NULL once the arena is exhausted
+        static tagMappingNode* acquireNode()
+        {
+            if ( NULL == s_pFreeNodes ) {
+                tagMappingNode* pChunk = (tagMappingNode*)Arena::allocate( MAPPING_CHUNK * sizeof( tagMappingNode ) );
+                if ( NULL == pChunk ) return NULL;
+
+                for ( size_t i = 0; i < MAPPING_CHUNK; ++i ) {
+                    pChunk[i].pLeft = s_pFreeNodes;
+                    s_pFreeNodes    = &pChunk[i];
+                }
+            }
+
+            tagMappingNode* pNode = s_pFreeNodes;
+            s_pFreeNodes    = pNode->pLeft;
+            pNode->pLeft    = NULL;
+            pNode->pRight   = NULL;
+            pNode->height   = 1;
+            return pNode;
+        }
+
+        static void releaseNode( tagMappingNode* const pNode )
+        {
+            pNode->pLeft    = s_pFreeNodes;
+            s_pFreeNodes    = pNode;
+        }
+
+        static tagMappingNode* insertNode( tagMappingNode* const pTree, tagMappingNode* const pNode )
+        {
+            if ( NULL == pTree ) return pNode;
+
+            if ( pNode->mapping.begin < pTree->mapping.begin ) pTree->pLeft = insertNode( pTree->pLeft, pNode );
+            else pTree->pRight = insertNode( pTree->pRight, pNode );
+            return balance( pTree );
+        }
+
+        static tagMappingNode* removeFirst( tagMappingNode* const pTree, tagMappingNode** const ppFirst )
+        {
+            if ( NULL == pTree->pLeft ) { *ppFirst = pTree; return pTree->pRight; }
+
+            pTree->pLeft = removeFirst( pTree->pLeft, ppFirst );
+            return balance( pTree );
+        }
+
+        // unlinks and releases the node of the interval starting at begin
+        static tagMappingNode* removeNode( tagMappingNode* const pTree, uintptr_t begin )
+        {
+            if ( NULL == pTree ) return NULL;
+
+            if ( begin < pTree->mapping.begin ) {
+                pTree->pLeft = removeNode( pTree->pLeft, begin );
+            } else if ( begin > pTree->mapping.begin ) {
+                pTree->pRight = removeNode( pTree->pRight, begin );
+            } else {
+                tagMappingNode* pLeft = pTree->pLeft, *pRight = pTree->pRight;
+                releaseNode( pTree );
+                if ( NULL == pRight ) return pLeft;
+
+                tagMappingNode* pFirst = NULL;
+                pRight          = removeFirst( pRight, &pFirst );
+                pFirst->pLeft   = pLeft;
+                pFirst->pRight  = pRight;
+                return balance( pFirst );
+            }
+            return balance( pTree );
+        }
+
+        static void releaseTree( tagMappingNode* const pTree )
+        {
+            if ( NULL == pTree ) return;
+
+            releaseTree( pTree->pLeft );
+            releaseTree( pTree->pRight );
+            releaseNode( pTree );
+        }
+
+        // in address order, returns the index past the last interval copied
+        static size_t copyTree( const tagMappingNode* const pTree, tagMapping* const pCopy, size_t index )
+        {
+            if ( NULL == pTree ) return index;
+
+            index = copyTree( pTree->pLeft, pCopy, index );
+            memcpy( &pCopy[ index++ ], &pTree->mapping, sizeof( tagMapping ) );
+            return copyTree( pTree->pRight, pCopy, index );
+        }
+
+        // first interval that ends after addr, NULL when there is none
+        static tagMappingNode* findEnd( uintptr_t addr )
+        {
+            tagMappingNode* pFound = NULL;
+
+            for ( tagMappingNode* pNode = s_pRoot; NULL != pNode; ) {
+                if ( pNode->mapping.end > addr ) { pFound = pNode; pNode = pNode->pLeft; }
+                else pNode = pNode->pRight;
+            }
+            return pFound;
+        }
+
+        // s_mutexMapping must be held, returns the bytes that were tracked in [begin, end)
+        static size_t removeRange( uintptr_t begin, uintptr_t end )
+        {
+            size_t removed = 0;
+
+            for ( tagMappingNode* pNode = findEnd( begin ); NULL != pNode && pNode->mapping.begin < end; pNode = findEnd( begin ) ) {
+                tagMapping* pMapping = &pNode->mapping;
+                uintptr_t cutBegin  = ( pMapping->begin > begin ) ? pMapping->begin : begin;
+                uintptr_t cutEnd    = ( pMapping->end < end ) ? pMapping->end : end;
+                size_t cut          = cutEnd - cutBegin;
+
+                removed                 += cut;
+                s_statistics.liveSize   -= cut;
+
+                if ( pMapping->begin >= begin && pMapping->end <= end ) {
+                    StackDepot::removeLive( pMapping->stackId, cut );
+                    s_statistics.liveCount--;
+                    s_pRoot = removeNode( s_pRoot, pMapping->begin );
+                    continue;
+                }
+
+                if ( pMapping->begin < begin && pMapping->end > end ) {
+                    // a hole in the middle, the right part becomes an interval of its own
+                    tagMappingNode* pRight = acquireNode();
+                    if ( NULL != pRight ) {
+                        memcpy( &pRight->mapping, pMapping, sizeof( tagMapping ) );
+                        pRight->mapping.begin = end;
+                        s_pRoot = insertNode( s_pRoot, pRight );
+                        s_statistics.liveCount++;
+                        StackDepot::adjustLive( pMapping->stackId, 1, -(int64_t)cut );
+                    } else {
+                        size_t right = pMapping->end - end;
+                        s_statistics.liveSize -= right;
+                        s_statistics.dropped++;
+                        StackDepot::adjustLive( pMapping->stackId, 0, -(int64_t)( cut + right ) );
+                    }
+                    pMapping->end = begin;
+                    break;
+                }
+
+                // trimmed, the order stays as it is
+                StackDepot::adjustLive( pMapping->stackId, 0, -(int64_t)cut );
+                if ( pMapping->begin < begin ) pMapping->end = begin;
+                else { pMapping->begin = end; break; }
+            }
+
+            return removed;
+        }
+
+        // s_mutexMapping must be held and [begin, end) free of other intervals
+        static bool insertMapping( const tagMapping* const pMapping, bool bNew )
+        {
+            tagMappingNode* pNode = acquireNode();
+            if ( NULL == pNode ) { s_statistics.dropped++; return false; }
+
+            memcpy( &pNode->mapping, pMapping, sizeof( tagMapping ) );
+            s_pRoot = insertNode( s_pRoot, pNode );
+
+            size_t size = pMapping->end - pMapping->begin;
+            s_statistics.liveCount++;
+            s_statistics.liveSize += size;
+            if ( s_statistics.liveSize > s_statistics.peakSize ) s_statistics.peakSize = s_statistics.liveSize;
+
+            if ( bNew ) StackDepot::addLive( pMapping->stackId, size );
+            else StackDepot::adjustLive( pMapping->stackId, 1, size );
+            return true;
+        }
+
+        static void describe( tagMapping* const pMapping, uintptr_t begin, uintptr_t end, int prot, int flags, MappingKind kind )
+        {
+            pMapping->begin     = begin;
+            pMapping->end       = end;
+            pMapping->prot      = prot;
+            pMapping->flags     = flags;
+            pMapping->kind      = kind;
+            pMapping->timestamp = MemoryManager::timestamp();
+            pMapping->stackId   = 0;
+            pMapping->traceSize = 0;
+
+            if ( Config::isTraced() ) {
+                size_t hash = 0;
+                pMapping->traceSize = MemoryManager::captureBacktrace( pMapping->backtrace, &hash );
+                pMapping->stackId   = StackDepot::intern( hash, pMapping->backtrace, pMapping->traceSize );
+            }
+        }
+
+        void initialize()
+        {
+            s_pRealMmap     = (FUNC_MMAP)dlsym( RTLD_NEXT, "mmap" );
+            s_pRealMunmap   = (FUNC_MUNMAP)dlsym( RTLD_NEXT, "munmap" );
+            s_pRealMremap   = (FUNC_MREMAP)dlsym( RTLD_NEXT, "mremap" );
+            s_pRealSbrk     = (FUNC_SBRK)dlsym( RTLD_NEXT, "sbrk" );
+            s_pageMask      = sysconf( _SC_PAGESIZE ) - 1;
+
+            s_bEnabled = Config::get()->bMapping && Config::TM_OFF != Config::get()->mode;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void forkPrepare()
+        {
+            pthread_mutex_lock( &s_mutexMapping );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexMapping );
+        }
+
+        void forkChild()
+        {
+            releaseTree( s_pRoot );
+            s_pRoot = NULL;
+            memset( &s_statistics, 0, sizeof( s_statistics ) );
+        }
+
+        void* mmap( void* pAddr, size_t length, int prot, int flags, int fd, off_t offset, const void* pCaller )
+        {
+            void* pResult = realMmap( pAddr, length, prot, flags, fd, offset );
+            // new mappings follow the runtime switch, the tracked ones are still unmapped and moved
+            if ( MAP_FAILED == pResult || 0 == length || !isTracked( pCaller ) || !TraceIsOn() ) return pResult;
+
+            int error = errno;
+            t_bInside = true;
+
+            tagMapping mapping;
+            uintptr_t begin = (uintptr_t)pResult;
+            describe( &mapping, begin, pageEnd( begin, length ), prot, flags, ( flags & MAP_ANONYMOUS ) ? MK_ANONYMOUS : MK_FILE );
+
+            // MAP_FIXED replaces whatever was mapped there
+            pthread_mutex_lock( &s_mutexMapping );
+            removeRange( mapping.begin, mapping.end );
+            mapping.serial = s_serial++;
+            if ( insertMapping( &mapping, true ) ) {
+                s_statistics.mapCount++;
+                s_statistics.mapSize += mapping.end - mapping.begin;
+            }
+            pthread_mutex_unlock( &s_mutexMapping );
+
+            t_bInside = false;
+            errno = error;
+            return pResult;
+        }
+
+        // the lock is held across the calls that give address space back, otherwise an mmap in another thread
+        // could get the same range and be registered before the old interval is removed
+        int munmap( void* pAddr, size_t length, const void* pCaller )
+        {
+            if ( !isTracked( pCaller ) ) return realMunmap( pAddr, length );
+
+            uintptr_t begin = (uintptr_t)pAddr;
+
+            pthread_mutex_lock( &s_mutexMapping );
+            int result = realMunmap( pAddr, length );
+            if ( 0 == result ) {
+                size_t removed = removeRange( begin, pageEnd( begin, length ) );
+                if ( removed > 0 ) {
+                    s_statistics.unmapCount++;
+                    s_statistics.unmapSize += removed;
+                }
+            }
+            pthread_mutex_unlock( &s_mutexMapping );
+
+            return result;
+        }
+
+        void* mremap( void* pOld, size_t oldLength, size_t newLength, int flags, void* pNew, const void* pCaller )
+        {
+            if ( !isTracked( pCaller ) ) return realMremap( pOld, oldLength, newLength, flags, pNew );
+
+            uintptr_t oldBegin = (uintptr_t)pOld;
+
+            pthread_mutex_lock( &s_mutexMapping );
+            void* pResult = realMremap( pOld, oldLength, newLength, flags, pNew );
+
+            // the interval keeps the call stack of the mmap that created it
+            tagMappingNode* pNode = findEnd( oldBegin );
+            if ( MAP_FAILED != pResult && NULL != pNode && pNode->mapping.begin <= oldBegin ) {
+                tagMapping mapping;
+                memcpy( &mapping, &pNode->mapping, sizeof( tagMapping ) );
+
+                // an old length of 0 duplicates a shared mapping and leaves the old one alone
+                size_t removed  = ( 0 == oldLength ) ? 0 : removeRange( oldBegin, pageEnd( oldBegin, oldLength ) );
+                mapping.begin   = (uintptr_t)pResult;
+                mapping.end     = pageEnd( mapping.begin, newLength );
+                removeRange( mapping.begin, mapping.end );
+
+                if ( insertMapping( &mapping, 0 == oldLength ) ) {
+                    size_t size = mapping.end - mapping.begin;
+                    if ( size > removed ) s_statistics.mapSize += size - removed;
+                    else s_statistics.unmapSize += removed - size;
+                    s_statistics.remapCount++;
+                }
+            }
+            pthread_mutex_unlock( &s_mutexMapping );
+
+            return pResult;
+        }
+
+        void* sbrk( intptr_t increment, const void* pCaller )
+        {
+            if ( 0 == increment || !isTracked( pCaller ) ) return ( NULL != s_pRealSbrk ) ? s_pRealSbrk( increment ) : __sbrk( increment );
+
+            if ( increment < 0 ) {
+                pthread_mutex_lock( &s_mutexMapping );
+                void* pResult = ( NULL != s_pRealSbrk ) ? s_pRealSbrk( increment ) : __sbrk( increment );
+                if ( (void*)-1 != pResult ) {
+                    size_t removed = removeRange( (uintptr_t)pResult + increment, (uintptr_t)pResult );
+                    if ( removed > 0 ) {
+                        s_statistics.unmapCount++;
+                        s_statistics.unmapSize += removed;
+                    }
+                }
+                pthread_mutex_unlock( &s_mutexMapping );
+                return pResult;
+            }
+
+            void* pResult = ( NULL != s_pRealSbrk ) ? s_pRealSbrk( increment ) : __sbrk( increment );
+            if ( (void*)-1 == pResult ) return pResult;
+
+            int error = errno;
+            t_bInside = true;
+
+            tagMapping mapping;
+            describe( &mapping, (uintptr_t)pResult, (uintptr_t)pResult + increment, PROT_READ | PROT_WRITE, MAP_PRIVATE, MK_BRK );
+
+            pthread_mutex_lock( &s_mutexMapping );
+            mapping.serial = s_serial++;
+            if ( insertMapping( &mapping, true ) ) {
+                s_statistics.mapCount++;
+                s_statistics.mapSize += increment;
+            }
+            pthread_mutex_unlock( &s_mutexMapping );
+
+            t_bInside = false;
+            errno = error;
+            return pResult;
+        }
+
+        void getStatistics( tagMappingStatistics* const pStat )
+        {
+            if ( NULL == pStat ) return;
+
+            pthread_mutex_lock( &s_mutexMapping );
+            *pStat = s_statistics;
+            pthread_mutex_unlock( &s_mutexMapping );
+        }
+
+        tagMapping* copyMappings( size_t* const pCount, size_t* const pMapSize )
+        {
+            *pCount = 0;
+            if ( !s_bEnabled ) return NULL;
+
+            pthread_mutex_lock( &s_mutexMapping );
+            size_t count    = s_statistics.liveCount;
+            *pMapSize       = ( count + 1 ) * sizeof( tagMapping );
+            tagMapping* pCopy = (tagMapping*)realMmap( NULL, *pMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( MAP_FAILED != pCopy ) count = copyTree( s_pRoot, pCopy, 0 );
+            pthread_mutex_unlock( &s_mutexMapping );
+            if ( MAP_FAILED == pCopy ) return NULL;
+
+            *pCount = count;
+            return pCopy;
+        }
+
+        void releaseCopy( tagMapping* const pCopy, size_t mapSize )
+        {
+            if ( NULL != pCopy ) realMunmap( pCopy, mapSize );
+        }
+
+        // pages of the interval in memory, 0 once it is gone
+        static size_t residentSize( const tagMapping* const pMapping )
+        {
+            uintptr_t begin = pMapping->begin & ~s_pageMask, end = pageEnd( pMapping->end, 0 );
+            size_t resident = 0;
+
+            while ( begin < end ) {
+                size_t pages = ( end - begin ) / ( s_pageMask + 1 );
+                if ( pages > MAPPING_RESIDENT_CHUNK ) pages = MAPPING_RESIDENT_CHUNK;
+
+                if ( 0 != mincore( (void*)begin, pages * ( s_pageMask + 1 ), s_residency ) ) break;
+                for ( size_t i = 0; i < pages; ++i ) resident += s_residency[i] & 1;
+
+                begin += pages * ( s_pageMask + 1 );
+            }
+
+            return resident * ( s_pageMask + 1 );
+        }
+
+        static const char* describeKind( const tagMapping* const pMapping )
+        {
+            switch ( pMapping->kind ) {
+            case MK_ANONYMOUS:  return ( pMapping->flags & MAP_SHARED ) ? "anonymous shared" : "anonymous private";
+            case MK_FILE:       return ( pMapping->flags & MAP_SHARED ) ? "file shared" : "file private";
+            default:            return "brk";
+            }
+        }
+
+        static size_t processResident()
+        {
+            char buffer[ 64 ];
+            int fd = open( "/proc/self/statm", O_RDONLY | O_CLOEXEC );
+            if ( -1 == fd ) return 0;
+
+            ssize_t length = read( fd, buffer, sizeof( buffer ) - 1 );
+            close( fd );
+            if ( length <= 0 ) return 0;
+            buffer[ length ] = '\0';
+
+            // size resident shared text lib data dt, in pages
+            const char* pResident = strchr( buffer, ' ' );
+            return ( NULL == pResident ) ? 0 : strtoul( pResident + 1, NULL, 10 ) * ( s_pageMask + 1 );
+        }
+
+        void report()
+        {
+            if ( !s_bEnabled ) return;
+
+            // mincore and symbolizing take long, work on a copy like the heap report does
+            tagMappingStatistics stat;
+            getStatistics( &stat );
+            size_t count = 0, mapSize = 0;
+            tagMapping* pCopy = copyMappings( &count, &mapSize );
+            if ( NULL == pCopy ) return;
+
+            if ( Config::get()->symbolizeThreads > 0 ) {
+                for ( size_t i = 0; i < count; ++i ) Symbolizer::prefetch( pCopy[i].backtrace, pCopy[i].traceSize );
+                Symbolizer::resolvePending();
+            }
+
+            size_t resident = 0, anonymousSize = 0, anonymousResident = 0, fileSize = 0, fileResident = 0, brkSize = 0;
+            for ( size_t i = 0; i < count; ++i ) {
+                size_t size = pCopy[i].end - pCopy[i].begin, pages = residentSize( &pCopy[i] );
+                resident += pages;
+
+                if ( MK_ANONYMOUS == pCopy[i].kind )    { anonymousSize += size; anonymousResident += pages; }
+                else if ( MK_FILE == pCopy[i].kind )    { fileSize += size; fileResident += pages; }
+                else                                    brkSize += size;
+            }
+
+            FILE* pOutput = Config::output();
+            fprintf( pOutput, "mapped \n \tcount: %ld\n\tsize: %ld\n\tresident: %ld\n", stat.liveCount, stat.liveSize, resident );
+            fprintf( pOutput, "\tanonymous size: %ld, resident: %ld\n\tfile size: %ld, resident: %ld\n\tbrk size: %ld\n", \
+                            anonymousSize, \
+                            anonymousResident, \
+                            fileSize, \
+                            fileResident, \
+                            brkSize );
+            fprintf( pOutput, "\tmapped count: %ld, size: %ld, unmapped count: %ld, size: %ld, remapped: %ld, peak: %ld, untracked: %ld\n", \
+                            stat.mapCount, \
+                            stat.mapSize, \
+                            stat.unmapCount, \
+                            stat.unmapSize, \
+                            stat.remapCount, \
+                            stat.peakSize, \
+                            stat.dropped );
+
+            for ( size_t i = 0; i < count; ++i ) {
+                const tagMapping* pMapping = &pCopy[i];
+
+                fprintf( pOutput, "++++++++++++++ mapped addr: %p, size: %ld, resident: %ld, %s %c%c%c, serial: %ld ++++++++++++++\n", \
+                             (void*)pMapping->begin, \
+                             pMapping->end - pMapping->begin, \
+                             residentSize( pMapping ), \
+                             describeKind( pMapping ), \
+                             ( pMapping->prot & PROT_READ ) ? 'r' : '-', \
+                             ( pMapping->prot & PROT_WRITE ) ? 'w' : '-', \
+                             ( pMapping->prot & PROT_EXEC ) ? 'x' : '-', \
+                             pMapping->serial );
+                fprintf( pOutput, "backtrace:\n" );
+                MemoryManager::showBacktrace( pMapping->backtrace, pMapping->traceSize );
+                fprintf( pOutput, "++++++++++++++ end ++++++++++++++\n" );
+            }
+
+            // what the hook sees next to what the kernel counts, the rest is code, stacks and the allocator's own mappings
+            MemoryManager::tagUnitManager heap;
+            MemoryManager::getStatistics( &heap );
+            fprintf( pOutput, "rss \n \tprocess: %ld\n\theap unfreed: %ld\n\tmapped resident: %ld\n", \
+                            processResident(), \
+                            heap.allocSize - heap.freeSize, \
+                            resident );
+
+            realMunmap( pCopy, mapSize );
+        }
+    } // namespace Mapping
+} // namespace MemoryTrace
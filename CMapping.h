@@ -0,0 +1,74 @@
+#ifndef __CMAPPINGH__
+#define __CMAPPINGH__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define MAPPING_CHUNK           64          // tree nodes taken from the arena at a time
+    #define MAPPING_RESIDENT_CHUNK  4096        // pages per mincore() call
+    namespace Mapping
+    {
+        enum MappingKind
+        {
+            MK_ANONYMOUS = 0,
+            MK_FILE,
+            MK_BRK,             // grown by sbrk()
+        };
+
+        // one live interval [begin, end), page aligned, kept in a tree ordered by begin
+        struct tagMapping
+        {
+            uintptr_t       begin;
+            uintptr_t       end;
+            int             prot;
+            int             flags;
+            MappingKind     kind;
+
+            size_t          serial;
+            uint64_t        timestamp;
+            size_t          stackId;
+            size_t          traceSize;
+            void*           backtrace[ BACKTRACE_DEPTH ];
+        };
+
+        struct tagMappingStatistics
+        {
+            size_t          mapCount;
+            size_t          mapSize;
+            size_t          unmapCount;         // unmaps that hit a tracked interval, partial ones included
+            size_t          unmapSize;
+            size_t          remapCount;
+            size_t          peakSize;
+
+            size_t          liveCount;
+            size_t          liveSize;
+            size_t          dropped;            // mappings not tracked because the arena was exhausted
+        };
+
+        // resolves the next mmap, munmap, mremap and sbrk, tracking starts with mmap=1
+        void                initialize();
+        bool                isEnabled();
+        void                forkPrepare();
+        void                forkRelease();
+        // the child tracks the mappings it makes itself, the inherited ones are the parent's
+        void                forkChild();
+
+        // pCaller is the return address of the interposed call, the hook's own mappings are not tracked
+        void*               mmap( void* pAddr, size_t length, int prot, int flags, int fd, off_t offset, const void* pCaller );
+        int                 munmap( void* pAddr, size_t length, const void* pCaller );
+        void*               mremap( void* pOld, size_t oldLength, size_t newLength, int flags, void* pNew, const void* pCaller );
+        void*               sbrk( intptr_t increment, const void* pCaller );
+
+        void                getStatistics( tagMappingStatistics* const );
+        // the live intervals in address order, in a mapping of their own so the caller may take its time.
+        // NULL when there are none or no memory, releaseCopy() hands it back
+        tagMapping*         copyMappings( size_t* const pCount, size_t* const pMapSize );
+        void                releaseCopy( tagMapping* const, size_t mapSize );
+        // live mappings with their resident bytes, next to the unfreed heap blocks
+        void                report();
+    }; // namespace Mapping
+}; // namespace MemoryTrace
+#endif
@@ -9,7 +9,40 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <link.h>
+#include <sys/mman.h>
+#include <malloc.h>
+#include <algorithm>
 #include "CMemoryManager.h"
+#include "CConfig.h"
+#include "CReporter.h"
+#include "CSymbolizer.h"
+#include "CHeavyHitter.h"
+#include "CStackDepot.h"
+#include "CChurn.h"
+#include "CSizeClass.h"
+#include "CStatPage.h"
+#include "CRecorder.h"
+#include "CLeakSuspect.h"
+#include "CPersist.h"
+#include "CThreadSlot.h"
+#include "CTag.h"
+#include "CExec.h"
+#include "CCollector.h"
+#include "CMapping.h"
+#include "CArena.h"
+#include "CCpuSlot.h"
+#include "CBlockSet.h"
+#include "CSlab.h"
+#include "CProfile.h"
+#include "CFault.h"
+#include "CSnapshot.h"
+#include "CWriter.h"
+#include "CBudget.h"
+#include "CPlugin.h"
+#include "CGrowth.h"
 
 //#include <assert.h>
 #define assert(X) do { if ( !(X) ) { abort(); } } while(0)
@@ -18,17 +51,25 @@
 extern "C"
 {
 #endif
-    void signalHandle( int signal )
+    void signalHandle( int signal, siginfo_t* pInfo, void* )
     {
         int     size;
         void*   buffer[ BACKTRACE_DEPTH ];
 
-        fprintf( stderr, "signal: %d\n", signal );
+        MemoryTrace::Fault::announce( signal );
         switch ( signal ) {
         case SIGABRT:  
         case SIGSEGV:
+        case SIGBUS:
+            MemoryTrace::Persist::markCrashed( signal );
             size = backtrace( buffer, BACKTRACE_DEPTH );
-            backtrace_symbols_fd( buffer, size, STDERR_FILENO );
+            backtrace_symbols_fd( buffer, size, MemoryTrace::Config::signalFd() );
+            if ( SIGABRT != signal ) MemoryTrace::Fault::report( signal, pInfo->si_addr );
+
+            // the default action on the way out, a faulting instruction runs again and now dumps core,
+            // a signal that was sent is sent once more
+            ::signal( signal, SIG_DFL );
+            if ( pInfo->si_code <= 0 ) raise( signal );
             return;
         default:
         break;
@@ -39,9 +80,15 @@ extern "C"
     static void registerSignal()
     {
         fprintf( stderr, "registerSignal\n" );
-        signal( SIGABRT, signalHandle ); 
-        signal( SIGINT, signalHandle ); 
-        signal( SIGSEGV, signalHandle ); 
+
+        struct sigaction action;
+        sigemptyset( &action.sa_mask );
+        action.sa_sigaction = signalHandle;
+        action.sa_flags     = SA_SIGINFO;
+        sigaction( SIGABRT, &action, NULL ); 
+        sigaction( SIGINT, &action, NULL ); 
+        sigaction( SIGSEGV, &action, NULL ); 
+        sigaction( SIGBUS, &action, NULL ); 
     }
 
 #ifdef __cplusplus
@@ -59,24 +106,111 @@ namespace MemoryTrace
     #define UNIT_NODE_MAGIC								        0xFEEF9FF9CDDC9889
     #define MAKE_UNIT_NODE_MAGIC(ptr_unit_hdr)			        ( UNIT_NODE_MAGIC ^ (size_t)ptr_unit_hdr )
 
+    // frames of the hook itself on top of every captured backtrace
+    #define HOOK_FRAME_MAX                                      8
+
+    // set once profiling is initialized, until then and while it is off a hook pays a load and a branch
+    // instead of calls into the profiler
+    static bool s_bProfiled = false;
+
+    static inline uint64_t profileBegin( Profile::Operation op )
+    {
+        return s_bProfiled ? Profile::begin( op ) : 0;
+    }
+
+    static inline void profileEnd( Profile::Operation op, uint64_t start )
+    {
+        if ( 0 != start ) Profile::end( op, start );
+    }
+
+    static inline uint64_t profileStart()
+    {
+        return s_bProfiled ? Profile::start() : 0;
+    }
+
+    static inline void profileRecord( Profile::Phase phase, uint64_t start )
+    {
+        if ( 0 != start ) Profile::record( phase, start );
+    }
+
     namespace MemoryManager
     {
-        static tagUnitManager s_unitManager;
+        static tagUnitManager  s_defaultManager;
+        static tagUnitManager* s_pUnitManager = &s_defaultManager;
 
         static pthread_mutex_t s_mutexMemory = PTHREAD_MUTEX_INITIALIZER;
 
+        static uintptr_t s_selfBegin = 0;
+        static uintptr_t s_selfEnd = 0;
+
+        // frees waiting for their unlink, one batch per thread slot
+        struct __attribute__ (( aligned( 64 ) )) tagFreeBatch
+        {
+            ThreadSlot::tagSpinLock lock;
+            size_t          count;
+            tagUnitNode*    nodes[ FREE_BATCH_MAX ];
+        };
+
+        static tagFreeBatch s_batches[ MAX_THREAD_SLOT ];
+        static void         (*s_pRelease)( void* ) = NULL;
+
+        static uint32_t     s_generation = 0;
+
+        // live nodes in arena chunks, slots past the high water mark were never handed out in this generation
+        static tagUnitSlot* s_slotChunks[ REGISTRY_CHUNKS ];
+        static size_t       s_slotHigh  = 0;
+        static size_t       s_slotLive  = 0;
+        static size_t       s_freeSlot  = 0;      // index + 1, 0 when the free list is empty
+
+        // live slots listed by the region their block starts in, so a crash looks at the few regions around
+        // the address instead of every slot. the root and the leaves come from the arena on first use and are
+        // never freed, a reader without the lock follows them safely. blocks larger than a region and those
+        // outside the indexed 48 bits are on a list of their own
+        static uint32_t**   s_pRegions  = NULL;
+        static uint32_t     s_largeHead = 0;      // index + 1
+
+        static __thread size_t t_sampleCountdown __attribute__ (( tls_model( "initial-exec" ) )) = 0;
+
+        // the peak is kept on the allocation path from a shared live size that every thread folds its
+        // changes into once they reach PEAK_BATCH bytes, so it is short by at most that much per thread
+        static volatile int64_t s_liveSize = 0;
+        static __thread int64_t t_liveDelta __attribute__ (( tls_model( "initial-exec" ) )) = 0;
+        // bytes through the per-CPU counters since the thread last charged the persist threshold
+        static __thread int64_t t_traffic __attribute__ (( tls_model( "initial-exec" ) )) = 0;
+
+        static int findSelf( struct dl_phdr_info* pInfo, size_t, void* pBase )
+        {
+            if ( (void*)pInfo->dlpi_addr != pBase ) return 0;
+
+            for ( int i = 0; i < pInfo->dlpi_phnum; ++i ) {
+                const ElfW(Phdr)* pHeader = &pInfo->dlpi_phdr[i];
+                if ( PT_LOAD != pHeader->p_type || !( pHeader->p_flags & PF_X ) ) continue;
+
+                s_selfBegin = pInfo->dlpi_addr + pHeader->p_vaddr;
+                s_selfEnd   = s_selfBegin + pHeader->p_memsz;
+            }
+            return 1;
+        }
+
         void initialize()
         {
-            s_unitManager.allocCount       = 0;
-            s_unitManager.allocSize        = 0;
-            s_unitManager.freeCount        = 0;
-            s_unitManager.freeSize         = 0;
-            s_unitManager.pRoot            = NULL;
-            s_unitManager.pCurrent         = NULL; 
+            s_pUnitManager->allocCount       = 0;
+            s_pUnitManager->allocSize        = 0;
+            s_pUnitManager->freeCount        = 0;
+            s_pUnitManager->freeSize         = 0;
+            s_pUnitManager->peakSize         = 0;
+            s_liveSize                       = 0;
+            CpuSlot::initialize();
+            CpuSlot::reset();
 
             // add first call when initialize for load
             void* btBuffer[ BACKTRACE_DEPTH ];
             backtrace( btBuffer, BACKTRACE_DEPTH );
+
+            // code range of this library, its frames are cut from every backtrace
+            Dl_info self;
+            if ( 0 != dladdr( (void*)&initialize, &self ) )
+                dl_iterate_phdr( findSelf, self.dli_fbase );
         }
 
         void uninitialize()
@@ -84,32 +218,233 @@ namespace MemoryTrace
             ;
         }
 
+        void relocate( tagUnitManager* pManager )
+        {
+            if ( NULL == pManager ) pManager = &s_defaultManager;
+
+            pthread_mutex_lock( &s_mutexMemory );
+            if ( pManager != s_pUnitManager ) *pManager = *s_pUnitManager;
+            s_pUnitManager = pManager;
+            pthread_mutex_unlock( &s_mutexMemory );
+        }
+
+        void forkPrepare()
+        {
+            // batch before registry, the order of flushBatch
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::lock( &s_batches[i].lock );
+            pthread_mutex_lock( &s_mutexMemory );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexMemory );
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::unlock( &s_batches[i].lock );
+        }
+
+        void forkChild()
+        {
+            // the blocks of the parent stay allocated in the child, they are neither its leaks nor counted when freed,
+            // the counters may live in a file shared with the parent
+            pthread_mutex_lock( &s_mutexMemory );
+            ++s_generation;
+            s_pUnitManager                   = &s_defaultManager;
+            s_pUnitManager->allocCount       = 0;
+            s_pUnitManager->allocSize        = 0;
+            s_pUnitManager->freeCount        = 0;
+            s_pUnitManager->freeSize         = 0;
+            s_pUnitManager->peakSize         = 0;
+            s_liveSize                       = 0;
+            t_liveDelta                      = 0;
+            t_traffic                        = 0;
+            CpuSlot::reset();
+            // the chunks are kept, the slots are handed out again from the start
+            s_slotHigh                       = 0;
+            s_slotLive                       = 0;
+            s_freeSlot                       = 0;
+            s_largeHead                      = 0;
+            if ( NULL != s_pRegions ) {
+                for ( size_t i = 0; i < REGION_ROOT_SIZE; ++i ) {
+                    if ( NULL != s_pRegions[i] ) memset( s_pRegions[i], 0, ( 1UL << REGION_LEAF_BITS ) * sizeof( uint32_t ) );
+                }
+            }
+            pthread_mutex_unlock( &s_mutexMemory );
+        }
+
+        static inline tagUnitSlot* slotAt( size_t index )
+        {
+            return &s_slotChunks[ index / REGISTRY_CHUNK_SLOTS ][ index % REGISTRY_CHUNK_SLOTS ];
+        }
+
+        // s_mutexMemory must be held, false once the registry is full
+        static bool acquireSlot( uint32_t* const pIndex )
+        {
+            if ( 0 != s_freeSlot ) {
+                *pIndex     = s_freeSlot - 1;
+                s_freeSlot  = slotAt( *pIndex )->nextFree;
+                return true;
+            }
+
+            if ( s_slotHigh >= (size_t)REGISTRY_CHUNKS * REGISTRY_CHUNK_SLOTS ) return false;
+
+            size_t chunk = s_slotHigh / REGISTRY_CHUNK_SLOTS;
+            if ( NULL == s_slotChunks[ chunk ] ) {
+                s_slotChunks[ chunk ] = (tagUnitSlot*)Arena::allocate( REGISTRY_CHUNK_SLOTS * sizeof( tagUnitSlot ) );
+                if ( NULL == s_slotChunks[ chunk ] ) return false;
+            }
+
+            *pIndex = s_slotHigh++;
+            return true;
+        }
+
+        // the list head of a region, NULL while its leaf is not there yet
+        static inline uint32_t* regionHead( uintptr_t region )
+        {
+            if ( NULL == s_pRegions || region >= REGION_ROOT_SIZE << REGION_LEAF_BITS ) return NULL;
+
+            uint32_t* pLeaf = s_pRegions[ region >> REGION_LEAF_BITS ];
+            return ( NULL == pLeaf ) ? NULL : &pLeaf[ region & ( ( 1UL << REGION_LEAF_BITS ) - 1 ) ];
+        }
+
+        // s_mutexMemory must be held, the large list when the index has no room for the region
+        static uint32_t* headOf( const tagUnitSlot* const pSlot, bool bCreate )
+        {
+            uintptr_t region = (uintptr_t)PTR_UNIT_NODE_DATA( pSlot->pNode ) >> REGION_SHIFT;
+            if ( pSlot->size > ( 1UL << REGION_SHIFT ) || region >= REGION_ROOT_SIZE << REGION_LEAF_BITS ) return &s_largeHead;
+
+            if ( bCreate && NULL == s_pRegions ) s_pRegions = (uint32_t**)Arena::allocate( REGION_ROOT_SIZE * sizeof( uint32_t* ) );
+            if ( bCreate && NULL != s_pRegions && NULL == s_pRegions[ region >> REGION_LEAF_BITS ] ) {
+                s_pRegions[ region >> REGION_LEAF_BITS ] = (uint32_t*)Arena::allocate( ( 1UL << REGION_LEAF_BITS ) * sizeof( uint32_t ) );
+            }
+
+            uint32_t* pHead = regionHead( region );
+            return ( NULL == pHead ) ? &s_largeHead : pHead;
+        }
+
+        // s_mutexMemory must be held, new slots go in front. the list pointers are written before the head
+        // so a crash sees either list
+        static void indexSlot( uint32_t index )
+        {
+            tagUnitSlot* pSlot  = slotAt( index );
+            uint32_t* pHead     = headOf( pSlot, true );
+
+            pSlot->regionPrev   = 0;
+            pSlot->regionNext   = *pHead;
+            if ( 0 != *pHead ) slotAt( *pHead - 1 )->regionPrev = index + 1;
+            __sync_synchronize();
+            *pHead              = index + 1;
+        }
+
+        // s_mutexMemory must be held, before the node is cleared. the head of a list is found again by its value,
+        // a leaf created after the slot went to the large list does not hold it
+        static void unindexSlot( uint32_t index )
+        {
+            tagUnitSlot* pSlot  = slotAt( index );
+
+            if ( 0 != pSlot->regionPrev )           slotAt( pSlot->regionPrev - 1 )->regionNext = pSlot->regionNext;
+            else if ( s_largeHead == index + 1 )    s_largeHead = pSlot->regionNext;
+            else                                    *headOf( pSlot, false ) = pSlot->regionNext;
+
+            if ( 0 != pSlot->regionNext ) slotAt( pSlot->regionNext - 1 )->regionPrev = pSlot->regionPrev;
+        }
+
+        // the wait for the registry lock is a phase of its own, a contended lock shows in the tail
+        static inline void lockMemory()
+        {
+            uint64_t start = profileStart();
+            pthread_mutex_lock( &s_mutexMemory );
+            profileRecord( Profile::PP_LOCK, start );
+        }
+
+        // small alloc/free pairs cancel in the thread, only growth by a batch touches the shared line
+        static void countLive( int64_t size )
+        {
+            int64_t delta = t_liveDelta + size;
+            if ( delta < PEAK_BATCH && delta > -PEAK_BATCH ) { t_liveDelta = delta; return; }
+
+            t_liveDelta = 0;
+            int64_t live = __sync_add_and_fetch( &s_liveSize, delta );
+            if ( delta < 0 || live <= 0 ) return;
+
+            tagUnitManager* pManager = s_pUnitManager;
+            size_t peakSize = pManager->peakSize;
+            while ( (size_t)live > peakSize && !__sync_bool_compare_and_swap( &pManager->peakSize, peakSize, (size_t)live ) )
+                peakSize = pManager->peakSize;
+        }
+
+        // alloc/free churn moves the per-CPU totals without moving the live size, so the persisted page
+        // is charged with both directions
+        static void countTraffic( int64_t size )
+        {
+            int64_t traffic = t_traffic + size;
+            if ( traffic < PEAK_BATCH ) { t_traffic = traffic; return; }
+
+            t_traffic = 0;
+            Persist::charge( traffic );
+        }
+
+        // per-CPU, summed by getStatistics()
+        static void countUnit( tagUnitNode* pNode )
+        {
+            CpuSlot::add( CpuSlot::CC_ALLOC_COUNT, 1 );
+            CpuSlot::add( CpuSlot::CC_ALLOC_SIZE, pNode->size );
+            countLive( (int64_t)pNode->size );
+            countTraffic( (int64_t)pNode->size );
+        }
+
+        // blocks of the parent are neither counted nor in the registry of a forked child
+        static void countFree( tagUnitNode* pNode )
+        {
+            if ( pNode->generation != s_generation ) return;
+
+            CpuSlot::add( CpuSlot::CC_FREE_COUNT, 1 );
+            CpuSlot::add( CpuSlot::CC_FREE_SIZE, pNode->size );
+            countLive( -(int64_t)pNode->size );
+            countTraffic( (int64_t)pNode->size );
+        }
+
         void appendUnit( tagUnitNode* pNode )
         {
             static size_t serial = 0;
-            pthread_mutex_lock( &s_mutexMemory );
-           
-            if ( NULL == pNode ) { pthread_mutex_unlock( &s_mutexMemory ); return; }
+            if ( NULL == pNode ) return;
+
+            countUnit( pNode );
+
+            lockMemory();
+            uint64_t start = profileStart();
             
-            pNode->pPrev    = s_unitManager.pCurrent;
-            pNode->pNext    = NULL;
             pNode->serial   = serial++;
 
-            if ( !s_unitManager.pRoot || !s_unitManager.pCurrent ) {
-                s_unitManager.pRoot     = pNode;
-                s_unitManager.pCurrent  = pNode;
+            // counted all the same when there is no slot left, it only misses from the reports
+            if ( !acquireSlot( &pNode->slot ) ) {
+                pNode->bLinked = false;
             } else {
-                s_unitManager.pCurrent->pNext = pNode;
-                s_unitManager.pCurrent = pNode;
+                tagUnitSlot* pSlot  = slotAt( pNode->slot );
+                pSlot->pNode        = pNode;
+                pSlot->size         = pNode->size;
+                pSlot->serial       = pNode->serial;
+                pSlot->timestamp    = pNode->timestamp;
+                pSlot->stackId      = pNode->stackId;
+                pSlot->tagId        = pNode->tagId;
+                pSlot->bMock        = pNode->bMock;
+                pSlot->bPending     = false;
+                pSlot->threadSlot   = pNode->threadSlot;
+                indexSlot( pNode->slot );
+                ++s_slotLive;
             }
 
-            s_unitManager.allocCount++;
-            s_unitManager.allocSize += pNode->size;
-
+            profileRecord( Profile::PP_REGISTRY, start );
             pthread_mutex_unlock( &s_mutexMemory );  
         }
 
-        const tagUnitNode* appendUnit(void* const pData, size_t size, bool isMock)
+        static bool sampleNext()
+        {
+            if ( t_sampleCountdown > 0 ) { --t_sampleCountdown; return false; }
+
+            t_sampleCountdown = Config::get()->sampleRate - 1;
+            return true;
+        }
+
+        const tagUnitNode* appendUnit(void* const pData, size_t size, bool isMock, bool isTraced, uint8_t sizeClass)
         {
             if ( NULL == pData ) return NULL;
 
@@ -117,43 +452,168 @@ namespace MemoryTrace
                         
             pNode->sync     = MAKE_UNIT_NODE_MAGIC( pNode );
             pNode->bMock    = isMock;
-            pNode->pPrev    = NULL;
-            pNode->pNext    = NULL;
+            pNode->bLinked  = isMock || isTraced;
+            pNode->bPending = false;
+            pNode->sizeClass = sizeClass;
+            pNode->tagId    = isMock ? 0 : Tag::current();
+            pNode->generation = s_generation;
+            pNode->slot     = 0;
             pNode->size     = size;
             pNode->pData    = PTR_UNIT_NODE_DATA( pNode );
+            pNode->timestamp = 0;
+            pNode->stackId  = 0;
+            pNode->traceSize = 0;
+            pNode->chainLength = 0;
+            pNode->threadSlot = (uint16_t)ThreadSlot::current();
    
-            if ( !isMock ) {
+            if ( isTraced && !isMock ) {
+                pNode->timestamp = timestamp();
+                uint64_t start = profileStart();
                 storeBacktrace( pNode ); 
+                pNode->stackId = StackDepot::intern( pNode->traceHash, pNode->backtrace, pNode->traceSize );
+                profileRecord( Profile::PP_BACKTRACE, start );
+                StackDepot::addLive( pNode->stackId, pNode->size );
+                HeavyHitter::record( pNode );
+                Plugin::recordAlloc( pNode );
+            }
+
+            if ( !isMock ) {
+                SizeClass::recordAlloc( pNode );
+                StatPage::recordAlloc( pNode );
+                Tag::recordAlloc( pNode );
+                Budget::recordAlloc( pNode );
+            }
+
+            if ( pNode->bLinked ) {
+                appendUnit( pNode );
+            } else {
+                countUnit( pNode );
             }
 
-            appendUnit( pNode );
+            // a block missing from the set would be freed by its user pointer once tracing is switched off
+            if ( !isMock && BlockSet::isEnabled() && !BlockSet::insert( pNode->pData ) ) return NULL;
           
             return pNode;
         }
         
+        // per call site and per thread accounting, done when the block is freed even if the unlink is deferred
+        static void accountFree( tagUnitNode* pNode )
+        {
+            countFree( pNode );
+            // out of the set before the real allocator may hand the address out again
+            if ( !pNode->bMock && BlockSet::isEnabled() ) BlockSet::erase( pNode->pData );
+
+            // a parent's block, none of the child's figures counted it
+            if ( pNode->generation != s_generation ) return;
+
+            Fault::recordFree( pNode );
+
+            if ( 0 != pNode->stackId ) {
+                Churn::record( pNode, timestamp() );
+                Growth::recordFree( pNode );
+                StackDepot::removeLive( pNode->stackId, pNode->size );
+            }
+
+            if ( !pNode->bMock ) {
+                SizeClass::recordFree( pNode );
+                StatPage::recordFree( pNode );
+                Tag::recordFree( pNode );
+                Budget::recordFree( pNode );
+            }
+        }
+
+        // s_mutexMemory must be held
+        static void unlinkUnit( tagUnitNode* pNode )
+        {
+            if ( pNode->generation != s_generation ) return;
+
+            if ( pNode->bLinked ) {
+                unindexSlot( pNode->slot );
+                tagUnitSlot* pSlot  = slotAt( pNode->slot );
+                pSlot->pNode        = NULL;
+                pSlot->nextFree     = s_freeSlot;
+                s_freeSlot          = pNode->slot + 1;
+                --s_slotLive;
+            }
+        }
+
         void deleteUnit( tagUnitNode* pNode )
         {
-            pthread_mutex_lock( &s_mutexMemory );
-            
-            if ( !pNode ) { pthread_mutex_unlock( &s_mutexMemory ); }
+            if ( !pNode ) return;
 
             // hook all type of memory request, this must be true       
             assert( MAKE_UNIT_NODE_MAGIC( pNode ) == pNode->sync );
 
-            assert( NULL != s_unitManager.pCurrent );
-            if ( s_unitManager.pCurrent == pNode )
-                s_unitManager.pCurrent = pNode->pPrev;
+            accountFree( pNode );
 
-            assert ( NULL != pNode->pPrev );
-            pNode->pPrev->pNext = pNode->pNext;
+            // counted already, only a registry slot needs the lock
+            if ( !pNode->bLinked || pNode->generation != s_generation ) return;
 
-            if ( NULL != pNode->pNext )
-                pNode->pNext->pPrev = pNode->pPrev;
+            lockMemory();
+            uint64_t start = profileStart();
+            unlinkUnit( pNode );
+            profileRecord( Profile::PP_REGISTRY, start );
+            pthread_mutex_unlock( &s_mutexMemory );
+        }
 
-            s_unitManager.freeCount++;
-            s_unitManager.freeSize += pNode->size;
+        // called with the batch locked
+        static void flushBatch( tagFreeBatch* const pBatch )
+        {
+            if ( 0 == pBatch->count ) return;
 
+            lockMemory();
+            uint64_t start = profileStart();
+            for ( size_t i = 0; i < pBatch->count; ++i ) unlinkUnit( pBatch->nodes[i] );
+            profileRecord( Profile::PP_REGISTRY, start );
             pthread_mutex_unlock( &s_mutexMemory );
+
+            for ( size_t i = 0; i < pBatch->count; ++i ) s_pRelease( pBatch->nodes[i] );
+            pBatch->count = 0;
+        }
+
+        void setRelease( void (*pRelease)( void* ) )
+        {
+            s_pRelease = pRelease;
+        }
+
+        void releaseUnit( tagUnitNode* pNode )
+        {
+            if ( !pNode ) return;
+
+            assert( MAKE_UNIT_NODE_MAGIC( pNode ) == pNode->sync );
+
+            // batches amortize the registry lock, a block without a slot has nothing to wait for
+            size_t batchSize = Config::get()->freeBatch;
+            if ( batchSize <= 1 || !pNode->bLinked ) {
+                deleteUnit( pNode );
+                s_pRelease( pNode );
+                return;
+            }
+
+            // freed twice while waiting in a batch
+            if ( pNode->bPending ) return;
+            pNode->bPending = true;
+            // the slot is the node's until the batch unlinks it
+            if ( pNode->bLinked && pNode->generation == s_generation ) slotAt( pNode->slot )->bPending = true;
+
+            accountFree( pNode );
+
+            tagFreeBatch* pBatch = &s_batches[ ThreadSlot::current() ];
+            ThreadSlot::lock( &pBatch->lock );
+            pBatch->nodes[ pBatch->count++ ] = pNode;
+            if ( pBatch->count >= batchSize ) flushBatch( pBatch );
+            ThreadSlot::unlock( &pBatch->lock );
+        }
+
+        void flushPending()
+        {
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) {
+                if ( 0 == s_batches[i].count ) continue;
+
+                ThreadSlot::lock( &s_batches[i].lock );
+                flushBatch( &s_batches[i] );
+                ThreadSlot::unlock( &s_batches[i].lock );
+            }
         }
 
         bool checkUnit( tagUnitNode* pNode )
@@ -167,61 +627,247 @@ namespace MemoryTrace
             return true;
         }
 
+        static bool bySerial( const tagUnitRecord& left, const tagUnitRecord& right )
+        {
+            return left.serial < right.serial;
+        }
+
+        // slot and depot only, a header is read only for a backtrace the depot had no room for
+        static void fillRecord( const tagUnitSlot* const pSlot, tagUnitRecord* const pRecord )
+        {
+            pRecord->pNode      = pSlot->pNode;
+            pRecord->pData      = PTR_UNIT_NODE_DATA( pSlot->pNode );
+            pRecord->bMock      = pSlot->bMock;
+            pRecord->size       = pSlot->size;
+            pRecord->serial     = pSlot->serial;
+            pRecord->timestamp  = pSlot->timestamp;
+            pRecord->stackId    = pSlot->stackId;
+            pRecord->tagId      = pSlot->tagId;
+            pRecord->threadId   = ThreadSlot::threadId( pSlot->threadSlot );
+            pRecord->traceSize  = 0;
+
+            const StackDepot::tagStackEntry* pEntry = StackDepot::get( pSlot->stackId );
+            if ( NULL != pEntry ) {
+                pRecord->traceSize = pEntry->traceSize;
+                memcpy( pRecord->backtrace, pEntry->backtrace, pEntry->traceSize * sizeof( void* ) );
+            } else if ( !pSlot->bMock ) {
+                pRecord->traceSize = pSlot->pNode->traceSize;
+                memcpy( pRecord->backtrace, pSlot->pNode->backtrace, pRecord->traceSize * sizeof( void* ) );
+            }
+        }
+
+        tagUnitSnapshot* takeSnapshot()
+        {
+            // frees still in a batch are done as far as the application is concerned
+            flushPending();
+
+            tagUnitManager statistics;
+            getStatistics( &statistics );
+
+            pthread_mutex_lock( &s_mutexMemory );
+
+            size_t capacity = s_slotLive;
+            size_t mapSize  = sizeof( tagUnitSnapshot ) + capacity * sizeof( tagUnitRecord );
+
+            void* pMap = mmap( NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( MAP_FAILED == pMap ) { pthread_mutex_unlock( &s_mutexMemory ); return NULL; }
+
+            tagUnitSnapshot* pSnapshot = (tagUnitSnapshot*)pMap;
+            pSnapshot->mapSize      = mapSize;
+            pSnapshot->statistics   = statistics;
+            pSnapshot->count        = 0;
+
+            for ( size_t i = 0; i < s_slotHigh && pSnapshot->count < capacity; ++i ) {
+                const tagUnitSlot* pSlot = slotAt( i );
+                // batched by a free that raced with the flush above
+                if ( NULL == pSlot->pNode || pSlot->bPending ) continue;
+
+                fillRecord( pSlot, &pSnapshot->records[ pSnapshot->count++ ] );
+            }
+
+            pthread_mutex_unlock( &s_mutexMemory );
+
+            // slots are reused, reports keep the allocation order
+            std::sort( pSnapshot->records, pSnapshot->records + pSnapshot->count, bySerial );
+            return pSnapshot;
+        }
+
+        // a crash may come in the middle of an update, the walk stops after as many steps as there are slots
+        static void nearestIn( uint32_t head, uintptr_t addr, const tagUnitSlot** ppBest, uintptr_t* pBestDistance )
+        {
+            size_t slotHigh = s_slotHigh;
+            for ( size_t steps = 0; 0 != head && head <= slotHigh && steps < slotHigh && 0 != *pBestDistance; ++steps ) {
+                const tagUnitSlot* pSlot = slotAt( head - 1 );
+                head = pSlot->regionNext;
+
+                tagUnitNode* pNode = pSlot->pNode;
+                if ( NULL == pNode || pSlot->bMock ) continue;
+
+                uintptr_t begin = (uintptr_t)PTR_UNIT_NODE_DATA( pNode );
+                uintptr_t distance = ( addr < begin ) ? begin - addr : ( addr >= begin + pSlot->size ) ? addr - ( begin + pSlot->size ) + 1 : 0;
+                if ( distance < *pBestDistance ) { *ppBest = pSlot; *pBestDistance = distance; }
+            }
+        }
+
+        bool findUnit( const void* pAddr, tagUnitRecord* const pRecord )
+        {
+            // a crash may come with the lock held, the lists are read as they are. a block of at most a region
+            // that holds the address or lies within a region of it starts two regions below to one above
+            uintptr_t addr = (uintptr_t)pAddr;
+            uintptr_t region = addr >> REGION_SHIFT;
+            const tagUnitSlot* pBest = NULL;
+            uintptr_t bestDistance = UINTPTR_MAX;
+
+            for ( uintptr_t r = ( region < 2 ) ? 0 : region - 2; r <= region + 1; ++r ) {
+                const uint32_t* pHead = regionHead( r );
+                if ( NULL != pHead ) nearestIn( *pHead, addr, &pBest, &bestDistance );
+            }
+            nearestIn( s_largeHead, addr, &pBest, &bestDistance );
+
+            if ( NULL == pBest ) return false;
+
+            fillRecord( pBest, pRecord );
+            return true;
+        }
+
+        void releaseSnapshot( tagUnitSnapshot* pSnapshot )
+        {
+            if ( NULL != pSnapshot ) munmap( pSnapshot, pSnapshot->mapSize );
+        }
+
         void analyse( bool autoDelete )
         { 
-            size_t leakCount    = s_unitManager.allocCount - s_unitManager.freeCount;
-            size_t leakSize     = s_unitManager.allocSize - s_unitManager.freeSize;
-           
-            tagUnitNode* pNode  = s_unitManager.pRoot;
-            tagUnitNode* pCur   = NULL;
-
-            fprintf( stderr, "unfreed \n \tcount: %ld\n\tsize: %ld\n", \
-                            leakCount,\
-                            leakSize );
-
-            while ( pNode ) {
-                pCur    = pNode;
-                pNode   = pNode->pNext;
-
-                if ( pCur->bMock ) {
-                    fprintf( stderr, "allocted by mock, size: %ld, serial: %ld\n", pCur->size, pCur->serial );
-                    continue;
+            // printing and symbolizing may allocate, so work on a copy and keep the registry unlocked
+            tagUnitSnapshot* pSnapshot = takeSnapshot();
+            if ( NULL == pSnapshot ) return;
+
+            // resolve every unique frame up front, in parallel
+            if ( Config::get()->symbolizeThreads > 0 ) {
+                for ( size_t i = 0; i < pSnapshot->count; ++i ) {
+                    if ( !pSnapshot->records[i].bMock ) 
+                        Symbolizer::prefetch( pSnapshot->records[i].backtrace, pSnapshot->records[i].traceSize );
                 }
-                fprintf( stderr, "++++++++++++++ unfreed addr: %p, size: %ld, serial: %ld ++++++++++++++\n", \
-                             pCur, \
-                             pCur->size, \
-                             pCur->serial );
-                fprintf( stderr, "backtrace:\n" );
-                showBacktrace( pCur );              
-                fprintf( stderr, "++++++++++++++ end ++++++++++++++\n" );
-
-                if ( autoDelete ) TraceFree( pCur );
+                Symbolizer::resolvePending();
+            }
+
+            size_t leakCount    = pSnapshot->statistics.allocCount - pSnapshot->statistics.freeCount;
+            size_t leakSize     = pSnapshot->statistics.allocSize - pSnapshot->statistics.freeSize;
+
+            Writer::summary( leakCount, leakSize );
+
+            for ( size_t i = 0; i < pSnapshot->count; ++i ) {
+                tagUnitRecord* pCur = &pSnapshot->records[i];
+
+                char tag[ 512 ];
+                if ( 0 != pCur->tagId ) Tag::describe( pCur->tagId, tag, sizeof( tag ) );
+                Writer::block( pCur, ( 0 != pCur->tagId ) ? tag : NULL );
+
+                if ( autoDelete && !pCur->bMock ) TraceFree( pCur->pData );
             }
+
+            releaseSnapshot( pSnapshot );
+        }
+
+        void getStatistics( tagUnitManager* const pStat )
+        {
+            int64_t values[ CpuSlot::CC_COUNT ];
+            CpuSlot::sum( values );
+
+            // published where relocate() put the counters, the persist file has them as of the last read
+            tagUnitManager* pManager = s_pUnitManager;
+            pManager->allocCount    = values[ CpuSlot::CC_ALLOC_COUNT ];
+            pManager->allocSize     = values[ CpuSlot::CC_ALLOC_SIZE ];
+            pManager->freeCount     = values[ CpuSlot::CC_FREE_COUNT ];
+            pManager->freeSize      = values[ CpuSlot::CC_FREE_SIZE ];
+
+            // the exact live size of this read may be above what the threads folded so far
+            size_t liveSize = ( pManager->allocSize > pManager->freeSize ) ? pManager->allocSize - pManager->freeSize : 0;
+            size_t peakSize = pManager->peakSize;
+            while ( liveSize > peakSize && !__sync_bool_compare_and_swap( &pManager->peakSize, peakSize, liveSize ) )
+                peakSize = pManager->peakSize;
+
+            if ( NULL != pStat ) *pStat = *pManager;
         }
 
         void storeBacktrace( tagUnitNode* const pNode )
         {
             if ( NULL == pNode ) return;
 
-            pNode->traceSize = backtrace( pNode->backtrace, BACKTRACE_DEPTH );
+            pNode->traceSize = captureBacktrace( pNode->backtrace, &pNode->traceHash );
+        }
+
+        size_t captureBacktrace( void** const pBacktrace, size_t* const pHash )
+        {
+            void*  buffer[ BACKTRACE_DEPTH + HOOK_FRAME_MAX ];
+            size_t depth    = Config::get()->depth;
+            size_t size     = backtrace( buffer, depth + HOOK_FRAME_MAX );
+            size_t skip     = skipHookFrames( buffer, size );
+
+            size -= skip;
+            size_t traceSize = ( size < depth ) ? size : depth;
+            memcpy( pBacktrace, buffer + skip, traceSize * sizeof( void* ) );
+            *pHash = hashBacktrace( pBacktrace, traceSize );
+            return traceSize;
         }
    
         void showBacktrace( tagUnitNode* const pNode )
         {
             if ( NULL == pNode ) return;
 
-            backtrace_symbols_fd( pNode->backtrace, pNode->traceSize, STDERR_FILENO );
+            showBacktrace( pNode->backtrace, pNode->traceSize );
+        }
+
+        void showBacktrace( void* const* backtrace, size_t traceSize )
+        {
+            if ( NULL == backtrace ) return;
+
+            Writer::backtrace( backtrace, traceSize );
+        }
+
+        size_t hashBacktrace( void* const* backtrace, size_t traceSize )
+        {
+            // FNV-1a over the frame addresses
+            size_t hash = 0xCBF29CE484222325;
+
+            for ( size_t i = 0; i < traceSize; ++i ) {
+                hash ^= (size_t)backtrace[i];
+                hash *= 0x100000001B3;
+            }
+
+            return hash;
+        }
+
+        bool isHookAddress( const void* pAddr )
+        {
+            return (uintptr_t)pAddr >= s_selfBegin && (uintptr_t)pAddr < s_selfEnd;
+        }
+
+        size_t skipHookFrames( void* const* backtrace, size_t traceSize )
+        {
+            size_t i = 0;
+            while ( i < traceSize && (uintptr_t)backtrace[i] >= s_selfBegin && (uintptr_t)backtrace[i] < s_selfEnd ) ++i;
+
+            return ( i < traceSize ) ? i : 0;
+        }
+
+        uint64_t timestamp()
+        {
+            struct timespec now;
+            clock_gettime( CLOCK_MONOTONIC, &now );
+
+            return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
         }
     } // namespace MemoryManager
 
     namespace mockMemory
     {
-        static char             s_mockBuffer[1024 * 1024];
+        static char             s_mockBuffer[1024 * 1024] __attribute__ (( aligned( 16 ) ));
         static size_t           s_mockMallocPos = 0;
 
         void* _mockMalloc( size_t size )
         {
-            size_t mockSize = size + DEF_SIZE_UNIT_NODE;
+            // keep the next header aligned like the real allocator would
+            size_t mockSize = ( size + DEF_SIZE_UNIT_NODE + 15 ) & ~(size_t)15;
             assert ( s_mockMallocPos + mockSize < sizeof( s_mockBuffer ) );
 
             const MemoryManager::tagUnitNode* pNode = MemoryManager::appendUnit( (void*)( s_mockBuffer + s_mockMallocPos ), size, true);
@@ -244,6 +890,11 @@ namespace MemoryTrace
         {
             ;
         }    
+
+        bool _mockContains( void* ptr )
+        {
+            return (char*)ptr >= s_mockBuffer && (char*)ptr < s_mockBuffer + sizeof( s_mockBuffer );
+        }
     } // namespace mockMemory
 
     static void printMap()
@@ -270,6 +921,17 @@ namespace MemoryTrace
         TS_INITIALIZED,
         TS_FAILED,
     };
+
+    // implementations of the configured mode, selected once in TraceInitialize
+    struct tagTraceHooks
+    {
+        void*               (*pMalloc)( size_t, bool );
+        void*               (*pCalloc)( size_t, size_t, bool );
+        void*               (*pRealloc)( void*, size_t, bool );
+        void*               (*pMemalign)( size_t, size_t, bool );
+        void*               (*pValloc)( size_t, bool );
+        void                (*pFree)( void*, bool );
+    };
    
     static TraceStatus      s_status            = TS_UNINITIALIZE;
     static FUNC_MALLOC      s_pRealMalloc       = NULL;
@@ -278,11 +940,137 @@ namespace MemoryTrace
     static FUNC_MEMALIGN    s_pRealMemalign     = NULL;
     static FUNC_VALLOC      s_pRealValloc       = NULL;
     static FUNC_FREE        s_pRealFree         = NULL;
+    static tagTraceHooks    s_hooks;
+    static volatile bool    s_bTracing          = true;
 
     static pthread_mutex_t  s_mutexInit = PTHREAD_MUTEX_INITIALIZER;
 
+    template <int MODE>
+    static void selectHooks()
+    {
+        s_hooks.pMalloc     = _impMalloc<MODE>;
+        s_hooks.pCalloc     = _impCalloc<MODE>;
+        s_hooks.pRealloc    = _impRealloc<MODE>;
+        s_hooks.pMemalign   = _impMemalign<MODE>;
+        s_hooks.pValloc     = _impValloc<MODE>;
+        s_hooks.pFree       = _impFree<MODE>;
+    }
+
+    static void selectMode( int mode )
+    {
+        switch ( mode ) {
+        case Config::TM_OFF:        selectHooks<Config::TM_OFF>();      break;
+        case Config::TM_COUNTERS:   selectHooks<Config::TM_COUNTERS>(); break;
+        case Config::TM_SAMPLE:     selectHooks<Config::TM_SAMPLE>();   break;
+        case Config::TM_TRACE:      selectHooks<Config::TM_TRACE>();    break;
+        default:                    selectHooks<Config::TM_FULL>();     break;
+        }
+    }
+
+    // async-signal-safe, a hook that runs with the previous pointers still finds its blocks in the block set
+    bool TraceSwitch( bool bOn )
+    {
+        if ( s_status != TS_INITIALIZED || !BlockSet::isEnabled() ) return false;
+
+        s_bTracing = bOn;
+        selectMode( bOn ? Config::get()->mode : Config::TM_OFF );
+        return true;
+    }
+
+    bool TraceIsOn()
+    {
+        return s_bTracing;
+    }
+
+    // release function of the registry, a slab block goes back to the cache of the freeing thread
+    static void releaseBlock( void* pBlock )
+    {
+        uint8_t sizeClass = ( (MemoryManager::tagUnitNode*)pBlock )->sizeClass;
+        uint64_t start = profileStart();
+
+        if ( 0 != sizeClass ) {
+            Slab::free( pBlock, sizeClass );
+        } else {
+            s_pRealFree( pBlock );
+        }
+
+        profileRecord( Profile::PP_ALLOCATOR, start );
+    }
+
+    static void signalSwitch( int )
+    {
+        TraceSwitch( !s_bTracing );
+    }
+
+    // every lock a hook or the service thread may hold is taken around fork(), in the order they nest
+    static void TraceForkPrepare()
+    {
+        pthread_mutex_lock( &s_mutexInit );
+        Reporter::forkPrepare();
+        Plugin::forkPrepare();
+        Writer::forkPrepare();
+        Collector::forkPrepare();
+        Symbolizer::forkPrepare();
+        HeavyHitter::forkPrepare();
+        SizeClass::forkPrepare();
+        Recorder::forkPrepare();
+        Mapping::forkPrepare();
+        MemoryManager::forkPrepare();
+        Slab::forkPrepare();
+        BlockSet::forkPrepare();
+        Arena::forkPrepare();
+    }
+
+    static void TraceForkParent()
+    {
+        Arena::forkRelease();
+        BlockSet::forkRelease();
+        Slab::forkRelease();
+        MemoryManager::forkRelease();
+        Mapping::forkRelease();
+        Recorder::forkRelease();
+        SizeClass::forkRelease();
+        HeavyHitter::forkRelease();
+        Symbolizer::forkRelease();
+        Collector::forkRelease();
+        Writer::forkRelease();
+        Plugin::forkRelease();
+        Reporter::forkRelease();
+        pthread_mutex_unlock( &s_mutexInit );
+    }
+
+    // only the forking thread lives on, every module lets go of what it shares with the parent
+    // before the child allocates, then opens its own files and starts its own service thread
+    static void TraceForkChild()
+    {
+        TraceForkParent();
+
+        ThreadSlot::forkChild();
+        MemoryManager::forkChild();
+        StackDepot::forkChild();
+        Tag::forkChild();
+        SizeClass::forkChild();
+        HeavyHitter::forkChild();
+        LeakSuspect::forkChild();
+        Budget::forkChild();
+        Growth::forkChild();
+        Churn::forkChild();
+        Mapping::forkChild();
+        Persist::forkChild();
+        StatPage::forkChild();
+        Profile::forkChild();
+        Recorder::forkChild();
+        Collector::forkChild();
+
+        Config::forkChild();
+        Persist::initialize();
+        StatPage::initialize();
+        Recorder::initialize();
+        Reporter::forkChild();
+    }
+
     //__attribute__ ((constructor(102)))
-    static void TraceInitialize()
+    void TraceInitialize()
     {
 #ifdef _DEBUG
         fprintf( stderr, "call TraceInitialize\n" );      
@@ -292,7 +1080,33 @@ namespace MemoryTrace
 
         s_status = TS_INITIALIZING;
 
+        Config::initialize();
+        Writer::initialize();
+        Arena::initialize();
         MemoryManager::initialize();
+        StackDepot::initialize();
+        Persist::initialize();
+        BlockSet::initialize();
+        Slab::initialize();
+        Profile::initialize();
+        s_bProfiled = Profile::isEnabled();
+        Fault::initialize();
+        HeavyHitter::initialize();
+        Churn::initialize();
+        Growth::initialize();
+        SizeClass::initialize();
+        StatPage::initialize();
+        LeakSuspect::initialize();
+        Recorder::initialize();
+        Budget::initialize();
+        Plugin::initialize();
+        Snapshot::initialize();
+        Collector::initialize();
+        Mapping::initialize();
+        Reporter::initialize();
+        Exec::initialize();
+
+        pthread_atfork( TraceForkPrepare, TraceForkParent, TraceForkChild );
        
         s_pRealMalloc       = (FUNC_MALLOC)dlsym(RTLD_NEXT, "malloc");
         s_pRealCalloc       = (FUNC_CALLOC)dlsym(RTLD_NEXT, "calloc");
@@ -303,6 +1117,19 @@ namespace MemoryTrace
 
         assert( !( NULL == s_pRealMalloc || NULL == s_pRealCalloc || NULL == s_pRealRealloc || 
                     NULL == s_pRealMemalign || NULL == s_pRealValloc || NULL == s_pRealFree ) );
+
+        MemoryManager::setRelease( releaseBlock );
+
+        s_bTracing = Config::TM_OFF != Config::get()->mode && ( Config::get()->bTracing || !BlockSet::isEnabled() );
+        selectMode( s_bTracing ? Config::get()->mode : Config::TM_OFF );
+
+        if ( BlockSet::isEnabled() && Config::get()->switchSignal > 0 ) {
+            struct sigaction action;
+            sigemptyset( &action.sa_mask );
+            action.sa_handler   = signalSwitch;
+            action.sa_flags     = SA_RESTART;
+            sigaction( Config::get()->switchSignal, &action, NULL );
+        }
        
         s_status = TS_INITIALIZED;
 
@@ -317,7 +1144,11 @@ namespace MemoryTrace
 #ifdef _DEBUG
         fprintf(stderr, "call TraceUninitialize\n");     
 #endif 
-       MemoryManager::analyse(false);
+       if ( Config::get()->reportTriggers & Config::RT_EXIT ) Reporter::report();
+       StatPage::uninitialize();
+       Collector::uninitialize();
+       Recorder::uninitialize();
+       Persist::uninitialize();
     }
 
     void TraceExit( int status )
@@ -327,163 +1158,272 @@ namespace MemoryTrace
 #endif
     }
 
-    static int s_no_hook = 0;
+    // switched off at runtime, straight to the real allocator ahead of every other check. only cleared once
+    // initialized, nothing is recorded or profiled until tracing is switched on again
     void* TraceMalloc( size_t size )
     {  
+        if ( __builtin_expect( !s_bTracing, 0 ) ) return s_pRealMalloc( size );
+
         if ( s_status == TS_INITIALIZING ) return mockMemory::_mockMalloc( size );
 
         if ( s_status != TS_INITIALIZED )  TraceInitialize();
 
-        void* p = _impMalloc( size, __sync_fetch_and_add( &s_no_hook, 1 ) );
-        __sync_fetch_and_sub( &s_no_hook, 1 );
-        return p;
+        uint64_t start = profileBegin( Profile::PO_MALLOC );
+        void* pData = s_hooks.pMalloc( size, false );
+        if ( Recorder::isEnabled() ) Recorder::recordAlloc( Recorder::OP_MALLOC, pData, size );
+        profileEnd( Profile::PO_MALLOC, start );
+
+        return pData;
     }
 
     void* TraceCalloc( size_t nmemb, size_t size )
     { 
+        if ( __builtin_expect( !s_bTracing, 0 ) ) return s_pRealCalloc( nmemb, size );
+
         if ( s_status == TS_INITIALIZING ) return mockMemory::_mockCalloc( nmemb, size );
         
         if ( s_status != TS_INITIALIZED )  TraceInitialize();
 
-        void* p = _impCalloc( nmemb, size, __sync_fetch_and_add( &s_no_hook, 1 ) );
-        __sync_fetch_and_sub( &s_no_hook, 1 );
-        return p;
+        uint64_t start = profileBegin( Profile::PO_CALLOC );
+        void* pData = s_hooks.pCalloc( nmemb, size, false );
+        if ( Recorder::isEnabled() ) Recorder::recordAlloc( Recorder::OP_CALLOC, pData, nmemb * size );
+        profileEnd( Profile::PO_CALLOC, start );
+
+        return pData;
     }
 
     void* TraceRealloc( void *ptr, size_t size )
     {
         if ( s_status != TS_INITIALIZED )  TraceInitialize();
 
-        void* p = _impRealloc( ptr, size, __sync_fetch_and_add( &s_no_hook, 1 ) );
-        __sync_fetch_and_sub( &s_no_hook, 1 );
-        return p;
+        uint64_t begin = profileBegin( Profile::PO_REALLOC );
+        void* pData;
+
+        if ( !Recorder::isEnabled() ) {
+            pData = s_hooks.pRealloc( ptr, size, false );
+        } else {
+            // the old block is released inside the call, the replay needs both ends
+            uint64_t start = MemoryManager::timestamp();
+            pData = s_hooks.pRealloc( ptr, size, false );
+            Recorder::recordRealloc( ptr, pData, size, start );
+        }
+
+        profileEnd( Profile::PO_REALLOC, begin );
+        return pData;
     }
 
     void* TraceMemalign( size_t blocksize, size_t bytes )
     {
         if ( s_status != TS_INITIALIZED )  TraceInitialize();
 
-        void* p = _impMemalign( blocksize, bytes, __sync_fetch_and_add( &s_no_hook, 1 ) );
-        __sync_fetch_and_sub( &s_no_hook, 1 );
-        return p;
+        uint64_t start = profileBegin( Profile::PO_MEMALIGN );
+        void* pData = s_hooks.pMemalign( blocksize, bytes, false );
+        if ( Recorder::isEnabled() ) Recorder::recordAlloc( Recorder::OP_MEMALIGN, pData, bytes, blocksize );
+        profileEnd( Profile::PO_MEMALIGN, start );
+
+        return pData;
     }
     
     void* TraceValloc( size_t size )
     {
         if ( s_status != TS_INITIALIZED )  TraceInitialize();
 
-        void* p = _impValloc( size, __sync_fetch_and_add( &s_no_hook, 1 ) );
-        __sync_fetch_and_sub( &s_no_hook, 1 );
-        return p;
+        uint64_t start = profileBegin( Profile::PO_VALLOC );
+        void* pData = s_hooks.pValloc( size, false );
+        if ( Recorder::isEnabled() ) Recorder::recordAlloc( Recorder::OP_VALLOC, pData, size );
+        profileEnd( Profile::PO_VALLOC, start );
+
+        return pData;
     }
 
+    // the blocks allocated while it was on still have their header, the block set tells
     void TraceFree( void* ptr )
     {
+        if ( __builtin_expect( !s_bTracing, 0 ) ) return _impFree<Config::TM_OFF>( ptr, false );
+
         if ( s_status == TS_INITIALIZING ) return mockMemory::_mockFree( ptr );
 
         if ( s_status != TS_INITIALIZED )  TraceInitialize();
+
+        uint64_t start = profileBegin( Profile::PO_FREE );
+        if ( Recorder::isEnabled() ) Recorder::recordFree( ptr );
     
-        _impFree( ptr, __sync_fetch_and_add( &s_no_hook, 1 ) );
-        __sync_fetch_and_sub( &s_no_hook, 1 );
+        s_hooks.pFree( ptr, false );
+        profileEnd( Profile::PO_FREE, start );
+    }
+
+    // whether this allocation gets a backtrace and a place in the list, resolved at compile time except for sampling
+    template <int MODE>
+    static inline bool isTraced()
+    {
+        if ( Config::TM_SAMPLE == MODE ) return MemoryManager::sampleNext();
+
+        return MODE >= Config::TM_FULL;
     }
 
+    // blocks of the initialization phase always carry a header. with a runtime switch the ones allocated
+    // while it was off do not, and only the block set tells them apart without touching memory in front of them
+    template <int MODE>
+    static inline bool hasHeader( void* ptr )
+    {
+        if ( mockMemory::_mockContains( ptr ) ) return true;
+        if ( BlockSet::isEnabled() ) return BlockSet::contains( ptr );
+
+        return Config::TM_OFF != MODE;
+    }
+
+    // a block and its header from the slab backend when it has a class for them, the real allocator otherwise
+    static inline void* allocateSlab( size_t size, uint8_t* const pClass )
+    {
+        *pClass = 0;
+        if ( !Slab::isEnabled() ) return NULL;
+
+        return Slab::allocate( size, pClass );
+    }
+
+    // past a hard budget with budgetfail=1, or without room in the block set, the block is undone like a free and the allocation fails
+    static void* refuseBlock( MemoryManager::tagUnitNode* pNode )
+    {
+        MemoryManager::deleteUnit( pNode );
+        releaseBlock( pNode );
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    template <int MODE>
     void* _impMalloc( size_t size, bool bRecursive )
     {
-        MemoryManager::tagUnitNode* pNode = (MemoryManager::tagUnitNode*)s_pRealMalloc( size + DEF_SIZE_UNIT_NODE );
+        if ( Config::TM_OFF == MODE ) return s_pRealMalloc( size );
+
+        uint8_t sizeClass;
+        uint64_t start = profileStart();
+        MemoryManager::tagUnitNode* pNode = (MemoryManager::tagUnitNode*)allocateSlab( size + DEF_SIZE_UNIT_NODE, &sizeClass );
+        if ( NULL == pNode ) pNode = (MemoryManager::tagUnitNode*)s_pRealMalloc( size + DEF_SIZE_UNIT_NODE );
+        profileRecord( Profile::PP_ALLOCATOR, start );
 
         if ( NULL == pNode ) return NULL;
 
-        MemoryManager::appendUnit( pNode, size, false );
+        if ( NULL == MemoryManager::appendUnit( pNode, size, false, isTraced<MODE>(), sizeClass ) || !Budget::admit( pNode ) ) return refuseBlock( pNode );
+
+        if ( Config::TM_TRACE == MODE && !bRecursive )
+            fprintf( Config::output(), "===malloc: %p:%p, size: %ld\n", pNode, pNode->pData, pNode->size );
 
-#ifdef _DEBUG
-        if ( !bRecursive )
-            fprintf( stderr, "===malloc: %p:%p, size: %ld\n", pNode, pNode->pData, pNode->size );
-#endif
         return PTR_UNIT_NODE_DATA( pNode );
     }
 
+    template <int MODE>
     void* _impCalloc( size_t nmemb, size_t size, bool bRecursive )
     {
+        if ( Config::TM_OFF == MODE ) return s_pRealCalloc( nmemb, size );
+
         int needSize = nmemb * size;
-        nmemb = ceil( (double)( needSize + DEF_SIZE_UNIT_NODE ) / (double)size );
-        MemoryManager::tagUnitNode* pNode = (MemoryManager::tagUnitNode*)s_pRealCalloc( nmemb, size );
+        uint8_t sizeClass;
+        uint64_t start = profileStart();
+        MemoryManager::tagUnitNode* pNode = (MemoryManager::tagUnitNode*)allocateSlab( needSize + DEF_SIZE_UNIT_NODE, &sizeClass );
+        if ( NULL != pNode ) {
+            // recycled blocks are not zeroed like fresh pages
+            memset( PTR_UNIT_NODE_DATA( pNode ), 0, needSize );
+        } else {
+            nmemb = ceil( (double)( needSize + DEF_SIZE_UNIT_NODE ) / (double)size );
+            pNode = (MemoryManager::tagUnitNode*)s_pRealCalloc( nmemb, size );
+        }
+        profileRecord( Profile::PP_ALLOCATOR, start );
         if ( NULL == pNode ) return NULL;
         
-        MemoryManager::appendUnit( pNode, needSize, false );
+        if ( NULL == MemoryManager::appendUnit( pNode, needSize, false, isTraced<MODE>(), sizeClass ) || !Budget::admit( pNode ) ) return refuseBlock( pNode );
+
+        if ( Config::TM_TRACE == MODE && !bRecursive )
+            fprintf( Config::output(), "===calloc: %p, size: %ld\n", pNode, pNode->size );
 
-#ifdef _DEBUG
-        if ( !bRecursive )
-            fprintf(stderr, "===calloc: %p, size: %ld\n", pNode, pNode->size);
-#endif
         return PTR_UNIT_NODE_DATA( pNode );
     }
 
+    template <int MODE>
     void* _impRealloc( void *ptr, size_t size, bool bRecursive )
     {
-        MemoryManager::tagUnitNode* pNode = PTR_UNIT_NODE_HEADER( _impMalloc( size + DEF_SIZE_UNIT_NODE, true ) );
-        if ( NULL == pNode ) return NULL;
+        if ( Config::TM_OFF == MODE && !hasHeader<MODE>( ptr ) ) return s_pRealRealloc( ptr, size );
 
-        if ( NULL != ptr ) {
+        void* pData = _impMalloc<MODE>( size, true );
+        if ( NULL == pData ) return NULL;
+
+        if ( NULL != ptr && !hasHeader<MODE>( ptr ) ) {
+            // allocated while switched off, the real allocator knows its size
+            size_t usableSize = malloc_usable_size( ptr );
+            memcpy( pData, ptr, ( size <= usableSize ) ? size : usableSize );
+            s_pRealFree( ptr );
+        } else if ( NULL != ptr ) {
             MemoryManager::tagUnitNode* pNodeLast = PTR_UNIT_NODE_HEADER(ptr);
             size_t copySize = ( size <= pNodeLast->size ) ? size : pNodeLast->size;
-            memcpy( pNode->pData, pNodeLast->pData, copySize );
+            memcpy( pData, pNodeLast->pData, copySize );
+            // switched off the new block comes from the real allocator without a header to carry the chain
+            if ( Config::TM_OFF != MODE ) Growth::recordRealloc( pNodeLast, PTR_UNIT_NODE_HEADER( pData ), copySize );
 
-            _impFree( ptr, true );
+            _impFree<MODE>( ptr, true );
         }
 
-#ifdef _DEBUG
-        if ( !bRecursive )
-            fprintf(stderr, "===realloc: %p, size: %ld\n", pNode, pNode->size);
-#endif
-        return PTR_UNIT_NODE_DATA( pNode );
+        if ( Config::TM_TRACE == MODE && !bRecursive )
+            fprintf( Config::output(), "===realloc: %p, size: %ld\n", PTR_UNIT_NODE_HEADER( pData ), size );
+
+        return pData;
     }
 
+    template <int MODE>
     void* _impMemalign( size_t blocksize, size_t size, bool bRecursive )
     {
+        if ( Config::TM_OFF == MODE ) return s_pRealMemalign( blocksize, size );
+
+        uint64_t start = profileStart();
         MemoryManager::tagUnitNode* pNode = (MemoryManager::tagUnitNode*)s_pRealMemalign( blocksize, size + DEF_SIZE_UNIT_NODE );
+        profileRecord( Profile::PP_ALLOCATOR, start );
 
         if ( NULL == pNode ) return NULL;
         
-        MemoryManager::appendUnit( pNode, size, false );
+        if ( NULL == MemoryManager::appendUnit( pNode, size, false, isTraced<MODE>() ) || !Budget::admit( pNode ) ) return refuseBlock( pNode );
+
+        if ( Config::TM_TRACE == MODE && !bRecursive )
+            fprintf( Config::output(), "===memalign: %p, size: %ld\n", pNode, pNode->size );
 
-#ifdef _DEBUG
-        if ( !bRecursive )
-            fprintf(stderr, "===memalign: %p, size: %ld\n", pNode, pNode->size);
-#endif
         return PTR_UNIT_NODE_DATA( pNode );
     }
 
+    template <int MODE>
     void* _impValloc( size_t size, bool bRecursive )
     {
+        if ( Config::TM_OFF == MODE ) return s_pRealValloc( size );
+
+        uint64_t start = profileStart();
         MemoryManager::tagUnitNode* pNode = (MemoryManager::tagUnitNode*)s_pRealValloc( size + DEF_SIZE_UNIT_NODE );
+        profileRecord( Profile::PP_ALLOCATOR, start );
 
         if ( NULL == pNode ) return NULL;
         
-        MemoryManager::appendUnit( pNode, size, false );
+        if ( NULL == MemoryManager::appendUnit( pNode, size, false, isTraced<MODE>() ) || !Budget::admit( pNode ) ) return refuseBlock( pNode );
+
+        if ( Config::TM_TRACE == MODE && !bRecursive )
+            fprintf( Config::output(), "===valloc: %p, size: %ld\n", pNode, pNode->size );
 
-#ifdef _DEBUG
-        if ( !bRecursive )
-            fprintf(stderr, "===valloc: %p, size: %ld\n", pNode, pNode->size);
-#endif
         return PTR_UNIT_NODE_DATA( pNode );
     }
 
+    template <int MODE>
     void _impFree( void* ptr, bool bRecursive )
     {
         if ( NULL == ptr ) return;
+
+        if ( !hasHeader<MODE>( ptr ) ) { s_pRealFree( ptr ); return; }
+
         MemoryManager::tagUnitNode* pNode = PTR_UNIT_NODE_HEADER( ptr );
 
         if ( !MemoryManager::checkUnit( pNode ) ) return;
-#ifdef _DEBUG       
-        if ( !bRecursive )
-            fprintf(stderr, "===free: %p, size: %ld\n", pNode, pNode->size);
-#endif        
-        MemoryManager::deleteUnit( pNode );
+
+        if ( Config::TM_TRACE == MODE && !bRecursive )
+            fprintf( Config::output(), "===free: %p, size: %ld\n", pNode, pNode->size );
 
         if ( pNode->bMock ) {
+            MemoryManager::deleteUnit( pNode );
             mockMemory::_mockFree(pNode);
         } else {
-            s_pRealFree( pNode );
+            MemoryManager::releaseUnit( pNode );
         }
     }
 }
@@ -2,30 +2,51 @@
 #define __CMEMORYMANAGERH__
 
 #include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
 #include <mutex>
 #include <backtrace.h>
 
 namespace MemoryTrace
 {
     #define BACKTRACE_DEPTH     10
+    #define FREE_BATCH_MAX      512
+    #define REGISTRY_CHUNK_SLOTS    65536       // slots mapped at once from the metadata arena
+    #define REGISTRY_CHUNKS         1024
+    #define PEAK_BATCH              ( 64 * 1024 )   // bytes a thread counts before the shared peak sees them
+    #define REGION_SHIFT            16          // the crash handler finds live blocks by the 64 KiB region they start in
+    #define REGION_LEAF_BITS        16          // regions per leaf of the index, 2^16 leaves cover 48 bits
+    #define REGION_ROOT_SIZE        ( 1UL << ( 48 - REGION_SHIFT - REGION_LEAF_BITS ) )
     namespace MemoryManager
     {
-        struct tagUnitNode
+        // keep the size a multiple of 16, user data follows the header directly
+        struct __attribute__ (( aligned( 16 ) )) tagUnitNode
         {
             size_t          sync;
             bool            bMock;
+            bool            bLinked;
+            bool            bPending;       // freed, waiting in a batch for its unlink
+            uint8_t         sizeClass;      // slab class the block came from, 0 for the real allocator
+            uint32_t        tagId;          // MEMHOOK_SCOPE path, 0 when untagged
+            uint32_t        generation;     // bumped in a forked child, older blocks belong to the parent
+            uint32_t        slot;           // registry slot while linked
 
-            tagUnitNode*    pPrev;
-            tagUnitNode*    pNext;
             size_t          serial;
             
             size_t          size;
             void*           pData;
 
-            size_t          traceSize;
+            uint64_t        timestamp;
+            size_t          stackId;
+            size_t          traceHash;
+            uint32_t        traceSize;
+            uint16_t        chainLength;    // reallocs that led to this block, stops at UINT16_MAX
+            uint16_t        threadSlot;     // of the allocating thread
             void*           backtrace[ BACKTRACE_DEPTH ];
         };
 
+        // the live counters are per CPU, this is their sum as of the last getStatistics()
         struct tagUnitManager
         {
             size_t          allocCount;
@@ -33,21 +54,107 @@ namespace MemoryTrace
 
             size_t          freeCount;
             size_t          freeSize;
-            
-            tagUnitNode*    pRoot;
-            tagUnitNode*    pCurrent;
+
+            size_t          peakSize;
+        };
+
+        // what a report needs of a linked node, kept apart from the headers so a walk over every
+        // live block reads the registry sequentially instead of one scattered header per block
+        struct tagUnitSlot
+        {
+            tagUnitNode*    pNode;          // NULL while free
+            size_t          size;
+            union {
+                size_t      serial;
+                size_t      nextFree;       // index + 1 of the next free slot, 0 ends the list
+            };
+            uint64_t        timestamp;
+            size_t          stackId;
+            uint32_t        tagId;
+            bool            bMock;
+            bool            bPending;
+            uint16_t        threadSlot;     // of the allocating thread
+            uint32_t        regionNext;     // index + 1 of the neighbours in the list of its region, 0 ends it
+            uint32_t        regionPrev;
+        };
+
+        // copy of one linked node, taken under the registry lock
+        struct tagUnitRecord
+        {
+            tagUnitNode*    pNode;
+            void*           pData;
+            bool            bMock;
+            size_t          size;
+            size_t          serial;
+            uint64_t        timestamp;
+            size_t          stackId;
+            uint32_t        tagId;
+            pid_t           threadId;       // of the allocating thread, or of a thread sharing its slot
+
+            size_t          traceSize;
+            void*           backtrace[ BACKTRACE_DEPTH ];
+        };
+
+        // mmap'd, so reports can walk it without the registry lock and without the hooked allocator
+        struct tagUnitSnapshot
+        {
+            size_t          mapSize;
+            tagUnitManager  statistics;
+            size_t          count;
+            tagUnitRecord   records[];
         };
         
         void                initialize();
+        // moves the counters into caller provided storage, NULL for the built-in one,
+        // only while initializing or in a forked child
+        void                relocate( tagUnitManager* const );
+
+        // fork() keeps the registry consistent, the child starts a generation of its own in the built-in storage
+        void                forkPrepare();
+        void                forkRelease();
+        void                forkChild();
          
         void                appendUnit( tagUnitNode* );
-        const tagUnitNode*  appendUnit(void* pData, size_t size, bool isMock);
+        // NULL when the block set has no room for it, the caller undoes the block
+        const tagUnitNode*  appendUnit(void* pData, size_t size, bool isMock, bool isTraced = true, uint8_t sizeClass = 0);
         void                deleteUnit(tagUnitNode*);
+        // unlinks and hands the block to the release function in per-thread batches
+        void                releaseUnit( tagUnitNode* );
+        void                setRelease( void (*pRelease)( void* ) );
+        void                flushPending();
         bool                checkUnit(tagUnitNode*);
         void                analyse( bool autoDelete = true );
+        tagUnitSnapshot*    takeSnapshot();
+        // async-signal-safe and without the registry lock, the linked block containing pAddr or else the nearest one starting within a few regions of it
+        bool                findUnit( const void* pAddr, tagUnitRecord* const );
+        void                releaseSnapshot( tagUnitSnapshot* );
+        // sums the per-CPU counters and publishes them, NULL to publish only, async-signal-safe
+        void                getStatistics( tagUnitManager* const );
         
         void                storeBacktrace( tagUnitNode* const );    
+        // up to the configured depth without the hook's own frames, returns the frame count
+        size_t              captureBacktrace( void** const backtrace, size_t* const pHash );
         void                showBacktrace( tagUnitNode* const );
+        void                showBacktrace( void* const* backtrace, size_t traceSize );
+        size_t              hashBacktrace( void* const* backtrace, size_t traceSize );
+        size_t              skipHookFrames( void* const* backtrace, size_t traceSize );
+
+        // the C and C++ runtime, operator new and the other wrappers there are nobody's call site
+        inline bool isRuntimeModule( const char* pPath )
+        {
+            static const char* const s_names[] = { "libc.so", "libc-", "libstdc++.so", "libc++.so", "libc++abi.so", "libgcc_s.so", "ld-linux", "libpthread" };
+
+            const char* pName = strrchr( pPath, '/' );
+            pName = ( NULL == pName ) ? pPath : pName + 1;
+            for ( size_t i = 0; i < sizeof( s_names ) / sizeof( s_names[0] ); ++i ) {
+                if ( 0 == strncmp( pName, s_names[i], strlen( s_names[i] ) ) ) return true;
+            }
+            return false;
+        }
+        // code of this library, the hook's own calls are not traced
+        bool                isHookAddress( const void* );
+
+        uint64_t            timestamp();
     }; // namespace MemoryManager
    
     namespace mockMemory
@@ -55,6 +162,7 @@ namespace MemoryTrace
         void*               _mockMalloc( size_t size );
         void*               _mockCalloc( size_t nmemb, size_t size );
         void                _mockFree( void* ptr );
+        bool                _mockContains( void* ptr );
     }; // namespace _mockMemory
 
     typedef void*           (*FUNC_MALLOC)(size_t);
@@ -65,6 +173,11 @@ namespace MemoryTrace
     typedef int             (*FUNC_POSIX_MEMALIGN)(void**, size_t, size_t);
     typedef void            (*FUNC_FREE)(void* );
 
+    void                    TraceInitialize();
+    // switch=1, the hooks go straight to the real allocator while off, false when tracking cannot be switched
+    bool                    TraceSwitch( bool bOn );
+    bool                    TraceIsOn();
+
     void*                   TraceMalloc( size_t size );
     void*                   TraceCalloc( size_t nmemb, size_t size );
     void*                   TraceRealloc( void* ptr, size_t size );
@@ -72,11 +185,12 @@ namespace MemoryTrace
     void*                   TraceValloc( size_t size );
     void                    TraceFree( void* ptr );
 
-    void*                   _impMalloc( size_t size, bool bRecursive = true );
-    void*                   _impCalloc( size_t nmemb, size_t size, bool bRecursive = true );
-    void*                   _impRealloc( void* ptr, size_t size, bool bRecursive = true );
-    void*                   _impMemalign( size_t blocksize, size_t size, bool bRecursive = true );
-    void*                   _impValloc( size_t size, bool bRecursive = true );
-    void                    _impFree( void* ptr, bool bRecursive = true );
+    // MODE is a Config::TraceMode, every mode gets its own specialized path
+    template <int MODE> void*   _impMalloc( size_t size, bool bRecursive = true );
+    template <int MODE> void*   _impCalloc( size_t nmemb, size_t size, bool bRecursive = true );
+    template <int MODE> void*   _impRealloc( void* ptr, size_t size, bool bRecursive = true );
+    template <int MODE> void*   _impMemalign( size_t blocksize, size_t size, bool bRecursive = true );
+    template <int MODE> void*   _impValloc( size_t size, bool bRecursive = true );
+    template <int MODE> void    _impFree( void* ptr, bool bRecursive = true );
 }; // namespace MemoryTrace
 #endif
\ No newline at end of file
@@ -0,0 +1,180 @@
+#include <string.h>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <link.h>
+#include <sys/mman.h>
+#include "CPersist.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Persist
+    {
+        static bool             s_bEnabled      = false;
+        static tagPersistFile*  s_pFile         = NULL;
+        static volatile int64_t s_unpublished   = 0;
+
+        static uint64_t realtime()
+        {
+            struct timespec now;
+            clock_gettime( CLOCK_REALTIME, &now );
+
+            return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        }
+
+        struct tagModuleTable
+        {
+            tagPersistModule*   pModules;
+            uint32_t            capacity;
+            uint32_t            count;
+        };
+
+        static int collectModule( struct dl_phdr_info* pInfo, size_t, void* pData )
+        {
+            tagModuleTable* pTable = (tagModuleTable*)pData;
+            if ( pTable->count >= pTable->capacity ) return 1;
+
+            tagPersistModule* pModule = &pTable->pModules[ pTable->count ];
+            uint64_t begin = UINT64_MAX, end = 0;
+
+            for ( int i = 0; i < pInfo->dlpi_phnum; ++i ) {
+                const ElfW(Phdr)* pHeader = &pInfo->dlpi_phdr[i];
+                if ( PT_LOAD != pHeader->p_type || !( pHeader->p_flags & PF_X ) ) continue;
+
+                if ( pInfo->dlpi_addr + pHeader->p_vaddr < begin ) begin = pInfo->dlpi_addr + pHeader->p_vaddr;
+                if ( pInfo->dlpi_addr + pHeader->p_vaddr + pHeader->p_memsz > end ) end = pInfo->dlpi_addr + pHeader->p_vaddr + pHeader->p_memsz;
+            }
+            if ( begin >= end ) return 0;
+
+            // the main program comes without a name
+            const char* pPath = pInfo->dlpi_name;
+            char self[ PERSIST_MODULE_PATH ];
+            if ( NULL == pPath || '\0' == pPath[0] ) {
+                ssize_t length = readlink( "/proc/self/exe", self, sizeof( self ) - 1 );
+                self[ ( length > 0 ) ? length : 0 ] = '\0';
+                pPath = self;
+            }
+
+            pModule->base   = pInfo->dlpi_addr;
+            pModule->begin  = begin;
+            pModule->end    = end;
+            snprintf( pModule->path, PERSIST_MODULE_PATH, "%s", pPath );
+
+            ++pTable->count;
+            return 0;
+        }
+
+        uint32_t collectModules( tagPersistModule* const pModules, uint32_t capacity )
+        {
+            tagModuleTable table = { pModules, capacity, 0 };
+            dl_iterate_phdr( collectModule, &table );
+
+            return table.count;
+        }
+
+        void initialize()
+        {
+            const char* pPath = Config::get()->persist;
+            if ( '\0' == pPath[0] || Config::TM_OFF == Config::get()->mode ) return;
+
+            int fd = open( pPath, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+            if ( -1 == fd ) { fprintf( stderr, "memhook: can not open %s, not persisting\n", pPath ); return; }
+
+            if ( 0 != ftruncate( fd, sizeof( tagPersistFile ) ) ) { close( fd ); return; }
+
+            void* pMap = mmap( NULL, sizeof( tagPersistFile ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            close( fd );
+            if ( MAP_FAILED == pMap ) return;
+
+            s_pFile             = (tagPersistFile*)pMap;
+            s_pFile->version    = PERSIST_VERSION;
+            s_pFile->pid        = getpid();
+            s_pFile->startTime  = realtime();
+            s_pFile->updateTime = s_pFile->startTime;
+            s_pFile->state      = PS_RUNNING;
+
+            fd = open( "/proc/self/comm", O_RDONLY );
+            if ( -1 != fd ) {
+                ssize_t size = read( fd, s_pFile->command, sizeof( s_pFile->command ) - 1 );
+                if ( size > 0 && '\n' == s_pFile->command[ size - 1 ] ) s_pFile->command[ size - 1 ] = '\0';
+                close( fd );
+            }
+
+            // from here on the hook updates the shared pages directly, the kernel keeps them whatever kills the process
+            MemoryManager::relocate( &s_pFile->statistics );
+            StackDepot::relocate( s_pFile->stacks );
+            sync();
+
+            __sync_synchronize();
+            s_pFile->magic      = PERSIST_MAGIC;
+            s_bEnabled          = true;
+        }
+
+        void uninitialize()
+        {
+            if ( !s_bEnabled ) return;
+
+            sync();
+            s_pFile->state      = PS_EXITED;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void sync()
+        {
+            if ( NULL == s_pFile ) return;
+
+            // modules come and go with dlopen, the table is rewritten in place
+            s_pFile->moduleCount    = collectModules( s_pFile->modules, PERSIST_MODULES );
+            Mapping::getStatistics( &s_pFile->mapping );
+            s_unpublished           = 0;
+            publish();
+        }
+
+        void publish()
+        {
+            if ( NULL == s_pFile ) return;
+
+            MemoryManager::getStatistics( NULL );
+            s_pFile->updateTime     = realtime();
+        }
+
+        void charge( int64_t size )
+        {
+            if ( !s_bEnabled ) return;
+
+            int64_t unpublished = __sync_add_and_fetch( &s_unpublished, size );
+            // one of the threads crossing the threshold together publishes
+            if ( unpublished < PERSIST_SYNC_BYTES || !__sync_bool_compare_and_swap( &s_unpublished, unpublished, 0 ) ) return;
+
+            publish();
+        }
+
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            // the mapping is shared with the parent, the counters already left it with the new generation
+            tagPersistFile* pParent = s_pFile;
+            s_bEnabled  = false;
+            s_pFile     = NULL;
+
+            StackDepot::relocate( NULL );
+            munmap( pParent, sizeof( tagPersistFile ) );
+        }
+
+        void markCrashed( int signal )
+        {
+            if ( !s_bEnabled ) return;
+
+            MemoryManager::getStatistics( NULL );
+            s_pFile->signal     = signal;
+            s_pFile->state      = PS_CRASHED;
+        }
+    } // namespace Persist
+} // namespace MemoryTrace
@@ -0,0 +1,74 @@
+#ifndef __CPERSISTH__
+#define __CPERSISTH__
+
+#include <stdint.h>
+#include "CMemoryManager.h"
+#include "CStackDepot.h"
+#include "CMapping.h"
+
+namespace MemoryTrace
+{
+    #define PERSIST_MAGIC           0x315453495350484DULL   // "MHPSIST1"
+    #define PERSIST_VERSION         3
+    #define PERSIST_MODULES         256
+    #define PERSIST_MODULE_PATH     240
+    #define PERSIST_SYNC_PERIOD     1000000000ULL
+    #define PERSIST_SYNC_BYTES      ( 4 * 1024 * 1024 )     // allocated plus freed bytes that publish before the timer does
+    namespace Persist
+    {
+        enum PersistState
+        {
+            PS_RUNNING = 0,         // still running, or killed without a chance to say so
+            PS_EXITED,
+            PS_CRASHED,
+        };
+
+        struct tagPersistModule
+        {
+            uint64_t        base;
+            uint64_t        begin;
+            uint64_t        end;
+            char            path[ PERSIST_MODULE_PATH ];
+        };
+
+        // layout shared with memhook-postmortem, bump PERSIST_VERSION on any change
+        struct tagPersistFile
+        {
+            uint64_t        magic;
+            uint32_t        version;
+            uint32_t        pid;
+            char            command[ 32 ];
+            uint64_t        startTime;          // realtime ns
+            volatile uint64_t   updateTime;
+            volatile uint32_t   state;
+            volatile int32_t    signal;
+
+            MemoryManager::tagUnitManager   statistics;
+            Mapping::tagMappingStatistics   mapping;        // as of the last sync
+
+            uint32_t        moduleCount;
+            tagPersistModule    modules[ PERSIST_MODULES ];
+
+            StackDepot::tagStackEntry   stacks[ STACK_DEPOT_CAPACITY ];
+        };
+
+        // maps the persist file and moves the counters and the stack depot into it
+        void                initialize();
+        void                uninitialize();
+        bool                isEnabled();
+
+        // module table and update time, called by the reporter service thread
+        void                sync();
+        // counters and update time only, async-signal-safe and called from the allocation path
+        void                publish();
+        // bytes the threads counted into the per-CPU slots, publishes every PERSIST_SYNC_BYTES of them
+        void                charge( int64_t size );
+        // leaves the parent's file alone, initialize() again once the child has its own path
+        void                forkChild();
+        // async-signal-safe
+        void                markCrashed( int signal );
+        // executable ranges of the loaded modules, returns how many of them fit
+        uint32_t            collectModules( tagPersistModule* const pModules, uint32_t capacity );
+    }; // namespace Persist
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,254 @@
+#include <stdlib.h>
+#include <string.h>
+#include <cstdio>
+#include <errno.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "CPlugin.h"
+#include "CConfig.h"
+#include "CThreadSlot.h"
+#include "CStackDepot.h"
+#include "CWriter.h"
+
+namespace MemoryTrace
+{
+    namespace Plugin
+    {
+        typedef int         (*FUNC_DLCLOSE)( void* );
+
+        static bool                 s_bEnabled      = false;
+
+        // the program and the libraries it started with, code there is never a plugin's
+        static Persist::tagPersistModule    s_startup[ PERSIST_MODULES ];
+        static uint32_t             s_startupCount  = 0;
+
+        static tagPluginModule      s_modules[ PLUGIN_MODULES ];
+        static ThreadSlot::tagSpinLock  s_lockModules;
+
+        // per stack id: 0 until seen, PLUGIN_NONE or the module index + 1, and the next stack of that module
+        static uint16_t             s_stackModules[ STACK_DEPOT_CAPACITY ];
+        static uint32_t             s_nextStacks[ STACK_DEPOT_CAPACITY ];
+
+        static pthread_mutex_t      s_mutexReport   = PTHREAD_MUTEX_INITIALIZER;
+        static uint32_t             s_order[ STACK_DEPOT_CAPACITY ];
+
+        void initialize()
+        {
+            if ( !Config::get()->bUnloadReport || !Config::isTraced() ) return;
+
+            s_startupCount  = Persist::collectModules( s_startup, PERSIST_MODULES );
+            s_bEnabled      = true;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        static bool isStartup( uintptr_t pc )
+        {
+            for ( uint32_t i = 0; i < s_startupCount; ++i ) {
+                if ( pc >= s_startup[i].begin && pc < s_startup[i].end ) return true;
+            }
+            return false;
+        }
+
+        // the loaded module at base, a free entry for it when there is none yet
+        static uint16_t moduleOf( uint64_t base, const char* pPath )
+        {
+            uint16_t index = PLUGIN_NONE;
+
+            ThreadSlot::lock( &s_lockModules );
+            for ( size_t i = 0; i < PLUGIN_MODULES; ++i ) {
+                tagPluginModule* pModule = &s_modules[i];
+                if ( pModule->bLoaded && pModule->base == base ) { index = i; break; }
+                if ( PLUGIN_NONE == index && !pModule->bLoaded && 0 == pModule->head ) index = i;
+            }
+            if ( PLUGIN_NONE != index && !s_modules[ index ].bLoaded ) {
+                tagPluginModule* pModule = &s_modules[ index ];
+                pModule->base = base;
+                snprintf( pModule->path, PERSIST_MODULE_PATH, "%s", pPath );
+                pModule->bLoaded = true;
+            }
+            ThreadSlot::unlock( &s_lockModules );
+
+            return ( PLUGIN_NONE == index ) ? PLUGIN_NONE : index + 1;
+        }
+
+        // once per stack, dladdr() takes the loader lock
+        static uint16_t classify( const StackDepot::tagStackEntry* const pEntry )
+        {
+            for ( size_t frame = MemoryManager::skipHookFrames( pEntry->backtrace, pEntry->traceSize ); frame < pEntry->traceSize; ++frame ) {
+                uintptr_t pc = (uintptr_t)pEntry->backtrace[ frame ];
+                if ( isStartup( pc ) ) continue;
+
+                // generated code has no module
+                Dl_info info;
+                if ( 0 == dladdr( (void*)pc, &info ) || NULL == info.dli_fname ) continue;
+
+                return moduleOf( (uint64_t)info.dli_fbase, info.dli_fname );
+            }
+            return PLUGIN_NONE;
+        }
+
+        void recordAlloc( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || 0 == pNode->stackId || pNode->stackId > STACK_DEPOT_CAPACITY ) return;
+
+            size_t id = pNode->stackId;
+            if ( 0 != s_stackModules[ id - 1 ] ) return;
+
+            const StackDepot::tagStackEntry* pEntry = StackDepot::get( id );
+            if ( NULL == pEntry ) return;
+
+            // the thread that files the stack links it, racing ones found the same module
+            uint16_t module = classify( pEntry );
+            if ( !__sync_bool_compare_and_swap( &s_stackModules[ id - 1 ], 0, module ) || PLUGIN_NONE == module ) return;
+
+            tagPluginModule* pModule = &s_modules[ module - 1 ];
+            uint32_t head;
+            do {
+                head = pModule->head;
+                s_nextStacks[ id - 1 ] = head;
+            } while ( !__sync_bool_compare_and_swap( &pModule->head, head, (uint32_t)id ) );
+        }
+
+        // the stacks are filed again when they allocate, a module loaded again at the same address has the same stack ids
+        static void retire( tagPluginModule* const pModule )
+        {
+            ThreadSlot::lock( &s_lockModules );
+            for ( uint32_t id = pModule->head; 0 != id; id = s_nextStacks[ id - 1 ] ) s_stackModules[ id - 1 ] = 0;
+            pModule->head       = 0;
+            pModule->bLoaded    = false;
+            ThreadSlot::unlock( &s_lockModules );
+        }
+
+        // a site picked for the report with its frames, in a mapping of its own per dlclose
+        struct tagSiteText
+        {
+            uint32_t            id;
+            uint32_t            length;
+            char                text[ PLUGIN_SITE_TEXT ];
+        };
+
+        static int compareSites( const void* pLeft, const void* pRight )
+        {
+            int64_t left = StackDepot::get( *(const uint32_t*)pLeft )->liveSize, right = StackDepot::get( *(const uint32_t*)pRight )->liveSize;
+            return ( left == right ) ? 0 : ( ( left > right ) ? -1 : 1 );
+        }
+
+        static int compareTexts( const void* pLeft, const void* pRight )
+        {
+            return compareSites( &( (const tagSiteText*)pLeft )->id, &( (const tagSiteText*)pRight )->id );
+        }
+
+        // called with the report lock held while the module is mapped, the largest sites with their frames
+        static size_t render( const tagPluginModule* const pModule, tagSiteText* const pSites )
+        {
+            size_t count = 0;
+            for ( uint32_t id = ( NULL != pModule ) ? pModule->head : 0; 0 != id; id = s_nextStacks[ id - 1 ] ) {
+                const StackDepot::tagStackEntry* pEntry = StackDepot::get( id );
+                if ( NULL != pEntry && pEntry->liveCount > 0 ) s_order[ count++ ] = id;
+            }
+            qsort( s_order, count, sizeof( uint32_t ), compareSites );
+            if ( count > PLUGIN_REPORT_MAX ) count = PLUGIN_REPORT_MAX;
+
+            for ( size_t i = 0; i < count; ++i ) {
+                const StackDepot::tagStackEntry* pEntry = StackDepot::get( s_order[i] );
+                pSites[i].id        = s_order[i];
+                pSites[i].length    = Writer::renderBacktrace( pEntry->backtrace, pEntry->traceSize, pSites[i].text, PLUGIN_SITE_TEXT );
+            }
+            return count;
+        }
+
+        // called with the report lock held once the module is gone, a module that never allocated has no entry
+        // and only a summary. frees by its destructors are counted, a site they emptied is left out
+        static void report( const tagPluginModule* const pModule, const char* pPath, tagSiteText* const pSites, size_t count )
+        {
+            size_t siteCount = 0;
+            int64_t liveCount = 0, liveSize = 0;
+            for ( uint32_t id = ( NULL != pModule ) ? pModule->head : 0; 0 != id; id = s_nextStacks[ id - 1 ] ) {
+                const StackDepot::tagStackEntry* pEntry = StackDepot::get( id );
+                if ( NULL == pEntry || pEntry->liveCount <= 0 ) continue;
+
+                liveCount   += pEntry->liveCount;
+                liveSize    += pEntry->liveSize;
+                ++siteCount;
+            }
+            qsort( pSites, count, sizeof( tagSiteText ), compareTexts );
+
+            Writer::begin();
+            fprintf( Config::output(), "plugin unload: %s, live count: %ld, live size: %ld, sites: %ld\n", pPath, liveCount, liveSize, siteCount );
+            for ( size_t i = 0, shown = 0; i < count; ++i ) {
+                const StackDepot::tagStackEntry* pEntry = StackDepot::get( pSites[i].id );
+                if ( pEntry->liveCount <= 0 ) continue;
+
+                fprintf( Config::output(), "++++++++++++++ #%ld live count: %ld, live size: %ld ++++++++++++++\n", shown++, pEntry->liveCount, pEntry->liveSize );
+                Writer::writeRendered( pSites[i].text, pSites[i].length );
+                fprintf( Config::output(), "++++++++++++++ end ++++++++++++++\n" );
+            }
+            Writer::end();
+        }
+
+        int dlclose( void* handle )
+        {
+            static FUNC_DLCLOSE s_pReal = NULL;
+            if ( NULL == s_pReal && NULL == ( s_pReal = (FUNC_DLCLOSE)dlsym( RTLD_NEXT, "dlclose" ) ) ) { errno = ENOSYS; return -1; }
+
+            if ( !s_bEnabled ) return s_pReal( handle );
+
+            // the module is found by the start of its mapping, like the stacks were filed
+            struct link_map* pMap = NULL;
+            Dl_info info;
+            if ( 0 != dlinfo( handle, RTLD_DI_LINKMAP, &pMap ) || NULL == pMap || 0 == dladdr( pMap->l_ld, &info ) ) return s_pReal( handle );
+
+            uint64_t base = (uint64_t)info.dli_fbase;
+            tagPluginModule* pModule = NULL;
+            for ( size_t i = 0; i < PLUGIN_MODULES && NULL == pModule; ++i ) {
+                if ( s_modules[i].bLoaded && s_modules[i].base == base ) pModule = &s_modules[i];
+            }
+
+            // the name goes with the link map, whether this call unloads is only known after it
+            char path[ PERSIST_MODULE_PATH ];
+            snprintf( path, sizeof( path ), "%s", ( NULL != pModule ) ? pModule->path : pMap->l_name );
+
+            size_t mapSize = PLUGIN_REPORT_MAX * sizeof( tagSiteText );
+            tagSiteText* pSites = (tagSiteText*)mmap( NULL, mapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            size_t count = 0;
+            if ( MAP_FAILED == pSites ) pSites = NULL;
+
+            if ( NULL != pSites ) {
+                pthread_mutex_lock( &s_mutexReport );
+                count = render( pModule, pSites );
+                pthread_mutex_unlock( &s_mutexReport );
+            }
+
+            // destructors of the module may dlclose in turn, no lock is held across
+            int result = s_pReal( handle );
+
+            if ( 0 == result && ( 0 == dladdr( (void*)base, &info ) || (uint64_t)info.dli_fbase != base ) ) {
+                if ( NULL != pSites ) {
+                    pthread_mutex_lock( &s_mutexReport );
+                    report( pModule, path, pSites, count );
+                    pthread_mutex_unlock( &s_mutexReport );
+                }
+                if ( NULL != pModule ) retire( pModule );
+            }
+
+            if ( NULL != pSites ) munmap( pSites, mapSize );
+            return result;
+        }
+
+        void forkPrepare()
+        {
+            pthread_mutex_lock( &s_mutexReport );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+    } // namespace Plugin
+} // namespace MemoryTrace
@@ -0,0 +1,43 @@
+#ifndef __CPLUGINH__
+#define __CPLUGINH__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CMemoryManager.h"
+#include "CPersist.h"
+
+namespace MemoryTrace
+{
+    #define PLUGIN_MODULES          64
+    #define PLUGIN_NONE             0xFFFF      // the stack has no frame in a plugin
+    #define PLUGIN_REPORT_MAX       64
+    #define PLUGIN_SITE_TEXT        4096        // frames of a reported site, rendered while the module is mapped
+    namespace Plugin
+    {
+        // a module that was not loaded yet when the hook started, its call sites are a list through the stack ids
+        struct tagPluginModule
+        {
+            uint64_t            base;           // dli_fbase
+            volatile bool       bLoaded;
+            volatile uint32_t   head;           // first stack id, 0 ends the list
+            char                path[ PERSIST_MODULE_PATH ];
+        };
+
+        // unload=1, the stacks need mode=sample or mode=full
+        void                initialize();
+        bool                isEnabled();
+
+        // files a stack seen for the first time under the plugin of its innermost frame in one,
+        // frames in the program and the libraries it started with are passed over
+        void                recordAlloc( const MemoryManager::tagUnitNode* const );
+
+        // the real dlclose, then the live blocks of the module by call site once it is unmapped. the sites are
+        // symbolized before, the counts taken after its destructors ran. a dlclose that leaves it loaded reports nothing
+        int                 dlclose( void* handle );
+
+        // report lock held across fork()
+        void                forkPrepare();
+        void                forkRelease();
+    }; // namespace Plugin
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,189 @@
+#include <string.h>
+#include <cstdio>
+#include <time.h>
+#include "CProfile.h"
+#include "CThreadSlot.h"
+#include "CConfig.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace Profile
+    {
+        struct tagProfileSlot
+        {
+            tagHistogram    histograms[ PO_COUNT ][ PP_COUNT ];
+        };
+
+        static bool             s_bEnabled      = false;
+        static tagProfileSlot*  s_slots         = NULL;     // metadata arena, only when enabled
+
+        // where the TSC and the clock stood at initialize(), the report converts with their rates
+        static uint64_t         s_startCycles   = 0;
+        static uint64_t         s_startTime     = 0;
+
+        static __thread int     t_op __attribute__ (( tls_model( "initial-exec" ) )) = PO_COUNT;
+        static __thread int     t_depth __attribute__ (( tls_model( "initial-exec" ) )) = 0;
+
+        static const char* const s_operations[ PO_COUNT ]  = { "malloc", "calloc", "realloc", "memalign", "valloc", "free" };
+        static const char* const s_phases[ PP_COUNT ]      = { "total", "lock wait", "backtrace", "registry", "allocator" };
+
+        static uint64_t monotonic()
+        {
+            struct timespec now;
+            clock_gettime( CLOCK_MONOTONIC, &now );
+
+            return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        }
+
+        static inline uint64_t cycles()
+        {
+#if defined( __x86_64__ ) || defined( __i386__ )
+            return __builtin_ia32_rdtsc();
+#else
+            return monotonic();
+#endif
+        }
+
+        static inline size_t bucketOf( uint64_t value )
+        {
+            size_t bucket = ( 0 == value ) ? 0 : 64 - __builtin_clzl( value );
+            return ( bucket < PROFILE_BUCKETS ) ? bucket : PROFILE_BUCKETS - 1;
+        }
+
+        static inline void add( tagHistogram* pHistogram, uint64_t value )
+        {
+            pHistogram->count++;
+            pHistogram->cycles += value;
+            if ( value > pHistogram->max ) pHistogram->max = value;
+            pHistogram->buckets[ bucketOf( value ) ]++;
+        }
+
+        void initialize()
+        {
+            if ( !Config::get()->bProfile || Config::TM_OFF == Config::get()->mode ) return;
+
+            s_slots         = (tagProfileSlot*)Arena::allocate( MAX_THREAD_SLOT * sizeof( tagProfileSlot ) );
+            s_startCycles   = cycles();
+            s_startTime     = monotonic();
+            s_bEnabled      = NULL != s_slots;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            memset( s_slots, 0, MAX_THREAD_SLOT * sizeof( tagProfileSlot ) );
+        }
+
+        uint64_t begin( Operation op )
+        {
+            if ( !s_bEnabled ) return 0;
+
+            if ( 0 == t_depth++ ) t_op = op;
+            return cycles();
+        }
+
+        void end( Operation op, uint64_t start )
+        {
+            if ( 0 == start ) return;
+
+            if ( 0 == --t_depth ) {
+                add( &s_slots[ ThreadSlot::current() ].histograms[ op ][ PP_TOTAL ], cycles() - start );
+                t_op = PO_COUNT;
+            }
+        }
+
+        uint64_t start()
+        {
+            return ( PO_COUNT == t_op ) ? 0 : cycles();
+        }
+
+        void record( Phase phase, uint64_t start )
+        {
+            if ( 0 == start || PO_COUNT == t_op ) return;
+
+            add( &s_slots[ ThreadSlot::current() ].histograms[ t_op ][ phase ], cycles() - start );
+        }
+
+        // upper bound of the bucket that holds the rank-th value
+        static uint64_t percentile( const uint64_t* const buckets, uint64_t count, double fraction )
+        {
+            uint64_t rank = (uint64_t)( count * fraction );
+            uint64_t seen = 0;
+
+            for ( size_t i = 0; i < PROFILE_BUCKETS; ++i ) {
+                seen += buckets[i];
+                if ( seen > rank ) return ( 0 == i ) ? 0 : ( 1ULL << i ) - 1;
+            }
+            return ( 1ULL << ( PROFILE_BUCKETS - 1 ) ) - 1;
+        }
+
+        void summarize( Operation op, Phase phase, tagProfileSummary* const pSummary )
+        {
+            memset( pSummary, 0, sizeof( *pSummary ) );
+            if ( !s_bEnabled ) return;
+
+            uint64_t buckets[ PROFILE_BUCKETS ];
+            memset( buckets, 0, sizeof( buckets ) );
+
+            for ( size_t i = 0; i < ThreadSlot::count(); ++i ) {
+                const tagHistogram* pHistogram = &s_slots[i].histograms[ op ][ phase ];
+
+                pSummary->count     += pHistogram->count;
+                pSummary->cycles    += pHistogram->cycles;
+                if ( pHistogram->max > pSummary->max ) pSummary->max = pHistogram->max;
+                for ( size_t b = 0; b < PROFILE_BUCKETS; ++b ) buckets[b] += pHistogram->buckets[b];
+            }
+
+            if ( 0 == pSummary->count ) return;
+
+            pSummary->p50   = percentile( buckets, pSummary->count, 0.5 );
+            pSummary->p99   = percentile( buckets, pSummary->count, 0.99 );
+            pSummary->p999  = percentile( buckets, pSummary->count, 0.999 );
+        }
+
+        double cyclesPerUs()
+        {
+#if defined( __x86_64__ ) || defined( __i386__ )
+            uint64_t elapsed = monotonic() - s_startTime;
+            return ( 0 == elapsed ) ? 0 : (double)( cycles() - s_startCycles ) * 1000 / elapsed;
+#else
+            return 0;
+#endif
+        }
+
+        void report()
+        {
+            if ( !s_bEnabled ) return;
+
+            double rate = cyclesPerUs();
+            fprintf( Config::output(), "hook cost ( %s )\n", ( 0 == rate ) ? "ns" : "cycles" );
+            if ( 0 != rate ) fprintf( Config::output(), "\tcycles per us: %.0f\n", rate );
+            fprintf( Config::output(), "\t%-10s %-10s %12s %10s %10s %10s %10s %12s\n", "operation", "phase", "count", "mean", "p50", "p99", "p99.9", "max" );
+
+            for ( size_t op = 0; op < PO_COUNT; ++op ) {
+                for ( size_t phase = 0; phase < PP_COUNT; ++phase ) {
+                    tagProfileSummary summary;
+                    summarize( (Operation)op, (Phase)phase, &summary );
+                    if ( 0 == summary.count ) continue;
+
+                    fprintf( Config::output(), "\t%-10s %-10s %12lu %10lu %10lu %10lu %10lu %12lu\n", \
+                                    s_operations[ op ], \
+                                    s_phases[ phase ], \
+                                    summary.count, \
+                                    summary.cycles / summary.count, \
+                                    summary.p50, \
+                                    summary.p99, \
+                                    summary.p999, \
+                                    summary.max );
+                }
+            }
+        }
+    } // namespace Profile
+} // namespace MemoryTrace
@@ -0,0 +1,73 @@
+#ifndef __CPROFILEH__
+#define __CPROFILEH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MemoryTrace
+{
+    #define PROFILE_BUCKETS         40          // log2 of the cycles, the last one takes everything longer
+    namespace Profile
+    {
+        // profile=1, the hook's own cost per operation, split into the phases a slow call can be blamed on.
+        // one histogram per thread slot, written by that thread without a lock, so slots shared past
+        // MAX_THREAD_SLOT threads may lose the odd count
+        enum Operation
+        {
+            PO_MALLOC = 0,
+            PO_CALLOC,
+            PO_REALLOC,
+            PO_MEMALIGN,
+            PO_VALLOC,
+            PO_FREE,
+            PO_COUNT,
+        };
+
+        enum Phase
+        {
+            PP_TOTAL = 0,       // the whole hooked call
+            PP_LOCK,            // waiting for the registry lock
+            PP_BACKTRACE,       // capturing and interning the backtrace
+            PP_REGISTRY,        // slot taken or given back under the lock
+            PP_ALLOCATOR,       // real allocator or slab backend
+            PP_COUNT,
+        };
+
+        struct tagHistogram
+        {
+            uint64_t        count;
+            uint64_t        cycles;
+            uint64_t        max;
+            uint64_t        buckets[ PROFILE_BUCKETS ];
+        };
+
+        struct tagProfileSummary
+        {
+            uint64_t        count;
+            uint64_t        cycles;
+            uint64_t        max;
+            uint64_t        p50;            // upper bound of the bucket
+            uint64_t        p99;
+            uint64_t        p999;
+        };
+
+        void                initialize();
+        bool                isEnabled();
+        // the child's histograms start empty, the parent's costs are in the parent's report
+        void                forkChild();
+
+        // around a hooked call, nested calls of the hook count towards the outer one. 0 when off
+        uint64_t            begin( Operation );
+        void                end( Operation, uint64_t start );
+        // around a phase, 0 and nothing recorded outside a profiled call
+        uint64_t            start();
+        void                record( Phase, uint64_t start );
+
+        // all thread slots merged, a call recorded meanwhile may show in the count but not yet in the cycles
+        void                summarize( Operation, Phase, tagProfileSummary* const );
+        // TSC cycles per microsecond since initialize(), 0 when cycles are nanoseconds already
+        double              cyclesPerUs();
+        void                report();
+    }; // namespace Profile
+}; // namespace MemoryTrace
+#endif
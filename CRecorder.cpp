@@ -0,0 +1,216 @@
+#include <string.h>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "CRecorder.h"
+#include "CMemoryManager.h"
+#include "CThreadSlot.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Recorder
+    {
+        struct tagRecordBuffer
+        {
+            ThreadSlot::tagSpinLock lock;
+            uint32_t        count;
+            uint32_t        bytes;
+            uint64_t        baseTime;
+            uint64_t        lastTime;
+            uint64_t        lastAddr;
+            pid_t           lastTid;
+            uint8_t         data[ RECORD_BUFFER_SIZE ];
+        };
+
+        static bool             s_bEnabled      = false;
+        static int              s_fd            = -1;
+        static tagRecordBuffer  s_buffers[ MAX_THREAD_SLOT ];
+
+        static pthread_mutex_t  s_mutexWrite    = PTHREAD_MUTEX_INITIALIZER;
+
+        static __thread pid_t   t_tid __attribute__ (( tls_model( "initial-exec" ) )) = 0;
+
+        static bool writeAll( const void* pData, size_t size )
+        {
+            const char* pPos = (const char*)pData;
+
+            while ( size > 0 ) {
+                ssize_t written = write( s_fd, pPos, size );
+                if ( written <= 0 ) return false;
+                pPos += written;
+                size -= written;
+            }
+            return true;
+        }
+
+        // called with the buffer locked, chunks of different slots never interleave in the file
+        static void flush( tagRecordBuffer* const pBuffer )
+        {
+            if ( 0 == pBuffer->count ) return;
+
+            tagRecordChunk chunk;
+            chunk.count     = pBuffer->count;
+            chunk.bytes     = pBuffer->bytes;
+            chunk.baseTime  = pBuffer->baseTime;
+
+            pthread_mutex_lock( &s_mutexWrite );
+            if ( !writeAll( &chunk, sizeof( chunk ) ) || !writeAll( pBuffer->data, pBuffer->bytes ) ) {
+                fprintf( stderr, "memhook: recording to %s failed, stopped\n", Config::get()->record );
+                s_bEnabled = false;
+            }
+            pthread_mutex_unlock( &s_mutexWrite );
+
+            pBuffer->count  = 0;
+            pBuffer->bytes  = 0;
+        }
+
+        static inline void putNumber( tagRecordBuffer* const pBuffer, uint64_t number )
+        {
+            while ( number >= 0x80 ) {
+                pBuffer->data[ pBuffer->bytes++ ] = (uint8_t)( number | 0x80 );
+                number >>= 7;
+            }
+            pBuffer->data[ pBuffer->bytes++ ] = (uint8_t)number;
+        }
+
+        static inline void putAddress( tagRecordBuffer* const pBuffer, const void* ptr )
+        {
+            int64_t delta = (int64_t)( (uint64_t)(uintptr_t)ptr - pBuffer->lastAddr );
+
+            putNumber( pBuffer, ( (uint64_t)delta << 1 ) ^ (uint64_t)( delta >> 63 ) );
+            pBuffer->lastAddr = (uint64_t)(uintptr_t)ptr;
+        }
+
+        // locks the slot buffer and writes the common part of an event, the caller adds the operands and unlocks
+        static tagRecordBuffer* beginEvent( RecordOp op )
+        {
+            if ( 0 == t_tid ) t_tid = (pid_t)syscall( SYS_gettid );
+
+            tagRecordBuffer* pBuffer = &s_buffers[ ThreadSlot::current() ];
+            ThreadSlot::lock( &pBuffer->lock );
+
+            if ( pBuffer->bytes + RECORD_EVENT_MAX > RECORD_BUFFER_SIZE ) flush( pBuffer );
+
+            // taken under the lock, so times only grow inside a chunk
+            uint64_t now = MemoryManager::timestamp();
+            if ( 0 == pBuffer->count ) {
+                pBuffer->baseTime   = now;
+                pBuffer->lastTime   = now;
+                pBuffer->lastAddr   = 0;
+                pBuffer->lastTid    = 0;
+            }
+
+            bool bNewThread = pBuffer->lastTid != t_tid;
+            pBuffer->data[ pBuffer->bytes++ ] = (uint8_t)( op | ( bNewThread ? OP_THREAD : 0 ) );
+            putNumber( pBuffer, now - pBuffer->lastTime );
+            if ( bNewThread ) putNumber( pBuffer, t_tid );
+
+            pBuffer->lastTime   = now;
+            pBuffer->lastTid    = t_tid;
+            pBuffer->count++;
+
+            return pBuffer;
+        }
+
+        void initialize()
+        {
+            const char* pPath = Config::get()->record;
+            if ( '\0' == pPath[0] ) return;
+
+            s_fd = open( pPath, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+            if ( -1 == s_fd ) { fprintf( stderr, "memhook: can not open %s, not recording\n", pPath ); return; }
+
+            tagRecordHeader header;
+            header.magic        = RECORD_MAGIC;
+            header.version      = RECORD_VERSION;
+            header.pid          = getpid();
+            header.startTime    = MemoryManager::timestamp();
+
+            if ( !writeAll( &header, sizeof( header ) ) ) { close( s_fd ); s_fd = -1; return; }
+
+            s_bEnabled = true;
+        }
+
+        void uninitialize()
+        {
+            if ( !s_bEnabled ) return;
+
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) {
+                ThreadSlot::lock( &s_buffers[i].lock );
+                flush( &s_buffers[i] );
+                ThreadSlot::unlock( &s_buffers[i].lock );
+            }
+
+            // whatever still runs after the last flush is not recorded
+            s_bEnabled = false;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void recordAlloc( RecordOp op, const void* ptr, size_t size, size_t alignment )
+        {
+            if ( !s_bEnabled || NULL == ptr ) return;
+
+            tagRecordBuffer* pBuffer = beginEvent( op );
+            putAddress( pBuffer, ptr );
+            putNumber( pBuffer, size );
+            if ( OP_MEMALIGN == op ) putNumber( pBuffer, alignment );
+            ThreadSlot::unlock( &pBuffer->lock );
+        }
+
+        void recordRealloc( const void* oldPtr, const void* ptr, size_t size, uint64_t start )
+        {
+            if ( !s_bEnabled || NULL == ptr ) return;
+
+            tagRecordBuffer* pBuffer = beginEvent( OP_REALLOC );
+            putAddress( pBuffer, oldPtr );
+            putAddress( pBuffer, ptr );
+            putNumber( pBuffer, size );
+            putNumber( pBuffer, ( pBuffer->lastTime > start ) ? pBuffer->lastTime - start : 0 );
+            ThreadSlot::unlock( &pBuffer->lock );
+        }
+
+        void recordFree( const void* ptr )
+        {
+            if ( !s_bEnabled || NULL == ptr ) return;
+
+            tagRecordBuffer* pBuffer = beginEvent( OP_FREE );
+            putAddress( pBuffer, ptr );
+            ThreadSlot::unlock( &pBuffer->lock );
+        }
+
+        void forkPrepare()
+        {
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::lock( &s_buffers[i].lock );
+            pthread_mutex_lock( &s_mutexWrite );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexWrite );
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::unlock( &s_buffers[i].lock );
+        }
+
+        // the copied buffers are events of the parent, initialize() again records the child into a file of its own
+        void forkChild()
+        {
+            if ( !s_bEnabled ) return;
+
+            s_bEnabled = false;
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) {
+                s_buffers[i].count  = 0;
+                s_buffers[i].bytes  = 0;
+            }
+
+            close( s_fd );
+            s_fd    = -1;
+            t_tid   = 0;
+        }
+    } // namespace Recorder
+} // namespace MemoryTrace
@@ -0,0 +1,67 @@
+#ifndef __CRECORDERH__
+#define __CRECORDERH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MemoryTrace
+{
+    #define RECORD_MAGIC            0x3145434152544D4DULL   // "MMTRACE1"
+    #define RECORD_VERSION          1
+    #define RECORD_BUFFER_SIZE      ( 16 * 1024 )
+    #define RECORD_EVENT_MAX        64
+    namespace Recorder
+    {
+        // file layout shared with memhook-replay, bump RECORD_VERSION on any change
+        enum RecordOp
+        {
+            OP_MALLOC = 1,
+            OP_CALLOC,
+            OP_REALLOC,
+            OP_MEMALIGN,
+            OP_VALLOC,
+            OP_FREE,
+
+            OP_MASK             = 0x07,
+            OP_THREAD           = 0x08,     // the thread id follows, it changed since the last event of the chunk
+        };
+
+        struct tagRecordHeader
+        {
+            uint64_t        magic;
+            uint32_t        version;
+            uint32_t        pid;
+            uint64_t        startTime;
+        };
+
+        // followed by bytes of events, all fields are LEB128 varints:
+        //   op, time delta to the previous event, [tid], then per op
+        //   malloc/calloc/valloc:  addr, size
+        //   memalign:              addr, size, alignment
+        //   realloc:               old addr, addr, size, duration of the call
+        //   free:                  addr
+        // addresses are zigzag deltas to the previous address of the chunk, every chunk starts from zero
+        struct tagRecordChunk
+        {
+            uint32_t        count;
+            uint32_t        bytes;
+            uint64_t        baseTime;
+        };
+
+        void                initialize();
+        void                uninitialize();
+        bool                isEnabled();
+
+        // buffer locks held across fork(), the child drops the parent's events and file
+        void                forkPrepare();
+        void                forkRelease();
+        void                forkChild();
+
+        // frees are recorded before the block goes back, allocations after they returned,
+        // so a reused address is always seen freed first
+        void                recordAlloc( RecordOp op, const void* ptr, size_t size, size_t alignment = 0 );
+        void                recordRealloc( const void* oldPtr, const void* ptr, size_t size, uint64_t start );
+        void                recordFree( const void* ptr );
+    }; // namespace Recorder
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,207 @@
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include "CReporter.h"
+#include "CConfig.h"
+#include "CMemoryManager.h"
+#include "CHeavyHitter.h"
+#include "CChurn.h"
+#include "CSizeClass.h"
+#include "CStatPage.h"
+#include "CLeakSuspect.h"
+#include "CPersist.h"
+#include "CTag.h"
+#include "CCollector.h"
+#include "CMapping.h"
+#include "CArena.h"
+#include "CSlab.h"
+#include "CProfile.h"
+#include "CSnapshot.h"
+#include "CWriter.h"
+#include "CBudget.h"
+#include "CGrowth.h"
+
+namespace MemoryTrace
+{
+    namespace Reporter
+    {
+        static sem_t            s_semTrigger;
+        static bool             s_bService      = false;
+        static pthread_mutex_t  s_mutexReport   = PTHREAD_MUTEX_INITIALIZER;
+
+        static void signalTrigger( int )
+        {
+            trigger();
+        }
+
+        void initialize()
+        {
+            const Config::tagConfig* pConfig = Config::get();
+            if ( Config::TM_OFF == pConfig->mode ) return;
+
+            sem_init( &s_semTrigger, 0, 0 );
+
+            if ( ( pConfig->reportTriggers & Config::RT_SIGNAL ) && pConfig->reportSignal > 0 ) {
+                struct sigaction action;
+                sigemptyset( &action.sa_mask );
+                action.sa_handler   = signalTrigger;
+                action.sa_flags     = SA_RESTART;
+                sigaction( pConfig->reportSignal, &action, NULL );
+            }
+
+            s_bService = ( pConfig->reportTriggers & ( Config::RT_SIGNAL | Config::RT_PERIOD ) ) || pConfig->statsPeriod > 0 ||
+                         LeakSuspect::isEnabled() || Persist::isEnabled() || Collector::isEnabled() || Budget::isEnabled();
+        }
+
+        void trigger()
+        {
+            if ( s_bService ) sem_post( &s_semTrigger );
+        }
+
+        void report()
+        {
+            if ( Config::TM_OFF == Config::get()->mode ) return;
+
+            pthread_mutex_lock( &s_mutexReport );
+            Writer::begin();
+            MemoryManager::analyse( false );
+            Snapshot::write();
+            Mapping::report();
+            HeavyHitter::report();
+            Churn::report();
+            Growth::report();
+            SizeClass::report();
+            Tag::report();
+            Budget::report();
+            Profile::report();
+            Slab::report();
+            Arena::report();
+            Writer::end();
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+
+        static bool waitTrigger( uint64_t timeout )
+        {
+            if ( UINT64_MAX == timeout ) {
+                while ( 0 != sem_wait( &s_semTrigger ) ) ;
+                return true;
+            }
+
+            struct timespec deadline;
+            clock_gettime( CLOCK_REALTIME, &deadline );
+            uint64_t nsec       = deadline.tv_nsec + timeout;
+            deadline.tv_sec     += nsec / 1000000000;
+            deadline.tv_nsec    = nsec % 1000000000;
+
+            while ( 0 != sem_timedwait( &s_semTrigger, &deadline ) ) {
+                if ( ETIMEDOUT == errno ) return false;
+            }
+            return true;
+        }
+
+        static void* serviceThread( void* )
+        {
+            const Config::tagConfig* pConfig = Config::get();
+
+            uint64_t reportPeriod   = ( pConfig->reportTriggers & Config::RT_PERIOD ) ? pConfig->reportPeriod * 1000000000ULL : 0;
+            uint64_t statsPeriod    = pConfig->statsPeriod * 1000000ULL;
+            uint64_t now            = MemoryManager::timestamp();
+            uint64_t nextReport     = ( reportPeriod > 0 ) ? now + reportPeriod : UINT64_MAX;
+            uint64_t nextStats      = ( statsPeriod > 0 ) ? now : UINT64_MAX;
+            uint64_t nextLeak       = LeakSuspect::isEnabled() ? now + LeakSuspect::window() : UINT64_MAX;
+            uint64_t nextPersist    = Persist::isEnabled() ? now + PERSIST_SYNC_PERIOD : UINT64_MAX;
+            uint64_t collectPeriod  = pConfig->collectPeriod * 1000000ULL;
+            uint64_t nextCollect    = Collector::isEnabled() ? now : UINT64_MAX;
+            uint64_t nextBudget     = Budget::isEnabled() ? now + BUDGET_PERIOD : UINT64_MAX;
+
+            for ( ;; ) {
+                now = MemoryManager::timestamp();
+                uint64_t deadline = ( nextReport < nextStats ) ? nextReport : nextStats;
+                if ( nextLeak < deadline ) deadline = nextLeak;
+                if ( nextPersist < deadline ) deadline = nextPersist;
+                if ( nextCollect < deadline ) deadline = nextCollect;
+                if ( nextBudget < deadline ) deadline = nextBudget;
+
+                if ( now < deadline && waitTrigger( ( UINT64_MAX == deadline ) ? UINT64_MAX : deadline - now ) ) {
+                    report();
+                    continue;
+                }
+
+                now = MemoryManager::timestamp();
+                if ( now >= nextStats ) {
+                    StatPage::publish();
+                    nextStats = now + statsPeriod;
+                }
+                if ( now >= nextPersist ) {
+                    Persist::sync();
+                    nextPersist = now + PERSIST_SYNC_PERIOD;
+                }
+                if ( now >= nextCollect ) {
+                    Collector::push();
+                    nextCollect = now + collectPeriod;
+                }
+                if ( now >= nextBudget ) {
+                    Budget::tick();
+                    nextBudget = now + BUDGET_PERIOD;
+                }
+                if ( now >= nextLeak ) {
+                    LeakSuspect::tick();
+                    nextLeak += LeakSuspect::window();
+                }
+                if ( now >= nextReport ) {
+                    report();
+                    nextReport = now + reportPeriod;
+                }
+            }
+
+            return NULL;
+        }
+
+        void start()
+        {
+            if ( !s_bService ) return;
+
+            // keep report signals on the threads of the application
+            sigset_t mask, old;
+            sigfillset( &mask );
+            pthread_sigmask( SIG_SETMASK, &mask, &old );
+
+            pthread_t thread;
+            if ( 0 == pthread_create( &thread, NULL, serviceThread, NULL ) )
+                pthread_detach( thread );
+
+            pthread_sigmask( SIG_SETMASK, &old, NULL );
+        }
+
+        void forkPrepare()
+        {
+            pthread_mutex_lock( &s_mutexReport );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+
+        void forkChild()
+        {
+            if ( !s_bService ) return;
+
+            // the semaphore may have been in use by the thread that did not survive
+            sem_destroy( &s_semTrigger );
+            sem_init( &s_semTrigger, 0, 0 );
+            start();
+        }
+
+        // started after the hook is initialized so the thread's own allocations are ordinary ones
+        __attribute__ (( constructor( 103 ) ))
+        static void startService()
+        {
+            TraceInitialize();
+            start();
+        }
+    } // namespace Reporter
+} // namespace MemoryTrace
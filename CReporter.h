@@ -0,0 +1,21 @@
+#ifndef __CREPORTERH__
+#define __CREPORTERH__
+
+namespace MemoryTrace
+{
+    namespace Reporter
+    {
+        void                initialize();
+        void                start();
+
+        // async-signal-safe, wakes the service thread to write a report
+        void                trigger();
+        void                report();
+
+        // a report is never cut in half by fork(), the child starts its own service thread
+        void                forkPrepare();
+        void                forkRelease();
+        void                forkChild();
+    }; // namespace Reporter
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <string.h>
+#include <cstdio>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "CSizeClass.h"
+#include "CThreadSlot.h"
+#include "CConfig.h"
+#include "CArena.h"
+#include "CSlab.h"
+
+namespace MemoryTrace
+{
+    namespace SizeClass
+    {
+        struct tagSizeSlot
+        {
+            ThreadSlot::tagSpinLock lock;
+            tagSizeHistogram        histogram;
+        };
+
+        static bool                 s_bEnabled      = false;
+        static tagSizeSlot*         s_slots         = NULL;     // metadata arena, only when enabled
+
+        static pthread_mutex_t      s_mutexReport   = PTHREAD_MUTEX_INITIALIZER;
+        static tagSizeHistogram     s_merged;
+
+        void initialize()
+        {
+            if ( !Config::get()->bSizeClass || Config::TM_OFF == Config::get()->mode ) return;
+
+            s_slots     = (tagSizeSlot*)Arena::allocate( MAX_THREAD_SLOT * sizeof( tagSizeSlot ) );
+            s_bEnabled  = NULL != s_slots;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        size_t classOf( size_t size )
+        {
+            if ( size < ( 1UL << SIZE_CLASS_SUB_BITS ) ) return size;
+
+            size_t exponent = 63 - __builtin_clzl( size );
+            size_t sub      = ( size >> ( exponent - SIZE_CLASS_SUB_BITS ) ) & ( ( 1UL << SIZE_CLASS_SUB_BITS ) - 1 );
+            size_t index    = ( ( exponent - SIZE_CLASS_SUB_BITS + 1 ) << SIZE_CLASS_SUB_BITS ) + sub;
+
+            return ( index < SIZE_CLASS_COUNT ) ? index : SIZE_CLASS_COUNT - 1;
+        }
+
+        size_t classBase( size_t sizeClass )
+        {
+            if ( sizeClass < ( 1UL << SIZE_CLASS_SUB_BITS ) ) return sizeClass;
+
+            size_t exponent = ( sizeClass >> SIZE_CLASS_SUB_BITS ) + SIZE_CLASS_SUB_BITS - 1;
+            size_t sub      = sizeClass & ( ( 1UL << SIZE_CLASS_SUB_BITS ) - 1 );
+
+            return ( ( 1UL << SIZE_CLASS_SUB_BITS ) + sub ) << ( exponent - SIZE_CLASS_SUB_BITS );
+        }
+
+        // bytes the allocator handed out beyond header and request
+        static size_t wasteOf( const MemoryManager::tagUnitNode* const pNode )
+        {
+            // a slab block is as large as its class, the real allocator has no chunk header in front of it
+            size_t usable = ( 0 != pNode->sizeClass ) ? Slab::classSize( pNode->sizeClass - 1 ) : malloc_usable_size( (void*)pNode );
+            size_t needed = pNode->size + sizeof( MemoryManager::tagUnitNode );
+
+            return ( usable > needed ) ? usable - needed : 0;
+        }
+
+        void recordAlloc( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || pNode->bMock ) return;
+
+            size_t sizeClass    = classOf( pNode->size );
+            size_t waste        = wasteOf( pNode );
+            tagSizeSlot* pSlot  = &s_slots[ ThreadSlot::current() ];
+
+            ThreadSlot::lock( &pSlot->lock );
+            pSlot->histogram.liveCount[ sizeClass ]     += 1;
+            pSlot->histogram.liveSize[ sizeClass ]      += pNode->size;
+            pSlot->histogram.liveWaste[ sizeClass ]     += waste;
+            pSlot->histogram.totalCount[ sizeClass ]    += 1;
+            pSlot->histogram.totalSize[ sizeClass ]     += pNode->size;
+            ThreadSlot::unlock( &pSlot->lock );
+        }
+
+        void recordFree( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || pNode->bMock ) return;
+
+            size_t sizeClass    = classOf( pNode->size );
+            size_t waste        = wasteOf( pNode );
+            tagSizeSlot* pSlot  = &s_slots[ ThreadSlot::current() ];
+
+            // live values may go negative per thread when blocks are freed by another thread
+            ThreadSlot::lock( &pSlot->lock );
+            pSlot->histogram.liveCount[ sizeClass ]     -= 1;
+            pSlot->histogram.liveSize[ sizeClass ]      -= pNode->size;
+            pSlot->histogram.liveWaste[ sizeClass ]     -= waste;
+            ThreadSlot::unlock( &pSlot->lock );
+        }
+
+        static size_t readProcValue( const char* const buffer, const char* const key )
+        {
+            const char* pPos = strstr( buffer, key );
+            if ( NULL == pPos ) return 0;
+
+            return strtoul( pPos + strlen( key ), NULL, 10 ) * 1024;
+        }
+
+        static void readSmapsRollup( size_t* pRss, size_t* pAnonymous, size_t* pSwap )
+        {
+            char buffer[4096];
+            *pRss = *pAnonymous = *pSwap = 0;
+
+            int fd = open( "/proc/self/smaps_rollup", O_RDONLY );
+            if ( -1 == fd ) return;
+
+            ssize_t size = read( fd, buffer, sizeof( buffer ) - 1 );
+            close( fd );
+            if ( size <= 0 ) return;
+            buffer[ size ] = '\0';
+
+            *pRss       = readProcValue( buffer, "\nRss:" );
+            *pAnonymous = readProcValue( buffer, "\nAnonymous:" );
+            *pSwap      = readProcValue( buffer, "\nSwap:" );
+        }
+
+        static void mergeSlots()
+        {
+            memset( &s_merged, 0, sizeof( s_merged ) );
+
+            for ( size_t i = 0; i < ThreadSlot::count(); ++i ) {
+                tagSizeSlot* pSlot = &s_slots[i];
+
+                ThreadSlot::lock( &pSlot->lock );
+                for ( size_t c = 0; c < SIZE_CLASS_COUNT; ++c ) {
+                    s_merged.liveCount[c]   += pSlot->histogram.liveCount[c];
+                    s_merged.liveSize[c]    += pSlot->histogram.liveSize[c];
+                    s_merged.liveWaste[c]   += pSlot->histogram.liveWaste[c];
+                    s_merged.totalCount[c]  += pSlot->histogram.totalCount[c];
+                    s_merged.totalSize[c]   += pSlot->histogram.totalSize[c];
+                }
+                ThreadSlot::unlock( &pSlot->lock );
+            }
+        }
+
+        void report()
+        {
+            if ( !s_bEnabled ) return;
+
+            pthread_mutex_lock( &s_mutexReport );
+            mergeSlots();
+
+            int64_t liveCount = 0, liveSize = 0, liveWaste = 0;
+            for ( size_t c = 0; c < SIZE_CLASS_COUNT; ++c ) {
+                liveCount   += s_merged.liveCount[c];
+                liveSize    += s_merged.liveSize[c];
+                liveWaste   += s_merged.liveWaste[c];
+            }
+            size_t headerSize = liveCount * sizeof( MemoryManager::tagUnitNode );
+
+            size_t rss, anonymous, swap;
+            readSmapsRollup( &rss, &anonymous, &swap );
+
+            struct mallinfo2 info = mallinfo2();
+            size_t heapInUse    = info.uordblks + info.hblkhd;
+            size_t allocatorOverhead = heapInUse - ( ( heapInUse > liveSize + headerSize + liveWaste ) ? liveSize + headerSize + liveWaste : heapInUse );
+
+            fprintf( Config::output(), "size classes\n" );
+            fprintf( Config::output(), "\t%-12s %12s %14s %12s %12s %14s\n", "class", "live count", "live size", "waste", "total count", "total size" );
+            for ( size_t c = 0; c < SIZE_CLASS_COUNT; ++c ) {
+                if ( 0 == s_merged.totalCount[c] ) continue;
+                fprintf( Config::output(), "\t>= %-9ld %12ld %14ld %12ld %12lu %14lu\n", \
+                                classBase( c ), \
+                                s_merged.liveCount[c], \
+                                s_merged.liveSize[c], \
+                                s_merged.liveWaste[c], \
+                                s_merged.totalCount[c], \
+                                s_merged.totalSize[c] );
+            }
+
+            fprintf( Config::output(), "fragmentation\n" );
+            fprintf( Config::output(), "\tlive requested:     %ld ( count: %ld )\n", liveSize, liveCount );
+            fprintf( Config::output(), "\tunit node headers:  %ld\n", headerSize );
+            fprintf( Config::output(), "\tsize class waste:   %ld\n", liveWaste );
+            fprintf( Config::output(), "\tallocator overhead: %ld\n", allocatorOverhead );
+            fprintf( Config::output(), "\theap in use:        %ld ( arena: %ld, mmap: %ld )\n", heapInUse, info.uordblks, info.hblkhd );
+            fprintf( Config::output(), "\theap free:          %ld ( top: %ld, fastbin: %ld )\n", info.fordblks, info.keepcost, info.fsmblks );
+            fprintf( Config::output(), "\trss:                %ld ( anonymous: %ld, swap: %ld )\n", rss, anonymous, swap );
+            if ( liveSize > 0 )
+                fprintf( Config::output(), "\trss / live:         %.2f\n", (double)rss / liveSize );
+
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+
+        void forkPrepare()
+        {
+            if ( NULL == s_slots ) return;
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::lock( &s_slots[i].lock );
+        }
+
+        void forkRelease()
+        {
+            if ( NULL == s_slots ) return;
+            for ( size_t i = 0; i < MAX_THREAD_SLOT; ++i ) ThreadSlot::unlock( &s_slots[i].lock );
+        }
+
+        void forkChild()
+        {
+            if ( NULL == s_slots ) return;
+            for ( size_t i = 0; i < ThreadSlot::count(); ++i ) memset( &s_slots[i].histogram, 0, sizeof( tagSizeHistogram ) );
+        }
+    } // namespace SizeClass
+} // namespace MemoryTrace
@@ -0,0 +1,40 @@
+#ifndef __CSIZECLASSH__
+#define __CSIZECLASSH__
+
+#include <stdint.h>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    // log-linear classes, 4 linear steps per power of two
+    #define SIZE_CLASS_SUB_BITS     2
+    #define SIZE_CLASS_COUNT        ( ( 48 - SIZE_CLASS_SUB_BITS + 1 ) << SIZE_CLASS_SUB_BITS )
+    namespace SizeClass
+    {
+        struct tagSizeHistogram
+        {
+            int64_t         liveCount[ SIZE_CLASS_COUNT ];
+            int64_t         liveSize[ SIZE_CLASS_COUNT ];
+            int64_t         liveWaste[ SIZE_CLASS_COUNT ];
+            uint64_t        totalCount[ SIZE_CLASS_COUNT ];
+            uint64_t        totalSize[ SIZE_CLASS_COUNT ];
+        };
+
+        void                initialize();
+        bool                isEnabled();
+
+        size_t              classOf( size_t size );
+        size_t              classBase( size_t sizeClass );
+
+        void                recordAlloc( const MemoryManager::tagUnitNode* const );
+        void                recordFree( const MemoryManager::tagUnitNode* const );
+        void                report();
+
+        // slot locks held across fork()
+        void                forkPrepare();
+        void                forkRelease();
+        // the histograms start empty in a forked child
+        void                forkChild();
+    }; // namespace SizeClass
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,327 @@
+#include <string.h>
+#include <cstdio>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "CSlab.h"
+#include "CThreadSlot.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Slab
+    {
+        struct tagClassCache;
+
+        // the start of every span, a set bit is a free block
+        struct __attribute__ (( aligned( 64 ) )) tagSlab
+        {
+            tagClassCache* volatile pOwner;     // NULL while on the central list
+            tagSlab*        pNext;              // in the owner's list or the central list
+            tagSlab*        pNextAll;           // every slab of the class, for the statistics
+            char*           pBlocks;
+            uint32_t        blockSize;
+            uint32_t        blockCount;
+            uint32_t        wordCount;
+            uint64_t        divisor;            // ( offset * divisor ) >> 40 is offset / blockSize for any offset in the span
+
+            // the owner's, no other thread touches them
+            uint32_t        freeCount;
+            uint32_t        hint;               // no free bit in the words before it
+
+            volatile int32_t remoteCount;       // bits set in remote, may lag behind them
+            uint64_t        local[ SLAB_BITMAP_WORDS ];
+            uint64_t        remote[ SLAB_BITMAP_WORDS ];
+        };
+
+        // the slabs a thread owns of a class, it allocates from the first one with a free block
+        struct tagClassCache
+        {
+            tagSlab*        pCurrent;
+            tagSlab*        pSlabs;
+        };
+
+        struct __attribute__ (( aligned( 64 ) )) tagCentral
+        {
+            ThreadSlot::tagSpinLock lock;
+            tagSlab*        pHead;
+            size_t          count;
+            tagSlab*        pAll;
+            size_t          spanCount;
+        };
+
+        static bool             s_bEnabled      = false;
+        static pthread_key_t    s_keyExit;
+        static bool             s_bKeyExit      = false;
+        static tagCentral       s_centrals[ SLAB_CLASS_COUNT ];
+
+        static __thread tagClassCache t_caches[ SLAB_CLASS_COUNT ] __attribute__ (( tls_model( "initial-exec" ) ));
+        static __thread bool    t_bRegistered __attribute__ (( tls_model( "initial-exec" ) )) = false;
+
+        size_t classOf( size_t size )
+        {
+            if ( size <= SLAB_SMALL_MAX ) return ( size <= 16 ) ? 0 : ( size + 15 ) / 16 - 1;
+
+            // ( 1024, 32768 ], the top two bits below the leading one pick the step
+            size_t shift = 63 - __builtin_clzl( size - 1 );
+            size_t step  = ( size - 1 ) >> ( shift - 2 );
+            return SLAB_SMALL_MAX / 16 + ( shift - 10 ) * 4 + ( step - 4 );
+        }
+
+        size_t classSize( size_t sizeClass )
+        {
+            if ( sizeClass < SLAB_SMALL_MAX / 16 ) return ( sizeClass + 1 ) * 16;
+
+            size_t shift = 10 + ( sizeClass - SLAB_SMALL_MAX / 16 ) / 4;
+            size_t step  = 4 + ( sizeClass - SLAB_SMALL_MAX / 16 ) % 4;
+            return ( step + 1 ) << ( shift - 2 );
+        }
+
+        static inline tagSlab* slabOf( const void* pBlock )
+        {
+            return (tagSlab*)( (uintptr_t)pBlock & ~( SLAB_SPAN - 1 ) );
+        }
+
+        // central lock held, a span aligned to its size with every block free, NULL once nothing can be mapped
+        static tagSlab* mapSlab( tagCentral* pCentral, size_t sizeClass )
+        {
+            void* pMap = mmap( NULL, SLAB_SPAN * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+            if ( MAP_FAILED == pMap ) return NULL;
+
+            uintptr_t begin     = (uintptr_t)pMap;
+            uintptr_t aligned   = ( begin + SLAB_SPAN - 1 ) & ~( SLAB_SPAN - 1 );
+            if ( aligned > begin ) munmap( pMap, aligned - begin );
+            munmap( (void*)( aligned + SLAB_SPAN ), begin + SLAB_SPAN - aligned );
+
+            // fresh pages are zero, only the fields and the free bits need setting
+            tagSlab* pSlab      = (tagSlab*)aligned;
+            pSlab->pBlocks      = (char*)aligned + sizeof( tagSlab );
+            pSlab->blockSize    = classSize( sizeClass );
+            pSlab->blockCount   = ( SLAB_SPAN - sizeof( tagSlab ) ) / pSlab->blockSize;
+            pSlab->wordCount    = ( pSlab->blockCount + 63 ) / 64;
+            pSlab->divisor      = ( ( 1ULL << 40 ) + pSlab->blockSize - 1 ) / pSlab->blockSize;
+            pSlab->freeCount    = pSlab->blockCount;
+
+            memset( pSlab->local, 0xFF, ( pSlab->blockCount / 64 ) * sizeof( uint64_t ) );
+            if ( 0 != pSlab->blockCount % 64 ) pSlab->local[ pSlab->blockCount / 64 ] = ( 1ULL << ( pSlab->blockCount % 64 ) ) - 1;
+
+            pSlab->pNextAll     = pCentral->pAll;
+            pCentral->pAll      = pSlab;
+            pCentral->spanCount++;
+            return pSlab;
+        }
+
+        // the owner takes over what other threads freed, returns how many blocks that were
+        static uint32_t collect( tagSlab* pSlab )
+        {
+            if ( __atomic_load_n( &pSlab->remoteCount, __ATOMIC_ACQUIRE ) <= 0 ) return 0;
+
+            uint32_t collected = 0;
+            for ( uint32_t i = 0; i < pSlab->wordCount; ++i ) {
+                if ( 0 == pSlab->remote[i] ) continue;
+
+                uint64_t bits = __atomic_exchange_n( &pSlab->remote[i], 0, __ATOMIC_ACQUIRE );
+                pSlab->local[i] |= bits;
+                collected += __builtin_popcountll( bits );
+                if ( 0 != bits && i < pSlab->hint ) pSlab->hint = i;
+            }
+
+            __atomic_fetch_sub( &pSlab->remoteCount, (int32_t)collected, __ATOMIC_RELAXED );
+            pSlab->freeCount += collected;
+            return collected;
+        }
+
+        // central lock held
+        static void pushCentral( tagCentral* pCentral, tagSlab* pSlab )
+        {
+            __atomic_store_n( &pSlab->pOwner, (tagClassCache*)NULL, __ATOMIC_RELEASE );
+            pSlab->pNext        = pCentral->pHead;
+            pCentral->pHead     = pSlab;
+            pCentral->count++;
+        }
+
+        // the current slab is used up: another owned slab with a free block, one from the central list, or a new span.
+        // owned slabs found empty on the way are handed back, a thread that freed a lot does not keep them to itself
+        static tagSlab* refill( tagClassCache* pCache, size_t sizeClass )
+        {
+            tagCentral* pCentral = &s_centrals[ sizeClass ];
+            tagSlab* pFound = NULL;
+
+            for ( tagSlab** ppSlab = &pCache->pSlabs; NULL != *ppSlab; ) {
+                tagSlab* pSlab = *ppSlab;
+                collect( pSlab );
+
+                if ( NULL != pFound && pSlab->freeCount == pSlab->blockCount ) {
+                    *ppSlab = pSlab->pNext;
+                    ThreadSlot::lock( &pCentral->lock );
+                    pushCentral( pCentral, pSlab );
+                    ThreadSlot::unlock( &pCentral->lock );
+                    continue;
+                }
+
+                if ( NULL == pFound && 0 != pSlab->freeCount ) pFound = pSlab;
+                ppSlab = &pSlab->pNext;
+            }
+            if ( NULL != pFound ) return pFound;
+
+            ThreadSlot::lock( &pCentral->lock );
+            // a slab of a finished thread may still be full, it is owned from now on all the same
+            while ( NULL != pCentral->pHead ) {
+                tagSlab* pSlab      = pCentral->pHead;
+                pCentral->pHead     = pSlab->pNext;
+                pCentral->count--;
+
+                __atomic_store_n( &pSlab->pOwner, pCache, __ATOMIC_RELEASE );
+                pSlab->pNext        = pCache->pSlabs;
+                pCache->pSlabs      = pSlab;
+                if ( 0 != pSlab->freeCount || 0 != collect( pSlab ) ) { pFound = pSlab; break; }
+            }
+            if ( NULL == pFound && NULL != ( pFound = mapSlab( pCentral, sizeClass ) ) ) {
+                pFound->pOwner      = pCache;
+                pFound->pNext       = pCache->pSlabs;
+                pCache->pSlabs      = pFound;
+            }
+            ThreadSlot::unlock( &pCentral->lock );
+
+            return pFound;
+        }
+
+        // the slabs of a finished thread go to the central lists, blocks still out come back through the remote bits
+        static void threadExit( void* )
+        {
+            for ( size_t i = 0; i < SLAB_CLASS_COUNT; ++i ) {
+                tagClassCache* pCache = &t_caches[i];
+                if ( NULL == pCache->pSlabs ) continue;
+
+                tagCentral* pCentral = &s_centrals[i];
+                ThreadSlot::lock( &pCentral->lock );
+                while ( NULL != pCache->pSlabs ) {
+                    tagSlab* pSlab  = pCache->pSlabs;
+                    pCache->pSlabs  = pSlab->pNext;
+                    pushCentral( pCentral, pSlab );
+                }
+                ThreadSlot::unlock( &pCentral->lock );
+                pCache->pCurrent = NULL;
+            }
+
+            // frees by later destructors register once more, glibc calls this again for them
+            t_bRegistered = false;
+        }
+
+        static inline void registerThread()
+        {
+            if ( t_bRegistered ) return;
+
+            t_bRegistered = true;
+            if ( s_bKeyExit ) pthread_setspecific( s_keyExit, (void*)1 );
+        }
+
+        void initialize()
+        {
+            s_bEnabled = Config::BE_SLAB == Config::get()->backend && Config::TM_OFF != Config::get()->mode;
+            if ( s_bEnabled && !s_bKeyExit ) s_bKeyExit = 0 == pthread_key_create( &s_keyExit, threadExit );
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void forkPrepare()
+        {
+            if ( !s_bEnabled ) return;
+            for ( size_t i = 0; i < SLAB_CLASS_COUNT; ++i ) ThreadSlot::lock( &s_centrals[i].lock );
+        }
+
+        void forkRelease()
+        {
+            if ( !s_bEnabled ) return;
+            for ( size_t i = 0; i < SLAB_CLASS_COUNT; ++i ) ThreadSlot::unlock( &s_centrals[i].lock );
+        }
+
+        void* allocate( size_t size, uint8_t* const pClass )
+        {
+            if ( size > SLAB_MAX_SIZE ) return NULL;
+
+            size_t sizeClass        = classOf( size );
+            tagClassCache* pCache   = &t_caches[ sizeClass ];
+            tagSlab* pSlab          = pCache->pCurrent;
+
+            if ( NULL == pSlab || ( 0 == pSlab->freeCount && 0 == collect( pSlab ) ) ) {
+                if ( NULL == ( pSlab = refill( pCache, sizeClass ) ) ) return NULL;
+                pCache->pCurrent = pSlab;
+                registerThread();
+            }
+
+            // freeCount says there is a set bit at or after the hint
+            uint32_t word = pSlab->hint;
+            while ( 0 == pSlab->local[ word ] ) ++word;
+
+            uint64_t bits           = pSlab->local[ word ];
+            pSlab->local[ word ]    = bits & ( bits - 1 );
+            pSlab->hint             = word;
+            pSlab->freeCount--;
+
+            *pClass = (uint8_t)( sizeClass + 1 );
+            return pSlab->pBlocks + ( word * 64 + __builtin_ctzll( bits ) ) * (size_t)pSlab->blockSize;
+        }
+
+        void free( void* pBlock, uint8_t sizeClass )
+        {
+            tagSlab* pSlab  = slabOf( pBlock );
+            size_t index    = ( (uint64_t)( (char*)pBlock - pSlab->pBlocks ) * pSlab->divisor ) >> 40;
+            uint32_t word   = index / 64;
+            uint64_t bit    = 1ULL << ( index % 64 );
+
+            // only the owning thread can see its own cache here, a slab changes hands on the central list only
+            if ( __atomic_load_n( &pSlab->pOwner, __ATOMIC_RELAXED ) == &t_caches[ sizeClass - 1 ] ) {
+                pSlab->local[ word ] |= bit;
+                pSlab->freeCount++;
+                if ( word < pSlab->hint ) pSlab->hint = word;
+                return;
+            }
+
+            __atomic_fetch_or( &pSlab->remote[ word ], bit, __ATOMIC_RELEASE );
+            __atomic_fetch_add( &pSlab->remoteCount, 1, __ATOMIC_RELEASE );
+        }
+
+        void getStatistics( tagSlabStatistics* const pStat )
+        {
+            if ( NULL == pStat ) return;
+
+            memset( pStat, 0, sizeof( *pStat ) );
+            for ( size_t i = 0; i < SLAB_CLASS_COUNT; ++i ) {
+                tagCentral* pCentral = &s_centrals[i];
+                if ( 0 == pCentral->spanCount ) continue;
+
+                ThreadSlot::lock( &pCentral->lock );
+                pStat->spanCount    += pCentral->spanCount;
+                pStat->centralCount += pCentral->count;
+                pStat->classCount++;
+
+                // the owners change the bits meanwhile, the count is as good as a racy read
+                for ( const tagSlab* pSlab = pCentral->pAll; NULL != pSlab; pSlab = pSlab->pNextAll ) {
+                    size_t freeCount = 0;
+                    for ( uint32_t w = 0; w < pSlab->wordCount; ++w ) freeCount += __builtin_popcountll( pSlab->local[w] | pSlab->remote[w] );
+                    pStat->liveCount += pSlab->blockCount - freeCount;
+                }
+                ThreadSlot::unlock( &pCentral->lock );
+            }
+            pStat->mappedSize = pStat->spanCount * SLAB_SPAN;
+        }
+
+        void report()
+        {
+            if ( !s_bEnabled ) return;
+
+            tagSlabStatistics stat;
+            getStatistics( &stat );
+
+            fprintf( Config::output(), "slab \n \tclasses: %ld\n\tspans: %ld\n\tmapped: %ld\n\tcentral slabs: %ld\n\tlive blocks: %ld\n", \
+                            stat.classCount, \
+                            stat.spanCount, \
+                            stat.mappedSize, \
+                            stat.centralCount, \
+                            stat.liveCount );
+        }
+    } // namespace Slab
+} // namespace MemoryTrace
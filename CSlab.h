@@ -0,0 +1,48 @@
+#ifndef __CSLABH__
+#define __CSLABH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace MemoryTrace
+{
+    #define SLAB_SMALL_MAX          1024                // 16 byte steps up to here
+    #define SLAB_MAX_SIZE           32768               // 4 steps per power of two up to here, larger blocks go to the real allocator
+    #define SLAB_CLASS_COUNT        ( SLAB_SMALL_MAX / 16 + 5 * 4 )
+    #define SLAB_SPAN               ( 1UL << 20 )       // one slab, aligned to its size so a block finds the slab's metadata
+    #define SLAB_BITMAP_WORDS       ( SLAB_SPAN / 16 / 64 )
+    namespace Slab
+    {
+        // backend=slab, headed blocks come from slabs of fixed size classes instead of the real allocator.
+        // the metadata of a slab sits at its start, a bit per block tells which are free. a thread allocates
+        // from the slabs it owns and frees into them without a lock or a locked instruction, other threads
+        // set the block's bit in a second bitmap the owner takes over when it runs out. slabs of a finished
+        // thread, and empty ones it no longer needs, go to the class's central list. spans are never given back
+        struct tagSlabStatistics
+        {
+            size_t          spanCount;
+            size_t          mappedSize;
+            size_t          centralCount;       // slabs on the central lists, waiting for an owner
+            size_t          classCount;         // classes with a span
+            size_t          liveCount;          // blocks handed out, from a scan of the bitmaps
+        };
+
+        // only maps on first use, so it may be called while the hook initializes
+        void                initialize();
+        bool                isEnabled();
+        void                forkPrepare();
+        void                forkRelease();
+
+        // 16 byte aligned, NULL for a size past SLAB_MAX_SIZE or once nothing can be mapped.
+        // *pClass is what free() takes back, never 0. any thread may free a block
+        void*               allocate( size_t size, uint8_t* const pClass );
+        void                free( void* pBlock, uint8_t sizeClass );
+
+        size_t              classOf( size_t size );
+        size_t              classSize( size_t sizeClass );
+
+        void                getStatistics( tagSlabStatistics* const );
+        void                report();
+    }; // namespace Slab
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,245 @@
+#include <string.h>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include "CSnapshot.h"
+#include "CStackDepot.h"
+#include "CMapping.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Snapshot
+    {
+        struct tagWriter
+        {
+            int             fd;
+            size_t          used;
+            uint64_t        offset;         // of the next byte put
+            bool            bFailed;
+        };
+
+        static bool             s_bEnabled      = false;
+        static uint64_t         s_sequence      = 0;
+
+        // only touched by write(), which runs under the report lock
+        static char             s_buffer[ SNAPSHOT_BUFFER_SIZE ];
+        static uint32_t         s_stackIndex[ STACK_DEPOT_CAPACITY + 1 ];  // depot id to table index, 0 when not seen yet
+        static uint32_t         s_stackIds[ STACK_DEPOT_CAPACITY + 1 ];    // table index to depot id
+        static Persist::tagPersistModule    s_modules[ PERSIST_MODULES ];
+
+        static const size_t     s_widths[ SC_STACKS ] = { 8, 8, 8, 8, 4, 4 };
+
+        static uint64_t realtime()
+        {
+            struct timespec now;
+            clock_gettime( CLOCK_REALTIME, &now );
+
+            return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        }
+
+        static inline uint64_t alignUp( uint64_t offset )
+        {
+            return ( offset + SNAPSHOT_ALIGN - 1 ) & ~(uint64_t)( SNAPSHOT_ALIGN - 1 );
+        }
+
+        static void flush( tagWriter* const pWriter )
+        {
+            const char* pPos = s_buffer;
+            size_t size = pWriter->used;
+
+            while ( size > 0 && !pWriter->bFailed ) {
+                ssize_t written = ::write( pWriter->fd, pPos, size );
+                if ( written <= 0 ) { pWriter->bFailed = true; break; }
+                pPos += written;
+                size -= written;
+            }
+            pWriter->used = 0;
+        }
+
+        static void put( tagWriter* const pWriter, const void* pData, size_t size )
+        {
+            const char* pPos = (const char*)pData;
+            pWriter->offset += size;
+
+            while ( size > 0 ) {
+                size_t chunk = SNAPSHOT_BUFFER_SIZE - pWriter->used;
+                if ( chunk > size ) chunk = size;
+
+                memcpy( s_buffer + pWriter->used, pPos, chunk );
+                pWriter->used += chunk;
+                pPos += chunk;
+                size -= chunk;
+                if ( SNAPSHOT_BUFFER_SIZE == pWriter->used ) flush( pWriter );
+            }
+        }
+
+        static void pad( tagWriter* const pWriter )
+        {
+            static const char zeros[ SNAPSHOT_ALIGN ] = { 0 };
+            put( pWriter, zeros, alignUp( pWriter->offset ) - pWriter->offset );
+        }
+
+        // one pass over the records per column, each pass reads only the field it writes
+        static void putColumn( tagWriter* const pWriter, const MemoryManager::tagUnitSnapshot* const pSnapshot, SnapshotColumn column )
+        {
+            pad( pWriter );
+
+            for ( size_t i = 0; i < pSnapshot->count; ++i ) {
+                const MemoryManager::tagUnitRecord* pRecord = &pSnapshot->records[i];
+                if ( pRecord->bMock ) continue;
+
+                uint64_t value = 0;
+                uint32_t value32 = 0;
+                switch ( column ) {
+                case SC_ADDRESS:    value = (uintptr_t)pRecord->pData; break;
+                case SC_SIZE:       value = pRecord->size; break;
+                case SC_SERIAL:     value = pRecord->serial; break;
+                case SC_TIMESTAMP:  value = pRecord->timestamp; break;
+                case SC_THREAD:     value32 = (uint32_t)pRecord->threadId; break;
+                case SC_STACK:      value32 = ( pRecord->stackId <= STACK_DEPOT_CAPACITY ) ? s_stackIndex[ pRecord->stackId ] : 0; break;
+                default:            break;
+                }
+
+                if ( 8 == s_widths[ column ] ) put( pWriter, &value, sizeof( value ) );
+                else put( pWriter, &value32, sizeof( value32 ) );
+            }
+        }
+
+        static void addStack( tagSnapshotHeader* const pHeader, size_t id )
+        {
+            if ( 0 == id || id > STACK_DEPOT_CAPACITY || 0 != s_stackIndex[ id ] ) return;
+
+            s_stackIndex[ id ]                  = pHeader->stackCount;
+            s_stackIds[ pHeader->stackCount++ ] = (uint32_t)id;
+        }
+
+        void initialize()
+        {
+            s_bEnabled = '\0' != Config::get()->snapshot[0] && Config::TM_OFF != Config::get()->mode;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void write()
+        {
+            if ( !s_bEnabled ) return;
+
+            MemoryManager::tagUnitSnapshot* pSnapshot = MemoryManager::takeSnapshot();
+            if ( NULL == pSnapshot ) return;
+
+            tagSnapshotHeader header;
+            memset( &header, 0, sizeof( header ) );
+            header.magic        = SNAPSHOT_MAGIC;
+            header.version      = SNAPSHOT_VERSION;
+            header.pid          = getpid();
+            header.time         = realtime();
+            header.clock        = MemoryManager::timestamp();
+            header.sequence     = ++s_sequence;
+            header.statistics   = pSnapshot->statistics;
+
+            int fd = open( "/proc/self/comm", O_RDONLY | O_CLOEXEC );
+            if ( -1 != fd ) {
+                ssize_t size = read( fd, header.command, sizeof( header.command ) - 1 );
+                if ( size > 0 && '\n' == header.command[ size - 1 ] ) header.command[ size - 1 ] = '\0';
+                close( fd );
+            }
+
+            // the stack table holds the backtraces of live blocks and mappings only, in the order they are first seen
+            memset( s_stackIndex, 0, sizeof( s_stackIndex ) );
+            header.stackCount = 1;
+            for ( size_t i = 0; i < pSnapshot->count; ++i ) {
+                const MemoryManager::tagUnitRecord* pRecord = &pSnapshot->records[i];
+                if ( pRecord->bMock ) continue;
+
+                header.blockCount++;
+                addStack( &header, pRecord->stackId );
+            }
+            header.moduleCount = Persist::collectModules( s_modules, PERSIST_MODULES );
+
+            size_t mappingCount = 0, mappingMapSize = 0;
+            Mapping::tagMapping* pMappings = Mapping::copyMappings( &mappingCount, &mappingMapSize );
+            for ( size_t i = 0; i < mappingCount; ++i ) addStack( &header, pMappings[i].stackId );
+            header.mappingCount = (uint32_t)mappingCount;
+
+            uint64_t offset = sizeof( header );
+            for ( size_t i = 0; i < SC_COUNT; ++i ) {
+                size_t width = ( i < SC_STACKS ) ? s_widths[i] : ( SC_STACKS == i ) ? sizeof( tagSnapshotStack ) : \
+                                ( SC_MODULES == i ) ? sizeof( Persist::tagPersistModule ) : sizeof( tagSnapshotMapping );
+                uint64_t count = ( i < SC_STACKS ) ? header.blockCount : ( SC_STACKS == i ) ? header.stackCount : \
+                                ( SC_MODULES == i ) ? header.moduleCount : header.mappingCount;
+
+                header.columns[i].offset    = alignUp( offset );
+                header.columns[i].size      = count * width;
+                offset = header.columns[i].offset + header.columns[i].size;
+            }
+
+            // written aside and renamed, a reader never maps a half written file
+            char path[ CONFIG_PATH_SIZE + 32 ], temporary[ CONFIG_PATH_SIZE + 40 ];
+            snprintf( path, sizeof( path ), "%s.%lu", Config::get()->snapshot, header.sequence );
+            snprintf( temporary, sizeof( temporary ), "%s.tmp", path );
+
+            tagWriter writer = { -1, 0, 0, false };
+            writer.fd = open( temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+            if ( -1 == writer.fd ) {
+                fprintf( Config::output(), "memhook: can not open %s, no snapshot\n", temporary );
+                Mapping::releaseCopy( pMappings, mappingMapSize );
+                MemoryManager::releaseSnapshot( pSnapshot );
+                return;
+            }
+
+            put( &writer, &header, sizeof( header ) );
+            for ( size_t i = 0; i < SC_STACKS; ++i ) putColumn( &writer, pSnapshot, (SnapshotColumn)i );
+
+            pad( &writer );
+            tagSnapshotStack stack;
+            memset( &stack, 0, sizeof( stack ) );
+            put( &writer, &stack, sizeof( stack ) );
+            for ( size_t i = 1; i < header.stackCount; ++i ) {
+                const StackDepot::tagStackEntry* pEntry = StackDepot::get( s_stackIds[i] );
+
+                memset( &stack, 0, sizeof( stack ) );
+                if ( NULL != pEntry ) {
+                    stack.traceSize = pEntry->traceSize;
+                    for ( size_t frame = 0; frame < pEntry->traceSize && frame < BACKTRACE_DEPTH; ++frame )
+                        stack.frames[ frame ] = (uintptr_t)pEntry->backtrace[ frame ];
+                }
+                put( &writer, &stack, sizeof( stack ) );
+            }
+
+            pad( &writer );
+            put( &writer, s_modules, header.moduleCount * sizeof( Persist::tagPersistModule ) );
+
+            pad( &writer );
+            for ( size_t i = 0; i < mappingCount; ++i ) {
+                const Mapping::tagMapping* pMapping = &pMappings[i];
+                tagSnapshotMapping mapping;
+
+                memset( &mapping, 0, sizeof( mapping ) );
+                mapping.begin       = pMapping->begin;
+                mapping.end         = pMapping->end;
+                mapping.serial      = pMapping->serial;
+                mapping.timestamp   = pMapping->timestamp;
+                mapping.prot        = pMapping->prot;
+                mapping.flags       = pMapping->flags;
+                mapping.kind        = pMapping->kind;
+                mapping.stack       = ( pMapping->stackId <= STACK_DEPOT_CAPACITY ) ? s_stackIndex[ pMapping->stackId ] : 0;
+                put( &writer, &mapping, sizeof( mapping ) );
+            }
+            flush( &writer );
+
+            close( writer.fd );
+            Mapping::releaseCopy( pMappings, mappingMapSize );
+            MemoryManager::releaseSnapshot( pSnapshot );
+
+            if ( writer.bFailed || 0 != rename( temporary, path ) ) {
+                fprintf( Config::output(), "memhook: writing %s failed\n", path );
+                unlink( temporary );
+            }
+        }
+    } // namespace Snapshot
+} // namespace MemoryTrace
@@ -0,0 +1,85 @@
+#ifndef __CSNAPSHOTH__
+#define __CSNAPSHOTH__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CMemoryManager.h"
+#include "CPersist.h"
+
+namespace MemoryTrace
+{
+    #define SNAPSHOT_MAGIC          0x315350414E53484DULL   // "MHSNAPS1"
+    #define SNAPSHOT_VERSION        2
+    #define SNAPSHOT_ALIGN          64
+    #define SNAPSHOT_BUFFER_SIZE    ( 64 * 1024 )
+    namespace Snapshot
+    {
+        // one array per field, a query reads only the columns it needs. every column starts SNAPSHOT_ALIGN
+        // aligned and holds blockCount values ( stackCount, moduleCount and mappingCount entries for the tables )
+        enum SnapshotColumn
+        {
+            SC_ADDRESS = 0,     // uint64_t
+            SC_SIZE,            // uint64_t
+            SC_SERIAL,          // uint64_t
+            SC_TIMESTAMP,       // uint64_t monotonic ns, 0 when the block has no backtrace
+            SC_THREAD,          // uint32_t thread id
+            SC_STACK,           // uint32_t index into SC_STACKS, 0 when unknown
+            SC_STACKS,          // tagSnapshotStack
+            SC_MODULES,         // Persist::tagPersistModule
+            SC_MAPPINGS,        // tagSnapshotMapping, empty unless mmap=1
+            SC_COUNT,
+        };
+
+        struct tagSnapshotColumn
+        {
+            uint64_t        offset;
+            uint64_t        size;
+        };
+
+        struct tagSnapshotStack
+        {
+            uint64_t        traceSize;
+            uint64_t        frames[ BACKTRACE_DEPTH ];
+        };
+
+        struct tagSnapshotMapping
+        {
+            uint64_t        begin;
+            uint64_t        end;
+            uint64_t        serial;
+            uint64_t        timestamp;
+            int32_t         prot;
+            int32_t         flags;
+            uint32_t        kind;               // Mapping::MappingKind
+            uint32_t        stack;              // index into SC_STACKS, 0 when unknown
+        };
+
+        // layout shared with memhook-query, bump SNAPSHOT_VERSION on any change
+        struct tagSnapshotHeader
+        {
+            uint64_t        magic;
+            uint32_t        version;
+            uint32_t        pid;
+            char            command[ 32 ];
+            uint64_t        time;               // realtime ns
+            uint64_t        clock;              // monotonic ns, what the timestamps are measured against
+            uint64_t        sequence;
+
+            MemoryManager::tagUnitManager   statistics;
+
+            uint64_t        blockCount;
+            uint32_t        stackCount;
+            uint32_t        moduleCount;
+            uint32_t        mappingCount;
+            uint32_t        reserved;
+            tagSnapshotColumn   columns[ SC_COUNT ];
+        };
+
+        void                initialize();
+        bool                isEnabled();
+
+        // snapshot=path, the live blocks to path.N with every report, called under the report lock
+        void                write();
+    }; // namespace Snapshot
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,125 @@
+#include <string.h>
+#include <cstdio>
+#include <dlfcn.h>
+#include "CStackDepot.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace StackDepot
+    {
+        static tagStackEntry    s_defaultEntries[ STACK_DEPOT_CAPACITY ];
+        static tagStackEntry*   s_entries = s_defaultEntries;
+        static tagStackEntry*   s_pHome   = s_defaultEntries;
+
+        void initialize()
+        {
+            // the built-in table stays untouched, so its pages are never faulted in
+            tagStackEntry* pEntries = (tagStackEntry*)Arena::allocate( sizeof( s_defaultEntries ) );
+            if ( NULL == pEntries ) return;
+
+            relocate( pEntries );
+            s_pHome = pEntries;
+        }
+
+        void relocate( tagStackEntry* pEntries )
+        {
+            if ( NULL == pEntries ) pEntries = s_pHome;
+
+            if ( pEntries != s_entries ) memcpy( pEntries, s_entries, sizeof( s_defaultEntries ) );
+            s_entries = pEntries;
+        }
+
+        size_t intern( size_t hash, void* const* backtrace, size_t traceSize )
+        {
+            // hash 0 marks an empty entry
+            if ( 0 == hash ) hash = 1;
+
+            size_t index = hash & ( STACK_DEPOT_CAPACITY - 1 );
+            for ( size_t probe = 0; probe < STACK_DEPOT_PROBE; ++probe ) {
+                tagStackEntry* pEntry = &s_entries[ index ];
+
+                size_t current = pEntry->hash;
+                if ( 0 == current ) {
+                    current = __sync_val_compare_and_swap( &pEntry->hash, 0, hash );
+                    if ( 0 == current ) {
+                        pEntry->traceSize = traceSize;
+                        memcpy( pEntry->backtrace, backtrace, traceSize * sizeof( void* ) );
+                        __sync_synchronize();
+                        pEntry->bReady = true;
+                        return index + 1;
+                    }
+                }
+
+                if ( current == hash ) return index + 1;
+
+                index = ( index + 1 ) & ( STACK_DEPOT_CAPACITY - 1 );
+            }
+
+            // depot is full around this hash
+            return 0;
+        }
+
+        const tagStackEntry* get( size_t id )
+        {
+            if ( 0 == id || id > STACK_DEPOT_CAPACITY ) return NULL;
+
+            const tagStackEntry* pEntry = &s_entries[ id - 1 ];
+
+            return pEntry->bReady ? pEntry : NULL;
+        }
+
+        void describe( const tagStackEntry* const pEntry, char* const buffer, size_t length )
+        {
+            size_t frame = MemoryManager::skipHookFrames( pEntry->backtrace, pEntry->traceSize );
+            void* pAddr  = pEntry->backtrace[ frame ];
+
+            Dl_info info;
+            if ( 0 == dladdr( pAddr, &info ) || NULL == info.dli_fname ) {
+                snprintf( buffer, length, "%p", pAddr );
+            } else if ( NULL != info.dli_sname ) {
+                snprintf( buffer, length, "%s+0x%lx (%s)", info.dli_sname, (char*)pAddr - (char*)info.dli_saddr, info.dli_fname );
+            } else {
+                snprintf( buffer, length, "%s+0x%lx", info.dli_fname, (char*)pAddr - (char*)info.dli_fbase );
+            }
+        }
+
+        void addLive( size_t id, size_t size )
+        {
+            if ( 0 == id || id > STACK_DEPOT_CAPACITY ) return;
+
+            __sync_fetch_and_add( &s_entries[ id - 1 ].liveCount, 1 );
+            __sync_fetch_and_add( &s_entries[ id - 1 ].liveSize, size );
+            __sync_fetch_and_add( &s_entries[ id - 1 ].allocCount, 1 );
+        }
+
+        void removeLive( size_t id, size_t size )
+        {
+            if ( 0 == id || id > STACK_DEPOT_CAPACITY ) return;
+
+            __sync_fetch_and_sub( &s_entries[ id - 1 ].liveCount, 1 );
+            __sync_fetch_and_sub( &s_entries[ id - 1 ].liveSize, size );
+        }
+
+        void adjustLive( size_t id, int64_t count, int64_t size )
+        {
+            if ( 0 == id || id > STACK_DEPOT_CAPACITY ) return;
+
+            __sync_fetch_and_add( &s_entries[ id - 1 ].liveCount, count );
+            __sync_fetch_and_add( &s_entries[ id - 1 ].liveSize, size );
+        }
+
+        void forkChild()
+        {
+            // entries that never counted are left alone, their pages need not be touched
+            for ( size_t i = 0; i < STACK_DEPOT_CAPACITY; ++i ) {
+                tagStackEntry* pEntry = &s_entries[i];
+                if ( 0 == pEntry->allocCount && 0 == pEntry->liveCount ) continue;
+
+                pEntry->liveCount   = 0;
+                pEntry->liveSize    = 0;
+                pEntry->allocCount  = 0;
+            }
+        }
+    } // namespace StackDepot
+} // namespace MemoryTrace
@@ -0,0 +1,48 @@
+#ifndef __CSTACKDEPOTH__
+#define __CSTACKDEPOTH__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define STACK_DEPOT_CAPACITY    16384
+    #define STACK_DEPOT_PROBE       64
+    namespace StackDepot
+    {
+        // every unique backtrace is stored once, nodes only keep the id ( index + 1, 0 is invalid )
+        struct tagStackEntry
+        {
+            size_t          hash;
+            volatile bool   bReady;
+
+            size_t          traceSize;
+            void*           backtrace[ BACKTRACE_DEPTH ];
+
+            int64_t         liveCount;
+            int64_t         liveSize;
+            uint64_t        allocCount;
+        };
+
+        size_t                  intern( size_t hash, void* const* backtrace, size_t traceSize );
+        const tagStackEntry*    get( size_t id );
+
+        // moves the depot into the metadata arena, only while initializing
+        void                    initialize();
+        // moves the depot into caller provided storage of STACK_DEPOT_CAPACITY entries, NULL for its own one,
+        // only while initializing or in a forked child
+        void                    relocate( tagStackEntry* const );
+
+        // first frame outside the hook as symbol+offset ( module ), the same in every process running the module
+        void                    describe( const tagStackEntry* const, char* const buffer, size_t length );
+
+        void                    addLive( size_t id, size_t size );
+        void                    removeLive( size_t id, size_t size );
+        // partial unmaps and remaps change a mapping without ending it
+        void                    adjustLive( size_t id, int64_t count, int64_t size );
+        // the traces stay, the live figures and counts start at 0 in a forked child
+        void                    forkChild();
+    }; // namespace StackDepot
+}; // namespace MemoryTrace
+#endif
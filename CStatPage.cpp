@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <string.h>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "CStatPage.h"
+#include "CStackDepot.h"
+#include "CThreadSlot.h"
+#include "CConfig.h"
+#include "CMapping.h"
+#include "CProfile.h"
+
+namespace MemoryTrace
+{
+    namespace StatPage
+    {
+        // a line of its own per thread, the threads freeing each other's blocks do not share one
+        struct __attribute__ (( aligned( 64 ) )) tagThreadLive
+        {
+            volatile int64_t    liveSize;
+        };
+
+        static bool             s_bEnabled          = false;
+        static char             s_path[64];
+        static tagStatPage*     s_pPage             = NULL;
+        static tagThreadLive    s_threadLive[ MAX_THREAD_SLOT ];
+
+        static uint64_t realtime()
+        {
+            struct timespec now;
+            clock_gettime( CLOCK_REALTIME, &now );
+
+            return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        }
+
+        void initialize()
+        {
+            // published by the reporter service thread every statsPeriod ms
+            if ( 0 == Config::get()->statsPeriod || Config::TM_OFF == Config::get()->mode ) return;
+
+            snprintf( s_path, sizeof( s_path ), "%s%d", STAT_PAGE_PATH, getpid() );
+            int fd = open( s_path, O_RDWR | O_CREAT | O_TRUNC, 0644 );
+            if ( -1 == fd ) return;
+
+            if ( 0 != ftruncate( fd, sizeof( tagStatPage ) ) ) { close( fd ); unlink( s_path ); return; }
+
+            void* pMap = mmap( NULL, sizeof( tagStatPage ), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+            close( fd );
+            if ( MAP_FAILED == pMap ) { unlink( s_path ); return; }
+
+            s_pPage             = (tagStatPage*)pMap;
+            s_pPage->version    = STAT_PAGE_VERSION;
+            s_pPage->pid        = getpid();
+            s_pPage->startTime  = realtime();
+
+            fd = open( "/proc/self/comm", O_RDONLY );
+            if ( -1 != fd ) {
+                ssize_t size = read( fd, s_pPage->command, sizeof( s_pPage->command ) - 1 );
+                if ( size > 0 && '\n' == s_pPage->command[ size - 1 ] ) s_pPage->command[ size - 1 ] = '\0';
+                close( fd );
+            }
+
+            // readers ignore the page until the magic is there
+            __sync_synchronize();
+            s_pPage->magic      = STAT_PAGE_MAGIC;
+            s_bEnabled          = true;
+        }
+
+        void uninitialize()
+        {
+            if ( !s_bEnabled ) return;
+
+            s_bEnabled = false;
+            unlink( s_path );
+        }
+
+        void forkChild()
+        {
+            memset( s_threadLive, 0, sizeof( s_threadLive ) );
+            if ( !s_bEnabled ) return;
+
+            // the page and its path belong to the parent, initialize() again maps one under the child's pid
+            s_bEnabled = false;
+            munmap( s_pPage, sizeof( tagStatPage ) );
+            s_pPage = NULL;
+        }
+
+        bool isEnabled()
+        {
+            return s_bEnabled;
+        }
+
+        void recordAlloc( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || pNode->bMock ) return;
+
+            __sync_fetch_and_add( &s_threadLive[ pNode->threadSlot ].liveSize, pNode->size );
+        }
+
+        void recordFree( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( !s_bEnabled || NULL == pNode || pNode->bMock || pNode->threadSlot >= MAX_THREAD_SLOT ) return;
+
+            __sync_fetch_and_sub( &s_threadLive[ pNode->threadSlot ].liveSize, pNode->size );
+        }
+
+        static uint32_t collectSites( size_t* const top )
+        {
+            uint32_t used = 0;
+
+            for ( size_t id = 1; id <= STACK_DEPOT_CAPACITY; ++id ) {
+                const StackDepot::tagStackEntry* pStack = StackDepot::get( id );
+                if ( NULL == pStack || pStack->liveSize <= 0 ) continue;
+
+                size_t pos = ( used < STAT_PAGE_SITES ) ? used++ : STAT_PAGE_SITES;
+                while ( pos > 0 && StackDepot::get( top[ pos - 1 ] )->liveSize < pStack->liveSize ) {
+                    if ( pos < STAT_PAGE_SITES ) top[ pos ] = top[ pos - 1 ];
+                    --pos;
+                }
+                if ( pos < STAT_PAGE_SITES ) top[ pos ] = id;
+            }
+
+            return used;
+        }
+
+        void publish()
+        {
+            if ( !s_bEnabled ) return;
+
+            MemoryManager::tagUnitManager stat;
+            MemoryManager::getStatistics( &stat );
+            Mapping::tagMappingStatistics mapping;
+            Mapping::getStatistics( &mapping );
+
+            size_t   top[ STAT_PAGE_SITES ];
+            uint32_t siteCount  = collectSites( top );
+            uint32_t threadCount = ThreadSlot::count();
+            if ( threadCount > STAT_PAGE_THREADS ) threadCount = STAT_PAGE_THREADS;
+
+            tagStatHook hooks[ STAT_PAGE_OPERATIONS ];
+            for ( uint32_t i = 0; i < STAT_PAGE_OPERATIONS; ++i ) {
+                Profile::tagProfileSummary summary;
+                Profile::summarize( (Profile::Operation)i, Profile::PP_TOTAL, &summary );
+                hooks[i].count      = summary.count;
+                hooks[i].meanCycles = ( 0 == summary.count ) ? 0 : summary.cycles / summary.count;
+                hooks[i].p99Cycles  = summary.p99;
+            }
+
+            // symbolizing takes long, readers would spin on an odd sequence all along
+            char locations[ STAT_PAGE_SITES ][ STAT_PAGE_LOCATION ];
+            for ( uint32_t i = 0; i < siteCount; ++i ) StackDepot::describe( StackDepot::get( top[i] ), locations[i], STAT_PAGE_LOCATION );
+
+            __sync_fetch_and_add( &s_pPage->sequence, 1 );
+            __sync_synchronize();
+
+            s_pPage->updateTime     = realtime();
+            s_pPage->allocCount     = stat.allocCount;
+            s_pPage->allocSize      = stat.allocSize;
+            s_pPage->freeCount      = stat.freeCount;
+            s_pPage->freeSize       = stat.freeSize;
+            s_pPage->peakSize       = stat.peakSize;
+            s_pPage->mappedCount    = mapping.liveCount;
+            s_pPage->mappedSize     = mapping.liveSize;
+
+            s_pPage->threadCount    = threadCount;
+            for ( uint32_t i = 0; i < threadCount; ++i ) {
+                s_pPage->threads[i].tid         = ThreadSlot::threadId( i );
+                s_pPage->threads[i].liveSize    = s_threadLive[i].liveSize;
+            }
+
+            s_pPage->siteCount      = siteCount;
+            for ( uint32_t i = 0; i < siteCount; ++i ) {
+                const StackDepot::tagStackEntry* pStack = StackDepot::get( top[i] );
+                s_pPage->sites[i].hash      = pStack->hash;
+                s_pPage->sites[i].liveCount = pStack->liveCount;
+                s_pPage->sites[i].liveSize  = pStack->liveSize;
+                memcpy( s_pPage->sites[i].location, locations[i], STAT_PAGE_LOCATION );
+            }
+
+            s_pPage->cyclesPerUs    = (uint64_t)Profile::cyclesPerUs();
+            memcpy( s_pPage->hooks, hooks, sizeof( hooks ) );
+
+            __sync_synchronize();
+            __sync_fetch_and_add( &s_pPage->sequence, 1 );
+        }
+    } // namespace StatPage
+} // namespace MemoryTrace
@@ -0,0 +1,81 @@
+#ifndef __CSTATPAGEH__
+#define __CSTATPAGEH__
+
+#include <stdint.h>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define STAT_PAGE_MAGIC         0x314B4F4F484D454DULL   // "MEMHOOK1"
+    #define STAT_PAGE_VERSION       3
+    #define STAT_PAGE_PATH          "/dev/shm/memhook."
+    #define STAT_PAGE_THREADS       128
+    #define STAT_PAGE_SITES         16
+    #define STAT_PAGE_LOCATION      112
+    #define STAT_PAGE_OPERATIONS    6           // Profile::PO_COUNT
+    namespace StatPage
+    {
+        // layout shared with memhook-top, bump STAT_PAGE_VERSION on any change
+        struct tagStatThread
+        {
+            int64_t         tid;
+            int64_t         liveSize;
+        };
+
+        struct tagStatSite
+        {
+            uint64_t        hash;
+            int64_t         liveCount;
+            int64_t         liveSize;
+            char            location[ STAT_PAGE_LOCATION ];
+        };
+
+        // profile=1, the whole hooked call
+        struct tagStatHook
+        {
+            uint64_t        count;
+            uint64_t        meanCycles;
+            uint64_t        p99Cycles;
+        };
+
+        struct tagStatPage
+        {
+            uint64_t        magic;
+            uint32_t        version;
+            uint32_t        pid;
+            char            command[ 32 ];
+
+            // odd while the writer is inside, readers retry until it is even and unchanged
+            volatile uint64_t   sequence;
+
+            uint64_t        startTime;
+            uint64_t        updateTime;
+            uint64_t        allocCount;
+            uint64_t        allocSize;
+            uint64_t        freeCount;
+            uint64_t        freeSize;
+            uint64_t        peakSize;
+            uint64_t        mappedCount;        // mmap=1
+            uint64_t        mappedSize;
+
+            uint32_t        threadCount;
+            uint32_t        siteCount;
+            tagStatThread   threads[ STAT_PAGE_THREADS ];
+            tagStatSite     sites[ STAT_PAGE_SITES ];
+
+            uint64_t        cyclesPerUs;        // 0 when the hook cycles are nanoseconds
+            tagStatHook     hooks[ STAT_PAGE_OPERATIONS ];
+        };
+
+        void                initialize();
+        void                uninitialize();
+        void                forkChild();
+        bool                isEnabled();
+
+        void                recordAlloc( const MemoryManager::tagUnitNode* const );
+        // charged to the thread that allocated the block
+        void                recordFree( const MemoryManager::tagUnitNode* const );
+        void                publish();
+    }; // namespace StatPage
+}; // namespace MemoryTrace
+#endif
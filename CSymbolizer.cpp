@@ -0,0 +1,258 @@
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <cxxabi.h>
+#include <backtrace.h>
+#include "CSymbolizer.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Symbolizer
+    {
+        static pthread_once_t           s_onceInit      = PTHREAD_ONCE_INIT;
+        static pthread_mutex_t          s_mutexCache    = PTHREAD_MUTEX_INITIALIZER;
+        static pthread_mutex_t          s_mutexResolve  = PTHREAD_MUTEX_INITIALIZER;     // one batch at a time
+        static struct backtrace_state*  s_pState        = NULL;
+
+        // table and arena are mapped on the first report, a process that never reports pays nothing
+        static tagSymbol*               s_pTable        = NULL;
+        static char*                    s_pArena        = NULL;
+        static size_t                   s_arenaUsed     = 0;
+
+        static uint32_t*                s_pPending      = NULL;
+        static size_t                   s_pendingCount  = 0;
+        static size_t                   s_pendingNext   = 0;
+        static size_t                   s_pendingBatch  = 0;    // the entries the workers share, the rest queued since
+
+        static void errorCallback( void*, const char*, int )
+        {
+            // missing debug info is reported here, the entry falls back to the symbol table
+        }
+
+        static void initialize()
+        {
+            void* pMap = mmap( NULL, SYMBOL_CACHE_CAPACITY * ( sizeof( tagSymbol ) + sizeof( uint32_t ) ) + SYMBOL_ARENA_SIZE, \
+                                PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( MAP_FAILED == pMap ) return;
+
+            s_pTable    = (tagSymbol*)pMap;
+            s_pPending  = (uint32_t*)( s_pTable + SYMBOL_CACHE_CAPACITY );
+            s_pArena    = (char*)( s_pPending + SYMBOL_CACHE_CAPACITY );
+
+            // one state for the whole process, libbacktrace walks every loaded module itself
+            s_pState    = backtrace_create_state( NULL, 1, errorCallback, NULL );
+        }
+
+        static const char* storeString( const char* const pString )
+        {
+            if ( NULL == pString ) return NULL;
+
+            size_t length   = strlen( pString ) + 1;
+            size_t offset   = __sync_fetch_and_add( &s_arenaUsed, length );
+            if ( offset + length > SYMBOL_ARENA_SIZE ) return NULL;
+
+            memcpy( s_pArena + offset, pString, length );
+            return s_pArena + offset;
+        }
+
+        static const char* storeFunction( const char* const pName )
+        {
+            if ( NULL == pName ) return NULL;
+
+            int status      = 0;
+            char* pDemangled = abi::__cxa_demangle( pName, NULL, NULL, &status );
+            if ( NULL == pDemangled ) return storeString( pName );
+
+            const char* pStored = storeString( pDemangled );
+            free( pDemangled );
+            return pStored;
+        }
+
+        static int pcinfoCallback( void* pData, uintptr_t, const char* pFile, int line, const char* pFunction )
+        {
+            tagSymbol* pSymbol = (tagSymbol*)pData;
+            if ( NULL == pFunction ) return 0;
+
+            // the innermost frame comes first when code was inlined
+            pSymbol->function   = storeFunction( pFunction );
+            pSymbol->file       = storeString( pFile );
+            pSymbol->line       = line;
+            return 1;
+        }
+
+        static void syminfoCallback( void* pData, uintptr_t, const char* pName, uintptr_t, uintptr_t )
+        {
+            tagSymbol* pSymbol = (tagSymbol*)pData;
+            if ( NULL != pName ) pSymbol->function = storeFunction( pName );
+        }
+
+        static void resolveSymbol( tagSymbol* const pSymbol )
+        {
+            // return addresses point behind the call
+            uintptr_t pc = pSymbol->pc - 1;
+
+            if ( NULL != s_pState ) {
+                backtrace_pcinfo( s_pState, pc, pcinfoCallback, errorCallback, pSymbol );
+                if ( NULL == pSymbol->function )
+                    backtrace_syminfo( s_pState, pc, syminfoCallback, errorCallback, pSymbol );
+            }
+
+            Dl_info info;
+            if ( 0 != dladdr( (void*)pc, &info ) ) {
+                pSymbol->module = storeString( info.dli_fname );
+                pSymbol->offset = pSymbol->pc - (uintptr_t)info.dli_fbase;
+                if ( NULL == pSymbol->function && NULL != info.dli_sname )
+                    pSymbol->function = storeFunction( info.dli_sname );
+            }
+
+            __sync_synchronize();
+            pSymbol->state = SS_RESOLVED;
+        }
+
+        // open addressing on the pc, NULL when the table is full around it
+        static tagSymbol* findSymbol( uintptr_t pc, bool* pbInserted )
+        {
+            size_t index = ( pc * 0x9E3779B97F4A7C15ULL ) >> 48;
+            *pbInserted = false;
+
+            for ( size_t probe = 0; probe < 64; ++probe ) {
+                tagSymbol* pSymbol = &s_pTable[ ( index + probe ) & ( SYMBOL_CACHE_CAPACITY - 1 ) ];
+
+                if ( pSymbol->pc == pc ) return pSymbol;
+                if ( SS_EMPTY != pSymbol->state ) continue;
+
+                memset( pSymbol, 0, sizeof( tagSymbol ) );
+                pSymbol->pc     = pc;
+                pSymbol->state  = SS_PENDING;
+                *pbInserted     = true;
+                return pSymbol;
+            }
+
+            return NULL;
+        }
+
+        void prefetch( void* const* backtrace, size_t traceSize )
+        {
+            pthread_once( &s_onceInit, initialize );
+            if ( NULL == s_pTable ) return;
+
+            pthread_mutex_lock( &s_mutexCache );
+            for ( size_t i = 0; i < traceSize; ++i ) {
+                bool bInserted;
+                tagSymbol* pSymbol = findSymbol( (uintptr_t)backtrace[i], &bInserted );
+                if ( bInserted ) s_pPending[ s_pendingCount++ ] = pSymbol - s_pTable;
+            }
+            pthread_mutex_unlock( &s_mutexCache );
+        }
+
+        static void* resolveThread( void* )
+        {
+            for ( ;; ) {
+                size_t next = __sync_fetch_and_add( &s_pendingNext, 1 );
+                if ( next >= s_pendingBatch ) break;
+
+                // a lookup may have claimed it since it was queued
+                tagSymbol* pSymbol = &s_pTable[ s_pPending[ next ] ];
+                if ( __sync_bool_compare_and_swap( &pSymbol->state, SS_PENDING, SS_RESOLVING ) ) resolveSymbol( pSymbol );
+            }
+
+            return NULL;
+        }
+
+        void resolvePending()
+        {
+            if ( NULL == s_pTable ) return;
+
+            // the cache stays open while the workers run, lookups and prefetches of other threads only queue
+            // behind the batch, the state of an entry tells who resolves it
+            pthread_mutex_lock( &s_mutexResolve );
+            pthread_mutex_lock( &s_mutexCache );
+            s_pendingBatch = s_pendingCount;
+            pthread_mutex_unlock( &s_mutexCache );
+
+            // a few hundred frames are not worth a thread
+            size_t threads = s_pendingBatch / 256 + 1;
+            if ( threads > Config::get()->symbolizeThreads ) threads = Config::get()->symbolizeThreads;
+            if ( threads > SYMBOL_MAX_THREADS ) threads = SYMBOL_MAX_THREADS;
+
+            pthread_t workers[ SYMBOL_MAX_THREADS ];
+            size_t started = 0;
+
+            s_pendingNext = 0;
+            for ( ; started + 1 < threads; ++started ) {
+                if ( 0 != pthread_create( &workers[ started ], NULL, resolveThread, NULL ) ) break;
+            }
+
+            resolveThread( NULL );
+            for ( size_t i = 0; i < started; ++i ) pthread_join( workers[i], NULL );
+
+            pthread_mutex_lock( &s_mutexCache );
+            s_pendingCount -= s_pendingBatch;
+            memmove( s_pPending, s_pPending + s_pendingBatch, s_pendingCount * sizeof( uint32_t ) );
+            s_pendingBatch = 0;
+            pthread_mutex_unlock( &s_mutexCache );
+            pthread_mutex_unlock( &s_mutexResolve );
+        }
+
+        const tagSymbol* lookup( void* pc, tagSymbol* const pFallback )
+        {
+            pthread_once( &s_onceInit, initialize );
+
+            tagSymbol* pSymbol = NULL;
+            bool bClaimed = false;
+            if ( NULL != s_pTable ) {
+                bool bInserted;
+                pthread_mutex_lock( &s_mutexCache );
+                pSymbol = findSymbol( (uintptr_t)pc, &bInserted );
+                // only the thread that moves the entry out of pending writes its fields
+                if ( NULL != pSymbol ) bClaimed = __sync_bool_compare_and_swap( &pSymbol->state, SS_PENDING, SS_RESOLVING );
+                pthread_mutex_unlock( &s_mutexCache );
+            }
+
+            if ( NULL == pSymbol ) {
+                pSymbol = pFallback;
+                memset( pSymbol, 0, sizeof( tagSymbol ) );
+                pSymbol->pc = (uintptr_t)pc;
+                bClaimed = true;
+            }
+
+            if ( bClaimed ) {
+                resolveSymbol( pSymbol );
+            } else {
+                while ( SS_RESOLVED != pSymbol->state ) sched_yield();
+            }
+            return pSymbol;
+        }
+
+        int describe( void* pc, size_t index, char* const line, size_t length )
+        {
+            tagSymbol fallback;
+            const tagSymbol* pSymbol = lookup( pc, &fallback );
+
+            int used = snprintf( line, length, "\t#%-2ld %p in %s", index, pc, ( NULL != pSymbol->function ) ? pSymbol->function : "??" );
+            if ( NULL != pSymbol->file && used < (int)length )
+                used += snprintf( line + used, length - used, " at %s:%d", pSymbol->file, pSymbol->line );
+            if ( NULL != pSymbol->module && used < (int)length )
+                used += snprintf( line + used, length - used, " (%s+0x%lx)", pSymbol->module, pSymbol->offset );
+
+            return ( used < (int)length ) ? used : (int)length - 1;
+        }
+
+        // never inside a batch, the child would wait on entries its missing workers claimed
+        void forkPrepare()
+        {
+            pthread_mutex_lock( &s_mutexResolve );
+            pthread_mutex_lock( &s_mutexCache );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexCache );
+            pthread_mutex_unlock( &s_mutexResolve );
+        }
+    } // namespace Symbolizer
+} // namespace MemoryTrace
@@ -0,0 +1,49 @@
+#ifndef __CSYMBOLIZERH__
+#define __CSYMBOLIZERH__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cstdio>
+
+namespace MemoryTrace
+{
+    #define SYMBOL_CACHE_CAPACITY   65536
+    #define SYMBOL_ARENA_SIZE       ( 16 * 1024 * 1024 )
+    #define SYMBOL_MAX_THREADS      16
+    namespace Symbolizer
+    {
+        enum SymbolState
+        {
+            SS_EMPTY = 0,
+            SS_PENDING,
+            SS_RESOLVING,       // claimed by one thread, the others wait for it
+            SS_RESOLVED,
+        };
+
+        // one entry per unique pc, strings live in the symbolizer arena
+        struct tagSymbol
+        {
+            uintptr_t       pc;
+            volatile int    state;
+
+            const char*     function;
+            const char*     file;
+            int             line;
+            const char*     module;
+            uintptr_t       offset;
+        };
+
+        // queue the frames of a backtrace, resolvePending() then spreads them over worker threads
+        void                prefetch( void* const* backtrace, size_t traceSize );
+        void                resolvePending();
+
+        const tagSymbol*    lookup( void* pc, tagSymbol* const pFallback );
+        // one frame as "\t#index pc in function at file:line (module+offset)", returns the length written
+        int                 describe( void* pc, size_t index, char* const line, size_t length );
+
+        // cache lock held across fork()
+        void                forkPrepare();
+        void                forkRelease();
+    }; // namespace Symbolizer
+}; // namespace MemoryTrace
+#endif
@@ -0,0 +1,285 @@
+#include <string.h>
+#include <stdlib.h>
+#include <cstdio>
+#include <pthread.h>
+#include "CTag.h"
+#include "CConfig.h"
+#include "CThreadSlot.h"
+#include "CArena.h"
+
+namespace MemoryTrace
+{
+    namespace Tag
+    {
+        static tagTagName       s_names[ TAG_NAME_CAPACITY ];
+        static tagTagPath       s_paths[ TAG_PATH_CAPACITY ];
+        static volatile bool    s_bUsed         = false;
+
+        // TAG_PATH_CAPACITY counters per thread slot, from the metadata arena with the slot's first tagged block
+        static tagTagCounters* volatile s_slotCounters[ MAX_THREAD_SLOT ];
+
+        static __thread uint32_t t_path __attribute__ (( tls_model( "initial-exec" ) )) = 0;
+
+        static pthread_mutex_t  s_mutexReport   = PTHREAD_MUTEX_INITIALIZER;
+        static tagTagCounters   s_totals[ TAG_NAME_CAPACITY ];
+        static tagTagCounters*  s_pathTotals    = NULL;     // metadata arena, with the first report
+        static uint32_t         s_order[ TAG_PATH_CAPACITY ];
+
+        static uint64_t hashName( const char* name )
+        {
+            // FNV-1a, names longer than the stored size are told apart by the hash
+            uint64_t hash = 0xCBF29CE484222325;
+            for ( ; '\0' != *name; ++name ) {
+                hash ^= (unsigned char)*name;
+                hash *= 0x100000001B3;
+            }
+            return ( 0 == hash ) ? 1 : hash;
+        }
+
+        static uint32_t internName( const char* name )
+        {
+            uint64_t hash = hashName( name );
+            size_t index = hash & ( TAG_NAME_CAPACITY - 1 );
+
+            for ( size_t probe = 0; probe < TAG_PATH_PROBE; ++probe ) {
+                tagTagName* pEntry = &s_names[ index ];
+
+                uint64_t current = pEntry->hash;
+                if ( 0 == current ) {
+                    current = __sync_val_compare_and_swap( &pEntry->hash, 0, hash );
+                    if ( 0 == current ) {
+                        strncpy( pEntry->name, name, TAG_NAME_SIZE - 1 );
+                        __sync_synchronize();
+                        pEntry->bReady = true;
+                        return index + 1;
+                    }
+                }
+
+                // the same hash is not the same name, the stored part has to match as well
+                if ( current == hash ) {
+                    while ( !pEntry->bReady ) ;
+                    if ( 0 == strncmp( pEntry->name, name, TAG_NAME_SIZE - 1 ) ) return index + 1;
+                }
+
+                index = ( index + 1 ) & ( TAG_NAME_CAPACITY - 1 );
+            }
+
+            return 0;
+        }
+
+        static uint32_t internPath( uint32_t parent, uint32_t nameId )
+        {
+            uint64_t key = ( (uint64_t)parent << 32 ) | nameId;
+            size_t index = ( key * 0x9E3779B97F4A7C15ULL >> 32 ) & ( TAG_PATH_CAPACITY - 1 );
+
+            for ( size_t probe = 0; probe < TAG_PATH_PROBE; ++probe ) {
+                tagTagPath* pEntry = &s_paths[ index ];
+
+                uint64_t current = pEntry->key;
+                if ( 0 == current ) {
+                    current = __sync_val_compare_and_swap( &pEntry->key, 0, key );
+                    if ( 0 == current ) {
+                        pEntry->parent = parent;
+                        pEntry->nameId = nameId;
+                        __sync_synchronize();
+                        pEntry->bReady = true;
+                        return index + 1;
+                    }
+                }
+
+                if ( current == key ) return index + 1;
+
+                index = ( index + 1 ) & ( TAG_PATH_CAPACITY - 1 );
+            }
+
+            return 0;
+        }
+
+        uint32_t push( const char* name )
+        {
+            uint32_t token = t_path;
+            if ( NULL == name ) return token;
+
+            // a full table keeps the allocations on the enclosing path
+            uint32_t nameId = internName( name );
+            uint32_t path   = ( 0 == nameId ) ? 0 : internPath( token, nameId );
+            if ( 0 != path ) t_path = path;
+
+            s_bUsed = true;
+            return token;
+        }
+
+        void pop( uint32_t token )
+        {
+            t_path = token;
+        }
+
+        uint32_t current()
+        {
+            return t_path;
+        }
+
+        // the counters of the calling thread, NULL once the arena is exhausted
+        static tagTagCounters* slotCounters()
+        {
+            tagTagCounters* volatile* ppCounters = &s_slotCounters[ ThreadSlot::current() ];
+            if ( NULL != *ppCounters ) return *ppCounters;
+
+            tagTagCounters* pCounters = (tagTagCounters*)Arena::allocate( TAG_PATH_CAPACITY * sizeof( tagTagCounters ) );
+            if ( NULL == pCounters ) return NULL;
+            // threads past MAX_THREAD_SLOT share a slot, one of them puts its counters there first
+            __sync_bool_compare_and_swap( ppCounters, (tagTagCounters*)NULL, pCounters );
+            return *ppCounters;
+        }
+
+        // the slot may be shared, the adds stay atomic but no longer bounce between threads
+        void recordAlloc( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( NULL == pNode || 0 == pNode->tagId || pNode->tagId > TAG_PATH_CAPACITY ) return;
+
+            tagTagCounters* pCounters = slotCounters();
+            if ( NULL == pCounters ) return;
+
+            tagTagCounters* pPath = &pCounters[ pNode->tagId - 1 ];
+            __atomic_fetch_add( &pPath->liveCount, 1, __ATOMIC_RELAXED );
+            __atomic_fetch_add( &pPath->liveSize, pNode->size, __ATOMIC_RELAXED );
+            __atomic_fetch_add( &pPath->allocCount, 1, __ATOMIC_RELAXED );
+            __atomic_fetch_add( &pPath->allocSize, pNode->size, __ATOMIC_RELAXED );
+        }
+
+        // charged to the freeing thread, only the sum over the slots means anything
+        void recordFree( const MemoryManager::tagUnitNode* const pNode )
+        {
+            if ( NULL == pNode || 0 == pNode->tagId || pNode->tagId > TAG_PATH_CAPACITY ) return;
+
+            tagTagCounters* pCounters = slotCounters();
+            if ( NULL == pCounters ) return;
+
+            tagTagCounters* pPath = &pCounters[ pNode->tagId - 1 ];
+            __atomic_fetch_sub( &pPath->liveCount, 1, __ATOMIC_RELAXED );
+            __atomic_fetch_sub( &pPath->liveSize, pNode->size, __ATOMIC_RELAXED );
+        }
+
+        size_t describe( uint32_t path, char* const buffer, size_t length )
+        {
+            uint32_t chain[ TAG_PATH_DEPTH ];
+            size_t depth = 0;
+
+            for ( ; 0 != path && depth < TAG_PATH_DEPTH; path = s_paths[ path - 1 ].parent ) chain[ depth++ ] = path;
+
+            size_t pos = 0;
+            for ( size_t i = depth; i > 0 && pos < length; --i ) {
+                const tagTagName* pName = &s_names[ s_paths[ chain[ i - 1 ] - 1 ].nameId - 1 ];
+                pos += snprintf( buffer + pos, length - pos, "%s%s", ( i == depth ) ? "" : "/", pName->name );
+            }
+            return pos;
+        }
+
+        static int compareTotals( const void* pLeft, const void* pRight )
+        {
+            int64_t left = s_totals[ *(const uint32_t*)pLeft ].liveSize, right = s_totals[ *(const uint32_t*)pRight ].liveSize;
+            return ( left == right ) ? 0 : ( ( left > right ) ? -1 : 1 );
+        }
+
+        static int comparePaths( const void* pLeft, const void* pRight )
+        {
+            int64_t left = s_pathTotals[ *(const uint32_t*)pLeft ].liveSize, right = s_pathTotals[ *(const uint32_t*)pRight ].liveSize;
+            return ( left == right ) ? 0 : ( ( left > right ) ? -1 : 1 );
+        }
+
+        static void showTotal( const char* const name, int64_t liveCount, int64_t liveSize, uint64_t allocCount, uint64_t allocSize )
+        {
+            fprintf( Config::output(), "\t%s: live count: %ld, live size: %ld, allocated count: %lu, allocated size: %lu\n", \
+                            name, \
+                            liveCount, \
+                            liveSize, \
+                            allocCount, \
+                            allocSize );
+        }
+
+        void report()
+        {
+            if ( !s_bUsed || Config::TM_OFF == Config::get()->mode ) return;
+
+            pthread_mutex_lock( &s_mutexReport );
+            if ( NULL == s_pathTotals ) s_pathTotals = (tagTagCounters*)Arena::allocate( TAG_PATH_CAPACITY * sizeof( tagTagCounters ) );
+            if ( NULL == s_pathTotals ) { pthread_mutex_unlock( &s_mutexReport ); return; }
+
+            memset( s_totals, 0, sizeof( s_totals ) );
+            memset( s_pathTotals, 0, TAG_PATH_CAPACITY * sizeof( tagTagCounters ) );
+            for ( size_t slot = 0; slot < MAX_THREAD_SLOT; ++slot ) {
+                const tagTagCounters* pCounters = s_slotCounters[ slot ];
+                if ( NULL == pCounters ) continue;
+
+                for ( uint32_t i = 0; i < TAG_PATH_CAPACITY; ++i ) {
+                    if ( 0 == pCounters[i].allocCount && 0 == pCounters[i].liveCount ) continue;
+
+                    s_pathTotals[i].liveCount   += pCounters[i].liveCount;
+                    s_pathTotals[i].liveSize    += pCounters[i].liveSize;
+                    s_pathTotals[i].allocCount  += pCounters[i].allocCount;
+                    s_pathTotals[i].allocSize   += pCounters[i].allocSize;
+                }
+            }
+
+            // a tag counts everything allocated under it, once even when it nests in itself
+            size_t pathCount = 0;
+            for ( uint32_t i = 0; i < TAG_PATH_CAPACITY; ++i ) {
+                const tagTagCounters* pPath = &s_pathTotals[i];
+                if ( !s_paths[i].bReady || 0 == pPath->allocCount ) continue;
+
+                s_order[ pathCount++ ] = i;
+
+                uint32_t seen[ TAG_PATH_DEPTH ];
+                size_t seenCount = 0;
+                for ( uint32_t path = i + 1; 0 != path && seenCount < TAG_PATH_DEPTH; path = s_paths[ path - 1 ].parent ) {
+                    uint32_t nameId = s_paths[ path - 1 ].nameId;
+
+                    bool bSeen = false;
+                    for ( size_t k = 0; k < seenCount && !bSeen; ++k ) bSeen = seen[k] == nameId;
+                    if ( bSeen ) continue;
+                    seen[ seenCount++ ] = nameId;
+
+                    tagTagCounters* pTotal = &s_totals[ nameId - 1 ];
+                    pTotal->liveCount   += pPath->liveCount;
+                    pTotal->liveSize    += pPath->liveSize;
+                    pTotal->allocCount  += pPath->allocCount;
+                    pTotal->allocSize   += pPath->allocSize;
+                }
+            }
+
+            uint32_t nameOrder[ TAG_NAME_CAPACITY ];
+            size_t nameCount = 0;
+            for ( uint32_t i = 0; i < TAG_NAME_CAPACITY; ++i ) {
+                if ( s_names[i].bReady && 0 != s_totals[i].allocCount ) nameOrder[ nameCount++ ] = i;
+            }
+
+            qsort( nameOrder, nameCount, sizeof( uint32_t ), compareTotals );
+            qsort( s_order, pathCount, sizeof( uint32_t ), comparePaths );
+
+            fprintf( Config::output(), "tags: %ld, tag paths: %ld\n", nameCount, pathCount );
+            fprintf( Config::output(), "by tag, including nested tags:\n" );
+            for ( size_t i = 0; i < nameCount && i < TAG_REPORT_MAX; ++i ) {
+                const tagTagCounters* pTotal = &s_totals[ nameOrder[i] ];
+                showTotal( s_names[ nameOrder[i] ].name, pTotal->liveCount, pTotal->liveSize, pTotal->allocCount, pTotal->allocSize );
+            }
+
+            fprintf( Config::output(), "by tag path:\n" );
+            for ( size_t i = 0; i < pathCount && i < TAG_REPORT_MAX; ++i ) {
+                const tagTagCounters* pPath = &s_pathTotals[ s_order[i] ];
+
+                char name[ 512 ];
+                describe( s_order[i] + 1, name, sizeof( name ) );
+                showTotal( name, pPath->liveCount, pPath->liveSize, pPath->allocCount, pPath->allocSize );
+            }
+
+            pthread_mutex_unlock( &s_mutexReport );
+        }
+
+        void forkChild()
+        {
+            for ( size_t slot = 0; slot < MAX_THREAD_SLOT; ++slot ) {
+                if ( NULL != s_slotCounters[ slot ] ) memset( s_slotCounters[ slot ], 0, TAG_PATH_CAPACITY * sizeof( tagTagCounters ) );
+            }
+        }
+    } // namespace Tag
+} // namespace MemoryTrace
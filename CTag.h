@@ -0,0 +1,56 @@
+#ifndef __CTAGH__
+#define __CTAGH__
+
+#include <stdint.h>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define TAG_NAME_CAPACITY       1024
+    #define TAG_NAME_SIZE           32
+    #define TAG_PATH_CAPACITY       4096
+    #define TAG_PATH_PROBE          64
+    #define TAG_PATH_DEPTH          32
+    #define TAG_REPORT_MAX          64
+    namespace Tag
+    {
+        struct tagTagName
+        {
+            uint64_t        hash;
+            volatile bool   bReady;
+            char            name[ TAG_NAME_SIZE ];
+        };
+
+        // one entry per distinct nesting of tags, nodes keep the id ( index + 1, 0 is untagged )
+        struct tagTagPath
+        {
+            uint64_t        key;
+            volatile bool   bReady;
+            uint32_t        parent;
+            uint32_t        nameId;
+        };
+
+        // what was allocated under a path, kept per thread slot and summed by the report
+        struct tagTagCounters
+        {
+            int64_t         liveCount;
+            int64_t         liveSize;
+            uint64_t        allocCount;
+            uint64_t        allocSize;
+        };
+
+        // MEMHOOK_SCOPE, the token is the path to restore
+        uint32_t            push( const char* name );
+        void                pop( uint32_t token );
+        uint32_t            current();
+
+        void                recordAlloc( const MemoryManager::tagUnitNode* const );
+        void                recordFree( const MemoryManager::tagUnitNode* const );
+        // tag names of the path joined by '/'
+        size_t              describe( uint32_t path, char* const buffer, size_t length );
+        void                report();
+        // the paths stay, their counters start at 0 in a forked child
+        void                forkChild();
+    }; // namespace Tag
+}; // namespace MemoryTrace
+#endif
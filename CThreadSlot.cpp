@@ -0,0 +1,40 @@
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "CThreadSlot.h"
+
+namespace MemoryTrace
+{
+    namespace ThreadSlot
+    {
+        static size_t s_slotCount = 0;
+        static pid_t  s_threadIds[ MAX_THREAD_SLOT ];
+        static __thread size_t t_slot __attribute__ (( tls_model( "initial-exec" ) )) = (size_t)-1;
+
+        size_t current()
+        {
+            if ( (size_t)-1 == t_slot ) {
+                t_slot = __sync_fetch_and_add( &s_slotCount, 1 ) % MAX_THREAD_SLOT;
+                s_threadIds[ t_slot ] = (pid_t)syscall( SYS_gettid );
+            }
+
+            return t_slot;
+        }
+
+        size_t count()
+        {
+            size_t slotCount = s_slotCount;
+
+            return ( slotCount < MAX_THREAD_SLOT ) ? slotCount : MAX_THREAD_SLOT;
+        }
+
+        pid_t threadId( size_t slot )
+        {
+            return ( slot < MAX_THREAD_SLOT ) ? s_threadIds[ slot ] : 0;
+        }
+
+        void forkChild()
+        {
+            if ( (size_t)-1 != t_slot ) s_threadIds[ t_slot ] = (pid_t)syscall( SYS_gettid );
+        }
+    } // namespace ThreadSlot
+} // namespace MemoryTrace
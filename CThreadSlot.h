@@ -0,0 +1,38 @@
+#ifndef __CTHREADSLOTH__
+#define __CTHREADSLOTH__
+
+#include <stddef.h>
+#include <sys/types.h>
+
+namespace MemoryTrace
+{
+    #define MAX_THREAD_SLOT     128
+    namespace ThreadSlot
+    {
+        // per-thread data is kept in fixed arrays of MAX_THREAD_SLOT entries, 
+        // once more threads than slots were seen, slots are shared and the lock matters
+        struct tagSpinLock
+        {
+            volatile int    lock;
+        };
+
+        inline void lock( tagSpinLock* pLock )
+        {
+            while ( __sync_lock_test_and_set( &pLock->lock, 1 ) ) {
+                while ( pLock->lock ) ;
+            }
+        }
+
+        inline void unlock( tagSpinLock* pLock )
+        {
+            __sync_lock_release( &pLock->lock );
+        }
+
+        size_t              current();
+        size_t              count();
+        pid_t               threadId( size_t slot );
+        // the forking thread keeps its slot under a new thread id
+        void                forkChild();
+    }; // namespace ThreadSlot
+}; // namespace MemoryTrace
+#endif
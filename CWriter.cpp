@@ -0,0 +1,441 @@
+#include <string.h>
+#include <cstdio>
+#include <dlfcn.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "CWriter.h"
+#include "CSymbolizer.h"
+#include "CConfig.h"
+
+namespace MemoryTrace
+{
+    namespace Writer
+    {
+        static FILE*            s_pStream       = NULL;
+        static pthread_mutex_t  s_mutexWriter   = PTHREAD_MUTEX_INITIALIZER;
+        static int              s_depth         = 0;
+
+        // mapped with the first output, a process that never reports pays nothing
+        static char*            s_pBuffer       = NULL;
+        static size_t           s_used          = 0;
+        static uint8_t*         s_pPacked       = NULL;
+        static uint32_t*        s_pTable        = NULL;
+        static bool             s_bMapped       = false;
+
+        // json and csv wrap every line of the text sections, a line may come in several writes
+        static char             s_line[ WRITER_LINE_SIZE ];
+        static size_t           s_lineLength    = 0;
+
+        // one record formatted before it is put, json escapes may double a frame
+        struct tagRecord
+        {
+            char            text[ WRITER_LINE_SIZE * ( BACKTRACE_DEPTH + 4 ) ];
+            size_t          length;
+        };
+
+        static void map()
+        {
+            s_bMapped = true;
+
+            size_t size = WRITER_BUFFER_SIZE + WRITER_PACK_BOUND( WRITER_BUFFER_SIZE ) + ( sizeof( uint32_t ) << WRITER_PACK_HASH );
+            void* pMap = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+            if ( MAP_FAILED == pMap ) return;
+
+            s_pBuffer   = (char*)pMap;
+            s_pPacked   = (uint8_t*)( s_pBuffer + WRITER_BUFFER_SIZE );
+            s_pTable    = (uint32_t*)( s_pPacked + WRITER_PACK_BOUND( WRITER_BUFFER_SIZE ) );
+        }
+
+        static void writeAll( const void* pData, size_t size )
+        {
+            int fd = Config::outputFd();
+            const char* pPos = (const char*)pData;
+
+            while ( size > 0 ) {
+                ssize_t written = write( fd, pPos, size );
+                if ( written <= 0 ) return;
+                pPos += written;
+                size -= written;
+            }
+        }
+
+        static inline uint32_t read32( const uint8_t* p )
+        {
+            uint32_t value;
+            memcpy( &value, p, sizeof( value ) );
+            return value;
+        }
+
+        static inline uint8_t* putLength( uint8_t* pOut, size_t length )
+        {
+            while ( length >= 255 ) { *pOut++ = 255; length -= 255; }
+            *pOut++ = (uint8_t)length;
+            return pOut;
+        }
+
+        static uint8_t* putSequence( uint8_t* pOut, const uint8_t* pLiterals, size_t literals, size_t offset, size_t length )
+        {
+            uint8_t* pToken = pOut++;
+            *pToken = (uint8_t)( ( ( literals < 15 ) ? literals : 15 ) << 4 );
+            if ( literals >= 15 ) pOut = putLength( pOut, literals - 15 );
+            memcpy( pOut, pLiterals, literals );
+            pOut += literals;
+
+            if ( 0 == length ) return pOut;
+
+            *pOut++ = (uint8_t)offset;
+            *pOut++ = (uint8_t)( offset >> 8 );
+            length -= 4;
+            *pToken |= (uint8_t)( ( length < 15 ) ? length : 15 );
+            if ( length >= 15 ) pOut = putLength( pOut, length - 15 );
+            return pOut;
+        }
+
+        // greedy LZ4 block, one hash probe per position. reports repeat their frames and markers,
+        // which is all it has to find
+        size_t pack( const uint8_t* const pIn, size_t size, uint8_t* const pOut, uint32_t* const pTable )
+        {
+            uint8_t* pPos   = pOut;
+            size_t anchor   = 0;
+            size_t pos      = 0;
+
+            memset( pTable, 0, sizeof( uint32_t ) << WRITER_PACK_HASH );
+
+            // the format wants the last bytes as literals
+            while ( size > 12 && pos < size - 12 ) {
+                uint32_t sequence = read32( pIn + pos );
+                uint32_t hash = ( sequence * 2654435761U ) >> ( 32 - WRITER_PACK_HASH );
+                size_t candidate = pTable[ hash ];
+                pTable[ hash ] = (uint32_t)pos;
+
+                if ( candidate >= pos || pos - candidate > 65535 || read32( pIn + candidate ) != sequence ) { ++pos; continue; }
+
+                size_t length = 4;
+                while ( pos + length < size - 5 && pIn[ candidate + length ] == pIn[ pos + length ] ) ++length;
+
+                pPos    = putSequence( pPos, pIn + anchor, pos - anchor, pos - candidate, length );
+                pos    += length;
+                anchor  = pos;
+            }
+
+            pPos = putSequence( pPos, pIn + anchor, size - anchor, 0, 0 );
+            return pPos - pOut;
+        }
+
+        // writer lock held
+        static void send( const char* pData, size_t size )
+        {
+            if ( 0 == size ) return;
+
+            if ( !Config::get()->bCompress || NULL == s_pPacked ) { writeAll( pData, size ); return; }
+
+            while ( size > 0 ) {
+                size_t chunk = ( size < WRITER_BUFFER_SIZE ) ? size : WRITER_BUFFER_SIZE;
+                size_t packed = pack( (const uint8_t*)pData, chunk, s_pPacked, s_pTable );
+
+                tagPackHeader header = { WRITER_PACK_MAGIC, (uint32_t)chunk, (uint32_t)( ( packed < chunk ) ? packed : chunk ) };
+                writeAll( &header, sizeof( header ) );
+                writeAll( ( packed < chunk ) ? (const void*)s_pPacked : (const void*)pData, header.packedSize );
+
+                pData += chunk;
+                size  -= chunk;
+            }
+        }
+
+        static void flush()
+        {
+            send( s_pBuffer, s_used );
+            s_used = 0;
+        }
+
+        // writer lock held
+        static void emit( const char* pData, size_t size )
+        {
+            if ( !s_bMapped ) map();
+
+            if ( 0 == s_depth || NULL == s_pBuffer ) {
+                flush();
+                send( pData, size );
+                return;
+            }
+
+            while ( size > 0 ) {
+                size_t chunk = WRITER_BUFFER_SIZE - s_used;
+                if ( chunk > size ) chunk = size;
+
+                memcpy( s_pBuffer + s_used, pData, chunk );
+                s_used += chunk;
+                pData  += chunk;
+                size   -= chunk;
+                if ( WRITER_BUFFER_SIZE == s_used ) flush();
+            }
+        }
+
+        static void put( tagRecord* const pRecord, const char* pText, size_t length )
+        {
+            size_t room = sizeof( pRecord->text ) - pRecord->length;
+            if ( length > room ) length = room;
+
+            memcpy( pRecord->text + pRecord->length, pText, length );
+            pRecord->length += length;
+        }
+
+        static void put( tagRecord* const pRecord, const char* pText )
+        {
+            put( pRecord, pText, strlen( pText ) );
+        }
+
+        static void putFormat( tagRecord* const pRecord, const char* pFormat, size_t value )
+        {
+            size_t room = sizeof( pRecord->text ) - pRecord->length;
+            if ( 0 == room ) return;
+
+            int length = snprintf( pRecord->text + pRecord->length, room, pFormat, value );
+
+            if ( length > 0 ) pRecord->length += ( (size_t)length < room ) ? length : room - 1;
+        }
+
+        // json string or csv field contents, quotes are doubled in csv and escaped in json
+        static void putEscaped( tagRecord* const pRecord, const char* pText, size_t length )
+        {
+            bool bJson = Config::OF_JSON == Config::get()->format;
+
+            for ( size_t i = 0; i < length; ++i ) {
+                char c = pText[i];
+                if ( '"' == c ) put( pRecord, bJson ? "\\\"" : "\"\"" );
+                else if ( bJson && '\\' == c ) put( pRecord, "\\\\" );
+                else if ( bJson && '\t' == c ) put( pRecord, "\\t" );
+                else if ( (unsigned char)c < 0x20 ) put( pRecord, " " );
+                else put( pRecord, &c, 1 );
+            }
+        }
+
+        // writer lock held, a finished line of a text section
+        static void emitLine( const char* pText, size_t length )
+        {
+            tagRecord record;
+            record.length = 0;
+
+            put( &record, ( Config::OF_JSON == Config::get()->format ) ? "{\"type\":\"text\",\"text\":\"" : "text,,,,,,\"" );
+            putEscaped( &record, pText, length );
+            put( &record, ( Config::OF_JSON == Config::get()->format ) ? "\"}\n" : "\"\n" );
+            emit( record.text, record.length );
+        }
+
+        // writer lock held
+        static void text( const char* pData, size_t size )
+        {
+            if ( Config::OF_TEXT == Config::get()->format ) { emit( pData, size ); return; }
+
+            for ( size_t i = 0; i < size; ++i ) {
+                if ( '\n' == pData[i] ) {
+                    emitLine( s_line, s_lineLength );
+                    s_lineLength = 0;
+                } else if ( s_lineLength < WRITER_LINE_SIZE ) {
+                    s_line[ s_lineLength++ ] = pData[i];
+                }
+            }
+        }
+
+        static ssize_t writeStream( void*, const char* pData, size_t size )
+        {
+            pthread_mutex_lock( &s_mutexWriter );
+            text( pData, size );
+            pthread_mutex_unlock( &s_mutexWriter );
+
+            return size;
+        }
+
+        // as backtrace_symbols_fd has it without the symbolizer, module(symbol+offset)[address]
+        static void putFrame( tagRecord* const pRecord, void* pc, size_t index )
+        {
+            char line[ WRITER_LINE_SIZE ];
+            int length = 0;
+
+            if ( Config::get()->symbolizeThreads > 0 ) {
+                length = Symbolizer::describe( pc, index, line, sizeof( line ) );
+            } else {
+                Dl_info info;
+                if ( 0 != dladdr( pc, &info ) && NULL != info.dli_fname && '\0' != info.dli_fname[0] ) {
+                    uintptr_t base = ( NULL != info.dli_sname ) ? (uintptr_t)info.dli_saddr : (uintptr_t)info.dli_fbase;
+                    length = snprintf( line, sizeof( line ), "%s(%s+0x%lx)[%p]", info.dli_fname, \
+                                        ( NULL != info.dli_sname ) ? info.dli_sname : "", (uintptr_t)pc - base, pc );
+                } else {
+                    length = snprintf( line, sizeof( line ), "[%p]", pc );
+                }
+            }
+            if ( length < 0 ) length = 0;
+            if ( length >= (int)sizeof( line ) ) length = sizeof( line ) - 1;
+
+            if ( Config::OF_TEXT == Config::get()->format ) { put( pRecord, line, length ); return; }
+
+            // a field of its own needs no indent
+            const char* pLine = line;
+            while ( length > 0 && '\t' == *pLine ) { ++pLine; --length; }
+            putEscaped( pRecord, pLine, length );
+        }
+
+        void initialize()
+        {
+            // the FILE comes from the mock allocator while initializing, unbuffered since the writer buffers
+            cookie_io_functions_t functions = { NULL, writeStream, NULL, NULL };
+            FILE* pStream = fopencookie( NULL, "w", functions );
+            if ( NULL == pStream ) return;
+
+            setvbuf( pStream, NULL, _IONBF, 0 );
+            s_pStream = pStream;
+        }
+
+        void forkPrepare()
+        {
+            pthread_mutex_lock( &s_mutexWriter );
+        }
+
+        void forkRelease()
+        {
+            pthread_mutex_unlock( &s_mutexWriter );
+        }
+
+        FILE* stream()
+        {
+            return ( NULL != s_pStream ) ? s_pStream : stderr;
+        }
+
+        void begin()
+        {
+            pthread_mutex_lock( &s_mutexWriter );
+            s_depth++;
+            pthread_mutex_unlock( &s_mutexWriter );
+        }
+
+        void end()
+        {
+            pthread_mutex_lock( &s_mutexWriter );
+            if ( 0 == --s_depth ) flush();
+            pthread_mutex_unlock( &s_mutexWriter );
+        }
+
+        void backtrace( void* const* backtrace, size_t traceSize )
+        {
+            for ( size_t i = 0; i < traceSize; ++i ) {
+                tagRecord record;
+                record.length = 0;
+                putFrame( &record, backtrace[i], i );
+                put( &record, "\n" );
+
+                pthread_mutex_lock( &s_mutexWriter );
+                text( record.text, record.length );
+                pthread_mutex_unlock( &s_mutexWriter );
+            }
+        }
+
+        size_t renderBacktrace( void* const* backtrace, size_t traceSize, char* const pText, size_t size )
+        {
+            size_t used = 0;
+            for ( size_t i = 0; i < traceSize; ++i ) {
+                tagRecord record;
+                record.length = 0;
+                putFrame( &record, backtrace[i], i );
+                put( &record, "\n" );
+
+                // whole frames only
+                if ( record.length > size - used ) break;
+                memcpy( pText + used, record.text, record.length );
+                used += record.length;
+            }
+            return used;
+        }
+
+        void writeRendered( const char* pText, size_t length )
+        {
+            pthread_mutex_lock( &s_mutexWriter );
+            text( pText, length );
+            pthread_mutex_unlock( &s_mutexWriter );
+        }
+
+        void summary( size_t count, size_t size )
+        {
+            tagRecord record;
+            record.length = 0;
+
+            switch ( Config::get()->format ) {
+            case Config::OF_JSON:
+                putFormat( &record, "{\"type\":\"unfreed\",\"count\":%lu", count );
+                putFormat( &record, ",\"size\":%lu}\n", size );
+                break;
+            case Config::OF_CSV:
+                put( &record, "type,address,size,count,serial,tag,detail\n" );
+                putFormat( &record, "unfreed,,%lu", size );
+                putFormat( &record, ",%lu,,,\n", count );
+                break;
+            default:
+                putFormat( &record, "unfreed \n \tcount: %ld\n", count );
+                putFormat( &record, "\tsize: %ld\n", size );
+                break;
+            }
+
+            pthread_mutex_lock( &s_mutexWriter );
+            emit( record.text, record.length );
+            pthread_mutex_unlock( &s_mutexWriter );
+        }
+
+        void block( const MemoryManager::tagUnitRecord* const pRecord, const char* pTag )
+        {
+            tagRecord record;
+            record.length = 0;
+            Config::OutputFormat format = Config::get()->format;
+
+            if ( pRecord->bMock ) {
+                if ( Config::OF_JSON == format ) {
+                    putFormat( &record, "{\"type\":\"mock\",\"size\":%lu", pRecord->size );
+                    putFormat( &record, ",\"serial\":%lu}\n", pRecord->serial );
+                } else if ( Config::OF_CSV == format ) {
+                    putFormat( &record, "mock,,%lu,1", pRecord->size );
+                    putFormat( &record, ",%lu,,\n", pRecord->serial );
+                } else {
+                    putFormat( &record, "allocted by mock, size: %ld", pRecord->size );
+                    putFormat( &record, ", serial: %ld\n", pRecord->serial );
+                }
+            } else if ( Config::OF_JSON == format ) {
+                putFormat( &record, "{\"type\":\"block\",\"address\":\"0x%lx\"", (size_t)pRecord->pNode );
+                putFormat( &record, ",\"size\":%lu", pRecord->size );
+                putFormat( &record, ",\"serial\":%lu", pRecord->serial );
+                if ( NULL != pTag ) { put( &record, ",\"tag\":\"" ); putEscaped( &record, pTag, strlen( pTag ) ); put( &record, "\"" ); }
+                put( &record, ",\"frames\":[" );
+                for ( size_t i = 0; i < pRecord->traceSize; ++i ) {
+                    put( &record, ( 0 == i ) ? "\"" : ",\"" );
+                    putFrame( &record, pRecord->backtrace[i], i );
+                    put( &record, "\"" );
+                }
+                put( &record, "]}\n" );
+            } else if ( Config::OF_CSV == format ) {
+                putFormat( &record, "block,0x%lx", (size_t)pRecord->pNode );
+                putFormat( &record, ",%lu,1", pRecord->size );
+                putFormat( &record, ",%lu,\"", pRecord->serial );
+                if ( NULL != pTag ) putEscaped( &record, pTag, strlen( pTag ) );
+                put( &record, "\",\"" );
+                for ( size_t i = 0; i < pRecord->traceSize; ++i ) {
+                    if ( 0 != i ) put( &record, " | " );
+                    putFrame( &record, pRecord->backtrace[i], i );
+                }
+                put( &record, "\"\n" );
+            } else {
+                putFormat( &record, "++++++++++++++ unfreed addr: 0x%lx", (size_t)pRecord->pNode );
+                putFormat( &record, ", size: %ld", pRecord->size );
+                putFormat( &record, ", serial: %ld ++++++++++++++\n", pRecord->serial );
+                if ( NULL != pTag ) { put( &record, "tag: " ); put( &record, pTag ); put( &record, "\n" ); }
+                put( &record, "backtrace:\n" );
+                for ( size_t i = 0; i < pRecord->traceSize; ++i ) {
+                    putFrame( &record, pRecord->backtrace[i], i );
+                    put( &record, "\n" );
+                }
+                put( &record, "++++++++++++++ end ++++++++++++++\n" );
+            }
+
+            pthread_mutex_lock( &s_mutexWriter );
+            emit( record.text, record.length );
+            pthread_mutex_unlock( &s_mutexWriter );
+        }
+    } // namespace Writer
+} // namespace MemoryTrace
@@ -0,0 +1,93 @@
+#ifndef __CWRITERH__
+#define __CWRITERH__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <cstdio>
+#include "CMemoryManager.h"
+
+namespace MemoryTrace
+{
+    #define WRITER_BUFFER_SIZE      ( 1024 * 1024 )     // a report goes out in writes of this size
+    #define WRITER_LINE_SIZE        1024                // longer lines are cut in json and csv
+    #define WRITER_PACK_MAGIC       0x315A484DU         // "MHZ1"
+    #define WRITER_PACK_HASH        14                  // log2 of the match table entries
+    #define WRITER_PACK_BOUND( n )  ( (n) + (n) / 255 + 16 )
+    namespace Writer
+    {
+        // compress=1, every write is one block: the header, then packedSize bytes of LZ4 block format,
+        // or the raw bytes when packing did not make them smaller ( packedSize == rawSize )
+        struct tagPackHeader
+        {
+            uint32_t        magic;
+            uint32_t        rawSize;
+            uint32_t        packedSize;
+        };
+
+        // the report stream, formatted as text, json lines or csv rows and sent to the output
+        // in large writes while a report runs, at once otherwise
+        void                initialize();
+        void                forkPrepare();
+        void                forkRelease();
+
+        // what Config::output() hands out, stderr until initialize()
+        FILE*               stream();
+
+        // around a report, output is kept until the buffer is full or end()
+        void                begin();
+        void                end();
+
+        // frames one per line, the symbolizer's when symbolize=N, otherwise as backtrace_symbols_fd has them
+        void                backtrace( void* const* backtrace, size_t traceSize );
+        // the same frames kept as text, for code that may be unmapped by the time they are written. the length,
+        // cut at size
+        size_t              renderBacktrace( void* const* backtrace, size_t traceSize, char* const pText, size_t size );
+        void                writeRendered( const char* pText, size_t length );
+        // the unfreed listing, structured in json and csv
+        void                summary( size_t count, size_t size );
+        void                block( const MemoryManager::tagUnitRecord* const, const char* pTag );
+
+        // one LZ4 block of size bytes into WRITER_PACK_BOUND( size ) at pOut, pTable has 1 << WRITER_PACK_HASH
+        // entries. the size packed, it may be above size
+        size_t              pack( const uint8_t* const pIn, size_t size, uint8_t* const pOut, uint32_t* const pTable );
+        // the inverse of the packing, for the tools. the size unpacked, SIZE_MAX for a damaged block
+        inline size_t unpack( const uint8_t* pIn, size_t inSize, uint8_t* const pOut, size_t outSize )
+        {
+            const uint8_t* pInEnd = pIn + inSize;
+            size_t used = 0;
+
+            while ( pIn < pInEnd ) {
+                uint8_t token = *pIn++;
+                size_t literals = token >> 4;
+                if ( 15 == literals ) {
+                    uint8_t more;
+                    do { if ( pIn >= pInEnd ) return SIZE_MAX; more = *pIn++; literals += more; } while ( 255 == more );
+                }
+                if ( literals > (size_t)( pInEnd - pIn ) || literals > outSize - used ) return SIZE_MAX;
+                memcpy( pOut + used, pIn, literals );
+                pIn += literals;
+                used += literals;
+
+                // the last sequence has literals only
+                if ( pIn >= pInEnd ) break;
+
+                if ( pInEnd - pIn < 2 ) return SIZE_MAX;
+                size_t offset = pIn[0] | ( pIn[1] << 8 );
+                pIn += 2;
+                size_t length = ( token & 0x0F ) + 4;
+                if ( 19 == length ) {
+                    uint8_t more;
+                    do { if ( pIn >= pInEnd ) return SIZE_MAX; more = *pIn++; length += more; } while ( 255 == more );
+                }
+                if ( 0 == offset || offset > used || length > outSize - used ) return SIZE_MAX;
+
+                // overlapping copies repeat the pattern, byte by byte
+                for ( size_t i = 0; i < length; ++i ) pOut[ used + i ] = pOut[ used - offset + i ];
+                used += length;
+            }
+            return used;
+        }
+    }; // namespace Writer
+}; // namespace MemoryTrace
+#endif
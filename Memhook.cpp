@@ -0,0 +1,246 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "CConfig.h"
+#include "CWriter.h"
+
+#define PRELOAD_LIBRARY     "libPreLoad.so"
+#define OPTIONS_SIZE        2048
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s run [options] -- program [args...]\n", name );
+    fprintf( stderr, "       %s cat report...\n", name );
+    fprintf( stderr, "\t-m mode\t\toff, counters, sample, full or trace\n" );
+    fprintf( stderr, "\t-d depth\tbacktrace depth\n" );
+    fprintf( stderr, "\t-s rate\t\ttrack every rate-th allocation in sample mode\n" );
+    fprintf( stderr, "\t-o dir\t\twrite reports to dir/memhook.<pid>.log, one per process of the tree, memhook-merge combines them\n" );
+    fprintf( stderr, "\t-f format\treport format, text, json or csv\n" );
+    fprintf( stderr, "\t-z\t\tpack the report in blocks, %s cat unpacks it\n", name );
+    fprintf( stderr, "\t-r triggers\treport triggers, exit+signal+period\n" );
+    fprintf( stderr, "\t-p seconds\treport period\n" );
+    fprintf( stderr, "\t-R file\t\trecord every operation to file for memhook-replay, %%p expands to the pid\n" );
+    fprintf( stderr, "\t-M\t\ttrack mmap, munmap, mremap and sbrk next to the heap\n" );
+    fprintf( stderr, "\t-c socket\tsend live figures to memhook-collect -d listening on socket\n" );
+    fprintf( stderr, "\t-l library\tpath of %s, default next to this program\n", PRELOAD_LIBRARY );
+    fprintf( stderr, "\t-x options\textra key=value options passed through\n" );
+}
+
+static bool appendOption( char* const options, const char* const key, const char* const value )
+{
+    size_t length = strlen( options );
+    int written = snprintf( options + length, OPTIONS_SIZE - length, "%s%s=%s", ( 0 == length ) ? "" : ":", key, value );
+
+    return written > 0 && (size_t)written < OPTIONS_SIZE - length;
+}
+
+static bool makeDirectory( const char* const path )
+{
+    char buffer[ PATH_MAX ];
+    snprintf( buffer, sizeof( buffer ), "%s", path );
+
+    for ( char* p = buffer + 1; *p; ++p ) {
+        if ( '/' != *p ) continue;
+        *p = '\0';
+        if ( 0 != mkdir( buffer, 0755 ) && EEXIST != errno ) return false;
+        *p = '/';
+    }
+
+    return 0 == mkdir( buffer, 0755 ) || EEXIST == errno;
+}
+
+static bool defaultLibrary( char* const path, size_t size )
+{
+    char self[ PATH_MAX ];
+    ssize_t length = readlink( "/proc/self/exe", self, sizeof( self ) - 1 );
+    if ( length <= 0 ) return false;
+    self[ length ] = '\0';
+
+    char* pSlash = strrchr( self, '/' );
+    if ( NULL == pSlash ) return false;
+    *pSlash = '\0';
+
+    int written = snprintf( path, size, "%s/%s", self, PRELOAD_LIBRARY );
+    return written > 0 && (size_t)written < size;
+}
+
+static int run( int argc, char* const argv[] )
+{
+    char options[ OPTIONS_SIZE ] = { '\0' };
+    char library[ PATH_MAX ] = { '\0' };
+    bool bValid = true;
+
+    const char* pInherited = getenv( CONFIG_ENV_OPTIONS );
+    if ( NULL != pInherited ) snprintf( options, sizeof( options ), "%s", pInherited );
+
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "+m:d:s:o:f:zr:p:R:c:Ml:x:h" ) ) ) {
+        switch ( option ) {
+        case 'm': bValid &= appendOption( options, "mode", optarg );     break;
+        case 'd': bValid &= appendOption( options, "depth", optarg );    break;
+        case 's': bValid &= appendOption( options, "sample", optarg );   break;
+        case 'f': bValid &= appendOption( options, "format", optarg );   break;
+        case 'r': bValid &= appendOption( options, "report", optarg );   break;
+        case 'p': bValid &= appendOption( options, "period", optarg );   break;
+        case 'R': bValid &= appendOption( options, "record", optarg );   break;
+        case 'c': bValid &= appendOption( options, "collect", optarg );  break;
+        case 'M': bValid &= appendOption( options, "mmap", "1" );        break;
+        case 'z': bValid &= appendOption( options, "compress", "1" );    break;
+        case 'l': snprintf( library, sizeof( library ), "%s", optarg ); break;
+        case 'x': {
+            size_t length = strlen( options );
+            snprintf( options + length, sizeof( options ) - length, "%s%s", ( 0 == length ) ? "" : ":", optarg );
+            break;
+        }
+        case 'o': {
+            char directory[ PATH_MAX ], path[ PATH_MAX + 32 ];
+            if ( !makeDirectory( optarg ) || NULL == realpath( optarg, directory ) ) {
+                fprintf( stderr, "memhook: can not create %s: %s\n", optarg, strerror( errno ) );
+                return EXIT_FAILURE;
+            }
+            snprintf( path, sizeof( path ), "%s/memhook.%%p.log", directory );
+            bValid &= appendOption( options, "output", path );
+            break;
+        }
+        default:
+            usage( "memhook" );
+            return ( 'h' == option ) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if ( !bValid ) { fprintf( stderr, "memhook: options too long\n" ); return EXIT_FAILURE; }
+    if ( optind >= argc ) { usage( "memhook" ); return EXIT_FAILURE; }
+
+    if ( '\0' == library[0] && !defaultLibrary( library, sizeof( library ) ) ) {
+        fprintf( stderr, "memhook: can not locate %s, use -l\n", PRELOAD_LIBRARY );
+        return EXIT_FAILURE;
+    }
+
+    char resolved[ PATH_MAX ];
+    if ( NULL == realpath( library, resolved ) ) {
+        fprintf( stderr, "memhook: %s: %s\n", library, strerror( errno ) );
+        return EXIT_FAILURE;
+    }
+
+    // keep anything the caller already preloads
+    char preload[ PATH_MAX * 2 ];
+    const char* pPreload = getenv( "LD_PRELOAD" );
+    if ( NULL != pPreload && '\0' != *pPreload ) {
+        snprintf( preload, sizeof( preload ), "%s:%s", resolved, pPreload );
+    } else {
+        snprintf( preload, sizeof( preload ), "%s", resolved );
+    }
+
+    setenv( "LD_PRELOAD", preload, 1 );
+    setenv( CONFIG_ENV_OPTIONS, options, 1 );
+
+    execvp( argv[ optind ], argv + optind );
+    fprintf( stderr, "memhook: %s: %s\n", argv[ optind ], strerror( errno ) );
+    return 127;
+}
+
+// writes a report to stdout, packed blocks unpacked and plain text passed through
+// the part of a report memhook cat has read and not written yet, large enough for the biggest block
+struct tagWindow
+{
+    FILE*       pFile;
+    size_t      begin;
+    size_t      end;
+    uint8_t     data[ sizeof( MemoryTrace::Writer::tagPackHeader ) + WRITER_PACK_BOUND( WRITER_BUFFER_SIZE ) ];
+};
+
+// reads until size bytes are in the window or the input ends, returns how many are
+static size_t fill( tagWindow* const pWindow, size_t size )
+{
+    if ( pWindow->end - pWindow->begin >= size ) return pWindow->end - pWindow->begin;
+
+    memmove( pWindow->data, pWindow->data + pWindow->begin, pWindow->end - pWindow->begin );
+    pWindow->end   -= pWindow->begin;
+    pWindow->begin  = 0;
+
+    size_t read = 1;
+    while ( pWindow->end < size && 0 != read ) {
+        read = fread( pWindow->data + pWindow->end, 1, sizeof( pWindow->data ) - pWindow->end, pWindow->pFile );
+        pWindow->end += read;
+    }
+    return pWindow->end;
+}
+
+static bool catReport( const char* const path )
+{
+    FILE* pInput = fopen( path, "r" );
+    if ( NULL == pInput ) { fprintf( stderr, "memhook: %s: %s\n", path, strerror( errno ) ); return false; }
+
+    static tagWindow s_window;
+    static uint8_t s_raw[ WRITER_BUFFER_SIZE ];
+    const uint32_t magic = WRITER_PACK_MAGIC;
+    const size_t headerSize = sizeof( MemoryTrace::Writer::tagPackHeader );
+    tagWindow* pWindow = &s_window;
+    bool bValid = true;
+
+    pWindow->pFile  = pInput;
+    pWindow->begin  = 0;
+    pWindow->end    = 0;
+
+    for ( ;; ) {
+        size_t available = fill( pWindow, headerSize );
+        if ( 0 == available ) break;
+
+        const uint8_t* pData = pWindow->data + pWindow->begin;
+        MemoryTrace::Writer::tagPackHeader header;
+        if ( available >= headerSize ) memcpy( &header, pData, headerSize );
+
+        // a report written without compress=1, text that went out before the output was opened, or
+        // crash output written raw between two blocks, copied up to the next block header
+        if ( available < headerSize || WRITER_PACK_MAGIC != header.magic ) {
+            const uint8_t* pFound = (const uint8_t*)memmem( pData + 1, available - 1, &magic, sizeof( magic ) );
+            // a header may straddle the end of the window, its first bytes wait for the next read
+            size_t size = ( NULL != pFound ) ? pFound - pData : ( available < headerSize ) ? available : available - ( sizeof( magic ) - 1 );
+            fwrite( pData, 1, size, stdout );
+            pWindow->begin += size;
+            continue;
+        }
+
+        if ( header.rawSize > WRITER_BUFFER_SIZE || header.packedSize > header.rawSize || \
+             fill( pWindow, headerSize + header.packedSize ) < headerSize + header.packedSize ) {
+            bValid = false;
+            break;
+        }
+
+        const uint8_t* pPacked = pWindow->data + pWindow->begin + headerSize;
+        pWindow->begin += headerSize + header.packedSize;
+
+        if ( header.packedSize == header.rawSize ) {
+            fwrite( pPacked, 1, header.rawSize, stdout );
+        } else if ( header.rawSize == MemoryTrace::Writer::unpack( pPacked, header.packedSize, s_raw, sizeof( s_raw ) ) ) {
+            fwrite( s_raw, 1, header.rawSize, stdout );
+        } else {
+            bValid = false;
+            break;
+        }
+    }
+
+    fclose( pInput );
+    if ( !bValid ) fprintf( stderr, "memhook: %s: damaged block\n", path );
+    return bValid;
+}
+
+int main( int argc, char* const argv[] )
+{
+    if ( argc < 2 ) { usage( argv[0] ); return EXIT_FAILURE; }
+
+    if ( 0 == strcmp( argv[1], "run" ) ) return run( argc - 1, argv + 1 );
+
+    if ( 0 == strcmp( argv[1], "cat" ) && argc > 2 ) {
+        bool bValid = true;
+        for ( int i = 2; i < argc; ++i ) bValid &= catReport( argv[i] );
+        return bValid ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    usage( argv[0] );
+    return EXIT_FAILURE;
+}
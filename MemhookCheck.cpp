@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "CWriter.h"
+#include "CSlab.h"
+#include "CBlockSet.h"
+#include "CMapping.h"
+#include "CCollector.h"
+
+// self-checks of the hook's building blocks, linked against libPreLoad.so so they run inside the hook.
+// make check runs them with mmap=1, the mapping check needs the tracking on
+
+#define CHECK_BLOCKS        40000               // block set entries, about 60% of a shard's first table
+#define CHECK_BLOCK_BASE    0xFFFF900000000000ULL   // no user block lives up there, the hook never frees one
+#define CHECK_PAGES         8
+
+static int s_failures = 0;
+
+#define CHECK( condition ) \
+    do { if ( !( condition ) ) { fprintf( stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition ); ++s_failures; } } while ( 0 )
+
+static bool packRoundTrip( const uint8_t* pIn, size_t size )
+{
+    static uint32_t s_table[ 1 << WRITER_PACK_HASH ];
+    static uint8_t s_packed[ WRITER_PACK_BOUND( WRITER_BUFFER_SIZE ) ];
+    static uint8_t s_unpacked[ WRITER_BUFFER_SIZE ];
+
+    size_t packed = MemoryTrace::Writer::pack( pIn, size, s_packed, s_table );
+    if ( packed > WRITER_PACK_BOUND( size ) ) return false;
+
+    return size == MemoryTrace::Writer::unpack( s_packed, packed, s_unpacked, sizeof( s_unpacked ) ) && 0 == memcmp( pIn, s_unpacked, size );
+}
+
+static void checkPack()
+{
+    static uint8_t s_input[ WRITER_BUFFER_SIZE ];
+
+    // report text repeats itself, random bytes do not, runs overlap their own match
+    size_t length = 0;
+    for ( size_t i = 0; length + 64 < sizeof( s_input ); ++i ) {
+        length += snprintf( (char*)s_input + length, 64, "\t#%zu  0x%zx in main at main.cpp:%zu\n", i % 8, 0x401000 + i % 13, i % 5 );
+    }
+    CHECK( packRoundTrip( s_input, length ) );
+
+    srand( 1 );
+    for ( size_t i = 0; i < sizeof( s_input ); ++i ) s_input[i] = (uint8_t)rand();
+    CHECK( packRoundTrip( s_input, sizeof( s_input ) ) );
+
+    memset( s_input, 'a', 4096 );
+    CHECK( packRoundTrip( s_input, 4096 ) );
+
+    // the last bytes are always literals, short inputs are nothing else
+    for ( size_t size = 0; size <= 16; ++size ) CHECK( packRoundTrip( (const uint8_t*)"abcdabcdabcdabcd", size ) );
+
+    // a truncated block is damaged, never read past its end
+    static uint32_t s_table[ 1 << WRITER_PACK_HASH ];
+    static uint8_t s_packed[ WRITER_PACK_BOUND( 4096 ) ];
+    uint8_t unpacked[ 4096 ];
+    memset( s_input, 'a', 4096 );
+    size_t packed = MemoryTrace::Writer::pack( s_input, 4096, s_packed, s_table );
+    CHECK( 4096 != MemoryTrace::Writer::unpack( s_packed, packed - 1, unpacked, sizeof( unpacked ) ) );
+    CHECK( SIZE_MAX == MemoryTrace::Writer::unpack( s_packed, packed, unpacked, 100 ) );
+}
+
+static void checkSlabClasses()
+{
+    using namespace MemoryTrace;
+
+    CHECK( 0 == Slab::classOf( 1 ) );
+    CHECK( 0 == Slab::classOf( 16 ) );
+    CHECK( 1 == Slab::classOf( 17 ) );
+    CHECK( SLAB_SMALL_MAX == Slab::classSize( Slab::classOf( SLAB_SMALL_MAX ) ) );
+    CHECK( SLAB_MAX_SIZE == Slab::classSize( Slab::classOf( SLAB_MAX_SIZE ) ) );
+    CHECK( SLAB_CLASS_COUNT - 1 == Slab::classOf( SLAB_MAX_SIZE ) );
+
+    // every size fits its class and would not fit the one below, the classes grow
+    for ( size_t size = 1; size <= SLAB_MAX_SIZE; ++size ) {
+        size_t sizeClass = Slab::classOf( size );
+        if ( sizeClass >= SLAB_CLASS_COUNT || Slab::classSize( sizeClass ) < size || \
+             ( sizeClass > 0 && Slab::classSize( sizeClass - 1 ) >= size ) ) {
+            fprintf( stderr, "%s:%d: size %zu got class %zu\n", __FILE__, __LINE__, size, sizeClass );
+            ++s_failures;
+            return;
+        }
+    }
+    for ( size_t sizeClass = 0; sizeClass < SLAB_CLASS_COUNT; ++sizeClass ) {
+        CHECK( sizeClass == Slab::classOf( Slab::classSize( sizeClass ) ) );
+        CHECK( 0 == Slab::classSize( sizeClass ) % 16 );
+    }
+}
+
+static const void* blockAt( size_t i )
+{
+    return (const void*)( CHECK_BLOCK_BASE + i * 16 );
+}
+
+static void checkBlockSet()
+{
+    using namespace MemoryTrace;
+
+    // dense runs, so the erases below shift entries back across them
+    size_t count = BlockSet::count();
+    for ( size_t i = 0; i < CHECK_BLOCKS; ++i ) CHECK( BlockSet::insert( blockAt( i ) ) );
+    CHECK( count + CHECK_BLOCKS == BlockSet::count() );
+
+    for ( size_t i = 0; i < CHECK_BLOCKS; i += 3 ) CHECK( BlockSet::erase( blockAt( i ) ) );
+    CHECK( !BlockSet::erase( blockAt( 0 ) ) );
+    CHECK( !BlockSet::erase( blockAt( CHECK_BLOCKS ) ) );
+
+    size_t missing = 0, stale = 0;
+    for ( size_t i = 0; i < CHECK_BLOCKS; ++i ) {
+        bool bErased = 0 == i % 3;
+        if ( !bErased && !BlockSet::contains( blockAt( i ) ) ) ++missing;
+        if ( bErased && BlockSet::contains( blockAt( i ) ) ) ++stale;
+    }
+    CHECK( 0 == missing );
+    CHECK( 0 == stale );
+
+    for ( size_t i = 0; i < CHECK_BLOCKS; ++i ) {
+        if ( 0 != i % 3 ) CHECK( BlockSet::erase( blockAt( i ) ) );
+    }
+    CHECK( count == BlockSet::count() );
+}
+
+// the tracked intervals within [begin, end), at most capacity of them
+static size_t mappingsIn( uintptr_t begin, uintptr_t end, uintptr_t* const pBounds, size_t capacity )
+{
+    size_t count = 0, mapSize = 0;
+    MemoryTrace::Mapping::tagMapping* pMappings = MemoryTrace::Mapping::copyMappings( &count, &mapSize );
+
+    size_t found = 0;
+    for ( size_t i = 0; i < count; ++i ) {
+        if ( pMappings[i].end <= begin || pMappings[i].begin >= end ) continue;
+        if ( found < capacity ) {
+            pBounds[ found * 2 ]     = pMappings[i].begin;
+            pBounds[ found * 2 + 1 ] = pMappings[i].end;
+        }
+        ++found;
+    }
+
+    if ( NULL != pMappings ) MemoryTrace::Mapping::releaseCopy( pMappings, mapSize );
+    return found;
+}
+
+static void checkMapping()
+{
+    using namespace MemoryTrace;
+
+    if ( !Mapping::isEnabled() ) { fprintf( stderr, "%s: mapping check needs MEMHOOK_OPTIONS=mmap=1\n", __FILE__ ); ++s_failures; return; }
+
+    const void* pCaller = (const void*)&checkMapping;
+    uintptr_t page = sysconf( _SC_PAGESIZE );
+    uintptr_t bounds[ 8 ];
+
+    uint8_t* pMap = (uint8_t*)Mapping::mmap( NULL, CHECK_PAGES * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0, pCaller );
+    CHECK( MAP_FAILED != pMap );
+    if ( MAP_FAILED == pMap ) return;
+
+    uintptr_t begin = (uintptr_t)pMap, end = begin + CHECK_PAGES * page;
+    CHECK( 1 == mappingsIn( begin, end, bounds, 4 ) && begin == bounds[0] && end == bounds[1] );
+
+    // a hole in the middle splits the interval in two
+    CHECK( 0 == Mapping::munmap( pMap + 2 * page, 2 * page, pCaller ) );
+    CHECK( 2 == mappingsIn( begin, end, bounds, 4 ) );
+    CHECK( begin == bounds[0] && begin + 2 * page == bounds[1] );
+    CHECK( begin + 4 * page == bounds[2] && end == bounds[3] );
+
+    // trimming the front of one and the back of the other
+    CHECK( 0 == Mapping::munmap( pMap, page, pCaller ) );
+    CHECK( 0 == Mapping::munmap( pMap + 7 * page, page, pCaller ) );
+    CHECK( 2 == mappingsIn( begin, end, bounds, 4 ) );
+    CHECK( begin + page == bounds[0] && begin + 2 * page == bounds[1] );
+    CHECK( begin + 4 * page == bounds[2] && begin + 7 * page == bounds[3] );
+
+    // one unmap over the rest, holes included
+    CHECK( 0 == Mapping::munmap( pMap, CHECK_PAGES * page, pCaller ) );
+    CHECK( 0 == mappingsIn( begin, end, bounds, 4 ) );
+}
+
+static bool varintRoundTrip( uint64_t value, size_t expectedLength )
+{
+    uint8_t buffer[ 10 ];
+    size_t length = MemoryTrace::Collector::encode( buffer, value );
+
+    const uint8_t* pData = buffer;
+    uint64_t decoded = 0;
+    return expectedLength == length && MemoryTrace::Collector::decode( &pData, buffer + length, &decoded ) && \
+           value == decoded && buffer + length == pData;
+}
+
+static void checkVarint()
+{
+    using namespace MemoryTrace::Collector;
+
+    CHECK( varintRoundTrip( 0, 1 ) );
+    CHECK( varintRoundTrip( 0x7F, 1 ) );
+    CHECK( varintRoundTrip( 0x80, 2 ) );
+    CHECK( varintRoundTrip( 0x3FFF, 2 ) );
+    CHECK( varintRoundTrip( 0x4000, 3 ) );
+    CHECK( varintRoundTrip( UINT64_MAX >> 1, 9 ) );
+    CHECK( varintRoundTrip( UINT64_MAX, 10 ) );
+    for ( unsigned shift = 0; shift < 64; ++shift ) CHECK( varintRoundTrip( 1ULL << shift, shift / 7 + 1 ) );
+
+    // small deltas of either sign stay one byte
+    CHECK( 0 == zigzag( 0 ) && 1 == zigzag( -1 ) && 2 == zigzag( 1 ) );
+    CHECK( UINT64_MAX == zigzag( INT64_MIN ) && UINT64_MAX - 1 == zigzag( INT64_MAX ) );
+    const int64_t values[] = { 0, 1, -1, 63, -64, 64, INT32_MIN, INT64_MAX, INT64_MIN };
+    for ( size_t i = 0; i < sizeof( values ) / sizeof( values[0] ); ++i ) CHECK( values[i] == unzigzag( zigzag( values[i] ) ) );
+
+    // a record cut short, and one longer than 64 bits
+    uint8_t buffer[ 11 ];
+    const uint8_t* pData = buffer;
+    uint64_t value = 0;
+    size_t length = encode( buffer, UINT64_MAX );
+    CHECK( !decode( &pData, buffer + length - 1, &value ) );
+
+    memset( buffer, 0x80, sizeof( buffer ) );
+    pData = buffer;
+    CHECK( !decode( &pData, buffer + sizeof( buffer ), &value ) );
+}
+
+int main( int, char* const argv[] )
+{
+    checkPack();
+    checkSlabClasses();
+    checkBlockSet();
+    checkMapping();
+    checkVarint();
+
+    if ( 0 != s_failures ) { fprintf( stderr, "%s: %d checks failed\n", argv[0], s_failures ); return EXIT_FAILURE; }
+    printf( "%s: all checks passed\n", argv[0] );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,451 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "CCollector.h"
+
+using MemoryTrace::Collector::tagCollectHeader;
+using MemoryTrace::Collector::decode;
+using MemoryTrace::Collector::unzigzag;
+
+#define DEFAULT_SITES       20
+#define TICK_PERIOD         1000        // ms, rates and vanished processes
+#define SILENT_LIMIT        10          // seconds without a message before a gone pid is dropped
+#define RECEIVE_BUFFER      ( 4 << 20 )
+
+// one call site of one process, the deltas of every message added up
+struct tagProcessSite
+{
+    std::string             location;
+    int64_t                 liveCount;
+    int64_t                 liveSize;
+    uint64_t                allocCount;
+};
+
+struct tagProcess
+{
+    uint32_t                pid;
+    std::string             command;
+    uint64_t                updateTime;         // realtime ns of the last message
+    uint64_t                receiveTime;        // monotonic ns
+    uint64_t                allocCount;
+    uint64_t                allocSize;
+    uint64_t                freeCount;
+    uint64_t                freeSize;
+    uint64_t                peakSize;
+    uint64_t                mappedSize;
+    uint64_t                dropped;
+    double                  allocRate;
+    double                  byteRate;
+    std::map<uint32_t, tagProcessSite> sites;
+};
+
+// a call site over every process, keyed by its location which does not depend on where the module was loaded
+struct tagHostSite
+{
+    int64_t                 liveCount;
+    int64_t                 liveSize;
+    int64_t                 peakSize;
+    uint64_t                allocCount;         // since the collector started, processes that exited included
+    uint64_t                tickAllocCount;
+    double                  allocRate;
+    uint32_t                processes;
+};
+
+static std::map<uint32_t, tagProcess>       s_processes;
+static std::map<std::string, tagHostSite>   s_sites;
+static uint64_t             s_messages      = 0;
+static uint64_t             s_counterOnly   = 0;
+static uint64_t             s_exited        = 0;
+static uint64_t             s_invalid       = 0;
+static volatile bool        s_bStop         = false;
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s [-s socket] -d\n", name );
+    fprintf( stderr, "       %s [-s socket] [-n sites]\n", name );
+    fprintf( stderr, "\t-d\trun the collector, processes send to it with MEMHOOK_OPTIONS=collect=socket\n" );
+    fprintf( stderr, "\t-s\tsocket, default %s, queries go to socket%s\n", COLLECT_PATH, COLLECT_QUERY_SUFFIX );
+    fprintf( stderr, "\t-n\tcall sites to show by unfreed size, default %d, 0 for all\n", DEFAULT_SITES );
+}
+
+static uint64_t monotonic()
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void signalStop( int )
+{
+    s_bStop = true;
+}
+
+static tagHostSite* hostSite( const std::string& location )
+{
+    std::map<std::string, tagHostSite>::iterator it = s_sites.find( location );
+    if ( s_sites.end() != it ) return &it->second;
+
+    tagHostSite* pSite = &s_sites[ location ];
+    memset( pSite, 0, sizeof( tagHostSite ) );
+    return pSite;
+}
+
+// the live figures of the process leave the host view, what it allocated stays counted
+static void clearSites( tagProcess* const pProcess )
+{
+    for ( std::map<uint32_t, tagProcessSite>::iterator it = pProcess->sites.begin(); it != pProcess->sites.end(); ++it ) {
+        tagHostSite* pHost = hostSite( it->second.location );
+        pHost->liveCount    -= it->second.liveCount;
+        pHost->liveSize     -= it->second.liveSize;
+        pHost->processes--;
+    }
+    pProcess->sites.clear();
+}
+
+static void removeProcess( std::map<uint32_t, tagProcess>::iterator it )
+{
+    clearSites( &it->second );
+    s_processes.erase( it );
+    s_exited++;
+}
+
+static bool applySites( tagProcess* const pProcess, const uint8_t* pData, const uint8_t* const pEnd, uint32_t siteCount )
+{
+    for ( uint32_t i = 0; i < siteCount; ++i ) {
+        uint64_t key = 0, liveCount = 0, liveSize = 0, allocCount = 0;
+        if ( !decode( &pData, pEnd, &key ) ) return false;
+
+        uint32_t id = key >> 1;
+        std::map<uint32_t, tagProcessSite>::iterator it = pProcess->sites.find( id );
+        tagProcessSite* pSite = ( pProcess->sites.end() == it ) ? NULL : &it->second;
+
+        if ( key & 1 ) {
+            uint64_t length = 0;
+            if ( !decode( &pData, pEnd, &length ) || length > (uint64_t)( pEnd - pData ) ) return false;
+
+            if ( NULL == pSite ) {
+                pSite = &pProcess->sites[ id ];
+                pSite->location.assign( (const char*)pData, length );
+                pSite->liveCount = pSite->liveSize = 0;
+                pSite->allocCount = 0;
+                hostSite( pSite->location )->processes++;
+            }
+            pData += length;
+        } else if ( NULL == pSite ) {
+            // announced in a message that never arrived, the sender starts over on its next connection
+            char location[ 64 ];
+            snprintf( location, sizeof( location ), "unknown site %u of pid %u", id, pProcess->pid );
+            pSite = &pProcess->sites[ id ];
+            pSite->location = location;
+            pSite->liveCount = pSite->liveSize = 0;
+            pSite->allocCount = 0;
+            hostSite( pSite->location )->processes++;
+        }
+
+        if ( !decode( &pData, pEnd, &liveCount ) || !decode( &pData, pEnd, &liveSize ) || !decode( &pData, pEnd, &allocCount ) ) return false;
+
+        pSite->liveCount    += unzigzag( liveCount );
+        pSite->liveSize     += unzigzag( liveSize );
+        pSite->allocCount   += allocCount;
+
+        tagHostSite* pHost  = hostSite( pSite->location );
+        pHost->liveCount    += unzigzag( liveCount );
+        pHost->liveSize     += unzigzag( liveSize );
+        pHost->allocCount   += allocCount;
+        if ( pHost->liveSize > pHost->peakSize ) pHost->peakSize = pHost->liveSize;
+    }
+
+    return true;
+}
+
+static void applyMessage( const uint8_t* const pMessage, size_t length )
+{
+    const tagCollectHeader* pHeader = (const tagCollectHeader*)pMessage;
+    if ( length < sizeof( tagCollectHeader ) || COLLECT_MAGIC != pHeader->magic || COLLECT_VERSION != pHeader->version ) { s_invalid++; return; }
+
+    s_messages++;
+    if ( pHeader->flags & MemoryTrace::Collector::CF_COUNTERS ) s_counterOnly++;
+
+    std::map<uint32_t, tagProcess>::iterator it = s_processes.find( pHeader->pid );
+    if ( s_processes.end() == it ) {
+        tagProcess process;
+        process.pid             = pHeader->pid;
+        process.updateTime      = 0;
+        process.allocCount      = 0;
+        process.allocSize       = 0;
+        process.allocRate       = 0;
+        process.byteRate        = 0;
+        it = s_processes.insert( std::make_pair( pHeader->pid, process ) ).first;
+    }
+    tagProcess* pProcess = &it->second;
+
+    // the same pid again after an exec, or a sender that lost its connection
+    if ( pHeader->flags & MemoryTrace::Collector::CF_RESET ) clearSites( pProcess );
+
+    if ( 0 != pProcess->updateTime && pHeader->time > pProcess->updateTime && pHeader->allocCount >= pProcess->allocCount ) {
+        double seconds          = ( pHeader->time - pProcess->updateTime ) / 1e9;
+        pProcess->allocRate     = ( pHeader->allocCount - pProcess->allocCount ) / seconds;
+        pProcess->byteRate      = ( pHeader->allocSize - pProcess->allocSize ) / seconds;
+    }
+
+    pProcess->command.assign( pHeader->command, strnlen( pHeader->command, sizeof( pHeader->command ) ) );
+    pProcess->updateTime    = pHeader->time;
+    pProcess->receiveTime   = monotonic();
+    pProcess->allocCount    = pHeader->allocCount;
+    pProcess->allocSize     = pHeader->allocSize;
+    pProcess->freeCount     = pHeader->freeCount;
+    pProcess->freeSize      = pHeader->freeSize;
+    pProcess->peakSize      = pHeader->peakSize;
+    pProcess->mappedSize    = pHeader->mappedSize;
+    pProcess->dropped       = pHeader->dropped;
+
+    if ( !applySites( pProcess, pMessage + sizeof( tagCollectHeader ), pMessage + length, pHeader->siteCount ) ) s_invalid++;
+
+    if ( pHeader->flags & MemoryTrace::Collector::CF_EXIT ) removeProcess( it );
+}
+
+static void tick( double seconds )
+{
+    for ( std::map<std::string, tagHostSite>::iterator it = s_sites.begin(); it != s_sites.end(); ) {
+        tagHostSite* pSite      = &it->second;
+        pSite->allocRate        = ( pSite->allocCount - pSite->tickAllocCount ) / seconds;
+        pSite->tickAllocCount   = pSite->allocCount;
+
+        if ( 0 == pSite->processes && 0 == pSite->allocRate ) s_sites.erase( it++ );
+        else ++it;
+    }
+
+    // killed processes never send their exit message
+    uint64_t now = monotonic();
+    for ( std::map<uint32_t, tagProcess>::iterator it = s_processes.begin(); it != s_processes.end(); ) {
+        std::map<uint32_t, tagProcess>::iterator current = it++;
+        if ( now - current->second.receiveTime < SILENT_LIMIT * 1000000000ULL ) continue;
+        if ( 0 != kill( current->first, 0 ) && ESRCH == errno ) removeProcess( current );
+    }
+}
+
+static bool compareSites( const std::pair<const std::string*, const tagHostSite*>& left, const std::pair<const std::string*, const tagHostSite*>& right )
+{
+    if ( left.second->liveSize != right.second->liveSize ) return left.second->liveSize > right.second->liveSize;
+    return left.second->allocRate > right.second->allocRate;
+}
+
+static void writeView( FILE* const pOutput, size_t siteLimit )
+{
+    struct timespec now;
+    clock_gettime( CLOCK_REALTIME, &now );
+    uint64_t realtime = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
+    fprintf( pOutput, "memhook collector, processes: %ld, exited: %lu, messages: %lu, counters only: %lu, invalid: %lu\n", \
+                s_processes.size(), \
+                s_exited, \
+                s_messages, \
+                s_counterOnly, \
+                s_invalid );
+
+    int64_t totalCount = 0, totalSize = 0;
+    uint64_t totalMapped = 0;
+    double totalRate = 0, totalBytes = 0;
+    for ( std::map<uint32_t, tagProcess>::const_iterator it = s_processes.begin(); it != s_processes.end(); ++it ) {
+        const tagProcess* pProcess = &it->second;
+        int64_t liveCount = pProcess->allocCount - pProcess->freeCount, liveSize = pProcess->allocSize - pProcess->freeSize;
+
+        fprintf( pOutput, "pid: %u (%s), unfreed count: %ld, size: %ld, peak: %lu, mapped: %lu, allocs/s: %.0f, bytes/s: %.0f, held back: %lu, updated %.1fs ago\n", \
+                    pProcess->pid, \
+                    pProcess->command.c_str(), \
+                    liveCount, \
+                    liveSize, \
+                    pProcess->peakSize, \
+                    pProcess->mappedSize, \
+                    pProcess->allocRate, \
+                    pProcess->byteRate, \
+                    pProcess->dropped, \
+                    ( realtime > pProcess->updateTime ) ? ( realtime - pProcess->updateTime ) / 1e9 : 0.0 );
+
+        totalCount  += liveCount;
+        totalSize   += liveSize;
+        totalMapped += pProcess->mappedSize;
+        totalRate   += pProcess->allocRate;
+        totalBytes  += pProcess->byteRate;
+    }
+    fprintf( pOutput, "unfreed \n \tcount: %ld\n\tsize: %ld\n", totalCount, totalSize );
+    fprintf( pOutput, "mapped \n \tsize: %lu\n", totalMapped );
+    fprintf( pOutput, "allocations \n \tper second: %.0f\n\tbytes per second: %.0f\n", totalRate, totalBytes );
+
+    std::vector< std::pair<const std::string*, const tagHostSite*> > order;
+    for ( std::map<std::string, tagHostSite>::const_iterator it = s_sites.begin(); it != s_sites.end(); ++it ) {
+        if ( it->second.liveSize > 0 ) order.push_back( std::make_pair( &it->first, &it->second ) );
+    }
+    std::sort( order.begin(), order.end(), compareSites );
+
+    size_t shown = ( 0 == siteLimit || siteLimit > order.size() ) ? order.size() : siteLimit;
+    fprintf( pOutput, "call sites with unfreed memory: %ld, top %ld by size\n", order.size(), shown );
+
+    for ( size_t i = 0; i < shown; ++i ) {
+        const tagHostSite* pSite = order[i].second;
+
+        fprintf( pOutput, "++++++++++++++ #%ld unfreed count: %ld, size: %ld, peak: %ld, allocations: %lu, allocs/s: %.0f, processes: %u ++++++++++++++\n", \
+                    i, \
+                    pSite->liveCount, \
+                    pSite->liveSize, \
+                    pSite->peakSize, \
+                    pSite->allocCount, \
+                    pSite->allocRate, \
+                    pSite->processes );
+        fprintf( pOutput, "\tat %s\n", order[i].first->c_str() );
+        fprintf( pOutput, "++++++++++++++ end ++++++++++++++\n" );
+    }
+}
+
+static int bindSocket( const char* const path, int type )
+{
+    struct sockaddr_un address;
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+    if ( strlen( path ) >= sizeof( address.sun_path ) ) { fprintf( stderr, "memhook-collect: %s is too long\n", path ); return -1; }
+    strcpy( address.sun_path, path );
+
+    int fd = socket( AF_UNIX, type | SOCK_CLOEXEC, 0 );
+    if ( -1 == fd ) return -1;
+
+    unlink( path );
+    if ( 0 != bind( fd, (struct sockaddr*)&address, sizeof( address ) ) || ( SOCK_STREAM == type && 0 != listen( fd, 16 ) ) ) {
+        fprintf( stderr, "memhook-collect: %s: %s\n", path, strerror( errno ) );
+        close( fd );
+        return -1;
+    }
+
+    // hooked processes of every user on the host send to it
+    chmod( path, 0666 );
+    return fd;
+}
+
+static void serveQuery( int listenFd )
+{
+    int fd = accept4( listenFd, NULL, NULL, SOCK_CLOEXEC );
+    if ( -1 == fd ) return;
+
+    // the request is the number of sites, the answer the text view
+    char request[ 32 ];
+    struct pollfd wait = { fd, POLLIN, 0 };
+    ssize_t length = ( 1 == poll( &wait, 1, 1000 ) ) ? read( fd, request, sizeof( request ) - 1 ) : -1;
+    request[ ( length > 0 ) ? length : 0 ] = '\0';
+
+    FILE* pOutput = fdopen( fd, "w" );
+    if ( NULL == pOutput ) { close( fd ); return; }
+
+    writeView( pOutput, ( length > 0 ) ? strtoul( request, NULL, 10 ) : DEFAULT_SITES );
+    fclose( pOutput );
+}
+
+static int collect( const char* const path )
+{
+    std::string queryPath = std::string( path ) + COLLECT_QUERY_SUFFIX;
+
+    int messageFd = bindSocket( path, SOCK_DGRAM );
+    if ( -1 == messageFd ) return EXIT_FAILURE;
+
+    int queryFd = bindSocket( queryPath.c_str(), SOCK_STREAM );
+    if ( -1 == queryFd ) { unlink( path ); return EXIT_FAILURE; }
+
+    int size = RECEIVE_BUFFER;
+    setsockopt( messageFd, SOL_SOCKET, SO_RCVBUF, &size, sizeof( size ) );
+
+    struct sigaction action;
+    memset( &action, 0, sizeof( action ) );
+    action.sa_handler = signalStop;
+    sigaction( SIGINT, &action, NULL );
+    sigaction( SIGTERM, &action, NULL );
+    signal( SIGPIPE, SIG_IGN );
+
+    static uint8_t s_message[ COLLECT_MESSAGE_SIZE ];
+    uint64_t lastTick = monotonic();
+
+    while ( !s_bStop ) {
+        struct pollfd fds[2] = { { messageFd, POLLIN, 0 }, { queryFd, POLLIN, 0 } };
+        int ready = poll( fds, 2, TICK_PERIOD );
+
+        if ( ready > 0 && ( fds[0].revents & POLLIN ) ) {
+            // drain what is queued, senders fall back to counters while the queue is full
+            ssize_t length;
+            while ( ( length = recv( messageFd, s_message, sizeof( s_message ), MSG_DONTWAIT ) ) >= 0 ) applyMessage( s_message, length );
+        }
+        if ( ready > 0 && ( fds[1].revents & POLLIN ) ) serveQuery( queryFd );
+
+        uint64_t now = monotonic();
+        if ( now - lastTick >= TICK_PERIOD * 1000000ULL ) {
+            tick( ( now - lastTick ) / 1e9 );
+            lastTick = now;
+        }
+    }
+
+    close( messageFd );
+    close( queryFd );
+    unlink( path );
+    unlink( queryPath.c_str() );
+    return EXIT_SUCCESS;
+}
+
+static int query( const char* const path, size_t siteLimit )
+{
+    std::string queryPath = std::string( path ) + COLLECT_QUERY_SUFFIX;
+
+    struct sockaddr_un address;
+    memset( &address, 0, sizeof( address ) );
+    address.sun_family = AF_UNIX;
+    strncpy( address.sun_path, queryPath.c_str(), sizeof( address.sun_path ) - 1 );
+
+    int fd = socket( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0 );
+    if ( -1 == fd || 0 != connect( fd, (struct sockaddr*)&address, sizeof( address ) ) ) {
+        fprintf( stderr, "memhook-collect: no collector at %s: %s\n", queryPath.c_str(), strerror( errno ) );
+        if ( -1 != fd ) close( fd );
+        return EXIT_FAILURE;
+    }
+
+    char request[ 32 ];
+    int length = snprintf( request, sizeof( request ), "%lu\n", siteLimit );
+    if ( length != write( fd, request, length ) ) { close( fd ); return EXIT_FAILURE; }
+    shutdown( fd, SHUT_WR );
+
+    char buffer[ 4096 ];
+    ssize_t size;
+    while ( ( size = read( fd, buffer, sizeof( buffer ) ) ) > 0 ) fwrite( buffer, 1, size, stdout );
+
+    close( fd );
+    return EXIT_SUCCESS;
+}
+
+int main( int argc, char* const argv[] )
+{
+    const char* path = COLLECT_PATH;
+    size_t siteLimit = DEFAULT_SITES;
+    bool bCollect = false;
+
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "ds:n:h" ) ) ) {
+        switch ( option ) {
+        case 'd': bCollect = true; break;
+        case 's': path = optarg; break;
+        case 'n': siteLimit = strtoul( optarg, NULL, 10 ); break;
+        default:
+            usage( argv[0] );
+            return ( 'h' == option ) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if ( optind != argc ) { usage( argv[0] ); return EXIT_FAILURE; }
+
+    return bCollect ? collect( path ) : query( path, siteLimit );
+}
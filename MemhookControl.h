@@ -0,0 +1,38 @@
+#ifndef __MEMHOOKCONTROLH__
+#define __MEMHOOKCONTROLH__
+
+#include <stddef.h>
+
+// Runtime switch for code running under libPreLoad.so with MEMHOOK_OPTIONS=switch=1
+// ( or tracing=0 to start switched off, or switchsignal=N to toggle by signal ):
+//
+//     if ( NULL != memhook_switch ) memhook_switch( 1 );      // track from here on
+//     ...
+//     if ( NULL != memhook_switch ) memhook_switch( 0 );      // back to the real allocator
+//
+// Blocks allocated while switched on stay tracked until they are freed, reports keep listing them.
+//
+// Budgets from MEMHOOK_OPTIONS=budget=tag.render=64m/128m,module.libfoo.so=1g ( budgetfail=1 makes
+// allocations past a hard limit return NULL ) report their crossings to a callback, which is called
+// from the service thread once per crossing, again after the live size went back below the limit:
+//
+//     static void onBudget( const char* scope, size_t live, size_t limit, int hard, void* context ) { ... }
+//     if ( NULL != memhook_budget_callback ) memhook_budget_callback( onBudget, NULL );
+//
+// The functions are weak, without the preload library they are NULL.
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // 0 on success, -1 when the library was started without switch=1
+    int             memhook_switch( int on ) __attribute__ (( weak ));
+    int             memhook_is_on( void ) __attribute__ (( weak ));
+
+    // 0 on success, -1 when no budget is configured. NULL goes back to the line in the report output
+    int             memhook_budget_callback( void (*callback)( const char* scope, size_t live, size_t limit, int hard, void* context ),
+                                             void* context ) __attribute__ (( weak ));
+#ifdef __cplusplus
+} // extern "C"
+#endif
+#endif
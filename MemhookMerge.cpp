@@ -0,0 +1,226 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#define DEFAULT_SITES       20
+#define LINE_SIZE           4096
+#define BLOCK_MARK          "++++++++++++++ unfreed addr: "
+#define END_MARK            "++++++++++++++ end ++++++++++++++"
+#define PACK_MARK           "MHZ1"      // compress=1, the magic of every block
+
+// one call site over every report, keyed by its frames without the addresses that differ per process
+struct tagMergedSite
+{
+    size_t                  count;
+    size_t                  size;
+    std::set<size_t>        reports;
+    std::string             tag;
+    std::vector<std::string> frames;
+};
+
+// totals of the last report in one file, a file written with report=period holds several
+struct tagReportFile
+{
+    const char*             path;
+    size_t                  reports;
+    size_t                  unfreedCount;
+    size_t                  unfreedSize;
+    size_t                  mockCount;
+    std::map<std::string, tagMergedSite> sites;
+};
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s [-n sites] report...\n", name );
+    fprintf( stderr, "\tcombines the reports of a process tree, output=dir/memhook.%%p.log writes one per process\n" );
+    fprintf( stderr, "\tpacked reports ( compress=1 ) are read through memhook cat, %s <( memhook cat report )\n", name );
+    fprintf( stderr, "\t-n\tcall sites to show by unfreed size, default %d, 0 for all\n", DEFAULT_SITES );
+}
+
+static void chomp( char* line )
+{
+    size_t length = strlen( line );
+    while ( length > 0 && ( '\n' == line[ length - 1 ] || '\r' == line[ length - 1 ] ) ) line[ --length ] = '\0';
+}
+
+// "\tcount: 12"
+static size_t parseValue( const char* line )
+{
+    const char* pColon = strchr( line, ':' );
+    return strtoul( ( NULL != pColon ) ? pColon + 1 : line, NULL, 10 );
+}
+
+// "\t#3  0x55d0c1a2b3c4 in main at main.cpp:12 (/usr/bin/demo+0x1234)" or "/usr/bin/demo(main+0x14)[0x55d0c1a2b3c4]"
+static std::string normalizeFrame( const char* line )
+{
+    while ( '\t' == *line || ' ' == *line ) ++line;
+
+    if ( '#' == line[0] ) {
+        const char* pIn = strstr( line, " in " );
+        if ( NULL != pIn ) return std::string( pIn + 4 );
+    }
+
+    std::string frame( line );
+    size_t bracket = frame.rfind( '[' );
+    if ( std::string::npos != bracket && ']' == frame[ frame.size() - 1 ] ) frame.erase( bracket );
+    return frame;
+}
+
+static bool parseFile( tagReportFile* const pFile, size_t index )
+{
+    FILE* pInput = fopen( pFile->path, "r" );
+    if ( NULL == pInput ) { fprintf( stderr, "memhook-merge: %s: %s\n", pFile->path, strerror( errno ) ); return false; }
+
+    char line[ LINE_SIZE ];
+    bool bFirst = true;
+    bool bBlock = false, bFrames = false;
+    size_t blockSize = 0;
+    std::string tag;
+    std::vector<std::string> frames;
+
+    while ( NULL != fgets( line, sizeof( line ), pInput ) ) {
+        if ( bFirst && 0 == strncmp( line, PACK_MARK, 4 ) ) {
+            fprintf( stderr, "memhook-merge: %s is packed, read it through memhook cat\n", pFile->path );
+            fclose( pInput );
+            return false;
+        }
+        bFirst = false;
+        chomp( line );
+
+        // a new report replaces the one before, what it lists is what was still unfreed then
+        if ( 0 == strcmp( line, "unfreed " ) ) {
+            pFile->reports++;
+            pFile->sites.clear();
+            pFile->mockCount = 0;
+            if ( NULL != fgets( line, sizeof( line ), pInput ) ) pFile->unfreedCount = parseValue( line );
+            if ( NULL != fgets( line, sizeof( line ), pInput ) ) pFile->unfreedSize = parseValue( line );
+            bBlock = bFrames = false;
+            continue;
+        }
+
+        if ( 0 == strncmp( line, "allocted by mock", 16 ) ) { pFile->mockCount++; continue; }
+
+        if ( 0 == strncmp( line, BLOCK_MARK, sizeof( BLOCK_MARK ) - 1 ) ) {
+            const char* pSize = strstr( line, "size: " );
+            blockSize   = ( NULL != pSize ) ? strtoul( pSize + 6, NULL, 10 ) : 0;
+            bBlock      = true;
+            bFrames     = false;
+            tag.clear();
+            frames.clear();
+            continue;
+        }
+        if ( !bBlock ) continue;
+
+        if ( 0 == strcmp( line, END_MARK ) ) {
+            std::string key = tag;
+            for ( size_t i = 0; i < frames.size(); ++i ) key += "\n" + frames[i];
+
+            tagMergedSite* pSite = &pFile->sites[ key ];
+            if ( 0 == pSite->count ) { pSite->tag = tag; pSite->frames = frames; }
+            pSite->count++;
+            pSite->size += blockSize;
+            pSite->reports.insert( index );
+
+            bBlock = bFrames = false;
+        } else if ( 0 == strncmp( line, "tag: ", 5 ) && !bFrames ) {
+            tag = line + 5;
+        } else if ( 0 == strcmp( line, "backtrace:" ) ) {
+            bFrames = true;
+        } else if ( bFrames && '\0' != line[0] ) {
+            frames.push_back( normalizeFrame( line ) );
+        }
+    }
+
+    fclose( pInput );
+    if ( 0 == pFile->reports ) fprintf( stderr, "memhook-merge: %s holds no report\n", pFile->path );
+    return true;
+}
+
+static bool compareSites( const tagMergedSite* pLeft, const tagMergedSite* pRight )
+{
+    if ( pLeft->size != pRight->size ) return pLeft->size > pRight->size;
+    return pLeft->count > pRight->count;
+}
+
+int main( int argc, char* const argv[] )
+{
+    size_t siteLimit = DEFAULT_SITES;
+
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "n:h" ) ) ) {
+        switch ( option ) {
+        case 'n': siteLimit = strtoul( optarg, NULL, 10 ); break;
+        default:
+            usage( argv[0] );
+            return ( 'h' == option ) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if ( optind >= argc ) { usage( argv[0] ); return EXIT_FAILURE; }
+
+    std::vector<tagReportFile> files( argc - optind );
+    for ( size_t i = 0; i < files.size(); ++i ) {
+        files[i].path           = argv[ optind + i ];
+        files[i].reports        = 0;
+        files[i].unfreedCount   = 0;
+        files[i].unfreedSize    = 0;
+        files[i].mockCount      = 0;
+        if ( !parseFile( &files[i], i ) ) return EXIT_FAILURE;
+    }
+
+    std::map<std::string, tagMergedSite> merged;
+    size_t totalCount = 0, totalSize = 0;
+
+    printf( "memhook merge of %ld reports\n", files.size() );
+    for ( size_t i = 0; i < files.size(); ++i ) {
+        const tagReportFile* pFile = &files[i];
+        printf( "%s: unfreed count: %ld, size: %ld, call sites: %ld, mock blocks: %ld\n", \
+                    pFile->path, \
+                    pFile->unfreedCount, \
+                    pFile->unfreedSize, \
+                    pFile->sites.size(), \
+                    pFile->mockCount );
+
+        totalCount  += pFile->unfreedCount;
+        totalSize   += pFile->unfreedSize;
+
+        for ( std::map<std::string, tagMergedSite>::const_iterator it = pFile->sites.begin(); it != pFile->sites.end(); ++it ) {
+            tagMergedSite* pSite = &merged[ it->first ];
+            if ( 0 == pSite->count ) { pSite->tag = it->second.tag; pSite->frames = it->second.frames; }
+            pSite->count += it->second.count;
+            pSite->size  += it->second.size;
+            pSite->reports.insert( it->second.reports.begin(), it->second.reports.end() );
+        }
+    }
+    printf( "unfreed \n \tcount: %ld\n\tsize: %ld\n", totalCount, totalSize );
+
+    std::vector<const tagMergedSite*> order;
+    for ( std::map<std::string, tagMergedSite>::const_iterator it = merged.begin(); it != merged.end(); ++it ) order.push_back( &it->second );
+    std::sort( order.begin(), order.end(), compareSites );
+
+    size_t shown = ( 0 == siteLimit || siteLimit > order.size() ) ? order.size() : siteLimit;
+    printf( "call sites with unfreed memory: %ld, top %ld by size\n", order.size(), shown );
+
+    for ( size_t i = 0; i < shown; ++i ) {
+        const tagMergedSite* pSite = order[i];
+
+        printf( "++++++++++++++ #%ld unfreed count: %ld, size: %ld, processes: %ld of %ld ++++++++++++++\n", \
+                    i, \
+                    pSite->count, \
+                    pSite->size, \
+                    pSite->reports.size(), \
+                    files.size() );
+        if ( !pSite->tag.empty() ) printf( "tag: %s\n", pSite->tag.c_str() );
+        printf( "backtrace:\n" );
+        for ( size_t frame = 0; frame < pSite->frames.size(); ++frame ) printf( "\t#%-2ld %s\n", frame, pSite->frames[ frame ].c_str() );
+        printf( "++++++++++++++ end ++++++++++++++\n" );
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,217 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <backtrace.h>
+#include "CPersist.h"
+
+using MemoryTrace::Persist::tagPersistFile;
+using MemoryTrace::Persist::tagPersistModule;
+using MemoryTrace::StackDepot::tagStackEntry;
+
+#define DEFAULT_SITES       20
+
+struct tagFrameInfo
+{
+    const char*     function;
+    const char*     file;
+    int             line;
+};
+
+static backtrace_state* s_states[ PERSIST_MODULES ];
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s [-n sites] file\n", name );
+    fprintf( stderr, "\t-n\tcall sites to show by live bytes, default %d, 0 for all\n", DEFAULT_SITES );
+}
+
+static void errorCallback( void*, const char*, int )
+{
+    ;
+}
+
+static int pcinfoCallback( void* pData, uintptr_t, const char* pFile, int line, const char* pFunction )
+{
+    tagFrameInfo* pInfo = (tagFrameInfo*)pData;
+    if ( NULL == pFunction ) return 0;
+
+    pInfo->function = pFunction;
+    pInfo->file     = pFile;
+    pInfo->line     = line;
+    return 1;
+}
+
+static void syminfoCallback( void* pData, uintptr_t, const char* pName, uintptr_t, uintptr_t )
+{
+    tagFrameInfo* pInfo = (tagFrameInfo*)pData;
+    if ( NULL == pInfo->function ) pInfo->function = pName;
+}
+
+static const tagPersistModule* findModule( const tagPersistFile* const pFile, uintptr_t pc, size_t* pIndex )
+{
+    for ( size_t i = 0; i < pFile->moduleCount && i < PERSIST_MODULES; ++i ) {
+        if ( pc >= pFile->modules[i].begin && pc < pFile->modules[i].end ) { *pIndex = i; return &pFile->modules[i]; }
+    }
+    return NULL;
+}
+
+// the process is gone, frames are resolved from the module files at their link time addresses,
+// libbacktrace adds the load address of its own executable to them, which is why this tool is linked -no-pie
+static void showFrame( const tagPersistFile* const pFile, size_t index, void* pAddr )
+{
+    uintptr_t pc = (uintptr_t)pAddr;
+    size_t moduleIndex = 0;
+    const tagPersistModule* pModule = findModule( pFile, pc, &moduleIndex );
+
+    if ( NULL == pModule ) { printf( "\t#%-2ld %p\n", index, pAddr ); return; }
+
+    uintptr_t offset = pc - pModule->base;
+    if ( NULL == s_states[ moduleIndex ] )
+        s_states[ moduleIndex ] = backtrace_create_state( pModule->path, 0, errorCallback, NULL );
+
+    tagFrameInfo info = { NULL, NULL, 0 };
+    if ( NULL != s_states[ moduleIndex ] ) {
+        backtrace_pcinfo( s_states[ moduleIndex ], offset, pcinfoCallback, errorCallback, &info );
+        if ( NULL == info.function ) backtrace_syminfo( s_states[ moduleIndex ], offset, syminfoCallback, errorCallback, &info );
+    }
+
+    int status = -1;
+    char* pDemangled = ( NULL != info.function ) ? abi::__cxa_demangle( info.function, NULL, NULL, &status ) : NULL;
+    const char* pFunction = ( 0 == status && NULL != pDemangled ) ? pDemangled : info.function;
+
+    printf( "\t#%-2ld %p in %s", index, pAddr, ( NULL != pFunction ) ? pFunction : "??" );
+    if ( NULL != info.file ) printf( " at %s:%d", info.file, info.line );
+    printf( " (%s+0x%lx)\n", pModule->path, offset );
+
+    free( pDemangled );
+}
+
+static const char* describeState( const tagPersistFile* const pFile, char* const buffer, size_t length )
+{
+    switch ( pFile->state ) {
+    case MemoryTrace::Persist::PS_EXITED:
+        return "exited";
+    case MemoryTrace::Persist::PS_CRASHED:
+        snprintf( buffer, length, "crashed by signal %d (%s)", pFile->signal, strsignal( pFile->signal ) );
+        return buffer;
+    default:
+        // nothing marked the end, either it still runs or it was killed ( SIGKILL, OOM killer )
+        if ( 0 == kill( pFile->pid, 0 ) || EPERM == errno ) return "running, or killed and the pid reused";
+        return "killed without notice ( SIGKILL or OOM killer )";
+    }
+}
+
+static void showTime( const char* const name, uint64_t time )
+{
+    char buffer[ 64 ];
+    time_t seconds = time / 1000000000;
+    struct tm local;
+
+    localtime_r( &seconds, &local );
+    strftime( buffer, sizeof( buffer ), "%Y-%m-%d %H:%M:%S", &local );
+    printf( "%s: %s\n", name, buffer );
+}
+
+static int compareSites( const void* pLeft, const void* pRight )
+{
+    const tagStackEntry* pLeftEntry  = *(const tagStackEntry* const*)pLeft;
+    const tagStackEntry* pRightEntry = *(const tagStackEntry* const*)pRight;
+
+    if ( pLeftEntry->liveSize != pRightEntry->liveSize ) return ( pLeftEntry->liveSize > pRightEntry->liveSize ) ? -1 : 1;
+    return 0;
+}
+
+static void report( const char* const path, const tagPersistFile* const pFile, size_t siteLimit )
+{
+    char state[ 128 ];
+    const MemoryTrace::MemoryManager::tagUnitManager* pStat = &pFile->statistics;
+
+    printf( "memhook post-mortem of %s\n", path );
+    printf( "process: %s, pid: %u, state: %s\n", pFile->command, pFile->pid, describeState( pFile, state, sizeof( state ) ) );
+    showTime( "started", pFile->startTime );
+    showTime( "last sync", pFile->updateTime );
+
+    printf( "allocated \n \tcount: %ld\n\tsize: %ld\n", pStat->allocCount, pStat->allocSize );
+    printf( "freed \n \tcount: %ld\n\tsize: %ld\n", pStat->freeCount, pStat->freeSize );
+    printf( "unfreed \n \tcount: %ld\n\tsize: %ld\n", pStat->allocCount - pStat->freeCount, pStat->allocSize - pStat->freeSize );
+    printf( "peak \n \tsize: %ld\n", pStat->peakSize );
+
+    const MemoryTrace::Mapping::tagMappingStatistics* pMapping = &pFile->mapping;
+    if ( 0 != pMapping->mapCount )
+        printf( "mapped \n \tcount: %ld\n\tsize: %ld\n\tpeak: %ld\n", pMapping->liveCount, pMapping->liveSize, pMapping->peakSize );
+
+    static const tagStackEntry* s_sites[ STACK_DEPOT_CAPACITY ];
+    size_t siteCount = 0;
+    for ( size_t i = 0; i < STACK_DEPOT_CAPACITY; ++i ) {
+        const tagStackEntry* pEntry = &pFile->stacks[i];
+        if ( pEntry->bReady && pEntry->liveSize > 0 ) s_sites[ siteCount++ ] = pEntry;
+    }
+    qsort( s_sites, siteCount, sizeof( s_sites[0] ), compareSites );
+
+    size_t shown = ( 0 == siteLimit || siteLimit > siteCount ) ? siteCount : siteLimit;
+    printf( "call sites with unfreed memory: %ld, top %ld by size\n", siteCount, shown );
+
+    for ( size_t i = 0; i < shown; ++i ) {
+        const tagStackEntry* pEntry = s_sites[i];
+
+        printf( "++++++++++++++ #%ld unfreed count: %ld, size: %ld, allocations: %lu ++++++++++++++\n", \
+                    i, \
+                    pEntry->liveCount, \
+                    pEntry->liveSize, \
+                    pEntry->allocCount );
+        printf( "backtrace:\n" );
+        for ( size_t frame = 0; frame < pEntry->traceSize && frame < BACKTRACE_DEPTH; ++frame )
+            showFrame( pFile, frame, pEntry->backtrace[ frame ] );
+        printf( "++++++++++++++ end ++++++++++++++\n" );
+    }
+}
+
+int main( int argc, char* const argv[] )
+{
+    size_t siteLimit = DEFAULT_SITES;
+
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "n:h" ) ) ) {
+        switch ( option ) {
+        case 'n': siteLimit = strtoul( optarg, NULL, 10 ); break;
+        default:
+            usage( argv[0] );
+            return ( 'h' == option ) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if ( optind + 1 != argc ) { usage( argv[0] ); return EXIT_FAILURE; }
+
+    const char* path = argv[ optind ];
+    int fd = open( path, O_RDONLY );
+    if ( -1 == fd ) { fprintf( stderr, "memhook-postmortem: %s: %s\n", path, strerror( errno ) ); return EXIT_FAILURE; }
+
+    struct stat status;
+    if ( 0 != fstat( fd, &status ) || (size_t)status.st_size < sizeof( tagPersistFile ) ) {
+        fprintf( stderr, "memhook-postmortem: %s is too small for a version %d file\n", path, PERSIST_VERSION );
+        close( fd );
+        return EXIT_FAILURE;
+    }
+
+    void* pMap = mmap( NULL, sizeof( tagPersistFile ), PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( MAP_FAILED == pMap ) { fprintf( stderr, "memhook-postmortem: %s: %s\n", path, strerror( errno ) ); return EXIT_FAILURE; }
+
+    const tagPersistFile* pFile = (const tagPersistFile*)pMap;
+    if ( PERSIST_MAGIC != pFile->magic || PERSIST_VERSION != pFile->version ) {
+        fprintf( stderr, "memhook-postmortem: %s is not a version %d persist file\n", path, PERSIST_VERSION );
+        return EXIT_FAILURE;
+    }
+
+    report( path, pFile, siteLimit );
+
+    munmap( pMap, sizeof( tagPersistFile ) );
+    return EXIT_SUCCESS;
+}
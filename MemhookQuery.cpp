@@ -0,0 +1,485 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cxxabi.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <backtrace.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "CSnapshot.h"
+
+using MemoryTrace::Snapshot::tagSnapshotHeader;
+using MemoryTrace::Snapshot::tagSnapshotStack;
+using MemoryTrace::Snapshot::tagSnapshotMapping;
+using MemoryTrace::Persist::tagPersistModule;
+
+#define DEFAULT_ROWS        20
+#define SIZE_BUCKETS        64
+#define NO_MODULE           UINT32_MAX
+
+struct tagFrameInfo
+{
+    const char*     function;
+    const char*     file;
+    int             line;
+};
+
+// a mapped snapshot file, the columns are used in place
+struct tagSnapshotFile
+{
+    const char*                 path;
+    size_t                      index;          // of the file on the command line, symbols are kept per file
+    void*                       pMap;
+    size_t                      mapSize;
+    const tagSnapshotHeader*    pHeader;
+
+    const uint64_t*             addresses;
+    const uint64_t*             sizes;
+    const uint64_t*             serials;
+    const uint64_t*             timestamps;
+    const uint32_t*             threads;
+    const uint32_t*             stackIds;
+    const tagSnapshotStack*     stacks;
+    const tagPersistModule*     modules;
+    const tagSnapshotMapping*   mappings;
+};
+
+// live blocks of one stack, of one or two snapshots
+struct tagStackTotal
+{
+    uint64_t        count[ 2 ];
+    uint64_t        size[ 2 ];
+    uint64_t        oldest;
+    const tagSnapshotFile*  pFile;
+    uint32_t        stack;
+};
+
+static backtrace_state* s_states[ 2 ][ PERSIST_MODULES ];
+static bool             s_byCount = false;
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s [-n rows] [-c] [-t seconds] command snapshot [snapshot]\n", name );
+    fprintf( stderr, "\ttop snapshot\t\tstacks by live bytes\n" );
+    fprintf( stderr, "\told snapshot\t\tstacks by live bytes of blocks older than -t seconds\n" );
+    fprintf( stderr, "\tmodules snapshot\tsize distribution of the live blocks per module of the allocating frame\n" );
+    fprintf( stderr, "\tmappings snapshot\tstacks by mapped bytes, the process ran with mmap=1\n" );
+    fprintf( stderr, "\tdiff before after\tstacks by change of live bytes\n" );
+    fprintf( stderr, "\t-n\tstacks to show, default %d, 0 for all\n", DEFAULT_ROWS );
+    fprintf( stderr, "\t-c\tsort by block count instead of bytes\n" );
+    fprintf( stderr, "\t-t\tage for old, default 60\n" );
+}
+
+static void errorCallback( void*, const char*, int )
+{
+    ;
+}
+
+static int pcinfoCallback( void* pData, uintptr_t, const char* pFile, int line, const char* pFunction )
+{
+    tagFrameInfo* pInfo = (tagFrameInfo*)pData;
+    if ( NULL == pFunction ) return 0;
+
+    pInfo->function = pFunction;
+    pInfo->file     = pFile;
+    pInfo->line     = line;
+    return 1;
+}
+
+static void syminfoCallback( void* pData, uintptr_t, const char* pName, uintptr_t, uintptr_t )
+{
+    tagFrameInfo* pInfo = (tagFrameInfo*)pData;
+    if ( NULL == pInfo->function ) pInfo->function = pName;
+}
+
+static uint32_t findModule( const tagSnapshotFile* const pFile, uint64_t pc )
+{
+    for ( uint32_t i = 0; i < pFile->pHeader->moduleCount && i < PERSIST_MODULES; ++i ) {
+        if ( pc >= pFile->modules[i].begin && pc < pFile->modules[i].end ) return i;
+    }
+    return NO_MODULE;
+}
+
+// resolved from the module files at their link time addresses, like memhook-postmortem, which is why this tool is linked -no-pie
+static void showFrame( const tagSnapshotFile* const pFile, size_t index, uint64_t pc )
+{
+    uint32_t moduleIndex = findModule( pFile, pc );
+    if ( NO_MODULE == moduleIndex ) { printf( "\t#%-2ld 0x%lx\n", index, pc ); return; }
+
+    const tagPersistModule* pModule = &pFile->modules[ moduleIndex ];
+    uintptr_t offset = pc - pModule->base;
+    backtrace_state** ppState = &s_states[ pFile->index ][ moduleIndex ];
+    if ( NULL == *ppState ) *ppState = backtrace_create_state( pModule->path, 0, errorCallback, NULL );
+
+    tagFrameInfo info = { NULL, NULL, 0 };
+    if ( NULL != *ppState ) {
+        backtrace_pcinfo( *ppState, offset, pcinfoCallback, errorCallback, &info );
+        if ( NULL == info.function ) backtrace_syminfo( *ppState, offset, syminfoCallback, errorCallback, &info );
+    }
+
+    int status = -1;
+    char* pDemangled = ( NULL != info.function ) ? abi::__cxa_demangle( info.function, NULL, NULL, &status ) : NULL;
+    const char* pFunction = ( 0 == status && NULL != pDemangled ) ? pDemangled : info.function;
+
+    printf( "\t#%-2ld 0x%lx in %s", index, pc, ( NULL != pFunction ) ? pFunction : "??" );
+    if ( NULL != info.file ) printf( " at %s:%d", info.file, info.line );
+    printf( " (%s+0x%lx)\n", pModule->path, offset );
+
+    free( pDemangled );
+}
+
+static void showStack( const tagSnapshotFile* const pFile, uint32_t stack )
+{
+    printf( "backtrace:\n" );
+    if ( 0 == stack ) { printf( "\tnot recorded\n" ); return; }
+
+    const tagSnapshotStack* pStack = &pFile->stacks[ stack ];
+    for ( size_t frame = 0; frame < pStack->traceSize && frame < BACKTRACE_DEPTH; ++frame )
+        showFrame( pFile, frame, pStack->frames[ frame ] );
+}
+
+static bool openSnapshot( const char* const path, size_t index, tagSnapshotFile* const pFile )
+{
+    memset( pFile, 0, sizeof( *pFile ) );
+    pFile->path     = path;
+    pFile->index    = index;
+
+    int fd = open( path, O_RDONLY );
+    if ( -1 == fd ) { fprintf( stderr, "memhook-query: %s: %s\n", path, strerror( errno ) ); return false; }
+
+    struct stat status;
+    if ( 0 != fstat( fd, &status ) || (size_t)status.st_size < sizeof( tagSnapshotHeader ) ) {
+        fprintf( stderr, "memhook-query: %s is too small for a version %d snapshot\n", path, SNAPSHOT_VERSION );
+        close( fd );
+        return false;
+    }
+
+    pFile->mapSize  = status.st_size;
+    pFile->pMap     = mmap( NULL, pFile->mapSize, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( MAP_FAILED == pFile->pMap ) { fprintf( stderr, "memhook-query: %s: %s\n", path, strerror( errno ) ); return false; }
+
+    const tagSnapshotHeader* pHeader = (const tagSnapshotHeader*)pFile->pMap;
+    if ( SNAPSHOT_MAGIC != pHeader->magic || SNAPSHOT_VERSION != pHeader->version ) {
+        fprintf( stderr, "memhook-query: %s is not a version %d snapshot\n", path, SNAPSHOT_VERSION );
+        return false;
+    }
+
+    for ( size_t i = 0; i < MemoryTrace::Snapshot::SC_COUNT; ++i ) {
+        if ( pHeader->columns[i].offset > pFile->mapSize || pHeader->columns[i].size > pFile->mapSize - pHeader->columns[i].offset ) {
+            fprintf( stderr, "memhook-query: %s is truncated\n", path );
+            return false;
+        }
+    }
+
+    const char* pBase   = (const char*)pFile->pMap;
+    pFile->pHeader      = pHeader;
+    pFile->addresses    = (const uint64_t*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_ADDRESS ].offset );
+    pFile->sizes        = (const uint64_t*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_SIZE ].offset );
+    pFile->serials      = (const uint64_t*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_SERIAL ].offset );
+    pFile->timestamps   = (const uint64_t*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_TIMESTAMP ].offset );
+    pFile->threads      = (const uint32_t*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_THREAD ].offset );
+    pFile->stackIds     = (const uint32_t*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_STACK ].offset );
+    pFile->stacks       = (const tagSnapshotStack*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_STACKS ].offset );
+    pFile->modules      = (const tagPersistModule*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_MODULES ].offset );
+    pFile->mappings     = (const tagSnapshotMapping*)( pBase + pHeader->columns[ MemoryTrace::Snapshot::SC_MAPPINGS ].offset );
+    return true;
+}
+
+static void showHeader( const tagSnapshotFile* const pFile )
+{
+    const tagSnapshotHeader* pHeader = pFile->pHeader;
+    uint64_t liveSize = 0;
+    for ( uint64_t i = 0; i < pHeader->blockCount; ++i ) liveSize += pFile->sizes[i];
+
+    printf( "memhook snapshot %s\n", pFile->path );
+    printf( "process: %s, pid: %u, report: %lu\n", pHeader->command, pHeader->pid, pHeader->sequence );
+    printf( "live \n \tcount: %lu\n\tsize: %lu\n\tstacks: %u\n", pHeader->blockCount, liveSize, pHeader->stackCount - 1 );
+
+    if ( 0 == pHeader->mappingCount ) return;
+    uint64_t mappedSize = 0;
+    for ( uint32_t i = 0; i < pHeader->mappingCount; ++i ) mappedSize += pFile->mappings[i].end - pFile->mappings[i].begin;
+    printf( "mapped \n \tcount: %u\n\tsize: %lu\n", pHeader->mappingCount, mappedSize );
+}
+
+static bool bySize( const tagStackTotal& left, const tagStackTotal& right )
+{
+    if ( s_byCount ) return left.count[0] > right.count[0];
+    return left.size[0] > right.size[0];
+}
+
+static int64_t changeOf( const tagStackTotal& total )
+{
+    return s_byCount ? (int64_t)( total.count[1] - total.count[0] ) : (int64_t)( total.size[1] - total.size[0] );
+}
+
+static bool byChange( const tagStackTotal& left, const tagStackTotal& right )
+{
+    int64_t leftChange  = changeOf( left );
+    int64_t rightChange = changeOf( right );
+
+    return ( ( leftChange < 0 ) ? -leftChange : leftChange ) > ( ( rightChange < 0 ) ? -rightChange : rightChange );
+}
+
+// one pass over the stack, size and, for old, timestamp columns
+static std::vector<tagStackTotal> sumStacks( const tagSnapshotFile* const pFile, uint64_t before )
+{
+    const tagSnapshotHeader* pHeader = pFile->pHeader;
+    std::vector<tagStackTotal> totals( pHeader->stackCount );
+
+    for ( uint32_t i = 0; i < pHeader->stackCount; ++i ) {
+        totals[i].pFile     = pFile;
+        totals[i].stack     = i;
+        totals[i].oldest    = UINT64_MAX;
+    }
+
+    for ( uint64_t i = 0; i < pHeader->blockCount; ++i ) {
+        uint32_t stack = pFile->stackIds[i];
+        if ( stack >= pHeader->stackCount ) stack = 0;
+
+        if ( UINT64_MAX != before ) {
+            uint64_t timestamp = pFile->timestamps[i];
+            if ( 0 == timestamp || timestamp > before ) continue;
+            if ( timestamp < totals[ stack ].oldest ) totals[ stack ].oldest = timestamp;
+        }
+
+        totals[ stack ].count[0]++;
+        totals[ stack ].size[0] += pFile->sizes[i];
+    }
+    return totals;
+}
+
+static void showTotals( std::vector<tagStackTotal>& totals, size_t rows, uint64_t clock )
+{
+    std::sort( totals.begin(), totals.end(), bySize );
+
+    size_t used = 0;
+    while ( used < totals.size() && 0 != totals[ used ].count[0] ) ++used;
+    size_t shown = ( 0 == rows || rows > used ) ? used : rows;
+    printf( "stacks with live blocks: %ld, top %ld by %s\n", used, shown, s_byCount ? "count" : "size" );
+
+    for ( size_t i = 0; i < shown; ++i ) {
+        const tagStackTotal* pTotal = &totals[i];
+
+        printf( "++++++++++++++ #%ld count: %lu, size: %lu", i, pTotal->count[0], pTotal->size[0] );
+        if ( UINT64_MAX != pTotal->oldest ) printf( ", oldest: %.1f s", (double)( clock - pTotal->oldest ) / 1e9 );
+        printf( " ++++++++++++++\n" );
+        showStack( pTotal->pFile, pTotal->stack );
+        printf( "++++++++++++++ end ++++++++++++++\n" );
+    }
+}
+
+static void queryTop( const tagSnapshotFile* const pFile, size_t rows )
+{
+    showHeader( pFile );
+
+    std::vector<tagStackTotal> totals = sumStacks( pFile, UINT64_MAX );
+    showTotals( totals, rows, pFile->pHeader->clock );
+}
+
+static void queryOld( const tagSnapshotFile* const pFile, size_t rows, double seconds )
+{
+    showHeader( pFile );
+
+    // blocks without a backtrace have no time either
+    uint64_t age = (uint64_t)( seconds * 1e9 );
+    uint64_t before = ( pFile->pHeader->clock > age ) ? pFile->pHeader->clock - age : 0;
+    printf( "older than %.1f s\n", seconds );
+
+    std::vector<tagStackTotal> totals = sumStacks( pFile, before );
+    showTotals( totals, rows, pFile->pHeader->clock );
+}
+
+static void queryMappings( const tagSnapshotFile* const pFile, size_t rows )
+{
+    const tagSnapshotHeader* pHeader = pFile->pHeader;
+    showHeader( pFile );
+
+    std::vector<tagStackTotal> totals( pHeader->stackCount );
+    for ( uint32_t i = 0; i < pHeader->stackCount; ++i ) {
+        totals[i].pFile     = pFile;
+        totals[i].stack     = i;
+        totals[i].oldest    = UINT64_MAX;
+    }
+
+    for ( uint32_t i = 0; i < pHeader->mappingCount; ++i ) {
+        const tagSnapshotMapping* pMapping = &pFile->mappings[i];
+        uint32_t stack = ( pMapping->stack < pHeader->stackCount ) ? pMapping->stack : 0;
+
+        totals[ stack ].count[0]++;
+        totals[ stack ].size[0] += pMapping->end - pMapping->begin;
+        if ( 0 != pMapping->timestamp && pMapping->timestamp < totals[ stack ].oldest ) totals[ stack ].oldest = pMapping->timestamp;
+    }
+    showTotals( totals, rows, pHeader->clock );
+}
+
+// operator new and the other runtime wrappers are nobody's call site, the first frame past them is
+static uint32_t callerModule( const tagSnapshotFile* const pFile, const tagSnapshotStack* const pStack )
+{
+    uint32_t first = NO_MODULE;
+    for ( size_t frame = 0; frame < pStack->traceSize && frame < BACKTRACE_DEPTH; ++frame ) {
+        uint32_t module = findModule( pFile, pStack->frames[ frame ] );
+        if ( NO_MODULE == module ) continue;
+        if ( !MemoryTrace::MemoryManager::isRuntimeModule( pFile->modules[ module ].path ) ) return module;
+        if ( NO_MODULE == first ) first = module;
+    }
+    return first;
+}
+
+static void queryModules( const tagSnapshotFile* const pFile )
+{
+    const tagSnapshotHeader* pHeader = pFile->pHeader;
+    showHeader( pFile );
+
+    // module of the first frame outside the hook and the runtime, the last row takes the blocks without one
+    std::vector<uint32_t> stackModules( pHeader->stackCount, pHeader->moduleCount );
+    for ( uint32_t i = 1; i < pHeader->stackCount; ++i ) {
+        uint32_t module = callerModule( pFile, &pFile->stacks[i] );
+        if ( NO_MODULE != module ) stackModules[i] = module;
+    }
+
+    std::vector<uint64_t> counts( ( pHeader->moduleCount + 1 ) * SIZE_BUCKETS );
+    std::vector<uint64_t> sizes( ( pHeader->moduleCount + 1 ) * SIZE_BUCKETS );
+    for ( uint64_t i = 0; i < pHeader->blockCount; ++i ) {
+        uint32_t stack  = pFile->stackIds[i];
+        uint64_t size   = pFile->sizes[i];
+        size_t bucket   = ( 0 == size ) ? 0 : 64 - __builtin_clzl( size );
+        if ( bucket >= SIZE_BUCKETS ) bucket = SIZE_BUCKETS - 1;
+
+        size_t index = stackModules[ ( stack < pHeader->stackCount ) ? stack : 0 ] * SIZE_BUCKETS + bucket;
+        counts[ index ]++;
+        sizes[ index ] += size;
+    }
+
+    for ( uint32_t module = 0; module <= pHeader->moduleCount; ++module ) {
+        uint64_t count = 0, size = 0;
+        for ( size_t bucket = 0; bucket < SIZE_BUCKETS; ++bucket ) {
+            count   += counts[ module * SIZE_BUCKETS + bucket ];
+            size    += sizes[ module * SIZE_BUCKETS + bucket ];
+        }
+        if ( 0 == count ) continue;
+
+        printf( "%s \n \tcount: %lu\n\tsize: %lu\n", ( module < pHeader->moduleCount ) ? pFile->modules[ module ].path : "unknown", count, size );
+        for ( size_t bucket = 0; bucket < SIZE_BUCKETS; ++bucket ) {
+            size_t index = module * SIZE_BUCKETS + bucket;
+            if ( 0 == counts[ index ] ) continue;
+
+            printf( "\t<= %-12lu count: %-10lu size: %lu\n", ( 1UL << bucket ) - 1, counts[ index ], sizes[ index ] );
+        }
+    }
+}
+
+// addresses differ per process, a stack is known by its frames relative to their module
+static std::string keyOf( const tagSnapshotFile* const pFile, uint32_t stack )
+{
+    if ( 0 == stack ) return std::string();
+
+    std::string key;
+    const tagSnapshotStack* pStack = &pFile->stacks[ stack ];
+    for ( size_t frame = 0; frame < pStack->traceSize && frame < BACKTRACE_DEPTH; ++frame ) {
+        char buffer[ PERSIST_MODULE_PATH + 32 ];
+        uint64_t pc = pStack->frames[ frame ];
+        uint32_t module = findModule( pFile, pc );
+
+        if ( NO_MODULE == module ) snprintf( buffer, sizeof( buffer ), "0x%lx;", pc );
+        else snprintf( buffer, sizeof( buffer ), "%s+0x%lx;", pFile->modules[ module ].path, pc - pFile->modules[ module ].base );
+        key += buffer;
+    }
+    return key;
+}
+
+static void queryDiff( const tagSnapshotFile* const pBefore, const tagSnapshotFile* const pAfter, size_t rows )
+{
+    showHeader( pBefore );
+    showHeader( pAfter );
+
+    std::map<std::string, tagStackTotal> merged;
+    const tagSnapshotFile* files[ 2 ] = { pBefore, pAfter };
+
+    for ( size_t side = 0; side < 2; ++side ) {
+        std::vector<tagStackTotal> totals = sumStacks( files[ side ], UINT64_MAX );
+
+        for ( size_t i = 0; i < totals.size(); ++i ) {
+            if ( 0 == totals[i].count[0] ) continue;
+
+            tagStackTotal* pMerged = &merged[ keyOf( files[ side ], totals[i].stack ) ];
+            pMerged->count[ side ]  = totals[i].count[0];
+            pMerged->size[ side ]   = totals[i].size[0];
+            // the frames of the later snapshot are shown
+            pMerged->pFile          = files[ side ];
+            pMerged->stack          = totals[i].stack;
+        }
+    }
+
+    std::vector<tagStackTotal> changes;
+    for ( std::map<std::string, tagStackTotal>::const_iterator it = merged.begin(); it != merged.end(); ++it ) {
+        if ( 0 != changeOf( it->second ) ) changes.push_back( it->second );
+    }
+    std::sort( changes.begin(), changes.end(), byChange );
+
+    size_t shown = ( 0 == rows || rows > changes.size() ) ? changes.size() : rows;
+    printf( "stacks that changed: %ld, top %ld by %s\n", changes.size(), shown, s_byCount ? "count" : "size" );
+
+    for ( size_t i = 0; i < shown; ++i ) {
+        const tagStackTotal* pTotal = &changes[i];
+
+        printf( "++++++++++++++ #%ld count: %lu -> %lu ( %+ld ), size: %lu -> %lu ( %+ld ) ++++++++++++++\n", \
+                    i, \
+                    pTotal->count[0], pTotal->count[1], (int64_t)( pTotal->count[1] - pTotal->count[0] ), \
+                    pTotal->size[0], pTotal->size[1], (int64_t)( pTotal->size[1] - pTotal->size[0] ) );
+        showStack( pTotal->pFile, pTotal->stack );
+        printf( "++++++++++++++ end ++++++++++++++\n" );
+    }
+}
+
+int main( int argc, char* const argv[] )
+{
+    size_t rows = DEFAULT_ROWS;
+    double seconds = 60;
+
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "n:ct:h" ) ) ) {
+        switch ( option ) {
+        case 'n': rows = strtoul( optarg, NULL, 10 ); break;
+        case 'c': s_byCount = true; break;
+        case 't': seconds = strtod( optarg, NULL ); break;
+        default:
+            usage( argv[0] );
+            return ( 'h' == option ) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if ( optind + 2 > argc ) { usage( argv[0] ); return EXIT_FAILURE; }
+
+    const char* command = argv[ optind ];
+    bool bDiff = 0 == strcmp( command, "diff" );
+    if ( optind + ( bDiff ? 3 : 2 ) != argc ) { usage( argv[0] ); return EXIT_FAILURE; }
+
+    tagSnapshotFile files[ 2 ];
+    if ( !openSnapshot( argv[ optind + 1 ], 0, &files[0] ) ) return EXIT_FAILURE;
+    if ( bDiff && !openSnapshot( argv[ optind + 2 ], 1, &files[1] ) ) return EXIT_FAILURE;
+
+    if ( 0 == strcmp( command, "top" ) ) {
+        queryTop( &files[0], rows );
+    } else if ( 0 == strcmp( command, "old" ) ) {
+        queryOld( &files[0], rows, seconds );
+    } else if ( 0 == strcmp( command, "modules" ) ) {
+        queryModules( &files[0] );
+    } else if ( 0 == strcmp( command, "mappings" ) ) {
+        queryMappings( &files[0], rows );
+    } else if ( bDiff ) {
+        queryDiff( &files[0], &files[1], rows );
+    } else {
+        usage( argv[0] );
+        return EXIT_FAILURE;
+    }
+
+    munmap( files[0].pMap, files[0].mapSize );
+    if ( bDiff ) munmap( files[1].pMap, files[1].mapSize );
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,777 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "CRecorder.h"
+#include "CConfig.h"
+
+using namespace MemoryTrace::Recorder;
+
+#define PRELOAD_LIBRARY     "libPreLoad.so"
+#define MAX_REPLAY_THREAD   1024
+#define REF_CLASS_COUNT     28
+#define REF_CLASS_ALIGNED   0xFFFE
+#define REF_CLASS_LARGE     0xFFFF
+#define REF_ARENA_SIZE      ( 64UL * 1024 * 1024 )
+
+// one decoded operation, objects are numbered in recorded order so the replay never depends on addresses
+struct tagReplayEvent
+{
+    uint64_t        time;
+    uint64_t        start;          // realloc only, when the old block was released
+    uint64_t        size;
+    uint64_t        alignment;
+    uint64_t        addr;
+    uint64_t        oldAddr;
+    uint32_t        sequence;       // position in the file, breaks ties between equal times
+    uint32_t        id;
+    uint32_t        oldId;
+    uint32_t        thread;
+    uint8_t         op;
+};
+
+struct tagReplayObject
+{
+    void*           ptr;
+    volatile int    bReady;
+};
+
+struct tagReplayThread
+{
+    pthread_t       handle;
+    pid_t           tid;
+    uint32_t*       events;
+    size_t          count;
+    uint64_t        opCount[ OP_FREE + 1 ];
+    uint64_t        opTime[ OP_FREE + 1 ];
+};
+
+struct tagAllocator
+{
+    const char*     name;
+    void*           (*pMalloc)( size_t );
+    void*           (*pCalloc)( size_t, size_t );
+    void*           (*pRealloc)( void*, size_t );
+    void*           (*pMemalign)( size_t, size_t );
+    void*           (*pValloc)( size_t );
+    void            (*pFree)( void* );
+};
+
+static tagReplayEvent*      s_events        = NULL;
+static size_t               s_eventCount    = 0;
+static tagReplayObject*     s_objects       = NULL;
+static size_t               s_objectCount   = 0;
+static tagReplayThread      s_threads[ MAX_REPLAY_THREAD ];
+static size_t               s_threadCount   = 0;
+
+static const tagAllocator*  s_pAllocator    = NULL;
+static bool                 s_bTiming       = false;
+static uint64_t             s_traceStart    = 0;
+static uint64_t             s_replayStart   = 0;
+
+static const char* const    s_opNames[]     = { "", "malloc", "calloc", "realloc", "memalign", "valloc", "free" };
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s [-a allocator] [-j] [-t] [-m modes] [-l library] trace\n", name );
+    fprintf( stderr, "\t-a\tlibc or reference, default libc\n" );
+    fprintf( stderr, "\t-j\treplay every recorded thread on its own thread, default one thread in recorded order\n" );
+    fprintf( stderr, "\t-t\tkeep the recorded time between operations\n" );
+    fprintf( stderr, "\t-m\treplay under %s once per mode, e.g. off,counters,full\n", PRELOAD_LIBRARY );
+    fprintf( stderr, "\t-l\tpath of %s, default next to this program\n", PRELOAD_LIBRARY );
+}
+
+static uint64_t timestamp()
+{
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// everything the replay keeps for itself comes from mmap, so it stays out of the allocator under test
+static void* mapMemory( size_t size )
+{
+    void* pMap = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+
+    return ( MAP_FAILED == pMap ) ? NULL : pMap;
+}
+
+namespace Reference
+{
+    // size-segregated free lists over bump allocated arenas, blocks above the last class are mapped directly
+    struct tagBlockHeader
+    {
+        uint32_t        sizeClass;
+        uint32_t        reserved;
+        size_t          size;           // usable size, or the unaligned block for memalign
+    };
+
+    struct tagFreeBlock
+    {
+        tagFreeBlock*   pNext;
+    };
+
+    static tagFreeBlock*    s_freeLists[ REF_CLASS_COUNT ];
+    static pthread_mutex_t  s_mutexClass[ REF_CLASS_COUNT ];
+    static pthread_mutex_t  s_mutexArena    = PTHREAD_MUTEX_INITIALIZER;
+    static char*            s_pArena        = NULL;
+    static size_t           s_arenaLeft     = 0;
+
+    // 16 byte steps up to 256, powers of two above
+    static uint32_t classOf( size_t size )
+    {
+        if ( size <= 256 ) return ( 0 == size ) ? 0 : ( size - 1 ) / 16;
+
+        uint32_t sizeClass = 16;
+        for ( size_t classSize = 512; classSize < size; classSize <<= 1 ) ++sizeClass;
+
+        return sizeClass;
+    }
+
+    static size_t classSize( uint32_t sizeClass )
+    {
+        return ( sizeClass < 16 ) ? ( sizeClass + 1 ) * 16 : 512UL << ( sizeClass - 16 );
+    }
+
+    static void initialize()
+    {
+        for ( size_t i = 0; i < REF_CLASS_COUNT; ++i ) pthread_mutex_init( &s_mutexClass[i], NULL );
+    }
+
+    static void* carve( size_t size )
+    {
+        pthread_mutex_lock( &s_mutexArena );
+
+        if ( s_arenaLeft < size ) {
+            s_pArena    = (char*)mapMemory( REF_ARENA_SIZE );
+            s_arenaLeft = ( NULL == s_pArena ) ? 0 : REF_ARENA_SIZE;
+        }
+
+        void* pBlock = NULL;
+        if ( s_arenaLeft >= size ) {
+            pBlock      = s_pArena;
+            s_pArena    += size;
+            s_arenaLeft -= size;
+        }
+
+        pthread_mutex_unlock( &s_mutexArena );
+        return pBlock;
+    }
+
+    static void* allocate( size_t size )
+    {
+        uint32_t sizeClass = classOf( size );
+        tagBlockHeader* pHeader = NULL;
+
+        if ( sizeClass >= REF_CLASS_COUNT ) {
+            size_t mapSize = ( size + sizeof( tagBlockHeader ) + 4095 ) & ~4095UL;
+            pHeader = (tagBlockHeader*)mapMemory( mapSize );
+            if ( NULL == pHeader ) return NULL;
+
+            pHeader->sizeClass  = REF_CLASS_LARGE;
+            pHeader->size       = mapSize - sizeof( tagBlockHeader );
+            return pHeader + 1;
+        }
+
+        pthread_mutex_lock( &s_mutexClass[ sizeClass ] );
+        tagFreeBlock* pFree = s_freeLists[ sizeClass ];
+        if ( NULL != pFree ) s_freeLists[ sizeClass ] = pFree->pNext;
+        pthread_mutex_unlock( &s_mutexClass[ sizeClass ] );
+
+        if ( NULL != pFree ) return pFree;
+
+        pHeader = (tagBlockHeader*)carve( classSize( sizeClass ) + sizeof( tagBlockHeader ) );
+        if ( NULL == pHeader ) return NULL;
+
+        pHeader->sizeClass  = sizeClass;
+        pHeader->size       = classSize( sizeClass );
+        return pHeader + 1;
+    }
+
+    static void release( void* ptr )
+    {
+        if ( NULL == ptr ) return;
+
+        tagBlockHeader* pHeader = (tagBlockHeader*)ptr - 1;
+
+        if ( REF_CLASS_ALIGNED == pHeader->sizeClass ) return release( (void*)pHeader->size );
+
+        if ( REF_CLASS_LARGE == pHeader->sizeClass ) {
+            munmap( pHeader, pHeader->size + sizeof( tagBlockHeader ) );
+            return;
+        }
+
+        tagFreeBlock* pFree = (tagFreeBlock*)ptr;
+        pthread_mutex_lock( &s_mutexClass[ pHeader->sizeClass ] );
+        pFree->pNext = s_freeLists[ pHeader->sizeClass ];
+        s_freeLists[ pHeader->sizeClass ] = pFree;
+        pthread_mutex_unlock( &s_mutexClass[ pHeader->sizeClass ] );
+    }
+
+    static void* zeroAllocate( size_t nmemb, size_t size )
+    {
+        void* ptr = allocate( nmemb * size );
+        if ( NULL != ptr ) memset( ptr, 0, nmemb * size );
+
+        return ptr;
+    }
+
+    static void* alignedAllocate( size_t alignment, size_t size )
+    {
+        if ( alignment <= 16 ) return allocate( size );
+
+        char* pBlock = (char*)allocate( size + alignment + sizeof( tagBlockHeader ) );
+        if ( NULL == pBlock ) return NULL;
+
+        char* pAligned = (char*)( ( (uintptr_t)pBlock + sizeof( tagBlockHeader ) + alignment - 1 ) & ~( alignment - 1 ) );
+        tagBlockHeader* pHeader = (tagBlockHeader*)pAligned - 1;
+        pHeader->sizeClass  = REF_CLASS_ALIGNED;
+        pHeader->size       = (size_t)pBlock;
+
+        return pAligned;
+    }
+
+    static void* pageAllocate( size_t size )
+    {
+        return alignedAllocate( sysconf( _SC_PAGESIZE ), size );
+    }
+
+    static size_t usableSize( void* ptr )
+    {
+        tagBlockHeader* pHeader = (tagBlockHeader*)ptr - 1;
+        if ( REF_CLASS_ALIGNED != pHeader->sizeClass ) return pHeader->size;
+
+        tagBlockHeader* pBlock = (tagBlockHeader*)pHeader->size - 1;
+        return pBlock->size - ( (char*)ptr - (char*)pHeader->size );
+    }
+
+    static void* reallocate( void* ptr, size_t size )
+    {
+        if ( NULL == ptr ) return allocate( size );
+
+        size_t oldSize = usableSize( ptr );
+        if ( size <= oldSize ) return ptr;
+
+        void* pData = allocate( size );
+        if ( NULL == pData ) return NULL;
+
+        memcpy( pData, ptr, oldSize );
+        release( ptr );
+        return pData;
+    }
+} // namespace Reference
+
+static const tagAllocator s_allocators[] = {
+    { "libc",       malloc,                 calloc,                     realloc,                memalign,                   valloc,                 free },
+    { "reference",  Reference::allocate,    Reference::zeroAllocate,    Reference::reallocate,  Reference::alignedAllocate, Reference::pageAllocate, Reference::release },
+};
+
+static bool readNumber( const uint8_t** ppPos, const uint8_t* pEnd, uint64_t* pNumber )
+{
+    uint64_t number = 0;
+
+    for ( int shift = 0; *ppPos < pEnd && shift < 64; shift += 7 ) {
+        uint8_t byte = *(*ppPos)++;
+        number |= (uint64_t)( byte & 0x7F ) << shift;
+        if ( 0 == ( byte & 0x80 ) ) { *pNumber = number; return true; }
+    }
+    return false;
+}
+
+static bool readAddress( const uint8_t** ppPos, const uint8_t* pEnd, uint64_t* pLast, uint64_t* pAddr )
+{
+    uint64_t zigzag;
+    if ( !readNumber( ppPos, pEnd, &zigzag ) ) return false;
+
+    *pLast += ( zigzag >> 1 ) ^ -( zigzag & 1 );
+    *pAddr = *pLast;
+    return true;
+}
+
+static uint32_t threadIndex( pid_t tid )
+{
+    for ( size_t i = 0; i < s_threadCount; ++i ) {
+        if ( s_threads[i].tid == tid ) return i;
+    }
+
+    // threads beyond the limit share the last replay thread
+    if ( s_threadCount == MAX_REPLAY_THREAD ) return MAX_REPLAY_THREAD - 1;
+
+    s_threads[ s_threadCount ].tid = tid;
+    return s_threadCount++;
+}
+
+static bool decodeChunk( const tagRecordChunk* pChunk, const uint8_t* pPos )
+{
+    const uint8_t* pEnd = pPos + pChunk->bytes;
+    uint64_t time = pChunk->baseTime, lastAddr = 0, tid = 0, delta;
+
+    for ( uint32_t i = 0; i < pChunk->count; ++i ) {
+        if ( pPos >= pEnd ) return false;
+
+        tagReplayEvent* pEvent = &s_events[ s_eventCount ];
+        memset( pEvent, 0, sizeof( *pEvent ) );
+
+        uint8_t op = *pPos++;
+        pEvent->op = op & OP_MASK;
+        pEvent->sequence = s_eventCount;
+
+        if ( !readNumber( &pPos, pEnd, &delta ) ) return false;
+        time += delta;
+        pEvent->time = pEvent->start = time;
+
+        if ( ( op & OP_THREAD ) && !readNumber( &pPos, pEnd, &tid ) ) return false;
+        pEvent->thread = threadIndex( (pid_t)tid );
+
+        bool bValid = true;
+        switch ( pEvent->op ) {
+        case OP_MALLOC:
+        case OP_CALLOC:
+        case OP_VALLOC:
+            bValid = readAddress( &pPos, pEnd, &lastAddr, &pEvent->addr ) && readNumber( &pPos, pEnd, &pEvent->size );
+            break;
+        case OP_MEMALIGN:
+            bValid = readAddress( &pPos, pEnd, &lastAddr, &pEvent->addr ) && readNumber( &pPos, pEnd, &pEvent->size ) &&
+                     readNumber( &pPos, pEnd, &pEvent->alignment );
+            break;
+        case OP_REALLOC:
+            bValid = readAddress( &pPos, pEnd, &lastAddr, &pEvent->oldAddr ) && readAddress( &pPos, pEnd, &lastAddr, &pEvent->addr ) &&
+                     readNumber( &pPos, pEnd, &pEvent->size ) && readNumber( &pPos, pEnd, &delta );
+            pEvent->start = time - delta;
+            break;
+        case OP_FREE:
+            bValid = readAddress( &pPos, pEnd, &lastAddr, &pEvent->addr );
+            break;
+        default:
+            bValid = false;
+            break;
+        }
+        if ( !bValid ) return false;
+
+        ++s_eventCount;
+    }
+    return true;
+}
+
+// address to object id, linear probing with backward shift deletion
+struct tagAddressTable
+{
+    uint64_t*       addrs;
+    uint32_t*       ids;
+    size_t          mask;
+};
+
+static size_t hashAddress( const tagAddressTable* pTable, uint64_t addr )
+{
+    return ( ( addr >> 4 ) * 0x9E3779B97F4A7C15ULL >> 17 ) & pTable->mask;
+}
+
+static void insertAddress( tagAddressTable* pTable, uint64_t addr, uint32_t id )
+{
+    size_t pos = hashAddress( pTable, addr );
+    while ( 0 != pTable->ids[ pos ] && pTable->addrs[ pos ] != addr ) pos = ( pos + 1 ) & pTable->mask;
+
+    pTable->addrs[ pos ]    = addr;
+    pTable->ids[ pos ]      = id;
+}
+
+static uint32_t removeAddress( tagAddressTable* pTable, uint64_t addr )
+{
+    size_t pos = hashAddress( pTable, addr );
+    while ( 0 != pTable->ids[ pos ] && pTable->addrs[ pos ] != addr ) pos = ( pos + 1 ) & pTable->mask;
+
+    uint32_t id = pTable->ids[ pos ];
+    if ( 0 == id ) return 0;
+
+    for ( size_t next = ( pos + 1 ) & pTable->mask; 0 != pTable->ids[ next ]; next = ( next + 1 ) & pTable->mask ) {
+        size_t home = hashAddress( pTable, pTable->addrs[ next ] );
+        if ( ( ( next - home ) & pTable->mask ) < ( ( next - pos ) & pTable->mask ) ) continue;
+
+        pTable->addrs[ pos ]    = pTable->addrs[ next ];
+        pTable->ids[ pos ]      = pTable->ids[ next ];
+        pos = next;
+    }
+    pTable->ids[ pos ] = 0;
+
+    return id;
+}
+
+// the release half of a realloc sorts at its start, everything else at its time
+static uint64_t keyTime( uint64_t key )
+{
+    const tagReplayEvent* pEvent = &s_events[ key >> 1 ];
+
+    return ( key & 1 ) ? pEvent->start : pEvent->time;
+}
+
+static int compareKeys( const void* pLeft, const void* pRight )
+{
+    uint64_t left = *(const uint64_t*)pLeft, right = *(const uint64_t*)pRight;
+    uint64_t leftTime = keyTime( left ), rightTime = keyTime( right );
+
+    if ( leftTime != rightTime ) return ( leftTime < rightTime ) ? -1 : 1;
+    if ( ( left >> 1 ) != ( right >> 1 ) ) return ( left >> 1 < right >> 1 ) ? -1 : 1;
+    return ( left & 1 ) ? -1 : 1;
+}
+
+static int compareEvents( const void* pLeft, const void* pRight )
+{
+    const tagReplayEvent* pLeftEvent = (const tagReplayEvent*)pLeft;
+    const tagReplayEvent* pRightEvent = (const tagReplayEvent*)pRight;
+
+    if ( pLeftEvent->time != pRightEvent->time ) return ( pLeftEvent->time < pRightEvent->time ) ? -1 : 1;
+    return ( pLeftEvent->sequence < pRightEvent->sequence ) ? -1 : ( pLeftEvent->sequence > pRightEvent->sequence );
+}
+
+// walks the operations in recorded order and turns addresses into object ids
+static bool resolveObjects()
+{
+    size_t keyCount = 0;
+    uint64_t* keys = (uint64_t*)mapMemory( s_eventCount * 2 * sizeof( uint64_t ) );
+
+    size_t capacity = 1024;
+    while ( capacity < s_eventCount * 2 ) capacity <<= 1;
+
+    tagAddressTable table;
+    table.addrs = (uint64_t*)mapMemory( capacity * sizeof( uint64_t ) );
+    table.ids   = (uint32_t*)mapMemory( capacity * sizeof( uint32_t ) );
+    table.mask  = capacity - 1;
+
+    if ( NULL == keys || NULL == table.addrs || NULL == table.ids ) return false;
+
+    for ( size_t i = 0; i < s_eventCount; ++i ) {
+        keys[ keyCount++ ] = (uint64_t)i << 1;
+        if ( OP_REALLOC == s_events[i].op ) keys[ keyCount++ ] = ( (uint64_t)i << 1 ) | 1;
+    }
+    qsort( keys, keyCount, sizeof( uint64_t ), compareKeys );
+
+    for ( size_t i = 0; i < keyCount; ++i ) {
+        tagReplayEvent* pEvent = &s_events[ keys[i] >> 1 ];
+
+        if ( keys[i] & 1 ) {
+            if ( 0 != pEvent->oldAddr ) pEvent->oldId = removeAddress( &table, pEvent->oldAddr );
+        } else if ( OP_FREE == pEvent->op ) {
+            pEvent->id = removeAddress( &table, pEvent->addr );
+        } else {
+            pEvent->id = ++s_objectCount;
+            insertAddress( &table, pEvent->addr, pEvent->id );
+        }
+    }
+
+    munmap( keys, s_eventCount * 2 * sizeof( uint64_t ) );
+    munmap( table.addrs, capacity * sizeof( uint64_t ) );
+    munmap( table.ids, capacity * sizeof( uint32_t ) );
+
+    s_objects = (tagReplayObject*)mapMemory( ( s_objectCount + 1 ) * sizeof( tagReplayObject ) );
+    return NULL != s_objects;
+}
+
+static bool loadTrace( const char* const path )
+{
+    int fd = open( path, O_RDONLY );
+    if ( -1 == fd ) { fprintf( stderr, "memhook-replay: %s: %s\n", path, strerror( errno ) ); return false; }
+
+    struct stat status;
+    if ( 0 != fstat( fd, &status ) || (size_t)status.st_size < sizeof( tagRecordHeader ) ) {
+        fprintf( stderr, "memhook-replay: %s is not a trace\n", path );
+        close( fd );
+        return false;
+    }
+
+    void* pMap = mmap( NULL, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close( fd );
+    if ( MAP_FAILED == pMap ) return false;
+
+    const uint8_t* pBegin = (const uint8_t*)pMap;
+    const uint8_t* pEnd   = pBegin + status.st_size;
+    const tagRecordHeader* pHeader = (const tagRecordHeader*)pBegin;
+    if ( RECORD_MAGIC != pHeader->magic || RECORD_VERSION != pHeader->version ) {
+        fprintf( stderr, "memhook-replay: %s is not a version %d trace\n", path, RECORD_VERSION );
+        munmap( pMap, status.st_size );
+        return false;
+    }
+    s_traceStart = pHeader->startTime;
+
+    // count first, the events array is mapped once
+    size_t count = 0;
+    const uint8_t* pPos;
+    for ( pPos = pBegin + sizeof( tagRecordHeader ); pPos + sizeof( tagRecordChunk ) <= pEnd; ) {
+        const tagRecordChunk* pChunk = (const tagRecordChunk*)pPos;
+        if ( pPos + sizeof( tagRecordChunk ) + pChunk->bytes > pEnd ) break;
+
+        count += pChunk->count;
+        pPos += sizeof( tagRecordChunk ) + pChunk->bytes;
+    }
+
+    s_events = (tagReplayEvent*)mapMemory( ( count + 1 ) * sizeof( tagReplayEvent ) );
+    if ( NULL == s_events ) { munmap( pMap, status.st_size ); return false; }
+
+    bool bValid = true;
+    for ( pPos = pBegin + sizeof( tagRecordHeader ); bValid && pPos + sizeof( tagRecordChunk ) <= pEnd; ) {
+        const tagRecordChunk* pChunk = (const tagRecordChunk*)pPos;
+        if ( pPos + sizeof( tagRecordChunk ) + pChunk->bytes > pEnd ) break;
+
+        bValid = decodeChunk( pChunk, pPos + sizeof( tagRecordChunk ) );
+        pPos += sizeof( tagRecordChunk ) + pChunk->bytes;
+    }
+    munmap( pMap, status.st_size );
+
+    if ( !bValid ) { fprintf( stderr, "memhook-replay: %s is corrupt\n", path ); return false; }
+    if ( pPos != pEnd ) fprintf( stderr, "memhook-replay: %s is truncated, replaying what is complete\n", path );
+    if ( 0 == s_eventCount ) { fprintf( stderr, "memhook-replay: %s has no events\n", path ); return false; }
+
+    return resolveObjects();
+}
+
+static void waitFor( uint64_t time )
+{
+    uint64_t target = s_replayStart + ( time - s_traceStart );
+    uint64_t now    = timestamp();
+
+    if ( target <= now ) return;
+
+    // sleep the long gaps, spin the short ones
+    if ( target - now > 100000 ) {
+        struct timespec wake = { (time_t)( ( target - 50000 ) / 1000000000 ), (long)( ( target - 50000 ) % 1000000000 ) };
+        clock_nanosleep( CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL );
+    }
+    while ( timestamp() < target ) ;
+}
+
+static void waitReady( uint32_t id )
+{
+    while ( !__atomic_load_n( &s_objects[ id ].bReady, __ATOMIC_ACQUIRE ) ) sched_yield();
+}
+
+static void replayEvent( tagReplayThread* const pThread, const tagReplayEvent* const pEvent, bool bConcurrent )
+{
+    if ( OP_FREE == pEvent->op && 0 == pEvent->id ) return;
+
+    // objects made on another thread must exist before this thread touches them
+    if ( bConcurrent ) {
+        if ( OP_FREE == pEvent->op ) waitReady( pEvent->id );
+        if ( OP_REALLOC == pEvent->op && 0 != pEvent->oldId ) waitReady( pEvent->oldId );
+    }
+    if ( s_bTiming ) waitFor( pEvent->time );
+
+    void* ptr = NULL;
+    uint64_t begin = timestamp();
+
+    switch ( pEvent->op ) {
+    case OP_MALLOC:     ptr = s_pAllocator->pMalloc( pEvent->size );                                 break;
+    case OP_CALLOC:     ptr = s_pAllocator->pCalloc( 1, pEvent->size );                              break;
+    case OP_MEMALIGN:   ptr = s_pAllocator->pMemalign( pEvent->alignment, pEvent->size );           break;
+    case OP_VALLOC:     ptr = s_pAllocator->pValloc( pEvent->size );                                 break;
+    case OP_REALLOC:    ptr = s_pAllocator->pRealloc( s_objects[ pEvent->oldId ].ptr, pEvent->size ); break;
+    case OP_FREE:       s_pAllocator->pFree( s_objects[ pEvent->id ].ptr );                          break;
+    default:            return;
+    }
+
+    pThread->opTime[ pEvent->op ] += timestamp() - begin;
+    pThread->opCount[ pEvent->op ]++;
+
+    if ( OP_FREE != pEvent->op ) {
+        s_objects[ pEvent->id ].ptr = ptr;
+        __atomic_store_n( &s_objects[ pEvent->id ].bReady, 1, __ATOMIC_RELEASE );
+    }
+}
+
+static void* replayThread( void* pParam )
+{
+    tagReplayThread* pThread = (tagReplayThread*)pParam;
+
+    for ( size_t i = 0; i < pThread->count; ++i )
+        replayEvent( pThread, &s_events[ pThread->events[i] ], true );
+
+    return NULL;
+}
+
+static bool replayConcurrent()
+{
+    for ( size_t i = 0; i < s_eventCount; ++i ) s_threads[ s_events[i].thread ].count++;
+
+    for ( size_t i = 0; i < s_threadCount; ++i ) {
+        s_threads[i].events = (uint32_t*)mapMemory( ( s_threads[i].count + 1 ) * sizeof( uint32_t ) );
+        if ( NULL == s_threads[i].events ) return false;
+        s_threads[i].count = 0;
+    }
+    for ( size_t i = 0; i < s_eventCount; ++i ) {
+        tagReplayThread* pThread = &s_threads[ s_events[i].thread ];
+        pThread->events[ pThread->count++ ] = i;
+    }
+
+    s_replayStart = timestamp();
+    for ( size_t i = 0; i < s_threadCount; ++i ) {
+        if ( 0 != pthread_create( &s_threads[i].handle, NULL, replayThread, &s_threads[i] ) ) {
+            fprintf( stderr, "memhook-replay: can not start replay thread %ld\n", i );
+            return false;
+        }
+    }
+    for ( size_t i = 0; i < s_threadCount; ++i ) pthread_join( s_threads[i].handle, NULL );
+
+    return true;
+}
+
+static void replaySequential()
+{
+    s_replayStart = timestamp();
+
+    for ( size_t i = 0; i < s_eventCount; ++i )
+        replayEvent( &s_threads[0], &s_events[i], false );
+}
+
+static void report( uint64_t elapsed, bool bConcurrent )
+{
+    const char* pPreload = getenv( "LD_PRELOAD" );
+    const char* pOptions = getenv( CONFIG_ENV_OPTIONS );
+
+    printf( "allocator: %s", s_pAllocator->name );
+    if ( NULL != pPreload && '\0' != *pPreload ) printf( " under %s (%s)", pPreload, ( NULL != pOptions ) ? pOptions : "defaults" );
+    printf( "\nevents: %ld, objects: %ld, threads: %ld, replay: %s%s\n", s_eventCount, s_objectCount, s_threadCount,
+            bConcurrent ? "concurrent" : "sequential", s_bTiming ? ", timed" : "" );
+
+    uint64_t totalCount = 0, totalTime = 0;
+    printf( "\t%-10s %12s %12s %10s\n", "operation", "count", "total ms", "ns/op" );
+    for ( int op = OP_MALLOC; op <= OP_FREE; ++op ) {
+        uint64_t count = 0, time = 0;
+        for ( size_t i = 0; i < s_threadCount || ( 0 == i && 0 == s_threadCount ); ++i ) {
+            count   += s_threads[i].opCount[ op ];
+            time    += s_threads[i].opTime[ op ];
+        }
+        if ( 0 == count ) continue;
+
+        printf( "\t%-10s %12ld %12.3f %10.1f\n", s_opNames[ op ], count, time / 1e6, (double)time / count );
+        totalCount  += count;
+        totalTime   += time;
+    }
+    if ( totalCount > 0 )
+        printf( "\t%-10s %12ld %12.3f %10.1f\n", "total", totalCount, totalTime / 1e6, (double)totalTime / totalCount );
+
+    struct rusage usage;
+    getrusage( RUSAGE_SELF, &usage );
+    printf( "wall: %.3f ms, %.0f ops/s, max rss: %ld KB\n", elapsed / 1e6, totalCount / ( elapsed / 1e9 ), usage.ru_maxrss );
+}
+
+static bool defaultLibrary( char* const path, size_t size )
+{
+    char self[ PATH_MAX ];
+    ssize_t length = readlink( "/proc/self/exe", self, sizeof( self ) - 1 );
+    if ( length <= 0 ) return false;
+    self[ length ] = '\0';
+
+    char* pSlash = strrchr( self, '/' );
+    if ( NULL == pSlash ) return false;
+    *pSlash = '\0';
+
+    int written = snprintf( path, size, "%s/%s", self, PRELOAD_LIBRARY );
+    return written > 0 && (size_t)written < size;
+}
+
+// runs this program again under the hook for every mode, the trace is replayed with the libc allocator
+static int compareModes( char* const modes, const char* library, bool bConcurrent, const char* const trace )
+{
+    char path[ PATH_MAX ], self[ PATH_MAX ];
+
+    if ( NULL == library ) {
+        if ( !defaultLibrary( path, sizeof( path ) ) ) { fprintf( stderr, "memhook-replay: can not locate %s, use -l\n", PRELOAD_LIBRARY ); return EXIT_FAILURE; }
+        library = path;
+    }
+    if ( 0 != access( library, R_OK ) ) { fprintf( stderr, "memhook-replay: %s: %s\n", library, strerror( errno ) ); return EXIT_FAILURE; }
+
+    ssize_t length = readlink( "/proc/self/exe", self, sizeof( self ) - 1 );
+    if ( length <= 0 ) return EXIT_FAILURE;
+    self[ length ] = '\0';
+
+    int status = EXIT_SUCCESS;
+    for ( char* pMode = strtok( modes, "," ); NULL != pMode; pMode = strtok( NULL, "," ) ) {
+        char options[ 64 ];
+        snprintf( options, sizeof( options ), "mode=%s:report=none", pMode );
+
+        fflush( stdout );
+        pid_t pid = fork();
+        if ( 0 == pid ) {
+            const char* args[ 6 ];
+            int count = 0;
+            args[ count++ ] = self;
+            if ( bConcurrent ) args[ count++ ] = "-j";
+            if ( s_bTiming ) args[ count++ ] = "-t";
+            args[ count++ ] = trace;
+            args[ count ] = NULL;
+
+            setenv( "LD_PRELOAD", library, 1 );
+            setenv( CONFIG_ENV_OPTIONS, options, 1 );
+            execv( self, (char* const*)args );
+            _exit( 127 );
+        }
+
+        int childStatus = 0;
+        if ( -1 == pid || -1 == waitpid( pid, &childStatus, 0 ) || !WIFEXITED( childStatus ) || 0 != WEXITSTATUS( childStatus ) ) {
+            fprintf( stderr, "memhook-replay: replay in mode %s failed\n", pMode );
+            status = EXIT_FAILURE;
+        }
+        printf( "\n" );
+    }
+
+    return status;
+}
+
+int main( int argc, char* const argv[] )
+{
+    const char* library     = NULL;
+    char* modes             = NULL;
+    bool bConcurrent        = false;
+
+    s_pAllocator = &s_allocators[0];
+
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "a:jtm:l:h" ) ) ) {
+        switch ( option ) {
+        case 'a':
+            s_pAllocator = NULL;
+            for ( size_t i = 0; i < sizeof( s_allocators ) / sizeof( s_allocators[0] ); ++i ) {
+                if ( 0 == strcmp( optarg, s_allocators[i].name ) ) s_pAllocator = &s_allocators[i];
+            }
+            if ( NULL == s_pAllocator ) { fprintf( stderr, "memhook-replay: unknown allocator '%s'\n", optarg ); return EXIT_FAILURE; }
+            break;
+        case 'j': bConcurrent = true;   break;
+        case 't': s_bTiming = true;     break;
+        case 'm': modes = optarg;       break;
+        case 'l': library = optarg;     break;
+        default:
+            usage( argv[0] );
+            return ( 'h' == option ) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    if ( optind + 1 != argc ) { usage( argv[0] ); return EXIT_FAILURE; }
+
+    if ( NULL != modes ) return compareModes( modes, library, bConcurrent, argv[ optind ] );
+
+    Reference::initialize();
+    if ( !loadTrace( argv[ optind ] ) ) return EXIT_FAILURE;
+
+    // deterministic order for the sequential replay, the concurrent one keeps it per thread
+    qsort( s_events, s_eventCount, sizeof( tagReplayEvent ), compareEvents );
+
+    uint64_t begin = timestamp();
+    if ( bConcurrent ) {
+        if ( !replayConcurrent() ) return EXIT_FAILURE;
+    } else {
+        replaySequential();
+    }
+    report( timestamp() - begin, bConcurrent );
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#ifndef __MEMHOOKSCOPEH__
+#define __MEMHOOKSCOPEH__
+
+// Allocation tags for code running under libPreLoad.so:
+//
+//     void handle( Request& request )
+//     {
+//         MEMHOOK_SCOPE( "request" );
+//         ...
+//         {
+//             MEMHOOK_SCOPE( "parse" );    // allocations here are tagged request/parse
+//         }
+//     }
+//
+// Tags nest per thread, reports list live and allocated bytes per tag and per tag path.
+// The functions are weak, without the preload library every scope is a null check.
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+    // returns the token that restores the enclosing scope
+    unsigned int    memhook_tag_push( const char* name ) __attribute__ (( weak ));
+    void            memhook_tag_pop( unsigned int token ) __attribute__ (( weak ));
+#ifdef __cplusplus
+} // extern "C"
+
+class CMemhookScope
+{
+public:
+    explicit CMemhookScope( const char* name )
+    :m_token( 0 )
+    ,m_bActive( NULL != memhook_tag_push )
+    {
+        if ( m_bActive ) m_token = memhook_tag_push( name );
+    }
+
+    ~CMemhookScope()
+    {
+        if ( m_bActive ) memhook_tag_pop( m_token );
+    }
+
+private:
+    CMemhookScope( const CMemhookScope& );
+    CMemhookScope& operator=( const CMemhookScope& );
+
+    unsigned int    m_token;
+    bool            m_bActive;
+};
+
+#define MEMHOOK_SCOPE_NAME2(line)       memhookScope##line
+#define MEMHOOK_SCOPE_NAME(line)        MEMHOOK_SCOPE_NAME2( line )
+#define MEMHOOK_SCOPE(name)             CMemhookScope MEMHOOK_SCOPE_NAME( __LINE__ )( name )
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include "CStatPage.h"
+
+using MemoryTrace::StatPage::tagStatPage;
+
+#define MAX_PROCESS     256
+
+struct tagProcessSample
+{
+    uint32_t        pid;
+    uint64_t        updateTime;
+    uint64_t        allocCount;
+    uint64_t        freeCount;
+};
+
+static tagProcessSample s_samples[ MAX_PROCESS ];
+static size_t           s_sampleCount = 0;
+
+static void usage( const char* name )
+{
+    fprintf( stderr, "usage: %s [-c] [-d seconds] [-n iterations] [-p pid] [-s sites] [-t]\n", name );
+    fprintf( stderr, "\t-c\tshow the hook's own cost per operation, needs profile=1\n" );
+    fprintf( stderr, "\t-d\tpoll interval, default 1\n" );
+    fprintf( stderr, "\t-n\tnumber of polls, default 0 for endless\n" );
+    fprintf( stderr, "\t-p\tonly show this process\n" );
+    fprintf( stderr, "\t-s\tcall sites per process, default 5\n" );
+    fprintf( stderr, "\t-t\tshow live bytes per thread\n" );
+}
+
+// copy the page out under its seqlock, false when the writer kept it busy
+static bool readPage( const tagStatPage* const pPage, tagStatPage* const pCopy )
+{
+    for ( int retry = 0; retry < 100; ++retry ) {
+        uint64_t sequence = pPage->sequence;
+        if ( sequence & 1 ) { usleep( 100 ); continue; }
+
+        __sync_synchronize();
+        memcpy( pCopy, (const void*)pPage, sizeof( tagStatPage ) );
+        __sync_synchronize();
+
+        if ( sequence == pPage->sequence ) return true;
+    }
+
+    return false;
+}
+
+static bool loadPage( const char* const path, tagStatPage* const pCopy )
+{
+    int fd = open( path, O_RDONLY );
+    if ( -1 == fd ) return false;
+
+    void* pMap = mmap( NULL, sizeof( tagStatPage ), PROT_READ, MAP_SHARED, fd, 0 );
+    close( fd );
+    if ( MAP_FAILED == pMap ) return false;
+
+    const tagStatPage* pPage = (const tagStatPage*)pMap;
+    bool bValid = STAT_PAGE_MAGIC == pPage->magic && STAT_PAGE_VERSION == pPage->version && readPage( pPage, pCopy );
+
+    munmap( pMap, sizeof( tagStatPage ) );
+    return bValid;
+}
+
+static tagProcessSample* findSample( uint32_t pid )
+{
+    for ( size_t i = 0; i < s_sampleCount; ++i ) {
+        if ( s_samples[i].pid == pid ) return &s_samples[i];
+    }
+
+    if ( s_sampleCount == MAX_PROCESS ) return NULL;
+
+    tagProcessSample* pSample = &s_samples[ s_sampleCount++ ];
+    memset( pSample, 0, sizeof( tagProcessSample ) );
+    pSample->pid = pid;
+    return pSample;
+}
+
+// mean and p99 of one hooked call in ns
+static void showHooks( const tagStatPage* const pPage )
+{
+    static const char* const s_operations[ STAT_PAGE_OPERATIONS ] = { "malloc", "calloc", "realloc", "memalign", "valloc", "free" };
+
+    double scale = ( 0 == pPage->cyclesPerUs ) ? 1.0 : 1000.0 / pPage->cyclesPerUs;
+    for ( uint32_t i = 0; i < STAT_PAGE_OPERATIONS; ++i ) {
+        if ( 0 == pPage->hooks[i].count ) continue;
+        printf( "%8s   %-10s %14lu  mean %8.0f ns  p99 %8.0f ns\n", "", \
+                    s_operations[i], \
+                    pPage->hooks[i].count, \
+                    pPage->hooks[i].meanCycles * scale, \
+                    pPage->hooks[i].p99Cycles * scale );
+    }
+}
+
+static void showPage( const tagStatPage* const pPage, size_t sites, bool bThreads, bool bHooks )
+{
+    double allocRate = 0, freeRate = 0;
+
+    tagProcessSample* pSample = findSample( pPage->pid );
+    if ( NULL != pSample ) {
+        if ( 0 != pSample->updateTime && pPage->updateTime > pSample->updateTime ) {
+            double elapsed  = ( pPage->updateTime - pSample->updateTime ) / 1e9;
+            allocRate       = ( pPage->allocCount - pSample->allocCount ) / elapsed;
+            freeRate        = ( pPage->freeCount - pSample->freeCount ) / elapsed;
+        }
+        pSample->updateTime = pPage->updateTime;
+        pSample->allocCount = pPage->allocCount;
+        pSample->freeCount  = pPage->freeCount;
+    }
+
+    printf( "%8u %-16s %14lu %14lu %14lu %12lu %12.0f %12.0f %8u\n", \
+                pPage->pid, \
+                pPage->command, \
+                pPage->allocSize - pPage->freeSize, \
+                pPage->peakSize, \
+                pPage->mappedSize, \
+                pPage->allocCount - pPage->freeCount, \
+                allocRate, \
+                freeRate, \
+                pPage->threadCount );
+
+    if ( sites > pPage->siteCount ) sites = pPage->siteCount;
+    for ( size_t i = 0; i < sites; ++i ) {
+        printf( "%8s   %14ld %10ld  %s\n", "", pPage->sites[i].liveSize, pPage->sites[i].liveCount, pPage->sites[i].location );
+    }
+
+    if ( bHooks ) showHooks( pPage );
+
+    if ( !bThreads ) return;
+    for ( uint32_t i = 0; i < pPage->threadCount; ++i ) {
+        printf( "%8s   tid %-8ld %14ld\n", "", pPage->threads[i].tid, pPage->threads[i].liveSize );
+    }
+}
+
+static void poll( uint32_t pid, size_t sites, bool bThreads, bool bHooks )
+{
+    static tagStatPage page;
+
+    DIR* pDir = opendir( "/dev/shm" );
+    if ( NULL == pDir ) { perror( "/dev/shm" ); exit( EXIT_FAILURE ); }
+
+    const char* prefix  = strrchr( STAT_PAGE_PATH, '/' ) + 1;
+    size_t prefixLength = strlen( prefix );
+
+    printf( "%8s %-16s %14s %14s %14s %12s %12s %12s %8s\n", "PID", "COMMAND", "LIVE", "PEAK", "MAPPED", "BLOCKS", "ALLOC/s", "FREE/s", "THREADS" );
+
+    struct dirent* pEntry;
+    while ( NULL != ( pEntry = readdir( pDir ) ) ) {
+        if ( 0 != strncmp( pEntry->d_name, prefix, prefixLength ) ) continue;
+
+        uint32_t entryPid = strtoul( pEntry->d_name + prefixLength, NULL, 10 );
+        if ( 0 != pid && pid != entryPid ) continue;
+
+        // page left behind by a killed process
+        if ( 0 != kill( entryPid, 0 ) && ESRCH == errno ) continue;
+
+        char path[ 16 + sizeof( pEntry->d_name ) ];
+        snprintf( path, sizeof( path ), "/dev/shm/%s", pEntry->d_name );
+        if ( loadPage( path, &page ) ) showPage( &page, sites, bThreads, bHooks );
+    }
+
+    closedir( pDir );
+}
+
+int main( int argc, char* const argv[] )
+{
+    unsigned    interval    = 1;
+    long        iterations  = 0;
+    uint32_t    pid         = 0;
+    size_t      sites       = 5;
+    bool        bThreads    = false;
+    bool        bHooks      = false;
+
+    int option;
+    while ( -1 != ( option = getopt( argc, argv, "cd:n:p:s:th" ) ) ) {
+        switch ( option ) {
+        case 'c': bHooks        = true;             break;
+        case 'd': interval      = atoi( optarg );   break;
+        case 'n': iterations    = atol( optarg );   break;
+        case 'p': pid           = atoi( optarg );   break;
+        case 's': sites         = atoi( optarg );   break;
+        case 't': bThreads      = true;             break;
+        default:
+            usage( argv[0] );
+            return ( 'h' == option ) ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    bool bTerminal = isatty( STDOUT_FILENO );
+    for ( long i = 0; 0 == iterations || i < iterations; ++i ) {
+        if ( bTerminal ) printf( "\033[H\033[J" );
+        poll( pid, sites, bThreads, bHooks );
+        fflush( stdout );
+
+        if ( 0 == iterations || i + 1 < iterations ) sleep( interval );
+    }
+
+    return EXIT_SUCCESS;
+}
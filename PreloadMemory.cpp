@@ -1,4 +1,11 @@
 #include "CMemoryManager.h"
+#include "CTag.h"
+#include "CExec.h"
+#include "CMapping.h"
+#include "CBudget.h"
+#include "CPlugin.h"
+#include <stdarg.h>
+#include <sys/mman.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -34,6 +41,99 @@ extern "C"
 	    return MemoryTrace::TraceValloc( size );
 	}
 
+	// mmap=1, the return address tells the hook's own mappings apart
+	void* mmap( void* addr, size_t length, int prot, int flags, int fd, off_t offset )
+	{
+	    return MemoryTrace::Mapping::mmap( addr, length, prot, flags, fd, offset, __builtin_return_address( 0 ) );
+	}
+
+	void* mmap64( void* addr, size_t length, int prot, int flags, int fd, off_t offset )
+	{
+	    return MemoryTrace::Mapping::mmap( addr, length, prot, flags, fd, offset, __builtin_return_address( 0 ) );
+	}
+
+	int munmap( void* addr, size_t length )
+	{
+	    return MemoryTrace::Mapping::munmap( addr, length, __builtin_return_address( 0 ) );
+	}
+
+	void* mremap( void* old_address, size_t old_size, size_t new_size, int flags, ... )
+	{
+	    void* new_address = NULL;
+	    if ( flags & MREMAP_FIXED ) {
+	        va_list args;
+	        va_start( args, flags );
+	        new_address = va_arg( args, void* );
+	        va_end( args );
+	    }
+	    return MemoryTrace::Mapping::mremap( old_address, old_size, new_size, flags, new_address, __builtin_return_address( 0 ) );
+	}
+
+	void* sbrk( intptr_t increment )
+	{
+	    return MemoryTrace::Mapping::sbrk( increment, __builtin_return_address( 0 ) );
+	}
+
+	// MemhookScope.h, weak in the application
+	unsigned int memhook_tag_push( const char* name )
+	{
+	    return MemoryTrace::Tag::push( name );
+	}
+
+	void memhook_tag_pop( unsigned int token )
+	{
+	    MemoryTrace::Tag::pop( token );
+	}
+
+	// MemhookControl.h, weak in the application
+	int memhook_switch( int on )
+	{
+	    return MemoryTrace::TraceSwitch( 0 != on ) ? 0 : -1;
+	}
+
+	int memhook_is_on( void )
+	{
+	    return MemoryTrace::TraceIsOn() ? 1 : 0;
+	}
+
+	// MemhookControl.h, weak in the application
+	int memhook_budget_callback( void (*callback)( const char*, size_t, size_t, int, void* ), void* context )
+	{
+	    if ( !MemoryTrace::Budget::isEnabled() ) return -1;
+
+	    MemoryTrace::Budget::setCallback( callback, context );
+	    return 0;
+	}
+
+	// the live blocks of a plugin are symbolized before its code goes away
+	int dlclose( void* handle )
+	{
+	    return MemoryTrace::Plugin::dlclose( handle );
+	}
+
+	// children keep the preload library and the options even with an environment of their own
+	int execve( const char* path, char* const argv[], char* const envp[] )
+	{
+	    return MemoryTrace::Exec::execve( path, argv, envp );
+	}
+
+	int execvpe( const char* file, char* const argv[], char* const envp[] )
+	{
+	    return MemoryTrace::Exec::execvpe( file, argv, envp );
+	}
+
+	int posix_spawn( pid_t* pid, const char* path, const posix_spawn_file_actions_t* actions, \
+	                 const posix_spawnattr_t* attr, char* const argv[], char* const envp[] )
+	{
+	    return MemoryTrace::Exec::posixSpawn( pid, path, actions, attr, argv, envp, false );
+	}
+
+	int posix_spawnp( pid_t* pid, const char* file, const posix_spawn_file_actions_t* actions, \
+	                  const posix_spawnattr_t* attr, char* const argv[], char* const envp[] )
+	{
+	    return MemoryTrace::Exec::posixSpawn( pid, file, actions, attr, argv, envp, true );
+	}
+
 	// int posix_memalign(void **memptr, size_t alignment, size_t size)
 	// {
 	//     return MemoryTrace::TracePosixMemalign( memptr, alignment, size );